@@ -0,0 +1,391 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file bench_ipc.c
+ * @brief Loads the main and log queues until they saturate
+ *
+ * N producer threads send msg_t to the main queue and logmsg_t to the log
+ * queue with msg_send and logmsg_send, mixed in a fixed ratio. One consumer
+ * per queue takes them off the way the tasks do, the log consumer writing
+ * each line with log_log. The offered rate starts at IPC_RATE_START and
+ * doubles every IPC_STEP_MS until the consumers accept less than
+ * IPC_SATURATED of it, for each queue depth asked for.
+ *
+ *     bench_ipc [-p producers] [-m log percent] [-d depth,depth,...]
+ *               [-w handling us] [-o out.csv] [-l logfile]
+ *
+ * Every step is a CSV row: accepted messages per second, how long producers
+ * sat in the send call, which is the time they were blocked on a full queue,
+ * and the latency from send to receive, which includes the queueing.
+ * bench_ipc.gp plots them per depth.
+ *
+ * Queues deeper than /proc/sys/fs/mqueue/msg_max need root. Queues have
+ * names of their own, so this runs next to the daemon.
+ *
+ * @author Ben Heberlein
+ * @date Nov 18 2017
+ * @version 1.0
+ *
+ */
+
+#include "msg.h"
+#include "log.h"
+#include "main.h"
+#include "prof.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <mqueue.h>
+
+/**
+ * @brief Sweep and limits
+ */
+#define IPC_STEP_MS         1000
+#define IPC_TICK_US         1000
+#define IPC_RATE_START      1000
+#define IPC_RATE_MAX        8000000
+#define IPC_SATURATED       0.95
+#define IPC_PRODUCERS_MAX   32
+#define IPC_DEPTHS_MAX      8
+#define IPC_HIST_US         50000
+#define IPC_DRAIN_MS        5000
+#define IPC_LOG_DEFAULT     "/dev/shm/bench_ipc.log"
+
+/**
+ * @brief 1 us buckets, the last one takes everything longer
+ */
+typedef struct ipc_hist_s {
+    uint32_t n[IPC_HIST_US + 1];
+    uint64_t count;
+    uint64_t sum_ns;
+} ipc_hist_t;
+
+typedef struct ipc_prod_s {
+    pthread_t th;
+    uint64_t sent;
+    ipc_hist_t block;
+} ipc_prod_t;
+
+typedef struct ipc_cons_s {
+    pthread_t th;
+    uint8_t q;
+    uint64_t recv;
+    ipc_hist_t lat;
+} ipc_cons_t;
+
+/**
+ * @brief Private data
+ */
+static uint32_t ipc_nprod = 4;
+static uint32_t ipc_mix = 50;
+static uint32_t ipc_work_us;
+static uint32_t ipc_rate;
+static uint64_t ipc_start_ns, ipc_end_ns;
+static uint8_t ipc_stop;
+static ipc_prod_t ipc_prod[IPC_PRODUCERS_MAX];
+static ipc_cons_t ipc_cons[2] = {{.q = MAIN_THREAD_MAIN}, {.q = MAIN_THREAD_LOG}};
+
+static uint64_t ipc_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void ipc_hist_add(ipc_hist_t *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+
+    h->n[us < IPC_HIST_US ? us : IPC_HIST_US]++;
+    h->count++;
+    h->sum_ns += ns;
+}
+
+static void ipc_hist_merge(ipc_hist_t *to, const ipc_hist_t *h) {
+    for (int i = 0; i <= IPC_HIST_US; i++) {
+        to->n[i] += h->n[i];
+    }
+    to->count += h->count;
+    to->sum_ns += h->sum_ns;
+}
+
+static uint32_t ipc_hist_pct(const ipc_hist_t *h, uint32_t pct) {
+    uint64_t want = (h->count * pct + 99) / 100, seen = 0;
+
+    for (int i = 0; i <= IPC_HIST_US; i++) {
+        seen += h->n[i];
+        if (seen >= want && seen) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static void ipc_spin(uint32_t us) {
+    uint64_t end = ipc_ns() + us * 1000ull;
+
+    while (ipc_ns() < end);
+}
+
+static void *ipc_producer(void *arg) {
+    ipc_prod_t *p = arg;
+    double per_ns = (double) ipc_rate / ipc_nprod / 1e9;
+    struct timespec tick;
+    msg_t tx;
+    logmsg_t ltx;
+
+    tx.from = MAIN_THREAD_TEMP;
+    tx.cmd = MAIN_TEMPALERT;
+    memset(tx.data, 0, sizeof(tx.data));
+    LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_INFO, ltx, "Sample %.3f C", 21.5);
+
+    /* Catch up to the offered rate every tick, a producer held up by a full
+     * queue keeps sending back to back until it is level again */
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    while (1) {
+        uint64_t now = ipc_ns();
+        if (now >= ipc_end_ns) {
+            break;
+        }
+
+        uint64_t due = (now - ipc_start_ns) * per_ns;
+        while (p->sent < due && ipc_ns() < ipc_end_ns) {
+            uint8_t log = (p->sent * ipc_mix) / 100 != ((p->sent + 1) * ipc_mix) / 100;
+            uint64_t t0 = ipc_ns();
+            if (log) {
+                logmsg_send(&ltx, MAIN_THREAD_LOG);
+            } else {
+                msg_send(&tx, MAIN_THREAD_MAIN);
+            }
+            ipc_hist_add(&p->block, ipc_ns() - t0);
+            p->sent++;
+        }
+
+        tick.tv_nsec += IPC_TICK_US * 1000;
+        if (tick.tv_nsec >= 1000000000) {
+            tick.tv_sec++;
+            tick.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+    }
+
+    return NULL;
+}
+
+static void *ipc_consumer(void *arg) {
+    ipc_cons_t *c = arg;
+    char buf[MSG_LOGSIZE + 1];
+    mqd_t rxq = mq_open(msg_names[c->q], O_RDONLY);
+    struct timespec until;
+
+    while (!__atomic_load_n(&ipc_stop, __ATOMIC_ACQUIRE)) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 100000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        if (mq_timedreceive(rxq, buf, sizeof(buf), NULL, &until) == -1) {
+            continue;
+        }
+
+        /* Stamps are the us prof_stamp gives at send time */
+        uint32_t ts;
+        if (c->q == MAIN_THREAD_LOG) {
+            logmsg_t *rx = (logmsg_t *) buf;
+            ts = rx->ts;
+            log_log(rx);
+        } else {
+            ts = ((msg_t *) buf)->ts;
+        }
+        if (ipc_work_us) {
+            ipc_spin(ipc_work_us);
+        }
+        ipc_hist_add(&c->lat, (uint64_t) (uint32_t) (prof_stamp() - ts) * 1000);
+        __atomic_fetch_add(&c->recv, 1, __ATOMIC_RELEASE);
+    }
+    mq_close(rxq);
+
+    return NULL;
+}
+
+static uint64_t ipc_received(void) {
+    return __atomic_load_n(&ipc_cons[0].recv, __ATOMIC_ACQUIRE) +
+           __atomic_load_n(&ipc_cons[1].recv, __ATOMIC_ACQUIRE);
+}
+
+/* One offered rate, returns 1 once saturated */
+static int ipc_step(FILE *csv, uint32_t depth) {
+    static ipc_hist_t block, lat;
+
+    for (uint32_t i = 0; i < ipc_nprod; i++) {
+        memset(&ipc_prod[i].block, 0, sizeof(ipc_prod[i].block));
+        ipc_prod[i].sent = 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        memset(&ipc_cons[i].lat, 0, sizeof(ipc_cons[i].lat));
+        __atomic_store_n(&ipc_cons[i].recv, 0, __ATOMIC_RELEASE);
+    }
+
+    ipc_start_ns = ipc_ns();
+    ipc_end_ns = ipc_start_ns + IPC_STEP_MS * 1000000ull;
+    for (uint32_t i = 0; i < ipc_nprod; i++) {
+        pthread_create(&ipc_prod[i].th, NULL, ipc_producer, &ipc_prod[i]);
+    }
+
+    struct timespec end = {ipc_end_ns / 1000000000, ipc_end_ns % 1000000000};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL);
+    uint64_t accepted = ipc_received();
+
+    uint64_t sent = 0;
+    for (uint32_t i = 0; i < ipc_nprod; i++) {
+        pthread_join(ipc_prod[i].th, NULL);
+        sent += ipc_prod[i].sent;
+    }
+
+    /* Everything in the queues counts toward latency, not the next step */
+    uint64_t drain = ipc_ns() + IPC_DRAIN_MS * 1000000ull;
+    while (ipc_received() < sent && ipc_ns() < drain) {
+        usleep(1000);
+    }
+
+    memset(&block, 0, sizeof(block));
+    memset(&lat, 0, sizeof(lat));
+    for (uint32_t i = 0; i < ipc_nprod; i++) {
+        ipc_hist_merge(&block, &ipc_prod[i].block);
+    }
+    ipc_hist_merge(&lat, &ipc_cons[0].lat);
+    ipc_hist_merge(&lat, &ipc_cons[1].lat);
+
+    double secs = IPC_STEP_MS / 1000.0;
+    double got = accepted / secs;
+    int saturated = got < ipc_rate * IPC_SATURATED;
+    double block_mean = block.count ? block.sum_ns / 1000.0 / block.count : 0;
+    double lat_mean = lat.count ? lat.sum_ns / 1000.0 / lat.count : 0;
+
+    printf("%6u %10u %10.0f %10.1f %10u %10.1f %10u %10u%s\n", depth, ipc_rate, got, block_mean,
+           ipc_hist_pct(&block, 99), lat_mean, ipc_hist_pct(&lat, 99), ipc_hist_pct(&lat, 100),
+           saturated ? "  saturated" : "");
+    fprintf(csv, "%u,%u,%u,%u,%.0f,%.2f,%u,%.2f,%u,%u,%d\n", depth, ipc_nprod, ipc_mix, ipc_rate, got,
+            block_mean, ipc_hist_pct(&block, 99), lat_mean, ipc_hist_pct(&lat, 99),
+            ipc_hist_pct(&lat, 100), saturated);
+    fflush(csv);
+
+    return saturated;
+}
+
+static int ipc_depth(FILE *csv, uint32_t depth) {
+
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        if (msg_queues[i] > 0) {
+            mq_close(msg_queues[i]);
+        }
+    }
+    if (msg_init(depth) != MSG_SUCCESS) {
+        printf("depth %u: couldn't open the queues, past msg_max needs root\n", depth);
+        return 1;
+    }
+
+    __atomic_store_n(&ipc_stop, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&ipc_cons[i].th, NULL, ipc_consumer, &ipc_cons[i]);
+    }
+
+    for (ipc_rate = IPC_RATE_START; ipc_rate <= IPC_RATE_MAX; ipc_rate *= 2) {
+        if (ipc_step(csv, depth)) {
+            break;
+        }
+    }
+
+    __atomic_store_n(&ipc_stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(ipc_cons[i].th, NULL);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *out = "bench_ipc.csv", *logpath = IPC_LOG_DEFAULT;
+    uint32_t depths[IPC_DEPTHS_MAX] = {2, MSG_MAXMSGS};
+    uint32_t ndepths = 2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:m:d:w:o:l:")) != -1) {
+        switch (opt) {
+            case 'p':
+                ipc_nprod = atoi(optarg);
+                break;
+            case 'm':
+                ipc_mix = atoi(optarg);
+                break;
+            case 'd':
+                ndepths = 0;
+                for (char *d = strtok(optarg, ","); d != NULL && ndepths < IPC_DEPTHS_MAX; d = strtok(NULL, ",")) {
+                    depths[ndepths++] = atoi(d);
+                }
+                break;
+            case 'w':
+                ipc_work_us = atoi(optarg);
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'l':
+                logpath = optarg;
+                break;
+            default:
+                ndepths = 0;
+                break;
+        }
+    }
+    if (ndepths == 0 || ipc_nprod == 0 || ipc_nprod > IPC_PRODUCERS_MAX || ipc_mix > 100) {
+        printf("Usage: %s [-p producers, up to %d] [-m log percent] [-d depth,depth,...] "
+               "[-w handling us] [-o out.csv] [-l logfile]\n", argv[0], IPC_PRODUCERS_MAX);
+        return 1;
+    }
+
+    FILE *csv = fopen(out, "w");
+    if (csv == NULL) {
+        printf("Couldn't open %s\n", out);
+        return 1;
+    }
+    fprintf(csv, "# depth,producers,log_pct,offered,accepted,block_mean_us,block_p99_us,"
+                 "lat_mean_us,lat_p99_us,lat_max_us,saturated\n");
+
+    /* log_log needs the file open, the log task would have done this */
+    logmsg_t ltx;
+    ltx.data[0] = 1;
+    snprintf((char *) ltx.data + 1, MSG_LOGSIZE - 8, "%s", logpath);
+    if (log_init(&ltx) != LOG_SUCCESS) {
+        printf("Couldn't open %s\n", logpath);
+        return 1;
+    }
+
+    printf("%u producers, %u%% logmsg_t, %u us handling\n", ipc_nprod, ipc_mix, ipc_work_us);
+    printf("%6s %10s %10s %10s %10s %10s %10s %10s\n", "depth", "offered/s", "accepted/s",
+           "block us", "block p99", "lat us", "lat p99", "lat max");
+    for (uint32_t i = 0; i < ndepths; i++) {
+        ipc_depth(csv, depths[i]);
+    }
+
+    fclose(csv);
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        mq_unlink(msg_names[i]);
+    }
+    unlink(logpath);
+
+    return 0;
+}
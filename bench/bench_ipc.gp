@@ -0,0 +1,29 @@
+# Plots bench_ipc results, one line per queue depth
+#
+#     gnuplot -e "csv='build/bench_ipc.csv'; out='build/bench_ipc.png'" bench/bench_ipc.gp
+
+if (!exists("csv")) csv = 'bench_ipc.csv'
+if (!exists("out")) out = 'bench_ipc.png'
+
+depths = system("awk -F, '!/^#/ {print $1}' ".csv." | sort -nu | tr '\\n' ' '")
+
+set datafile separator ','
+set terminal pngcairo size 1000,1200
+set output out
+set multiplot layout 3,1 title 'Main and log queue saturation'
+set logscale xy
+set grid
+set key left top
+set xlabel 'offered msg/s'
+
+set ylabel 'accepted msg/s'
+plot for [d in depths] csv using ($1 == d + 0 ? $4 : 1/0):5 with linespoints title 'depth '.d, \
+     x with lines dashtype 2 lc rgb 'gray' title 'offered'
+
+set ylabel 'producer block us, mean'
+plot for [d in depths] csv using ($1 == d + 0 ? $4 : 1/0):($6 > 0 ? $6 : 1/0) with linespoints title 'depth '.d
+
+set ylabel 'send to receive us, p99'
+plot for [d in depths] csv using ($1 == d + 0 ? $4 : 1/0):($9 > 0 ? $9 : 1/0) with linespoints title 'depth '.d
+
+unset multiplot
@@ -0,0 +1,377 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file bench_micro.c
+ * @brief Times the conversion, formatting, logging and queue primitives
+ *
+ * Each benchmark runs BENCH_ROUNDS timed rounds of a batch of operations,
+ * after BENCH_WARMUP untimed ones, and reports ns per operation as the
+ * min, percentiles and max over the rounds. Inputs cycle through a fixed
+ * table so every run does the same work.
+ *
+ *     bench_micro [-j out.json] [-b baseline.json] [-t percent] [-l logfile]
+ *
+ * -j writes the results as JSON, one benchmark per line. -b compares the
+ * medians against an earlier -j file and exits 1 if any got more than -t
+ * percent slower, BENCH_REGRESS_PCT by default. -l is where log_log writes, tmpfs by default
+ * so the disk doesn't count.
+ *
+ * Queues have names of their own, so this runs next to the daemon.
+ *
+ * @author Ben Heberlein
+ * @date Nov 18 2017
+ * @version 1.0
+ *
+ */
+
+#include "light.h"
+#include "temp.h"
+#include "log.h"
+#include "msg.h"
+#include "main.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <mqueue.h>
+
+/**
+ * @brief Rounds, percentiles and how much slower is a regression
+ */
+#define BENCH_ROUNDS        2000
+#define BENCH_WARMUP        200
+#define BENCH_INPUTS        256
+#define BENCH_NAME_MAX      32
+#define BENCH_MAX           16
+#define BENCH_REGRESS_PCT   10.0
+#define BENCH_LOG_DEFAULT   "/dev/shm/bench_micro.log"
+
+typedef struct bench_s {
+    const char *name;
+    uint32_t batch;             /* Operations per timed round */
+    void (*fn)(uint32_t batch);
+} bench_t;
+
+typedef struct bench_res_s {
+    char name[BENCH_NAME_MAX];
+    double min, p50, p90, p99, max;
+} bench_res_t;
+
+/**
+ * @brief Private data
+ */
+static uint16_t bench_ch0[BENCH_INPUTS], bench_ch1[BENCH_INPUTS];
+static uint16_t bench_code[BENCH_INPUTS];
+static uint32_t bench_i;
+static volatile float bench_f;
+static volatile int32_t bench_l;
+static mqd_t bench_rx[MSG_QUEUE_NUM];
+static bench_res_t bench_res[BENCH_MAX];
+static uint32_t bench_nres;
+static double bench_regress = BENCH_REGRESS_PCT;
+
+static uint64_t bench_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Benchmarks, each does batch operations
+ */
+static void bench_lux(uint32_t batch) {
+    for (uint32_t i = 0; i < batch; i++, bench_i++) {
+        bench_f = __light_convert_lux(bench_ch0[bench_i % BENCH_INPUTS], bench_ch1[bench_i % BENCH_INPUTS]);
+    }
+}
+
+static void bench_temp_conv(uint32_t batch) {
+    for (uint32_t i = 0; i < batch; i++, bench_i++) {
+        bench_f = __temp_conv(bench_code[bench_i % BENCH_INPUTS]);
+    }
+}
+
+static void bench_temp_conv_mc(uint32_t batch) {
+    for (uint32_t i = 0; i < batch; i++, bench_i++) {
+        bench_l = __temp_conv_mc(bench_code[bench_i % BENCH_INPUTS]);
+    }
+}
+
+static void bench_temp_units(uint32_t batch) {
+    temp_all_t t;
+
+    for (uint32_t i = 0; i < batch; i++, bench_i++) {
+        t.mc = __temp_conv_mc(bench_code[bench_i % BENCH_INPUTS]);
+        temp_units(&t);
+        bench_l = t.mf + t.mk;
+    }
+}
+
+static void bench_log_fmt(uint32_t batch) {
+    logmsg_t ltx;
+
+    for (uint32_t i = 0; i < batch; i++, bench_i++) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Recieved temperature %.3f C %.3f F %.3f K, raw 0x%04x, %u ms old",
+                bench_i * 0.001, bench_i * 0.0018 + 32, bench_i * 0.001 + 273.15, bench_code[bench_i % BENCH_INPUTS], bench_i % 1000);
+        bench_l = ltx.data[1];
+    }
+}
+
+static void bench_log_log(uint32_t batch) {
+    logmsg_t ltx;
+
+    LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_INFO, ltx, "Sample %.3f C", 21.5);
+    for (uint32_t i = 0; i < batch; i++) {
+        log_log(&ltx);
+    }
+}
+
+static void bench_msg_loop(uint32_t batch) {
+    msg_t tx, rx;
+
+    tx.from = MAIN_THREAD_MAIN;
+    tx.cmd = TEMP_GETTEMP;
+    for (uint32_t i = 0; i < batch; i++) {
+        msg_send(&tx, MAIN_THREAD_TEMP);
+        mq_receive(bench_rx[MAIN_THREAD_TEMP], (char *) &rx, MSG_SIZE + 1, NULL);
+    }
+}
+
+static void bench_logmsg_loop(uint32_t batch) {
+    logmsg_t ltx, lrx;
+
+    LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_INFO, ltx, "Sample %.3f C", 21.5);
+    for (uint32_t i = 0; i < batch; i++) {
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        mq_receive(bench_rx[MAIN_THREAD_LOG], (char *) &lrx, MSG_LOGSIZE + 1, NULL);
+    }
+}
+
+/* Answers whatever reaches the light or log queue on the main queue, the
+ * way a task answers the supervisor */
+static void *bench_echo(void *arg) {
+    uint8_t q = (uintptr_t) arg;
+    char buf[MSG_LOGSIZE + 1];
+    msg_t tx;
+
+    tx.from = MSG_RSP_MASK | q;
+    tx.cmd = 0;
+    while (1) {
+        if (mq_receive(bench_rx[q], buf, sizeof(buf), NULL) != -1) {
+            msg_send(&tx, MAIN_THREAD_MAIN);
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_msg_rtt(uint32_t batch) {
+    msg_t tx, rx;
+
+    tx.from = MAIN_THREAD_MAIN;
+    tx.cmd = LIGHT_GETLUX;
+    for (uint32_t i = 0; i < batch; i++) {
+        msg_send(&tx, MAIN_THREAD_LIGHT);
+        mq_receive(bench_rx[MAIN_THREAD_MAIN], (char *) &rx, MSG_SIZE + 1, NULL);
+    }
+}
+
+static void bench_logmsg_rtt(uint32_t batch) {
+    logmsg_t ltx;
+    msg_t rx;
+
+    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Heartbeat check");
+    for (uint32_t i = 0; i < batch; i++) {
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        mq_receive(bench_rx[MAIN_THREAD_MAIN], (char *) &rx, MSG_SIZE + 1, NULL);
+    }
+}
+
+static const bench_t bench_all[] = {
+    {"light_convert_lux",   1000,   bench_lux},
+    {"temp_conv",           1000,   bench_temp_conv},
+    {"temp_conv_mc",        1000,   bench_temp_conv_mc},
+    {"temp_units",          1000,   bench_temp_units},
+    {"log_fmt",             100,    bench_log_fmt},
+    {"log_log",             20,     bench_log_log},
+    {"msg_send_recv",       20,     bench_msg_loop},
+    {"logmsg_send_recv",    20,     bench_logmsg_loop},
+    {"msg_round_trip",      10,     bench_msg_rtt},
+    {"logmsg_round_trip",   10,     bench_logmsg_rtt},
+};
+
+/**
+ * @brief Running and reporting
+ */
+static void bench_run(const bench_t *b) {
+    static double ns[BENCH_ROUNDS];
+
+    for (int i = 0; i < BENCH_WARMUP; i++) {
+        b->fn(b->batch);
+    }
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        uint64_t t0 = bench_ns();
+        b->fn(b->batch);
+        ns[i] = (double) (bench_ns() - t0) / b->batch;
+    }
+    qsort(ns, BENCH_ROUNDS, sizeof(ns[0]), bench_cmp);
+
+    bench_res_t *r = &bench_res[bench_nres++];
+    snprintf(r->name, sizeof(r->name), "%s", b->name);
+    r->min = ns[0];
+    r->p50 = ns[BENCH_ROUNDS / 2];
+    r->p90 = ns[(BENCH_ROUNDS * 90 + 99) / 100 - 1];
+    r->p99 = ns[(BENCH_ROUNDS * 99 + 99) / 100 - 1];
+    r->max = ns[BENCH_ROUNDS - 1];
+    printf("%-20s %10.1f %10.1f %10.1f %10.1f %10.1f\n", r->name, r->min, r->p50, r->p90, r->p99, r->max);
+}
+
+static int bench_json(const char *path) {
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+
+    /* One result per line so the baseline reader can take it apart with
+     * sscanf */
+    fprintf(f, "[\n");
+    for (uint32_t i = 0; i < bench_nres; i++) {
+        const bench_res_t *r = &bench_res[i];
+        fprintf(f, "  {\"name\": \"%s\", \"unit\": \"ns/op\", \"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+                "\"p99\": %.1f, \"max\": %.1f}%s\n", r->name, r->min, r->p50, r->p90, r->p99, r->max,
+                i + 1 < bench_nres ? "," : "");
+    }
+    fprintf(f, "]\n");
+
+    return fclose(f);
+}
+
+static int bench_compare(const char *path) {
+    char line[256];
+    bench_res_t base;
+    int slower = 0;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Couldn't open baseline %s\n", path);
+        return -1;
+    }
+
+    printf("\n%-20s %10s %10s %10s\n", "p50 vs baseline", "baseline", "now", "change");
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, " {\"name\": \"%31[^\"]\", \"unit\": \"ns/op\", \"min\": %lf, \"p50\": %lf, "
+                   "\"p90\": %lf, \"p99\": %lf, \"max\": %lf}", base.name, &base.min, &base.p50,
+                   &base.p90, &base.p99, &base.max) != 6) {
+            continue;
+        }
+
+        uint32_t i;
+        for (i = 0; i < bench_nres && strcmp(bench_res[i].name, base.name); i++);
+        if (i == bench_nres) {
+            printf("%-20s %10.1f %10s\n", base.name, base.p50, "-");
+            continue;
+        }
+
+        double pct = base.p50 > 0 ? (bench_res[i].p50 - base.p50) * 100.0 / base.p50 : 0;
+        uint8_t regress = pct > bench_regress;
+        printf("%-20s %10.1f %10.1f %+9.1f%%%s\n", base.name, base.p50, bench_res[i].p50, pct,
+               regress ? "  slower" : "");
+        slower += regress;
+    }
+    fclose(f);
+
+    return slower;
+}
+
+int main(int argc, char **argv) {
+    const char *json = NULL, *baseline = NULL, *logpath = BENCH_LOG_DEFAULT;
+    pthread_t echo[2];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:b:t:l:")) != -1) {
+        switch (opt) {
+            case 'j':
+                json = optarg;
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            case 't':
+                bench_regress = atof(optarg);
+                break;
+            case 'l':
+                logpath = optarg;
+                break;
+            default:
+                printf("Usage: %s [-j out.json] [-b baseline.json] [-t percent] [-l logfile]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    /* Lux and temperature codes across the whole range the parts give */
+    srand(1);
+    for (int i = 0; i < BENCH_INPUTS; i++) {
+        bench_ch0[i] = rand() % 65536;
+        bench_ch1[i] = bench_ch0[i] ? rand() % bench_ch0[i] : 0;
+        bench_code[i] = (uint16_t) ((rand() % 4096) << 4);
+    }
+
+    if (msg_init(MSG_MAXMSGS) != MSG_SUCCESS) {
+        printf("Couldn't open the queues\n");
+        return 1;
+    }
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        bench_rx[i] = mq_open(msg_names[i], O_RDONLY);
+    }
+
+    logmsg_t ltx;
+    ltx.data[0] = 1;
+    snprintf((char *) ltx.data + 1, MSG_LOGSIZE - 8, "%s", logpath);
+    if (log_init(&ltx) != LOG_SUCCESS) {
+        printf("Couldn't open %s\n", logpath);
+        return 1;
+    }
+
+    printf("%-20s %10s %10s %10s %10s %10s\n", "ns/op", "min", "p50", "p90", "p99", "max");
+    for (size_t i = 0; i < sizeof(bench_all) / sizeof(bench_all[0]); i++) {
+        if (!strcmp(bench_all[i].name, "msg_round_trip")) {
+            pthread_create(&echo[0], NULL, bench_echo, (void *) (uintptr_t) MAIN_THREAD_LIGHT);
+            pthread_create(&echo[1], NULL, bench_echo, (void *) (uintptr_t) MAIN_THREAD_LOG);
+        }
+        bench_run(&bench_all[i]);
+    }
+
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        mq_unlink(msg_names[i]);
+    }
+    unlink(logpath);
+
+    if (json != NULL && bench_json(json)) {
+        printf("Couldn't write %s\n", json);
+        return 1;
+    }
+    if (baseline != NULL && bench_compare(baseline) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file bench_restart.c
+ * @brief Times a supervised restart of the temperature task
+ *
+ * Plays the supervisor: cancels the task as a missed heartbeat would, starts
+ * a new one, sends TEMP_INIT and asks for a reading. Two times are taken
+ * from the cancel: until the new task answers, and until the first sample
+ * read after the cancel reaches a BUS_TOPIC_TEMP subscriber. The answer
+ * alone comes from the snapshot and can be the old task's reading. Cold
+ * restarts give each new task fresh state, the way the supervisor used to,
+ * so it opens the bus again and starts a new check period. Handoff restarts
+ * pass the same temp_state_t along and the check timer keeps its period.
+ *
+ * Runs against the real sensor, the queues have to be free, so not while the
+ * daemon is up.
+ *
+ * @author Ben Heberlein
+ * @date Nov 16 2017
+ * @version 1.0
+ *
+ */
+
+#include "temp.h"
+#include "msg.h"
+#include "main.h"
+#include "bus.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <mqueue.h>
+
+#define BENCH_RESTARTS  50
+#define BENCH_WAIT_MS   2000
+#define BENCH_SAMPLE_MS (TEMP_ADAPT_MAX_NS / 1000000 + BENCH_WAIT_MS)
+
+static mqd_t bench_rxq;
+static pthread_t bench_task;
+
+static uint64_t bench_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nothing reads the log queue here, and a full queue would block the task */
+static void *bench_drain(void *arg) {
+    mqd_t q = mq_open(msg_names[MAIN_THREAD_LOG], O_RDONLY);
+    char buf[MSG_LOGSIZE + 1];
+
+    while (1) {
+        mq_receive(q, buf, sizeof(buf), NULL);
+    }
+
+    return NULL;
+}
+
+/* Start a task on st, wait for it to answer and then for a sample read
+ * after t0_us */
+static int bench_start(temp_state_t *st, bus_sub_t *sub, uint32_t t0_us, uint64_t *ready_ns) {
+    struct timespec until;
+    bus_sample_t s;
+    msg_t tx, rx;
+
+    if (pthread_create(&bench_task, NULL, temp_task, st)) {
+        return -1;
+    }
+
+    tx.from = MAIN_THREAD_MAIN;
+    tx.cmd = TEMP_INIT;
+    tx.data[0] = 0;
+    msg_send(&tx, MAIN_THREAD_TEMP);
+    tx.cmd = TEMP_GETTEMP_ALL;
+    msg_send(&tx, MAIN_THREAD_TEMP);
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += BENCH_WAIT_MS / 1000;
+    do {
+        if (mq_timedreceive(bench_rxq, (char *) &rx, MSG_SIZE + 1, NULL, &until) == -1) {
+            return -1;
+        }
+    } while (rx.from != (MSG_RSP_MASK | MAIN_THREAD_TEMP) || rx.cmd != TEMP_GETTEMP_ALL);
+    *ready_ns = bench_ns();
+
+    /* Samples the old task read before the cancel don't count, a handoff
+     * keeps its adapted period so the next one can be that far off */
+    do {
+        if (bus_next(sub, &s, BENCH_SAMPLE_MS) != BUS_SUCCESS) {
+            return -1;
+        }
+    } while ((int32_t) (s.ts_us - t0_us) < 0);
+
+    return 0;
+}
+
+static void bench_print(const char *name, const char *what, uint64_t *ns) {
+
+    qsort(ns, BENCH_RESTARTS, sizeof(ns[0]), bench_cmp);
+    printf("%s: %d restarts, %.1f us min, %.1f us median, %.1f us p99, %.1f us max to %s\n",
+           name, BENCH_RESTARTS, ns[0] / 1000.0, ns[BENCH_RESTARTS / 2] / 1000.0,
+           ns[(BENCH_RESTARTS * 99 + 99) / 100 - 1] / 1000.0, ns[BENCH_RESTARTS - 1] / 1000.0, what);
+}
+
+static int bench_run(const char *name, uint8_t handoff) {
+    static uint64_t ready[BENCH_RESTARTS], sample[BENCH_RESTARTS];
+    temp_state_t *st = calloc(1, sizeof(*st));
+    uint64_t ready_ns;
+    bus_sub_t sub;
+
+    bus_subscribe(&sub, BUS_TOPIC_MASK(BUS_TOPIC_TEMP));
+    if (st == NULL || bench_start(st, &sub, bus_now_us(), &ready_ns)) {
+        printf("%s: task didn't start\n", name);
+        return 1;
+    }
+
+    for (int i = 0; i < BENCH_RESTARTS; i++) {
+        uint32_t t0_us = bus_now_us();
+        uint64_t t0 = bench_ns();
+        pthread_cancel(bench_task);
+        pthread_join(bench_task, NULL);
+
+        /* Old states stay allocated, their timers may still be running */
+        if (!handoff) {
+            st = calloc(1, sizeof(*st));
+        }
+        if (st == NULL || bench_start(st, &sub, t0_us, &ready_ns)) {
+            printf("%s: no sample after restart %d\n", name, i);
+            return 1;
+        }
+        sample[i] = bench_ns() - t0;
+        ready[i] = ready_ns - t0;
+    }
+
+    bench_print(name, "the answer", ready);
+    bench_print(name, "the first new sample", sample);
+
+    pthread_cancel(bench_task);
+    pthread_join(bench_task, NULL);
+    bus_unsubscribe(&sub);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    pthread_t drain;
+
+    if (msg_init(MSG_MAXMSGS) != MSG_SUCCESS) {
+        printf("Couldn't open the queues\n");
+        return 1;
+    }
+    bench_rxq = mq_open(msg_names[MAIN_THREAD_MAIN], O_RDONLY);
+    pthread_create(&drain, NULL, bench_drain, NULL);
+
+    if (bench_run("cold", 0) || bench_run("handoff", 1)) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file bench_rule.c
+ * @brief Times rule evaluation with a few hundred rules per sample
+ *
+ * Builds a rule set mixing plain limits, hysteresis, aggregates and and/or/not
+ * conditions, then evaluates it against a slow temperature and light sweep
+ * like the sensor tasks produce.
+ *
+ * @author Ben Heberlein
+ * @date Nov 9 2017
+ * @version 1.0
+ *
+ */
+
+#include "rule.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_RULES     500
+#define BENCH_SAMPLES   200000
+
+static rule_set_t bench_rules;
+static char bench_src[BENCH_RULES * 128];
+static uint32_t bench_fired;
+
+static void bench_act(const rule_set_t *rs, const rule_t *r, const rule_action_t *a, uint8_t active, void *ctx) {
+    bench_fired++;
+}
+
+static uint64_t bench_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    static const char *aggs[] = {"min", "max", "mean", "std"};
+    static const char *wins[] = {"1s", "1m", "1h"};
+    char err[128];
+    size_t len = 0;
+
+    srand(1);
+    for (int i = 0; i < BENCH_RULES; i++) {
+        int t = 5 + rand() % 30;
+        int l = rand() % 100;
+        switch (i % 4) {
+            case 0:
+                len += sprintf(bench_src + len, "temp > %d hyst 0.5 -> led %d\n", t, i % 3);
+                break;
+            case 1:
+                len += sprintf(bench_src + len, "lux < %d and temp >= %d -> log \"rule %d\"\n", l, t, i);
+                break;
+            case 2:
+                len += sprintf(bench_src + len, "temp.%s.%s > %d or not lux.%s.%s <= %d -> led %d, cmd light 3 1\n",
+                               aggs[i % 4], wins[i % 3], t, aggs[(i + 1) % 4], wins[(i + 1) % 3], l, i % 3);
+                break;
+            default:
+                len += sprintf(bench_src + len, "(temp < %d or lux > %d hyst 5) and temp.mean.1m != 0 -> led %d\n", t, l, i % 3);
+                break;
+        }
+    }
+
+    uint64_t t0 = bench_ns();
+    if (rule_compile(&bench_rules, bench_src, err, sizeof(err)) != RULE_SUCCESS) {
+        printf("compile failed: %s\n", err);
+        return 1;
+    }
+    uint64_t compile_ns = bench_ns() - t0;
+
+    /* Sweep 0-40 C and 0-100 lux so rules keep crossing their limits */
+    int32_t vars[RULE_VARS];
+    uint32_t valid = (1u << RULE_VARS) - 1;
+    uint32_t changed = 0;
+    t0 = bench_ns();
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        int32_t mc = (i * 7) % 40000;
+        int32_t clux = (i * 13) % 10000;
+        for (int v = 0; v < RULE_VARS; v++) {
+            vars[v] = v < RULE_SRCS ? (v ? clux : mc) : ((v - RULE_SRCS) < 12 ? mc : clux);
+        }
+        changed += rule_eval(&bench_rules, vars, valid, bench_act, NULL);
+    }
+    uint64_t eval_ns = bench_ns() - t0;
+
+    printf("%u rules, %u instructions, compiled in %llu us\n", bench_rules.nrules, bench_rules.ncode,
+           (unsigned long long) compile_ns / 1000);
+    printf("%d samples: %.1f ns per sample, %.2f ns per rule, %u changes, %u actions\n", BENCH_SAMPLES,
+           (double) eval_ns / BENCH_SAMPLES, (double) eval_ns / BENCH_SAMPLES / bench_rules.nrules, changed, bench_fired);
+
+    return 0;
+}
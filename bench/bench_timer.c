@@ -0,0 +1,568 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file bench_timer.c
+ * @brief Measures how late the sensor and supervisor timers fire, in the
+ * manner of cyclictest
+ *
+ * Runs the daemon's timer pattern with nothing behind it: the temp check,
+ * the one-shot conversion wait it starts, the light check and the
+ * heartbeat, at their default periods. Every fire is recorded against the
+ * time it was meant to happen. Each scheme below runs in turn:
+ *
+ *     oneshot    clk_after rearmed from the callback, what the tasks do,
+ *                late fires push every later one back
+ *     interval   one SIGEV_THREAD timer per loop with it_interval set,
+ *                fires stay on the grid from the start
+ *     nanosleep  a thread per loop sleeping to absolute times with
+ *                clock_nanosleep, SCHED_FIFO with -p, without it the
+ *                default 50 us timer slack shows up in the minimum
+ *
+ *     bench_timer [-d seconds per scheme] [-s period divisor]
+ *                 [-c cpu hogs] [-m memory hogs] [-i io hogs]
+ *                 [-w callback us] [-p fifo priority] [-S scheme,...]
+ *                 [-o samples.csv]
+ *
+ * The hogs run for the whole time as background load. -s shortens every
+ * period so a run collects more fires. The report has min, mean, p99 and
+ * max lateness in us, the mean time between fires, and a histogram. -o
+ * writes every fire as scheme,timer,intended ns,actual ns. A new scheme is
+ * one more entry in bench_schemes.
+ *
+ * @author Ben Heberlein
+ * @date Nov 18 2017
+ * @version 1.0
+ *
+ */
+
+#include "clk.h"
+#include "temp.h"
+#include "light.h"
+#include "main.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+
+/**
+ * @brief Limits
+ */
+#define BENCH_HIST_US       100000
+#define BENCH_HOGS_MAX      16
+#define BENCH_MEM_BYTES     (16 * 1024 * 1024)
+#define BENCH_IO_BYTES      4096
+#define BENCH_SAMPLES       (1 << 20)
+
+/**
+ * @brief The loops, the one-shot is started by the temp check
+ */
+#define BENCH_TEMP      0
+#define BENCH_ONESHOT   1
+#define BENCH_LIGHT     2
+#define BENCH_BEAT      3
+#define BENCH_TIMERS    4
+
+typedef struct bench_tmr_s {
+    const char *name;
+    uint64_t period_ns;
+    uint64_t due_ns;            /* When the next fire is meant to be */
+    uint64_t last_ns;           /* Last actual fire */
+    uint64_t fires;
+    clk_timer_t clk;
+    timer_t id;
+    pthread_t th;
+    pthread_mutex_t lock;
+    uint32_t hist[BENCH_HIST_US + 1];
+    uint64_t count, sum_ns, min_ns, max_ns;
+    uint64_t gaps, gap_sum_ns;
+} bench_tmr_t;
+
+typedef struct bench_sample_s {
+    uint8_t scheme;
+    uint8_t timer;
+    uint64_t due_ns;
+    uint64_t at_ns;
+} bench_sample_t;
+
+typedef struct bench_scheme_s {
+    const char *name;
+    int (*start)(void);
+    void (*stop)(void);
+} bench_scheme_t;
+
+/**
+ * @brief Private data
+ */
+static bench_tmr_t bench_tmr[BENCH_TIMERS] = {
+    [BENCH_TEMP] = {.name = "temp", .period_ns = TEMP_TIMER_NS},
+    [BENCH_ONESHOT] = {.name = "oneshot", .period_ns = TEMP_ONESHOT_NS},
+    [BENCH_LIGHT] = {.name = "light", .period_ns = LIGHT_TIMER_NS},
+    [BENCH_BEAT] = {.name = "heartbeat", .period_ns = MAIN_TIMER_HEARTBEAT_NS},
+};
+static uint8_t bench_run;
+static uint64_t bench_start_ns;
+static uint32_t bench_work_us;
+static int bench_prio;
+static uint8_t bench_scheme;
+static bench_sample_t *bench_samples;
+static uint32_t bench_nsamples;
+static uint8_t bench_hogs_run = 1;
+
+static uint64_t bench_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void bench_spin(uint32_t us) {
+    uint64_t end = bench_ns() + us * 1000ull;
+
+    while (bench_ns() < end);
+}
+
+static void bench_record(bench_tmr_t *t, uint64_t due, uint64_t at) {
+    uint64_t late = at > due ? at - due : 0;
+    uint64_t us = late / 1000;
+
+    pthread_mutex_lock(&t->lock);
+    t->hist[us < BENCH_HIST_US ? us : BENCH_HIST_US]++;
+    if (t->count == 0 || late < t->min_ns) {
+        t->min_ns = late;
+    }
+    if (late > t->max_ns) {
+        t->max_ns = late;
+    }
+    t->count++;
+    t->sum_ns += late;
+    if (t->last_ns) {
+        t->gaps++;
+        t->gap_sum_ns += at - t->last_ns;
+    }
+    t->last_ns = at;
+    pthread_mutex_unlock(&t->lock);
+
+    if (bench_samples != NULL) {
+        uint32_t i = __atomic_fetch_add(&bench_nsamples, 1, __ATOMIC_RELAXED);
+        if (i < BENCH_SAMPLES) {
+            bench_samples[i] = (bench_sample_t) {bench_scheme, t - bench_tmr, due, at};
+        }
+    }
+}
+
+/**
+ * @brief oneshot, clk_after from the callback like __temp_timer_init
+ */
+static void bench_oneshot_fire(union sigval arg);
+
+static void bench_oneshot_arm(bench_tmr_t *t, uint64_t ns) {
+    t->due_ns = bench_ns() + ns;
+    clk_after(&t->clk, bench_oneshot_fire, ns);
+}
+
+static void bench_oneshot_fire(union sigval arg) {
+    bench_tmr_t *t = NULL;
+    uint64_t at = bench_ns();
+
+    for (int i = 0; i < BENCH_TIMERS; i++) {
+        if (arg.sival_ptr == &bench_tmr[i].clk) {
+            t = &bench_tmr[i];
+        }
+    }
+    bench_record(t, t->due_ns, at);
+    bench_spin(bench_work_us);
+
+    if (!__atomic_load_n(&bench_run, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (t == &bench_tmr[BENCH_TEMP]) {
+        bench_oneshot_arm(&bench_tmr[BENCH_ONESHOT], bench_tmr[BENCH_ONESHOT].period_ns);
+    } else if (t == &bench_tmr[BENCH_ONESHOT]) {
+        bench_oneshot_arm(&bench_tmr[BENCH_TEMP], bench_tmr[BENCH_TEMP].period_ns);
+    } else {
+        bench_oneshot_arm(t, t->period_ns);
+    }
+}
+
+static int bench_oneshot_start(void) {
+    bench_oneshot_arm(&bench_tmr[BENCH_TEMP], bench_tmr[BENCH_TEMP].period_ns);
+    bench_oneshot_arm(&bench_tmr[BENCH_LIGHT], bench_tmr[BENCH_LIGHT].period_ns);
+    bench_oneshot_arm(&bench_tmr[BENCH_BEAT], bench_tmr[BENCH_BEAT].period_ns);
+
+    return 0;
+}
+
+static void bench_oneshot_stop(void) {
+    struct timespec ts = {0, (long) bench_tmr[BENCH_BEAT].period_ns};
+
+    /* Callbacks stop rearming, give the last of them time to run */
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief interval, kernel timers that repeat on a fixed grid
+ */
+static void bench_interval_fire(union sigval arg) {
+    bench_tmr_t *t = arg.sival_ptr;
+    uint64_t at = bench_ns();
+    uint64_t due;
+
+    /* Missed expiries still count toward where the grid is */
+    pthread_mutex_lock(&t->lock);
+    if (t == &bench_tmr[BENCH_ONESHOT]) {
+        due = t->due_ns;
+    } else {
+        t->fires += 1 + timer_getoverrun(t->id);
+        due = bench_start_ns + t->fires * t->period_ns;
+    }
+    pthread_mutex_unlock(&t->lock);
+    bench_record(t, due, at);
+    bench_spin(bench_work_us);
+
+    if (t == &bench_tmr[BENCH_TEMP] && __atomic_load_n(&bench_run, __ATOMIC_ACQUIRE)) {
+        bench_tmr_t *o = &bench_tmr[BENCH_ONESHOT];
+        struct itimerspec its = {{0, 0}, {0, 0}};
+        o->due_ns = due + o->period_ns;
+        its.it_value.tv_sec = o->due_ns / 1000000000;
+        its.it_value.tv_nsec = o->due_ns % 1000000000;
+        timer_settime(o->id, TIMER_ABSTIME, &its, NULL);
+    }
+}
+
+static int bench_interval_start(void) {
+
+    for (int i = 0; i < BENCH_TIMERS; i++) {
+        bench_tmr_t *t = &bench_tmr[i];
+        struct sigevent se;
+        memset(&se, 0, sizeof(se));
+        se.sigev_notify = SIGEV_THREAD;
+        se.sigev_value.sival_ptr = t;
+        se.sigev_notify_function = bench_interval_fire;
+        if (timer_create(CLOCK_MONOTONIC, &se, &t->id) == -1) {
+            return -1;
+        }
+        if (i == BENCH_ONESHOT) {
+            continue;
+        }
+
+        struct itimerspec its;
+        uint64_t first = bench_start_ns + t->period_ns;
+        its.it_value.tv_sec = first / 1000000000;
+        its.it_value.tv_nsec = first % 1000000000;
+        its.it_interval.tv_sec = t->period_ns / 1000000000;
+        its.it_interval.tv_nsec = t->period_ns % 1000000000;
+        if (timer_settime(t->id, TIMER_ABSTIME, &its, NULL) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void bench_interval_stop(void) {
+    struct timespec ts = {0, (long) bench_tmr[BENCH_ONESHOT].period_ns * 2};
+
+    for (int i = 0; i < BENCH_TIMERS; i++) {
+        if (i != BENCH_ONESHOT) {
+            timer_delete(bench_tmr[i].id);
+        }
+    }
+    nanosleep(&ts, NULL);
+    timer_delete(bench_tmr[BENCH_ONESHOT].id);
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief nanosleep, a thread per loop on absolute deadlines
+ */
+static void bench_sleep_until(uint64_t ns) {
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+static void *bench_nanosleep_loop(void *arg) {
+    bench_tmr_t *t = arg;
+    bench_tmr_t *o = &bench_tmr[BENCH_ONESHOT];
+
+    for (uint64_t k = 1; __atomic_load_n(&bench_run, __ATOMIC_ACQUIRE); k++) {
+        uint64_t due = bench_start_ns + k * t->period_ns;
+        bench_sleep_until(due);
+        bench_record(t, due, bench_ns());
+        bench_spin(bench_work_us);
+
+        if (t == &bench_tmr[BENCH_TEMP]) {
+            bench_sleep_until(due + o->period_ns);
+            bench_record(o, due + o->period_ns, bench_ns());
+            bench_spin(bench_work_us);
+        }
+    }
+
+    return NULL;
+}
+
+static int bench_nanosleep_start(void) {
+    static const int loops[] = {BENCH_TEMP, BENCH_LIGHT, BENCH_BEAT};
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    if (bench_prio) {
+        struct sched_param sp = {.sched_priority = bench_prio};
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &sp);
+    }
+    for (size_t i = 0; i < sizeof(loops) / sizeof(loops[0]); i++) {
+        if (pthread_create(&bench_tmr[loops[i]].th, &attr, bench_nanosleep_loop, &bench_tmr[loops[i]])) {
+            printf("nanosleep: couldn't start a thread%s\n", bench_prio ? ", SCHED_FIFO needs root" : "");
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    return 0;
+}
+
+static void bench_nanosleep_stop(void) {
+    pthread_join(bench_tmr[BENCH_TEMP].th, NULL);
+    pthread_join(bench_tmr[BENCH_LIGHT].th, NULL);
+    pthread_join(bench_tmr[BENCH_BEAT].th, NULL);
+}
+
+static const bench_scheme_t bench_schemes[] = {
+    {"oneshot",     bench_oneshot_start,    bench_oneshot_stop},
+    {"interval",    bench_interval_start,   bench_interval_stop},
+    {"nanosleep",   bench_nanosleep_start,  bench_nanosleep_stop},
+};
+
+#define BENCH_SCHEMES (sizeof(bench_schemes) / sizeof(bench_schemes[0]))
+
+/**
+ * @brief Background load
+ */
+static void *bench_cpu_hog(void *arg) {
+    volatile uint64_t x = 0;
+
+    while (__atomic_load_n(&bench_hogs_run, __ATOMIC_RELAXED)) {
+        x++;
+    }
+
+    return NULL;
+}
+
+static void *bench_mem_hog(void *arg) {
+    volatile uint8_t *buf = malloc(BENCH_MEM_BYTES);
+
+    /* One write per cache line keeps evicting what the timers use */
+    while (buf != NULL && __atomic_load_n(&bench_hogs_run, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < BENCH_MEM_BYTES; i += 64) {
+            buf[i]++;
+        }
+    }
+    free((void *) buf);
+
+    return NULL;
+}
+
+static void *bench_io_hog(void *arg) {
+    char path[] = "/tmp/bench_timer_XXXXXX";
+    static char block[BENCH_IO_BYTES];
+    int fd = mkstemp(path);
+
+    unlink(path);
+    while (fd >= 0 && __atomic_load_n(&bench_hogs_run, __ATOMIC_RELAXED)) {
+        if (write(fd, block, sizeof(block)) < 0 || lseek(fd, 0, SEEK_END) > 64 * BENCH_IO_BYTES) {
+            lseek(fd, 0, SEEK_SET);
+        }
+        fsync(fd);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Report
+ */
+static uint32_t bench_pct(const bench_tmr_t *t, uint32_t pct) {
+    uint64_t want = (t->count * pct + 99) / 100, seen = 0;
+
+    for (int i = 0; i <= BENCH_HIST_US; i++) {
+        seen += t->hist[i];
+        if (seen >= want && seen) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static void bench_report(const char *scheme) {
+    static const uint32_t edges[] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+    const size_t nedges = sizeof(edges) / sizeof(edges[0]);
+
+    for (int i = 0; i < BENCH_TIMERS; i++) {
+        const bench_tmr_t *t = &bench_tmr[i];
+        printf("%-10s %-10s %8llu %8.1f %8.1f %8u %8.1f %10.3f\n", scheme, t->name, (unsigned long long) t->count,
+               t->min_ns / 1000.0, t->count ? t->sum_ns / 1000.0 / t->count : 0.0, bench_pct(t, 99),
+               t->max_ns / 1000.0, t->gaps ? t->gap_sum_ns / 1e6 / t->gaps : 0.0);
+    }
+
+    /* Fires per lateness bucket, upper edges in us */
+    printf("%-10s %-10s", "", "late <us");
+    for (size_t e = 0; e < nedges; e++) {
+        printf(" %6u", edges[e]);
+    }
+    printf(" %6s\n", "more");
+    for (int i = 0; i < BENCH_TIMERS; i++) {
+        const bench_tmr_t *t = &bench_tmr[i];
+        uint32_t us = 0;
+        printf("%-10s %-10s", "", t->name);
+        for (size_t e = 0; e <= nedges; e++) {
+            uint64_t n = 0;
+            uint32_t top = e < nedges ? edges[e] : BENCH_HIST_US + 1;
+            for (; us < top; us++) {
+                n += t->hist[us];
+            }
+            printf(" %6llu", (unsigned long long) n);
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    uint32_t secs = 30, divisor = 1, cpu = 0, mem = 0, io = 0;
+    const char *csv = NULL;
+    char *only = NULL;
+    pthread_t hogs[3 * BENCH_HOGS_MAX];
+    uint32_t nhogs = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:c:m:i:w:p:S:o:")) != -1) {
+        switch (opt) {
+            case 'd':
+                secs = atoi(optarg);
+                break;
+            case 's':
+                divisor = atoi(optarg);
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            case 'm':
+                mem = atoi(optarg);
+                break;
+            case 'i':
+                io = atoi(optarg);
+                break;
+            case 'w':
+                bench_work_us = atoi(optarg);
+                break;
+            case 'p':
+                bench_prio = atoi(optarg);
+                break;
+            case 'S':
+                only = optarg;
+                break;
+            case 'o':
+                csv = optarg;
+                break;
+            default:
+                secs = 0;
+                break;
+        }
+    }
+    if (secs == 0 || divisor == 0 || cpu > BENCH_HOGS_MAX || mem > BENCH_HOGS_MAX || io > BENCH_HOGS_MAX) {
+        printf("Usage: %s [-d seconds] [-s period divisor] [-c cpu hogs] [-m memory hogs] [-i io hogs]\n"
+               "       [-w callback us] [-p fifo priority] [-S scheme,...] [-o samples.csv]\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 0; i < BENCH_TIMERS; i++) {
+        bench_tmr[i].period_ns /= divisor;
+        pthread_mutex_init(&bench_tmr[i].lock, NULL);
+    }
+    if (csv != NULL && (bench_samples = malloc(BENCH_SAMPLES * sizeof(*bench_samples))) == NULL) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < cpu; i++) {
+        pthread_create(&hogs[nhogs++], NULL, bench_cpu_hog, NULL);
+    }
+    for (uint32_t i = 0; i < mem; i++) {
+        pthread_create(&hogs[nhogs++], NULL, bench_mem_hog, NULL);
+    }
+    for (uint32_t i = 0; i < io; i++) {
+        pthread_create(&hogs[nhogs++], NULL, bench_io_hog, NULL);
+    }
+
+    printf("%u s per scheme, periods / %u, load %u cpu %u memory %u io, %u us per callback\n\n",
+           secs, divisor, cpu, mem, io, bench_work_us);
+    printf("%-10s %-10s %8s %8s %8s %8s %8s %10s\n", "scheme", "timer", "fires", "min us", "mean us",
+           "p99 us", "max us", "period ms");
+    for (bench_scheme = 0; bench_scheme < BENCH_SCHEMES; bench_scheme++) {
+        const bench_scheme_t *s = &bench_schemes[bench_scheme];
+        if (only != NULL && strstr(only, s->name) == NULL) {
+            continue;
+        }
+
+        for (int i = 0; i < BENCH_TIMERS; i++) {
+            bench_tmr_t *t = &bench_tmr[i];
+            memset(t->hist, 0, sizeof(t->hist));
+            t->count = t->sum_ns = t->min_ns = t->max_ns = 0;
+            t->gaps = t->gap_sum_ns = t->last_ns = t->fires = 0;
+        }
+
+        __atomic_store_n(&bench_run, 1, __ATOMIC_RELEASE);
+        bench_start_ns = bench_ns();
+        if (s->start()) {
+            printf("%s: couldn't start\n", s->name);
+            __atomic_store_n(&bench_run, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        sleep(secs);
+        __atomic_store_n(&bench_run, 0, __ATOMIC_RELEASE);
+        s->stop();
+        bench_report(s->name);
+    }
+
+    __atomic_store_n(&bench_hogs_run, 0, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < nhogs; i++) {
+        pthread_join(hogs[i], NULL);
+    }
+
+    if (csv != NULL) {
+        FILE *f = fopen(csv, "w");
+        if (f == NULL) {
+            printf("Couldn't open %s\n", csv);
+            return 1;
+        }
+        uint32_t n = bench_nsamples < BENCH_SAMPLES ? bench_nsamples : BENCH_SAMPLES;
+        fprintf(f, "scheme,timer,intended_ns,actual_ns\n");
+        for (uint32_t i = 0; i < n; i++) {
+            const bench_sample_t *b = &bench_samples[i];
+            fprintf(f, "%s,%s,%llu,%llu\n", bench_schemes[b->scheme].name, bench_tmr[b->timer].name,
+                    (unsigned long long) b->due_ns, (unsigned long long) b->at_ns);
+        }
+        fclose(f);
+    }
+
+    return 0;
+}
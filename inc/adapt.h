@@ -0,0 +1,116 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file adapt.h
+ * @brief Adaptive sampling period
+ *
+ * Each sensor task keeps one of these to pick its next sampling period from
+ * how much the signal is moving. A derivative or standard deviation above
+ * its bound drops the period straight to the minimum. A flat signal backs the
+ * period off exponentially up to the maximum. Savings are counted against the
+ * fixed period the task used to run at.
+ *
+ * @author Ben Heberlein
+ * @date Nov 2 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __ADAPT_H__
+#define __ADAPT_H__
+
+#include <stdint.h>
+
+/**
+ * @brief Error codes
+ */
+#define ADAPT_SUCCESS       0
+#define ADAPT_ERR_PARAM     1
+
+/**
+ * @brief Tuning
+ *
+ * ADAPT_ALPHA is the weight of a new sample in the running mean and variance.
+ * ADAPT_BACKOFF is the period growth per flat sample. ADAPT_MAX_NS keeps
+ * periods inside a 32 bit nanosecond count.
+ */
+#define ADAPT_ALPHA     0.25
+#define ADAPT_BACKOFF   1.5
+#define ADAPT_MAX_NS    4000000000u
+
+/**
+ * @brief Adaptive period state for one sensor
+ */
+typedef struct adapt_s {
+    uint32_t min_ns;        /* Fastest period */
+    uint32_t max_ns;        /* Slowest period */
+    uint32_t base_ns;       /* Fixed period savings are measured against */
+    uint32_t period_ns;     /* Period to use for the next sample */
+    float rate_bound;       /* Change per second that counts as moving */
+    float std_bound;        /* Standard deviation that counts as moving */
+    float noise;            /* Changes this small are ignored */
+    float last;             /* Previous sample */
+    float mean;             /* Running mean */
+    float var;              /* Running variance */
+    uint8_t primed;         /* Set once a sample has been seen */
+    uint32_t samples;       /* Samples taken */
+    uint64_t elapsed_ns;    /* Time covered by those samples */
+} adapt_t;
+
+/**
+ * @brief Initialize adaptive period state
+ *
+ * The period starts at the base period, clamped to the limits.
+ *
+ * @param a State to initialize
+ * @param min_ns Fastest period
+ * @param max_ns Slowest period
+ * @param base_ns Fixed period to compare against
+ * @param rate_bound Change per second above which sampling speeds up
+ * @param std_bound Standard deviation above which sampling speeds up
+ * @param noise Change per sample treated as no change
+ *
+ * @return ADAPT_SUCCESS or error code
+ */
+uint8_t adapt_init(adapt_t *a, uint32_t min_ns, uint32_t max_ns, uint32_t base_ns,
+                   float rate_bound, float std_bound, float noise);
+
+/**
+ * @brief Change the period limits
+ *
+ * @param a State to change
+ * @param min_ns Fastest period
+ * @param max_ns Slowest period
+ *
+ * @return ADAPT_SUCCESS or error code
+ */
+uint8_t adapt_limits(adapt_t *a, uint32_t min_ns, uint32_t max_ns);
+
+/**
+ * @brief Account for a new sample and pick the next period
+ *
+ * @param a State to update
+ * @param x New sample
+ *
+ * @return Period in ns until the next sample
+ */
+uint32_t adapt_update(adapt_t *a, float x);
+
+/**
+ * @brief Samples a fixed base period would have taken but we did not
+ *
+ * @param a State to query
+ *
+ * @return Samples saved, 0 if we sampled more often than the base period
+ */
+uint32_t adapt_saved(const adapt_t *a);
+
+#endif /* __ADAPT_H__ */
@@ -0,0 +1,164 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file bus.h
+ * @brief Publish/subscribe bus for sensor samples
+ *
+ * Sensor tasks publish every new sample once into a shared ring. Each
+ * subscriber keeps its own cursor into the ring and reads samples in place,
+ * so fan-out costs nothing extra per subscriber. Subscribers filter by topic
+ * and can rate limit and deadband each topic. A subscriber that falls more
+ * than BUS_SIZE samples behind skips ahead and counts what it lost. Waiting
+ * subscribers sleep on a futex that publishers only wake when someone waits.
+ *
+ * @author Ben Heberlein
+ * @date Nov 7 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __BUS_H__
+#define __BUS_H__
+
+#include <stdint.h>
+
+/**
+ * @brief Error codes
+ */
+#define BUS_SUCCESS     0
+#define BUS_ERR_PARAM   1
+#define BUS_ERR_TIMEOUT 2
+
+/**
+ * @brief Ring size in samples, must be a power of two
+ */
+#define BUS_SIZE 256
+#define BUS_MASK (BUS_SIZE - 1)
+
+/**
+ * @brief Topics, values are milli-degrees C and hundredths of lux
+ */
+#define BUS_TOPICS      2
+#define BUS_TOPIC_TEMP  0
+#define BUS_TOPIC_LIGHT 1
+#define BUS_TOPIC_MASK(t) (1 << (t))
+
+/**
+ * @brief Subscribers bus_quiet keeps track of
+ */
+#define BUS_SUBS        4
+
+/**
+ * @brief A published sample
+ */
+typedef struct bus_sample_s {
+    uint32_t topic;
+    int32_t value;      /* Converted reading */
+    uint32_t raw;       /* Sensor code */
+    uint32_t ts_ms;     /* hist_now_ms() time of the reading */
+    uint32_t ts_us;     /* bus_now_us() when published, right after the read */
+} bus_sample_t;
+
+/**
+ * @brief Per topic filter of a subscriber
+ */
+typedef struct bus_filter_s {
+    uint32_t min_ms;    /* Deliver at most one sample per this many ms */
+    uint32_t deadband;  /* Deliver only changes at least this big */
+    int32_t last;       /* Last delivered value */
+    uint32_t last_ms;   /* Time of the last delivered value */
+    uint8_t primed;     /* Set once a sample was delivered */
+} bus_filter_t;
+
+/**
+ * @brief Subscriber state, owned by a single consumer thread
+ */
+typedef struct bus_sub_s {
+    uint32_t next;      /* Ring position of the next sample to read */
+    uint8_t topics;     /* BUS_TOPIC_MASK of wanted topics */
+    bus_filter_t filter[BUS_TOPICS];
+    uint32_t delivered; /* Samples handed to the consumer */
+    uint32_t filtered;  /* Samples dropped by the filters */
+    uint32_t lost;      /* Samples overwritten before they were read */
+    uint32_t idle_gen;  /* Publish count when last found drained */
+} bus_sub_t;
+
+/**
+ * @brief Publish a sample to all subscribers
+ *
+ * Safe to call from any thread.
+ *
+ * @param topic BUS_TOPIC_*
+ * @param value Converted reading
+ * @param raw Sensor code
+ * @param ts_ms hist_now_ms() time of the reading
+ */
+void bus_publish(uint8_t topic, int32_t value, uint32_t raw, uint32_t ts_ms);
+
+/**
+ * @brief Start a subscription with samples published from now on
+ *
+ * Filters start out passing everything.
+ *
+ * @param sub Subscriber to initialize
+ * @param topics BUS_TOPIC_MASK of wanted topics
+ */
+void bus_subscribe(bus_sub_t *sub, uint8_t topics);
+
+/**
+ * @brief End a subscription, before the subscriber goes away
+ *
+ * @param sub Subscriber to forget
+ */
+void bus_unsubscribe(bus_sub_t *sub);
+
+/**
+ * @brief Set the rate limit and deadband of one topic
+ *
+ * @param sub Subscriber to change
+ * @param topic BUS_TOPIC_*
+ * @param min_ms Minimum time between delivered samples, 0 for no limit
+ * @param deadband Minimum change between delivered samples, 0 for none
+ *
+ * @return BUS_SUCCESS or error code
+ */
+uint8_t bus_filter(bus_sub_t *sub, uint8_t topic, uint32_t min_ms, uint32_t deadband);
+
+/**
+ * @brief Wait for the next sample that passes the subscriber's filters
+ *
+ * @param sub Subscriber to read for
+ * @param out Filled in with the sample
+ * @param timeout_ms How long to wait, 0 to only check
+ *
+ * @return BUS_SUCCESS or BUS_ERR_TIMEOUT
+ */
+uint8_t bus_next(bus_sub_t *sub, bus_sample_t *out, uint32_t timeout_ms);
+
+/**
+ * @brief Check that every subscriber is done with what was published
+ *
+ * A subscriber is done once it came back to bus_next and found nothing
+ * left, so whatever it did with the last sample has finished. Only the
+ * first BUS_SUBS subscribers are tracked.
+ *
+ * @return 1 if all subscribers are waiting on an empty ring, 0 if not
+ */
+uint8_t bus_quiet(void);
+
+/**
+ * @brief CLOCK_MONOTONIC time in us, for latencies against ts_us
+ *
+ * @return Time in us, wrapping at 32 bits
+ */
+uint32_t bus_now_us(void);
+
+#endif /* __BUS_H__ */
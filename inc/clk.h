@@ -0,0 +1,136 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file clk.h
+ * @brief Clock and one-shot timers behind the sampling, rules, heartbeat and
+ * log timestamps
+ *
+ * The real clock is CLOCK_MONOTONIC with SIGEV_THREAD timers. The virtual
+ * clock only moves when clk_step runs the earliest pending timer, on the
+ * caller's thread, and sets the time to when it was due. Timers due at the
+ * same time run in a fixed order of their callbacks, and in the order they
+ * were armed when they share one. Whoever drives it
+ * decides when the work a timer started is done, so hours of timers can
+ * run back to back in the order they were due.
+ *
+ * Durations the daemon measures, like I2C, queue waits and spans, stay on
+ * the real clock.
+ *
+ * @author Ben Heberlein
+ * @date Nov 18 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __CLK_H__
+#define __CLK_H__
+
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+/**
+ * @brief Error codes
+ */
+#define CLK_SUCCESS     0
+#define CLK_ERR_TIMER   1
+#define CLK_ERR_FULL    2
+#define CLK_ERR_EMPTY   3
+
+/**
+ * @brief Timers pending at once on the virtual clock
+ */
+#define CLK_EVENTS      16
+
+/**
+ * @brief Timer callback, arg.sival_ptr is the clk_timer_t
+ */
+typedef void (*clk_fn)(union sigval arg);
+
+/**
+ * @brief One timer, rearmed in place, zero it before first use
+ */
+typedef struct clk_timer_s {
+    clk_fn fn;
+    timer_t id;         /* Real clock, created on first use */
+    uint8_t made;
+    uint8_t pending;    /* Virtual clock */
+    uint64_t due_ns;
+    uint64_t seq;       /* Orders timers with one callback due at once */
+} clk_timer_t;
+
+/**
+ * @brief Current time
+ *
+ * @return Nanoseconds on CLOCK_MONOTONIC, or on the virtual clock
+ */
+uint64_t clk_now_ns(void);
+
+/**
+ * @brief Current time in microseconds, see clk_now_ns
+ */
+uint64_t clk_now_us(void);
+
+/**
+ * @brief Current time in milliseconds, wraps every 49 days
+ */
+uint32_t clk_now_ms(void);
+
+/**
+ * @brief Wall clock time for timestamps
+ *
+ * @return time(), or the wall time the virtual clock started at plus how
+ * far it has moved
+ */
+time_t clk_wall(void);
+
+/**
+ * @brief Arm a timer to call fn once after ns
+ *
+ * Arming a pending timer moves it, so a timer never has two calls queued.
+ *
+ * @param t Timer
+ * @param fn Callback, fixed by the first call on the real clock
+ * @param ns Delay
+ *
+ * @return CLK_SUCCESS, CLK_ERR_TIMER if the kernel timer failed or
+ * CLK_ERR_FULL with CLK_EVENTS virtual timers pending
+ */
+uint8_t clk_after(clk_timer_t *t, clk_fn fn, uint64_t ns);
+
+/**
+ * @brief Switch between the real and the virtual clock
+ *
+ * Meant for before any timer is armed. The virtual clock starts from the
+ * real one rounded down to a second, pending virtual timers are dropped
+ * when switching back.
+ *
+ * @param on 1 for the virtual clock
+ */
+void clk_virtual(uint8_t on);
+
+/**
+ * @brief When the next virtual timer is due
+ *
+ * @param due_ns Filled in with its time
+ *
+ * @return CLK_SUCCESS or CLK_ERR_EMPTY when nothing is pending
+ */
+uint8_t clk_next(uint64_t *due_ns);
+
+/**
+ * @brief Move the virtual clock to the next timer and run it
+ *
+ * @return CLK_SUCCESS or CLK_ERR_EMPTY when nothing is pending
+ */
+uint8_t clk_step(void);
+
+#endif /* __CLK_H__ */
@@ -0,0 +1,186 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file conf.h
+ * @brief Runtime configuration file
+ *
+ * The file holds `key = value` lines, anything after # is a comment and keys
+ * that are left out keep their defaults. A file is taken whole or not at all,
+ * so a typo never leaves the daemon half configured. Files can be watched
+ * with inotify so edits are picked up while running; keys that only take
+ * effect at startup are marked as such.
+ *
+ * @author Ben Heberlein
+ * @date Nov 10 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __CONF_H__
+#define __CONF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Error codes
+ */
+#define CONF_SUCCESS    0
+#define CONF_ERR_SYNTAX 1
+#define CONF_ERR_FILE   2
+#define CONF_ERR_INIT   3
+
+/**
+ * @brief Longest path value, it has to fit in a log message
+ */
+#define CONF_PATH_MAX   128
+
+/**
+ * @brief Most files that can be watched at once
+ */
+#define CONF_WATCH_MAX  4
+
+/**
+ * @brief Keys
+ */
+#define CONF_HEARTBEAT_MS   0
+#define CONF_QUEUE_DEPTH    1
+#define CONF_TEMP_MIN_MS    2
+#define CONF_TEMP_MAX_MS    3
+#define CONF_TEMP_ONESHOT   4
+#define CONF_LIGHT_MIN_MS   5
+#define CONF_LIGHT_MAX_MS   6
+#define CONF_LIGHT_AGC      7
+#define CONF_LOG_PATH       8
+#define CONF_LOG_LEVEL      9
+#define CONF_RULES          10
+#define CONF_CTL_PATH       11
+#define CONF_METRICS_PORT   12
+#define CONF_TRACE_PATH     13
+#define CONF_TRACE_EVENTS   14
+#define CONF_TRACE_START    15
+#define CONF_STALL_MS       16
+#define CONF_LED_DIR        17
+#define CONF_KEYS           18
+#define CONF_KEY(k)         (1u << (k))
+
+/**
+ * @brief Settings
+ */
+typedef struct conf_s {
+    uint32_t heartbeat_ms;          /* main.heartbeat_ms */
+    uint32_t queue_depth;           /* msg.queue_depth, restart only */
+    uint32_t temp_min_ms;           /* temp.min_ms */
+    uint32_t temp_max_ms;           /* temp.max_ms */
+    uint32_t temp_oneshot;          /* temp.oneshot */
+    uint32_t light_min_ms;          /* light.min_ms */
+    uint32_t light_max_ms;          /* light.max_ms */
+    uint32_t light_agc;             /* light.agc */
+    char log_path[CONF_PATH_MAX];   /* log.path */
+    uint32_t log_level;             /* log.level */
+    char rules[CONF_PATH_MAX];      /* main.rules */
+    char ctl_path[CONF_PATH_MAX];   /* ctl.path, restart only */
+    uint32_t metrics_port;          /* metrics.port, restart only, 0 for none */
+    char trace_path[CONF_PATH_MAX]; /* trace.path */
+    uint32_t trace_events;          /* trace.events */
+    uint32_t trace_start;           /* trace.start, restart only */
+    uint32_t stall_ms;              /* main.stall_ms */
+    char led_dir[CONF_PATH_MAX];    /* led.dir, restart only */
+} conf_t;
+
+/**
+ * @brief Called from the watch thread when a watched file changes
+ *
+ * @param path Path the file was watched under
+ * @param ctx Context given to conf_watch
+ */
+typedef void (*conf_fn)(const char *path, void *ctx);
+
+/**
+ * @brief Fill in the defaults
+ *
+ * @param c Settings to fill
+ */
+void conf_defaults(conf_t *c);
+
+/**
+ * @brief Parse configuration text on top of the defaults
+ *
+ * @param c Settings, only written if the whole text is valid
+ * @param src Configuration text
+ * @param err Filled in with a message on failure
+ * @param errlen Size of err
+ *
+ * @return CONF_SUCCESS or error code
+ */
+uint8_t conf_parse(conf_t *c, const char *src, char *err, size_t errlen);
+
+/**
+ * @brief Parse a configuration file on top of the defaults
+ *
+ * @param c Settings, only written if the whole file is valid
+ * @param path File to read
+ * @param err Filled in with a message on failure
+ * @param errlen Size of err
+ *
+ * @return CONF_SUCCESS or error code
+ */
+uint8_t conf_load(conf_t *c, const char *path, char *err, size_t errlen);
+
+/**
+ * @brief Keys that differ between two sets of settings
+ *
+ * @return CONF_KEY() mask
+ */
+uint32_t conf_diff(const conf_t *a, const conf_t *b);
+
+/**
+ * @brief Name of a key as written in the file
+ */
+const char *conf_key_name(uint8_t key);
+
+/**
+ * @brief Whether a change to a key can be applied without a restart
+ */
+uint8_t conf_key_live(uint8_t key);
+
+/**
+ * @brief Watch a file for changes
+ *
+ * The directory is watched rather than the file, so editors that replace the
+ * file are seen and a file that does not exist yet is picked up once it is
+ * created. The first call starts the watch thread. Watching the same path
+ * twice does nothing.
+ *
+ * @param path File to watch
+ * @param fn Called with path when the file is written or replaced
+ * @param ctx Passed to fn
+ *
+ * @return CONF_SUCCESS or error code
+ */
+uint8_t conf_watch(const char *path, conf_fn fn, void *ctx);
+
+/**
+ * @brief Stop calling back for a watched file
+ *
+ * Frees its slot for another conf_watch. Forgetting a path that is not
+ * watched does nothing.
+ *
+ * @param path Path the file was watched under
+ */
+void conf_forget(const char *path);
+
+/**
+ * @brief Stop the watch thread and forget all watched files
+ */
+void conf_unwatch(void);
+
+#endif /* __CONF_H__ */
@@ -0,0 +1,111 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file ctl.h
+ * @brief Control socket
+ *
+ * A Unix stream socket that forwards commands to the tasks and reports live
+ * counters. Requests are either text lines:
+ *
+ *     temp|light|log|main CMD [BYTE ...] ["text"]
+ *     stats
+ *
+ * where CMD is a command number or its name without the task prefix
+ * (`temp gettemp 0`, `light readreg 0x0a`, `log setlevel 2`), or binary
+ * frames of CTL_BIN, the task thread id, the command and MSG_DATASIZE data
+ * bytes. Text replies are one line each: `ok`, `ok` followed by the response
+ * data bytes in hex, or `err` and a reason. Binary replies are CTL_BIN, a
+ * CTL_BIN_* status, then the response from, cmd and data bytes.
+ *
+ * A client can send any number of requests without waiting. They go out to
+ * the tasks as they arrive and the replies come back in request order. Task
+ * responses come back on their own queue and are matched to the oldest
+ * outstanding request for the same task and command.
+ *
+ * @author Ben Heberlein
+ * @date Nov 11 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __CTL_H__
+#define __CTL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Error codes
+ */
+#define CTL_SUCCESS     0
+#define CTL_ERR_INIT    1
+
+/**
+ * @brief Default socket path
+ */
+#define CTL_PATH        "/tmp/project1.sock"
+
+/**
+ * @brief Limits
+ *
+ * A client with CTL_PENDING requests outstanding is not read from until some
+ * are answered. A client that stops reading its replies is dropped.
+ */
+#define CTL_CLIENTS     4
+#define CTL_PENDING     64
+#define CTL_LINE_MAX    256
+
+/**
+ * @brief How long to wait for a task response, and how long a response that
+ * missed its request is still expected so it can't be taken for a later one
+ */
+#define CTL_RSP_MS      1000
+#define CTL_ORPHAN_MS   5000
+
+/**
+ * @brief Binary frames
+ */
+#define CTL_BIN             0x01
+#define CTL_BIN_REQ_SIZE    17
+#define CTL_BIN_RSP_SIZE    18
+#define CTL_BIN_OK          0
+#define CTL_BIN_TIMEOUT     1
+#define CTL_BIN_BUSY        2
+#define CTL_BIN_BAD         3
+
+/**
+ * @brief Adds `key=value` counters of the caller to a stats reply
+ *
+ * @param buf Where to write, space separated with a leading space
+ * @param len Space left
+ *
+ * @return Characters written
+ */
+typedef size_t (*ctl_stats_fn)(char *buf, size_t len);
+
+/**
+ * @brief Open the control socket and start serving it
+ *
+ * A stale socket file at path is replaced. The message queues have to exist.
+ *
+ * @param path Socket path
+ * @param fn Adds counters to stats replies, may be NULL
+ *
+ * @return CTL_SUCCESS or error code
+ */
+uint8_t ctl_init(const char *path, ctl_stats_fn fn);
+
+/**
+ * @brief Stop serving, drop all clients and remove the socket
+ */
+void ctl_close(void);
+
+#endif /* __CTL_H__ */
@@ -0,0 +1,182 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file hist.h
+ * @brief Sample history with windowed aggregates
+ *
+ * A fixed ring of timestamped integer samples. Each standard window keeps
+ * running sums and monotonic min/max deques that are updated as samples come
+ * in and age out, so a window query does no scanning. Each window holds at
+ * most its own cap of samples; at faster sample rates a window is cut short
+ * to its newest cap samples.
+ *
+ * @author Ben Heberlein
+ * @date Nov 2 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * @brief Error codes
+ */
+#define HIST_SUCCESS    0
+#define HIST_ERR_PARAM  1
+#define HIST_ERR_EMPTY  2
+
+/**
+ * @brief Ring size in samples, a power of two no larger than 65536 so the
+ * deques can hold 16 bit ring indices
+ *
+ * The hour window holds the full hour at sample periods down to 220 ms. At
+ * the adapt floors, 100 ms for light and 130 ms for temperature, it covers
+ * the last 27 and 35 minutes; the period only stays there while the signal
+ * keeps moving.
+ */
+#define HIST_SIZE 16384
+#define HIST_MASK (HIST_SIZE - 1)
+#if HIST_SIZE > 65536
+#error "HIST_SIZE is too big for 16 bit ring indices"
+#endif
+
+/**
+ * @brief Samples the shorter windows hold, powers of two no larger than
+ * HIST_SIZE. The second window is full down to a 4 ms period, the minute
+ * window down to 15 ms.
+ */
+#define HIST_CAP_1S 256
+#define HIST_CAP_1M 4096
+
+/**
+ * @brief Deque slots for all windows, one min and one max deque each
+ *
+ * With the ring that comes to 8 bytes for each sample in the ring and 4 for
+ * each a window holds, about 210 KB for each hist_t.
+ */
+#define HIST_QSIZE (2 * (HIST_CAP_1S + HIST_CAP_1M + HIST_SIZE))
+
+/**
+ * @brief Standard windows
+ */
+#define HIST_WINDOWS 3
+#define HIST_WIN_1S  0
+#define HIST_WIN_1M  1
+#define HIST_WIN_1H  2
+
+/**
+ * @brief Set on the window byte of a stats response with no samples
+ */
+#define HIST_EMPTY   0x80
+
+/**
+ * @brief Running aggregates for one window
+ */
+typedef struct hist_win_s {
+    uint32_t span_ms;           /* Window length */
+    uint32_t mask;              /* Samples the window holds, less one */
+    uint32_t head;              /* Sequence number of the oldest sample */
+    int64_t sum;                /* Sum of samples in the window */
+    uint64_t sumsq;             /* Sum of squares */
+    uint32_t min_off, max_off;  /* Where the deques start in hist_t.q */
+    uint32_t min_head, min_tail;
+    uint32_t max_head, max_tail;
+} hist_win_t;
+
+/**
+ * @brief One sample, timestamp and value side by side
+ */
+typedef struct hist_rec_s {
+    uint32_t ts;                /* Timestamp in ms */
+    int32_t val;                /* Sample */
+} hist_rec_t;
+
+/**
+ * @brief Sample ring
+ */
+typedef struct hist_s {
+    hist_rec_t rec[HIST_SIZE];
+    uint16_t q[HIST_QSIZE];     /* Window deques of ring indices, min by
+                                 * increasing and max by decreasing value */
+    uint32_t seq;               /* Sequence number of the next sample */
+    hist_win_t win[HIST_WINDOWS];
+    pthread_mutex_t lock;
+} hist_t;
+
+/**
+ * @brief Aggregates over one window
+ */
+typedef struct hist_stats_s {
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+    uint32_t std;
+} hist_stats_t;
+
+/**
+ * @brief Initialize an empty history
+ *
+ * @param h History to initialize
+ *
+ * @return HIST_SUCCESS or error code
+ */
+uint8_t hist_init(hist_t *h);
+
+/**
+ * @brief Add a sample
+ *
+ * Timestamps must not go backwards. Squares of samples are summed in 64 bits,
+ * so keep samples under about 2^25 in magnitude.
+ *
+ * @param h History to add to
+ * @param ts_ms Sample time in ms
+ * @param v Sample
+ */
+void hist_push(hist_t *h, uint32_t ts_ms, int32_t v);
+
+/**
+ * @brief Aggregates over a window ending now
+ *
+ * @param h History to query
+ * @param win HIST_WIN_*
+ * @param now_ms Current time in ms
+ * @param out Filled in with the aggregates
+ *
+ * @return HIST_SUCCESS, HIST_ERR_EMPTY if the window has no samples, or error
+ */
+uint8_t hist_stats(hist_t *h, uint8_t win, uint32_t now_ms, hist_stats_t *out);
+
+/**
+ * @brief Pack a stats response
+ *
+ * Layout is (1) window, or'd with HIST_EMPTY if there were no samples, then
+ * (3) min, (3) max, (3) mean and (3) standard deviation as signed 24 bit.
+ *
+ * @param win Window the stats are for
+ * @param ret Return code from hist_stats
+ * @param st Aggregates
+ * @param data At least MSG_DATASIZE bytes
+ */
+void hist_stats_pack(uint8_t win, uint8_t ret, const hist_stats_t *st, uint8_t *data);
+
+/**
+ * @brief Current clk_now_ms time for timestamps
+ *
+ * @return Time in ms, wrapping at 32 bits
+ */
+uint32_t hist_now_ms(void);
+
+#endif /* __HIST_H__ */
@@ -0,0 +1,130 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file led.h
+ * @brief User LED output through sysfs
+ *
+ * The brightness and trigger files of the four user LEDs are opened once and
+ * kept open. The last value written to each is cached so repeated requests
+ * for the same state cost nothing. Blinking is handed to the kernel timer
+ * trigger and single flashes to the oneshot trigger, so patterns need no
+ * wakeups here. The sysfs directory is a parameter so tests can point it at a
+ * stub tree.
+ *
+ * @author Ben Heberlein
+ * @date Nov 8 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __LED_H__
+#define __LED_H__
+
+#include <stdint.h>
+
+/**
+ * @brief Error codes
+ */
+#define LED_SUCCESS     0
+#define LED_ERR_PARAM   1
+#define LED_ERR_OPEN    2
+#define LED_ERR_WRITE   3
+
+/**
+ * @brief LEDs and where they live
+ */
+#define LED_TOTAL   4
+#define LED_DIR     "/sys/devices/platform/leds/leds"
+#define LED_NAME    "beaglebone:green:usr%d"
+
+/**
+ * @brief States
+ */
+#define LED_OFF     0
+#define LED_ON      1
+
+/**
+ * @brief Kernel triggers
+ */
+#define LED_TRIG_NONE       0
+#define LED_TRIG_TIMER      1
+#define LED_TRIG_ONESHOT    2
+
+/**
+ * @brief Open the LEDs under a sysfs directory
+ *
+ * LEDs that fail to open are skipped by every later call. All LEDs are
+ * detached from any trigger and turned off.
+ *
+ * @param dir Directory holding one LED_NAME directory per LED
+ *
+ * @return LED_SUCCESS, or LED_ERR_OPEN if any LED could not be opened
+ */
+uint8_t led_init(const char *dir);
+
+/**
+ * @brief Close all LEDs
+ */
+void led_close(void);
+
+/**
+ * @brief Turn an LED on or off, detaching any trigger
+ *
+ * Nothing is written if the LED is already in that state.
+ *
+ * @param led LED number
+ * @param state LED_ON or LED_OFF
+ *
+ * @return LED_SUCCESS or error code
+ */
+uint8_t led_set(uint8_t led, uint8_t state);
+
+/**
+ * @brief Blink an LED with the kernel timer trigger until it is set again
+ *
+ * @param led LED number
+ * @param on_ms Time on per period
+ * @param off_ms Time off per period
+ *
+ * @return LED_SUCCESS or error code
+ */
+uint8_t led_blink(uint8_t led, uint32_t on_ms, uint32_t off_ms);
+
+/**
+ * @brief Flash an LED once with the kernel oneshot trigger
+ *
+ * Further calls with the same times only fire the trigger again.
+ *
+ * @param led LED number
+ * @param on_ms Time on
+ * @param off_ms Minimum time off before another flash
+ *
+ * @return LED_SUCCESS or error code
+ */
+uint8_t led_flash(uint8_t led, uint32_t on_ms, uint32_t off_ms);
+
+/**
+ * @brief Number of sysfs writes done and skipped thanks to the cache
+ *
+ * @param writes Filled in with writes done
+ * @param skipped Filled in with writes skipped
+ */
+void led_stats(uint32_t *writes, uint32_t *skipped);
+
+/**
+ * @brief Private functions
+ */
+int __led_open(uint8_t led, const char *file);
+uint8_t __led_write(int fd, const char *buf);
+uint8_t __led_trigger(uint8_t led, uint8_t trig);
+uint8_t __led_delays(uint8_t led, uint32_t on_ms, uint32_t off_ms);
+
+#endif /* __LED_H__ */
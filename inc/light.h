@@ -28,7 +28,12 @@
 #define __LIGHT_H__
 
 #include "msg.h"
+#include "adapt.h"
+#include "hist.h"
+#include "prof.h"
+#include <mraa.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 
 /**
@@ -54,6 +59,12 @@
 #define LIGHT_ISDAY         8
 #define LIGHT_ALIVE         9
 #define LIGHT_KILL          10
+#define LIGHT_SETAGC        11
+#define LIGHT_GETAGC        12
+#define LIGHT_SETADAPT      13
+#define LIGHT_GETADAPT      14
+#define LIGHT_GETSTATS      15
+#define LIGHT_STATS         16
 
 /**
  * @brief I2C and register macros
@@ -77,6 +88,13 @@
 #define LIGHT_REG_DATA1L    14
 #define LIGHT_REG_DATA1H    15
 
+/**
+ * @brief Control and timing register fields
+ */
+#define LIGHT_CTRL_POWERON  0x03
+#define LIGHT_TIMING_GAIN   (0x01 << 4)
+#define LIGHT_TIMING_INTEG  0x03
+
 /**
  * @brief Interrupt options
  */
@@ -90,6 +108,18 @@
 #define LIGHT_INT_101  1
 #define LIGHT_INT_402  2
 
+/**
+ * @brief Automatic gain control
+ *
+ * The AGC steps down one setting when the larger channel passes 
+ * LIGHT_AGC_HIGH percent of full scale, and steps up when the next setting
+ * would still keep it under LIGHT_AGC_LOW percent. LIGHT_AGC_MARGIN_NS is 
+ * added after an integration period before the channels are read.
+ */
+#define LIGHT_AGC_HIGH      90
+#define LIGHT_AGC_LOW       75
+#define LIGHT_AGC_MARGIN_NS 2000000
+
 /**
  * @brief Day or night calculation
  */
@@ -100,17 +130,53 @@
  */
 #define LIGHT_TIMER_NS 200000000
 
+/**
+ * @brief Adaptive sampling limits and bounds (lux/s, lux, lux)
+ *
+ * The adaptive period is rounded to a whole number of integration periods.
+ */
+#define LIGHT_ADAPT_MIN_NS  100000000
+#define LIGHT_ADAPT_MAX_NS  4000000000u
+#define LIGHT_ADAPT_RATE    5.0
+#define LIGHT_ADAPT_STD     2.0
+#define LIGHT_ADAPT_NOISE   0.5
+
+/**
+ * @brief History samples are lux in hundredths
+ */
+#define LIGHT_HIST_SCALE 100
+
+/**
+ * @brief What the task keeps across a restart
+ *
+ * Owned by the supervisor and handed to every light_task it starts, so a
+ * restarted task keeps the open bus, the AGC setting, sampling period and
+ * history instead of initializing the sensor again.
+ */
+typedef struct light_state_s {
+    mraa_i2c_context i2c;           /* NULL until LIGHT_INIT */
+    uint8_t agc_on;
+    uint8_t agc_idx;                /* Integration and gain setting in use */
+    uint8_t sampling;               /* Check timer is running */
+    float lux;                      /* Last reading */
+    adapt_t adapt;
+    hist_t hist;
+    prof_t prof;
+} light_state_t;
+
 /** 
  * @brief light task function
  *
- * @param data Data to send to task
+ * @param data light_state_t to run with and adopt, NULL for one of the
+ * module's own
  *
  * @return Return pointer
  */
 void *light_task(void *data);
 
 /**
- * @brief Initializes the light task
+ * @brief Initializes the light task, nothing to do for a task that adopted
+ * an open bus
  *
  * DATA     none
  * RESPONSE none
@@ -219,10 +285,109 @@ uint8_t light_readid(msg_t *rx);
 uint8_t light_isday(msg_t *rx);
 
 /**
- * @brief Check if the light task is still alive
+ * @brief Enable or disable automatic gain control
+ *
+ * With AGC on, integration time and gain are picked from the channel 
+ * magnitudes after every read and lux is scaled back to the 402 ms / 1x 
+ * setting the conversion was calibrated at.
+ *
+ * DATA     (1) 1 to enable, 0 to disable
+ * RESPONSE none
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns LIGHT_SUCCESS or error code
+ */
+uint8_t light_setagc(msg_t *rx);
+
+/**
+ * @brief Report the AGC setting and read counters
+ *
+ * A stale read is one where neither channel changed because no integration 
+ * finished since the last read.
  *
  * DATA     none
+ * RESPONSE (1) integration time
+ *          (1) gain, 1 or 16
+ *          (4) reads
+ *          (4) stale reads
+ *          (4) saturated reads
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns LIGHT_SUCCESS or error code
+ */
+uint8_t light_getagc(msg_t *rx);
+
+/**
+ * @brief Set the limits for the adaptive sampling period
+ *
+ * Equal limits give a fixed period.
+ *
+ * DATA     (2) minimum period in ms
+ *          (2) maximum period in ms
+ * RESPONSE none
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns LIGHT_SUCCESS or error code
+ */
+uint8_t light_setadapt(msg_t *rx);
+
+/**
+ * @brief Report the adaptive sampling period and its savings
+ *
+ * DATA     none
+ * RESPONSE (4) current period in us
+ *          (4) samples taken
+ *          (4) samples saved against LIGHT_TIMER_NS
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns LIGHT_SUCCESS or error code
+ */
+uint8_t light_getadapt(msg_t *rx);
+
+/**
+ * @brief Report aggregates of recent lux readings
+ *
+ * DATA     (1) window, HIST_WIN_1S, HIST_WIN_1M or HIST_WIN_1H
+ * RESPONSE (1) window, or'd with HIST_EMPTY if there were no readings
+ *          (3) minimum in hundredths of lux
+ *          (3) maximum in hundredths of lux
+ *          (3) mean in hundredths of lux
+ *          (3) standard deviation in hundredths of lux
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns LIGHT_SUCCESS or error code
+ */
+uint8_t light_getstats(msg_t *rx);
+
+/**
+ * @brief Reports how the light command loop spends its time
+ *
+ * DATA     (1) command, or'd with PROF_RSP for a response, or PROF_WAIT
+ *              for time spent waiting in the queue
+ * RESPONSE (1) the id asked for
+ *          (4) messages dispatched
+ *          (4) mean time in ns
+ *          (4) longest time in ns
+ *          (1) bucket of the 99th percentile, see PROF_BOUND_NS
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns LIGHT_SUCCESS or error code
+ */
+uint8_t light_stats(msg_t *rx);
+
+/**
+ * @brief Check if the light task is still alive
+ *
+ * DATA     (1) unused
+ *          (4) send stamp from prof_stamp
  * RESPONSE (1) alive signal 0xa5
+ *          (4) the send stamp, for timing the round trip
  * 
  * @param rx Pointer to message
  *
@@ -231,7 +396,7 @@ uint8_t light_isday(msg_t *rx);
 uint8_t light_alive(msg_t *rx);
 
 /**
- * @brief Kill the light task gracefully
+ * @brief Kill the light task gracefully, logging its dispatch profile first
  *
  * DATA     none
  * RESPONSE none
@@ -242,14 +407,31 @@ uint8_t light_alive(msg_t *rx);
  */
 uint8_t light_kill(msg_t *rx);
 
+/**
+ * @brief Convert arrays of channel readings to lux
+ *
+ * Same result as the single sample conversion, four at a time with SSE2 or
+ * NEON when the compiler targets them. Meant for reprocessing history.
+ *
+ * @param ch0 Channel 0 counts
+ * @param ch1 Channel 1 counts
+ * @param lux Output, one lux value per pair
+ * @param n Number of pairs
+ */
+void light_convert_lux_batch(const uint16_t *ch0, const uint16_t *ch1, float *lux, size_t n);
+
 /**
  *  * @brief Private functions
  *   */
 void __light_terminate(void *arg);
 uint8_t __light_i2c_read(uint8_t address);
+uint16_t __light_i2c_read_word(uint8_t address);
 void __light_i2c_write(uint8_t data, uint8_t address);
 float __light_convert_lux(uint16_t ch0, uint16_t ch1);
 void __light_check(union sigval arg);
 uint8_t __light_timer_init(void);
+void __light_timing_set(uint8_t integ, uint8_t gain);
+void __light_period_align(void);
+void __light_agc(uint16_t ch0, uint16_t ch1);
 
 #endif /* __LIGHT_H__ */
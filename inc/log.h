@@ -55,6 +55,8 @@
 #define LOG_SETPATH 2
 #define LOG_ALIVE   3
 #define LOG_KILL    4
+#define LOG_SETLEVEL 5
+#define LOG_STATS   6
 
 /**
  * @brief Log levels
@@ -64,11 +66,21 @@
 #define LOG_LEVEL_WARN  2
 #define LOG_LEVEL_ERROR 3
 
+/**
+ * @brief Sample subscription, at most one logged sample per topic per
+ * LOG_SUB_MIN_MS and only changes of at least the deadband (milli-degrees C,
+ * hundredths of lux)
+ */
+#define LOG_SUB_MIN_MS          1000
+#define LOG_SUB_TEMP_DEADBAND   250
+#define LOG_SUB_LIGHT_DEADBAND  100
+#define LOG_SUB_WAIT_MS         200
+
 /**
  * @brief Log string arrays
  */
 static char *log_level_strings[] = {"DEBUG", "INFO", "WARN", "ERROR"}; 
-static char *log_task_strings[] = {"MAIN", "LIGHT", "TEMP", "LOG"}; 
+static char *log_task_strings[] = {"MAIN", "LIGHT", "TEMP", "LOG", "CTL"}; 
 
 /** 
  * @brief log task function
@@ -120,8 +132,10 @@ uint8_t log_setpath(logmsg_t *rx);
 /**
  * @brief Checks if the log task is still alive
  * 
- * DATA     none
+ * DATA     (1) unused
+ *          (4) send stamp from prof_stamp
  * RESPONSE (1) alive packet 0xa5
+ *          (4) the send stamp, for timing the round trip
  * 
  * @param rx Pointer to message
  *
@@ -130,7 +144,7 @@ uint8_t log_setpath(logmsg_t *rx);
 uint8_t log_alive(logmsg_t *rx);
 
 /**
- * @brief Kills the task gracefully
+ * @brief Kills the task gracefully, logging its dispatch profile first
  * 
  * DATA     none
  * RESPONSE none
@@ -141,9 +155,41 @@ uint8_t log_alive(logmsg_t *rx);
  */
 uint8_t log_kill(logmsg_t *rx);
 
+/**
+ * @brief Sets the lowest level that gets written
+ * 
+ * DATA     (1) LOG_LEVEL_*
+ * RESPONSE none
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns LOG_SUCCESS or error code
+ */
+uint8_t log_setlevel(logmsg_t *rx);
+
+/**
+ * @brief Reports how the log command loop spends its time
+ *
+ * DATA     (1) command, or'd with PROF_RSP for a response, or PROF_WAIT
+ *              for time spent waiting in the queue
+ * RESPONSE (1) the id asked for
+ *          (4) messages dispatched
+ *          (4) mean time in ns
+ *          (4) longest time in ns
+ *          (1) bucket of the 99th percentile, see PROF_BOUND_NS
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns LOG_SUCCESS or error code
+ */
+uint8_t log_stats(logmsg_t *rx);
+
 /**
  * @brief Private functions
  */
 void __log_terminate(void *arg);
+void __log_write(uint8_t from, uint8_t lvl, const char *text);
+void __log_prof_line(uint8_t from, const char *line);
+void *__log_sub(void *arg);
 
 #endif /* __LOG_H */
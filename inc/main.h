@@ -25,6 +25,8 @@
 #define __MAIN_H__
 
 #include "msg.h"
+#include "rule.h"
+#include "conf.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/signal.h>
@@ -47,16 +49,38 @@
 #define MAIN_THREAD_TEMP  2
 #define MAIN_THREAD_LOG   3
 
+/**
+ * @brief Queue for responses to the control socket, not a supervised task
+ */
+#define MAIN_THREAD_CTL   4
+
 /**
  * @brief Main task API
  */
-#define MAIN_EXIT 0
+#define MAIN_EXIT       0
+#define MAIN_TEMPALERT  1
+#define MAIN_STATS      2
+#define MAIN_TRACE      3
 
 /**
- * @brief Main timer durations
+ * @brief Main timer durations, the heartbeat default for main.heartbeat_ms
  */
 #define MAIN_TIMER_HEARTBEAT_NS 500000000
-#define MAIN_TIMER_LOGIC_NS     400000000
+
+/**
+ * @brief Time a task may go without handling a message before it is
+ * restarted, the default for main.stall_ms. Every heartbeat sends each task
+ * a message, so a live task never goes this long. The supervisor never
+ * waits for room in a queue, a ping to a full one is counted as a drop.
+ */
+#define MAIN_STALL_MS   2000
+
+/**
+ * @brief Files used when none are given on the command line
+ */
+#define MAIN_LOG_DEFAULT    "project1.log"
+#define MAIN_CONF_FILE      "project1.conf"
+#define MAIN_TRACE_FILE     "project1.trace.json"
 
 /**
  * @brief LEDs
@@ -65,15 +89,51 @@
 #define MAIN_LED1       1
 #define MAIN_LED2       2
 #define MAIN_LED3       3
-#define MAIN_LED_ON     1
-#define MAIN_LED_OFF    0
 
 /**
- * @brief Logic for leds
+ * @brief LED3 patterns, blink on/off time once a restart has failed and the
+ * single flash for each restart
+ */
+#define MAIN_LED_ERR_MS     100
+#define MAIN_LED_FLASH_MS   250
+
+/**
+ * @brief Limits programmed into the TMP106 for its ALERT pin
  */
 #define MAIN_TOOCOLD    10.0
 #define MAIN_TOOHOT     30.0
-#define MAIN_TOOBRIGHT  50.0
+
+/**
+ * @brief Rules for the LEDs, read from main.rules (MAIN_RULES_FILE by
+ * default) when it exists (see rule.h for the language)
+ */
+#define MAIN_RULES_FILE "project1.rules"
+#define MAIN_RULES_DEFAULT \
+    "hot: temp > 30 hyst 0.5 -> led 0, log \"It is too hot in here!\"\n" \
+    "cold: temp < 10 hyst 0.5 -> led 1, log \"It is too cold in here!\"\n" \
+    "bright: lux > 50 hyst 5 -> led 2, log \"It is too bright in here!\"\n"
+
+/**
+ * @brief TMP106 ALERT mode requested at startup
+ */
+#define MAIN_TEMP_ALERT TEMP_ALERT_COMP
+
+/**
+ * @brief TMP106 one-shot sampling default for temp.oneshot and how many
+ * heartbeats pass between bus statistics reports
+ */
+#define MAIN_TEMP_ONESHOT   1
+#define MAIN_BUSSTATS_BEATS 20
+
+/**
+ * @brief APDS-9301 automatic gain control default for light.agc
+ */
+#define MAIN_LIGHT_AGC  1
+
+/**
+ * @brief Longest wait for a sample before the subscriber checks again
+ */
+#define MAIN_SUB_WAIT_MS        1000
 
 /**
  * @brief Main task function
@@ -83,7 +143,7 @@
 int main(int argc, char **argv);
 
 /**
- * @brief Kills all tasks and exits
+ * @brief Kills all tasks and exits, logging the main dispatch profile first
  *
  * DATA     none
  * RESPONSE none
@@ -94,15 +154,74 @@ int main(int argc, char **argv);
  */
 uint8_t main_exit(msg_t *rx);
 
+/**
+ * @brief Handles an ALERT edge from the temperature task
+ *
+ * Logs the edge. The reading taken on the edge is also published on the
+ * sample bus, which is what drives the LED logic.
+ *
+ * DATA     (4) temperature in thousandths of a degree C
+ *          (1) ALERT pin level
+ * RESPONSE none
+ *
+ * @param rx Pointer to message
+ *
+ * @return MAIN_SUCCESS or error code 
+ */
+uint8_t main_tempalert(msg_t *rx);
+
+/**
+ * @brief Reports how the main command loop spends its time
+ *
+ * DATA     (1) command, or'd with PROF_RSP for a response, or PROF_WAIT
+ *              for time spent waiting in the queue
+ * RESPONSE (1) the id asked for
+ *          (4) messages dispatched
+ *          (4) mean time in ns
+ *          (4) longest time in ns
+ *          (1) bucket of the 99th percentile, see PROF_BOUND_NS
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Returns MAIN_SUCCESS or error code
+ */
+uint8_t main_stats(msg_t *rx);
+
+/**
+ * @brief Starts or stops a span recording
+ *
+ * A start throws away spans that were never written and records up to
+ * trace.events of them. A stop writes them to trace.path as Chrome
+ * trace-event JSON.
+ *
+ * DATA     (1) 1 to start, 0 to stop and write the trace
+ * RESPONSE (1) 1 while recording, 0 once stopped
+ *          (4) spans kept
+ *          (4) spans dropped for a full buffer
+ *          (1) SPAN_SUCCESS or the error starting or writing
+ *
+ * @param rx Pointer to message
+ *
+ * @return Returns MAIN_SUCCESS or error code
+ */
+uint8_t main_trace(msg_t *rx);
+
 /**
  * @brief private functions
  */
 void __main_heartbeat(union sigval arg);
-void __main_logic(union sigval argv);
+void *__main_sub(void *arg);
+void __main_led_eval(uint8_t topic, uint32_t ts_us);
+void __main_rule_act(const rule_set_t *rs, const rule_t *r, const rule_action_t *a, uint8_t active, void *ctx);
+void __main_conf_send(const conf_t *c, uint32_t keys);
+void __main_conf_apply(const conf_t *next);
+void __main_reload(const char *path, void *ctx);
+void __main_rules_load(const char *path);
+size_t __main_ctl_stats(char *buf, size_t len);
+uint8_t __main_trace_dump(void);
+void __main_metrics_collect(void);
 uint8_t __main_heartbeat_init(void);
-uint8_t __main_logic_init(void);
 uint8_t __main_pthread_init(void);
-uint8_t __main_led_set(uint8_t led, uint8_t state);
 
 
 #endif /* __MAIN_H__ */
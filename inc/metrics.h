@@ -0,0 +1,145 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file metrics.h
+ * @brief In-process metrics served over loopback HTTP
+ *
+ * A fixed registry of counters, gauges and histograms, each with up to
+ * METRICS_LABELS series picked by a small label index (a queue or thread id,
+ * a log level). Counters and histograms are kept in METRICS_SHARDS copies and
+ * a thread always adds to the copy it was handed on its first update, so the
+ * hot paths never share a cache line or take a lock. Reads add the copies up.
+ *
+ * GET /metrics on 127.0.0.1 returns everything in the Prometheus text format.
+ *
+ * @author Ben Heberlein
+ * @date Nov 12 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Error codes
+ */
+#define METRICS_SUCCESS     0
+#define METRICS_ERR_PARAM   1
+#define METRICS_ERR_INIT    2
+
+/**
+ * @brief Default port for metrics.port
+ */
+#define METRICS_PORT        9101
+
+/**
+ * @brief Limits
+ *
+ * Every histogram has METRICS_BUCKETS bounds plus the +Inf bucket.
+ */
+#define METRICS_SHARDS      16
+#define METRICS_LABELS      5
+#define METRICS_BUCKETS     10
+#define METRICS_REQ_MAX     1024
+#define METRICS_TEXT_MAX    65536
+#define METRICS_IO_MS       1000
+
+/**
+ * @brief Metrics
+ *
+ * Messages are labelled by queue, I2C, timers, heartbeats and restarts by
+ * thread id and log lines by level. Durations are observed in microseconds.
+ */
+#define METRIC_MSG_SENT         0
+#define METRIC_MSG_RECV         1
+#define METRIC_MSG_DROPS        2
+#define METRIC_QUEUE_DEPTH      3
+#define METRIC_I2C_US           4
+#define METRIC_LOG_LINES        5
+#define METRIC_TIMER_LATE_US    6
+#define METRIC_HEARTBEAT_RTT_US 7
+#define METRIC_RESTARTS         8
+#define METRICS_NUM             9
+
+/**
+ * @brief Called before each scrape to bring gauges up to date
+ */
+typedef void (*metrics_collect_fn)(void);
+
+/**
+ * @brief Add to a counter
+ *
+ * @param m METRIC_*
+ * @param l Label index
+ * @param v Amount
+ */
+void metrics_add(uint8_t m, uint8_t l, uint64_t v);
+
+/**
+ * @brief Add one to a counter
+ */
+void metrics_inc(uint8_t m, uint8_t l);
+
+/**
+ * @brief Set a gauge
+ */
+void metrics_set(uint8_t m, uint8_t l, int64_t v);
+
+/**
+ * @brief Add a value to a histogram
+ */
+void metrics_observe(uint8_t m, uint8_t l, uint64_t v);
+
+/**
+ * @brief Current value of a counter or gauge, or the count of a histogram
+ */
+uint64_t metrics_get(uint8_t m, uint8_t l);
+
+/**
+ * @brief Microseconds on CLOCK_MONOTONIC, for timing what gets observed
+ */
+uint64_t metrics_now_us(void);
+
+/**
+ * @brief Write out every metric in the Prometheus text format
+ *
+ * @param buf Where to write
+ * @param len Size of buf
+ *
+ * @return Characters written, the text is cut short if buf is too small
+ */
+size_t metrics_render(char *buf, size_t len);
+
+/**
+ * @brief Serve GET /metrics on a loopback port
+ *
+ * @param port TCP port, 0 for any free one
+ * @param fn Called before each scrape, may be NULL
+ *
+ * @return METRICS_SUCCESS or error code
+ */
+uint8_t metrics_init(uint16_t port, metrics_collect_fn fn);
+
+/**
+ * @brief Port being served, 0 when not serving
+ */
+uint16_t metrics_port(void);
+
+/**
+ * @brief Stop serving
+ */
+void metrics_close(void);
+
+#endif /* __METRICS_H__ */
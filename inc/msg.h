@@ -35,10 +35,10 @@
 /**
  * @brief Message attributes
  */
-#define MSG_SIZE        16
+#define MSG_SIZE        20
 #define MSG_LOGSIZE     256
 #define MSG_DATASIZE    14
-#define MSG_LOGDATASIZE 253
+#define MSG_LOGDATASIZE 249
 #define MSG_MAXMSGS     8
 #define MSG_RSP_MASK    0x80
 #define MSG_FROM_MASK   0x7f
@@ -49,6 +49,7 @@
  */
 #define MSG_SUCCESS     0
 #define MSG_ERR_INIT    1
+#define MSG_ERR_FULL    2
 #define MSG_ERR_STUB    126
 #define MSG_ERR_UNKNOWN 127
 
@@ -59,6 +60,7 @@ typedef struct __attribute((packed)) msg_s {
     uint8_t from;       /* First bit is RSP field */
     uint8_t cmd;        /* Command */ 
     uint8_t data[MSG_DATASIZE];   /* NULL terminated data */
+    uint32_t ts;        /* Enqueue stamp, set by msg_send */
 } msg_t;
 
 /**
@@ -68,23 +70,32 @@ typedef struct __attribute((packed)) logmsg_s {
     uint8_t from;               /* First bit is RSP field */
     uint8_t cmd;                /* Command */ 
     uint8_t data[MSG_LOGDATASIZE];   /* NULL terminated data */
+    uint32_t ts;                /* Enqueue stamp, set by logmsg_send */
 } logmsg_t;
 
 /**
- * @brief Queue descriptions
+ * @brief Queue descriptions, one per task and one for control socket
+ * responses. Builds that must not share queues with a running daemon, like
+ * the simulator, give their own MSG_PREFIX
  */
-#define MSG_QUEUE_NUM 4
+#ifndef MSG_PREFIX
+#define MSG_PREFIX "/"
+#endif
+#define MSG_QUEUE_NUM 5
 #define MSG_QUEUE_PERM  0666
 mqd_t msg_queues[MSG_QUEUE_NUM];
 struct mq_attr msg_attrs[MSG_QUEUE_NUM];
-static const char *msg_names[] = {"/mainqueue",
-      		                        "/lightqueue",
-            	    	            "/tempqueue",
-                          		    "/logqueue"};
+static const char *msg_names[] = {MSG_PREFIX "mainqueue",
+      		                        MSG_PREFIX "lightqueue",
+            	    	            MSG_PREFIX "tempqueue",
+                          		    MSG_PREFIX "logqueue",
+                                    MSG_PREFIX "ctlqueue"};
 
 /**
  * @brief Send a message to a queue
  *
+ * Stamps the message so the receiver can tell how long it waited.
+ *
  * @param tx The message to send
  * @param to The queue to send the message to
  *
@@ -102,14 +113,87 @@ uint8_t msg_send(msg_t *tx, uint8_t to);
  */ 
 uint8_t logmsg_send(logmsg_t *tx, uint8_t to);
 
+/**
+ * @brief Send a message without waiting for room in the queue
+ *
+ * For the supervisor, which must not block on the queue of a task it
+ * may be about to restart. A full queue counts as a drop.
+ *
+ * @param tx The message to send
+ * @param to The queue to send the message to
+ *
+ * @return MSG_SUCCESS or MSG_ERR_FULL
+ */
+uint8_t msg_trysend(msg_t *tx, uint8_t to);
+
+/**
+ * @brief Send a message to the log queue without waiting for room
+ *
+ * @param tx The message to send
+ * @param to The queue to send the message to
+ *
+ * @return MSG_SUCCESS or MSG_ERR_FULL
+ */
+uint8_t logmsg_trysend(logmsg_t *tx, uint8_t to);
+
+
+/**
+ * @brief Pack a signed 24 bit value little endian
+ *
+ * @param p Where to write three bytes
+ * @param v Value, must fit in 24 bits
+ */
+void msg_put24(uint8_t *p, int32_t v);
+
+/**
+ * @brief Unpack a signed 24 bit little endian value
+ *
+ * @param p Three bytes to read
+ *
+ * @return Sign extended value
+ */
+int32_t msg_get24(const uint8_t *p);
+
+/**
+ * @brief Queue depth and failed sends
+ *
+ * @param q Queue
+ * @param depth Messages waiting in the queue, -1 if unknown
+ * @param drops Sends to the queue that failed
+ *
+ * @return MSG_SUCCESS or error value
+ */
+uint8_t msg_stats(uint8_t q, long *depth, uint32_t *drops);
+
+/**
+ * @brief Count a message as handled, called by a task loop after each one
+ *
+ * @param q Queue of the task
+ */
+void msg_progress(uint8_t q);
+
+/**
+ * @brief Messages a task has handled, readable from any thread
+ *
+ * The supervisor watches this move instead of waiting on a reply, so a
+ * task that is slow to answer is not taken for a dead one.
+ *
+ * @param q Queue of the task
+ *
+ * @return Count that wraps, 0 for an unknown queue
+ */
+uint32_t msg_progress_get(uint8_t q);
 
 /**
  * @brief Initialize queues
  * 
- * Initialize the four message queues.
+ * Initialize the message queues. Queues left over from an earlier run
+ * are removed first, since opening an existing queue keeps its old depth.
+ *
+ * @param depth Messages each queue holds (MSG_MAXMSGS by default)
  *
  * @return Returns MSG_SUCCESS for successful init or error value
  */
-uint8_t msg_init(void);
+uint8_t msg_init(uint32_t depth);
 
 #endif /* __MSG_H__ */
@@ -0,0 +1,147 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file prof.h
+ * @brief Dispatch profiling for the task command loops
+ *
+ * Each task keeps a prof_t of its own. Around every message it takes off its
+ * queue the loop records how long the message waited in the queue, from the
+ * stamp msg_send put on it, and how long the handler ran. Both go into
+ * per-command counts, totals, maxima and log2 histograms. Only the owning
+ * task writes or reads its profile, so none of this is locked.
+ *
+ * @author Ben Heberlein
+ * @date Nov 13 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __PROF_H__
+#define __PROF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Commands profiled per task, higher command numbers share the last
+ */
+#define PROF_CMDS       32
+
+/**
+ * @brief Histogram buckets, bucket b holds times under PROF_BOUND_NS(b) and
+ * the last one everything longer
+ */
+#define PROF_BUCKETS    16
+#define PROF_BOUND_NS(b) (1024ull << (b))
+
+/**
+ * @brief Profile ids for prof_get and the *_STATS commands, a command number
+ * or'd with PROF_RSP for responses, or PROF_WAIT for queue wait
+ */
+#define PROF_RSP        0x80
+#define PROF_WAIT       0xff
+
+/**
+ * @brief Times for one command
+ */
+typedef struct prof_ent_s {
+    uint32_t count;
+    uint32_t max_ns;
+    uint64_t total_ns;
+    uint32_t hist[PROF_BUCKETS];
+} prof_ent_t;
+
+/**
+ * @brief Profile of one task
+ */
+typedef struct prof_s {
+    prof_ent_t cmd[PROF_CMDS];
+    prof_ent_t rsp[PROF_CMDS];
+    prof_ent_t wait;
+} prof_t;
+
+/**
+ * @brief Writes a line of a profile dump
+ *
+ * @param from Task the profile belongs to
+ * @param line Text of the line
+ */
+typedef void (*prof_out_fn)(uint8_t from, const char *line);
+
+/**
+ * @brief Clear a profile
+ */
+void prof_init(prof_t *p);
+
+/**
+ * @brief Enqueue stamp for a message, microseconds that wrap
+ */
+uint32_t prof_stamp(void);
+
+/**
+ * @brief Record the queue wait of a message about to be dispatched
+ *
+ * @param p Profile
+ * @param stamp Stamp the message was sent with
+ *
+ * @return Start of the dispatch for prof_end
+ */
+uint64_t prof_begin(prof_t *p, uint32_t stamp);
+
+/**
+ * @brief Record the time a handler took
+ *
+ * @param p Profile
+ * @param from from field of the message, picks commands or responses
+ * @param cmd Command
+ * @param start Value prof_begin returned
+ */
+void prof_end(prof_t *p, uint8_t from, uint8_t cmd, uint64_t start);
+
+/**
+ * @brief Times for a profile id
+ *
+ * @return The entry, NULL for an unknown id
+ */
+const prof_ent_t *prof_get(const prof_t *p, uint8_t id);
+
+/**
+ * @brief Histogram bucket a percentile of an entry falls in
+ *
+ * @param e Entry
+ * @param pct Percentile, 1 to 100
+ *
+ * @return Bucket, 0 for an empty entry
+ */
+uint8_t prof_pct(const prof_ent_t *e, uint8_t pct);
+
+/**
+ * @brief Pack the times for a profile id into a *_STATS response
+ *
+ * Laid out as (1) id, (4) count, (4) mean ns, (4) max ns, (1) bucket of the
+ * 99th percentile. An unknown id comes back with a zero count.
+ *
+ * @param p Profile
+ * @param id Profile id
+ * @param data MSG_DATASIZE bytes to fill
+ */
+void prof_pack(const prof_t *p, uint8_t id, uint8_t *data);
+
+/**
+ * @brief Write a line for each command that ran and one for queue wait
+ *
+ * @param p Profile
+ * @param from Task the profile belongs to
+ * @param fn Where the lines go, NULL to send them to the log task
+ */
+void prof_dump(const prof_t *p, uint8_t from, prof_out_fn fn);
+
+#endif /* __PROF_H__ */
@@ -0,0 +1,199 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file rule.h
+ * @brief Threshold rules compiled to bytecode
+ *
+ * Rules are written one per line:
+ *
+ *     [name:] condition -> action [, action ...]
+ *
+ * A condition compares a sensor value to a number, `temp > 30 hyst 0.5`, and
+ * conditions combine with and, or, not and parentheses. Values are temp (C)
+ * and lux, or an aggregate of their history such as temp.mean.1m, with min,
+ * max, mean or std over 1s, 1m or 1h. A comparison with hyst has its limit
+ * moved back by that much while the comparison itself holds, so it works
+ * the same under not. == and != take no hyst. Actions are `led N` to
+ * follow the rule, `log "text"` when it becomes active and `cmd temp|light
+ * CMD [DATA]` to send a task command when it becomes active. Anything after
+ * # is a comment.
+ *
+ * Rules compile into a flat array of fused compare/logic instructions with
+ * numbers already in fixed point. Evaluation walks that array with a small
+ * fixed stack and calls back only when a rule changes state.
+ *
+ * @author Ben Heberlein
+ * @date Nov 9 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __RULE_H__
+#define __RULE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Error codes
+ */
+#define RULE_SUCCESS    0
+#define RULE_ERR_SYNTAX 1
+#define RULE_ERR_FULL   2
+#define RULE_ERR_FILE   3
+
+/**
+ * @brief Limits of a compiled rule set
+ */
+#define RULE_MAX        512
+#define RULE_CODE_MAX   8192
+#define RULE_ACT_MAX    1024
+#define RULE_TEXT_MAX   16384
+#define RULE_STACK      16
+
+/**
+ * @brief Variables, in milli-degrees C and hundredths of lux
+ *
+ * temp and lux are the latest samples, followed by the aggregates of each
+ * source ordered by statistic (min, max, mean, std) then window (1s, 1m, 1h)
+ * like hist_stats_t and HIST_WIN_*.
+ */
+#define RULE_VAR_TEMP   0
+#define RULE_VAR_LUX    1
+#define RULE_SRCS       2
+#define RULE_AGGS       4
+#define RULE_WINS       3
+#define RULE_VAR_AGG(src, agg, win) (RULE_SRCS + ((src) * RULE_AGGS + (agg)) * RULE_WINS + (win))
+#define RULE_VARS       RULE_VAR_AGG(RULE_SRCS, 0, 0)
+#define RULE_AGG_MIN    0
+#define RULE_AGG_MAX    1
+#define RULE_AGG_MEAN   2
+#define RULE_AGG_STD    3
+
+/**
+ * @brief Actions
+ */
+#define RULE_ACT_LED    0
+#define RULE_ACT_LOG    1
+#define RULE_ACT_CMD    2
+
+/**
+ * @brief Instruction, comparisons carry their variable and limit
+ */
+typedef struct rule_insn_s {
+    uint8_t op;
+    uint8_t var;
+    uint8_t on;         /* Result of the last evaluation */
+    int32_t k;          /* Limit */
+    int32_t h;          /* Hysteresis while on */
+} rule_insn_t;
+
+/**
+ * @brief Action of a rule
+ */
+typedef struct rule_action_s {
+    uint8_t type;       /* RULE_ACT_* */
+    uint8_t arg;        /* LED number or task thread id */
+    uint8_t cmd;        /* Task command */
+    uint8_t data;       /* Task command data byte */
+    uint16_t text;      /* Log text in the rule set text pool */
+} rule_action_t;
+
+/**
+ * @brief Compiled rule
+ */
+typedef struct rule_s {
+    uint16_t code;      /* First instruction */
+    uint16_t ncode;
+    uint16_t act;       /* First action */
+    uint8_t nact;
+    uint8_t active;     /* Result of the last evaluation */
+    uint16_t name;      /* Name in the text pool */
+    uint32_t vars;      /* Variables the rule reads */
+} rule_t;
+
+/**
+ * @brief Compiled rule set, fixed size so it can live in static storage
+ */
+typedef struct rule_set_s {
+    rule_t rules[RULE_MAX];
+    rule_insn_t code[RULE_CODE_MAX];
+    rule_action_t acts[RULE_ACT_MAX];
+    char text[RULE_TEXT_MAX];
+    uint16_t nrules;
+    uint16_t ncode;
+    uint16_t nact;
+    uint16_t ntext;
+    uint32_t used;      /* Variables any rule reads */
+} rule_set_t;
+
+/**
+ * @brief Called for each action of a rule that changed state
+ *
+ * @param rs Rule set
+ * @param r Rule that changed
+ * @param a Action to take
+ * @param active New state of the rule
+ * @param ctx Context given to rule_eval
+ */
+typedef void (*rule_act_fn)(const rule_set_t *rs, const rule_t *r, const rule_action_t *a,
+                            uint8_t active, void *ctx);
+
+/**
+ * @brief Compile rule text, replacing whatever the set held
+ *
+ * @param rs Set to compile into
+ * @param src Rule text
+ * @param err Filled in with a message on failure
+ * @param errlen Size of err
+ *
+ * @return RULE_SUCCESS or error code
+ */
+uint8_t rule_compile(rule_set_t *rs, const char *src, char *err, size_t errlen);
+
+/**
+ * @brief Compile the rules in a file
+ *
+ * @param rs Set to compile into
+ * @param path File to read
+ * @param err Filled in with a message on failure
+ * @param errlen Size of err
+ *
+ * @return RULE_SUCCESS or error code
+ */
+uint8_t rule_load(rule_set_t *rs, const char *path, char *err, size_t errlen);
+
+/**
+ * @brief Evaluate every rule against the current variables
+ *
+ * Rules reading a variable not in valid keep their state. Does not allocate.
+ *
+ * @param rs Rule set
+ * @param vars RULE_VARS values
+ * @param valid Bit mask of variables that hold a value
+ * @param act Called for the actions of rules that changed state
+ * @param ctx Passed to act
+ *
+ * @return Number of rules that changed state
+ */
+uint32_t rule_eval(rule_set_t *rs, const int32_t *vars, uint32_t valid, rule_act_fn act, void *ctx);
+
+/**
+ * @brief String from the text pool of a rule set
+ *
+ * @param rs Rule set
+ * @param off Offset of the string
+ *
+ * @return The string
+ */
+const char *rule_text(const rule_set_t *rs, uint16_t off);
+
+#endif /* __RULE_H__ */
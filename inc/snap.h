@@ -0,0 +1,142 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file snap.h
+ * @brief Latest sensor readings published through seqlocks
+ *
+ * Each sensor task publishes its newest reading into a slot of a shared
+ * memory segment. A slot's sequence counter is odd while a write is in
+ * progress, so readers copy the slot and retry if the counter moved. Readers
+ * never block the sensor tasks and any process can map the segment read only
+ * to watch the sensors. If the segment cannot be created the slots live in
+ * process memory and only this process sees them.
+ *
+ * @author Ben Heberlein
+ * @date Nov 6 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __SNAP_H__
+#define __SNAP_H__
+
+#include <stdint.h>
+
+/**
+ * @brief Error codes
+ */
+#define SNAP_SUCCESS    0
+#define SNAP_ERR_SHM    1
+#define SNAP_ERR_PARAM  2
+#define SNAP_ERR_EMPTY  3
+#define SNAP_ERR_BUSY   4
+
+/**
+ * @brief Shared memory name and layout check, the simulator builds with a
+ * name of its own
+ */
+#ifndef SNAP_NAME
+#define SNAP_NAME   "/project1_snap"
+#endif
+#define SNAP_MAGIC  0x534e4150
+
+/**
+ * @brief Slots
+ */
+#define SNAP_TOTAL  2
+#define SNAP_TEMP   0
+#define SNAP_LIGHT  1
+
+/**
+ * @brief Reads give up after this many torn copies
+ */
+#define SNAP_TRIES  1000
+
+/**
+ * @brief snap_read calls a task makes on a busy slot, yielding in between
+ */
+#define SNAP_RETRIES    10
+
+/**
+ * @brief One published reading
+ *
+ * Temperature values are milli-degrees C with the raw TMP106 code. Light
+ * values are hundredths of lux with channel 0 in the low half of raw and
+ * channel 1 in the high half.
+ */
+typedef struct snap_val_s {
+    int32_t value;      /* Converted reading */
+    uint32_t raw;       /* Sensor code */
+    uint32_t ts_ms;     /* CLOCK_MONOTONIC time of the reading in ms */
+    uint32_t seq;       /* Readings published so far, starting at 1 */
+} snap_val_t;
+
+/**
+ * @brief A slot, one cache line each so the tasks do not share lines
+ */
+typedef struct snap_slot_s {
+    uint32_t lock;      /* Odd while being written */
+    snap_val_t val;
+} __attribute__((aligned(64))) snap_slot_t;
+
+/**
+ * @brief Layout of the shared segment
+ */
+typedef struct snap_shm_s {
+    uint32_t magic;
+    uint32_t size;
+    snap_slot_t slot[SNAP_TOTAL];
+} snap_shm_t;
+
+/**
+ * @brief Create the segment for publishing, clearing any old readings
+ *
+ * @return SNAP_SUCCESS, or SNAP_ERR_SHM if publishing stays in process
+ */
+uint8_t snap_init(void);
+
+/**
+ * @brief Remove the segment made by snap_init, at shutdown
+ *
+ * Readers that are attached keep their mapping.
+ */
+void snap_close(void);
+
+/**
+ * @brief Map an existing segment read only, for other processes
+ *
+ * @return SNAP_SUCCESS or error code
+ */
+uint8_t snap_attach(void);
+
+/**
+ * @brief Publish a reading
+ *
+ * Safe to call from several threads for the same slot.
+ *
+ * @param id SNAP_TEMP or SNAP_LIGHT
+ * @param value Converted reading
+ * @param raw Sensor code
+ * @param ts_ms CLOCK_MONOTONIC time of the reading in ms
+ */
+void snap_publish(uint8_t id, int32_t value, uint32_t raw, uint32_t ts_ms);
+
+/**
+ * @brief Copy out the latest reading
+ *
+ * @param id SNAP_TEMP or SNAP_LIGHT
+ * @param out Filled in with the reading
+ *
+ * @return SNAP_SUCCESS, SNAP_ERR_EMPTY if nothing was published yet, or error
+ */
+uint8_t snap_read(uint8_t id, snap_val_t *out);
+
+#endif /* __SNAP_H__ */
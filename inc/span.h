@@ -0,0 +1,120 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file span.h
+ * @brief Span recorder with Chrome trace-event export
+ *
+ * While recording, handler dispatch, timer callbacks, I2C transactions, log
+ * writes and rule evaluation are each kept as one event with their thread,
+ * start and duration. The buffer fills once and then drops, so a burst
+ * records exactly its first events. span_dump writes them out as trace-event
+ * JSON that chrome://tracing and Perfetto load.
+ *
+ * Spans are taken as
+ *
+ *     uint64_t t = span_begin();
+ *     ...
+ *     span_end(SPAN_I2C, MAIN_THREAD_TEMP, address, t);
+ *
+ * and cost one relaxed load when not recording.
+ *
+ * @author Ben Heberlein
+ * @date Nov 15 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __SPAN_H__
+#define __SPAN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Error codes
+ */
+#define SPAN_SUCCESS    0
+#define SPAN_ERR_PARAM  1
+#define SPAN_ERR_MEM    2
+#define SPAN_ERR_FILE   3
+
+/**
+ * @brief Default and largest buffer, in events
+ */
+#define SPAN_EVENTS     65536
+#define SPAN_EVENTS_MAX 1048576
+
+/**
+ * @brief Span kinds
+ */
+#define SPAN_DISPATCH   0   /* arg is the command, or'd with SPAN_RSP */
+#define SPAN_TIMER      1   /* arg is TRACE_TIMER_* */
+#define SPAN_I2C        2   /* arg is the register */
+#define SPAN_LOG        3   /* arg is the level */
+#define SPAN_RULES      4   /* arg is the sample topic */
+#define SPAN_KINDS      5
+
+#define SPAN_RSP        0x100
+
+/**
+ * @brief Start of a span
+ *
+ * @return Start time, 0 when not recording
+ */
+uint64_t span_begin(void);
+
+/**
+ * @brief Record a span that started at t
+ *
+ * @param kind SPAN_*
+ * @param task Task the work belongs to
+ * @param arg Kind specific argument
+ * @param t Value span_begin returned, nothing is recorded for 0
+ */
+void span_end(uint8_t kind, uint8_t task, uint16_t arg, uint64_t t);
+
+/**
+ * @brief Start recording into a new buffer, dropping anything not dumped
+ *
+ * @param events Buffer size, 0 for SPAN_EVENTS
+ *
+ * @return SPAN_SUCCESS or error code
+ */
+uint8_t span_start(uint32_t events);
+
+/**
+ * @brief Stop recording, the events stay until the next start
+ */
+void span_stop(void);
+
+/**
+ * @brief Whether spans are being recorded
+ */
+uint8_t span_recording(void);
+
+/**
+ * @brief Events kept and events dropped for a full buffer
+ */
+void span_stats(uint32_t *kept, uint32_t *dropped);
+
+/**
+ * @brief Write the recorded events as Chrome trace-event JSON
+ *
+ * Recording should be stopped first, spans still being written are left
+ * out.
+ *
+ * @param path File to write
+ *
+ * @return SPAN_SUCCESS or error code
+ */
+uint8_t span_dump(const char *path);
+
+#endif /* __SPAN_H__ */
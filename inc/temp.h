@@ -27,11 +27,18 @@
 #define __TEMP_H__
 
 #include "msg.h"
+#include "adapt.h"
+#include "hist.h"
+#include "prof.h"
+#include <mraa.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 
 /* Error codes */
 #define TEMP_SUCCESS        0
+#define TEMP_ERR_PARAM      1
+#define TEMP_ERR_GPIO       2
 #define TEMP_ERR_STUB       126
 #define TEMP_ERR_UNKNOWN    127
 
@@ -49,6 +56,14 @@
 #define TEMP_ALIVE          8
 #define TEMP_KILL           9
 #define TEMP_WRITEPTR       10
+#define TEMP_SETALERT       11
+#define TEMP_SETONESHOT     12
+#define TEMP_GETBUSSTATS    13
+#define TEMP_SETADAPT       14
+#define TEMP_GETADAPT       15
+#define TEMP_GETTEMP_ALL    16
+#define TEMP_GETSTATS       17
+#define TEMP_STATS          18
 
 /**
  * @brief I2C and sensor macros
@@ -73,6 +88,30 @@
 #define TEMP_REG_CTRL_AL    (1<<5)
 #define TEMP_REG_CTRL_EM    (1<<4)
 
+/**
+ * @brief ALERT pin modes
+ *
+ * In comparator mode T_HIGH is MAIN_TOOHOT and T_LOW sits TEMP_ALERT_HYST 
+ * below it, so the ALERT level is the too-hot flag and both edges are 
+ * reported. In interrupt mode T_HIGH is MAIN_TOOHOT and T_LOW is MAIN_TOOCOLD;
+ * the sensor alternates between the two crossings and each one is reported 
+ * once. Returning to the normal band is still picked up by the timer reads.
+ */
+#define TEMP_ALERT_OFF      0
+#define TEMP_ALERT_COMP     1
+#define TEMP_ALERT_INT      2
+
+/**
+ * @brief ALERT pin wiring and comparator hysteresis (C)
+ */
+#define TEMP_ALERT_GPIO     60
+#define TEMP_ALERT_HYST     1.0
+
+/**
+ * @brief Reported before the first reading, 123.456 C as it always was
+ */
+#define TEMP_NONE_MC 123456
+
 /**
  * @brief Temperature formats
  */
@@ -93,11 +132,61 @@
  */
 #define TEMP_RES 0.0625
 
+/**
+ * @brief Sample timestamps travel as the low 24 bits of CLOCK_MONOTONIC in ms
+ */
+#define TEMP_TS_MASK 0xffffff
+
+/**
+ * @brief One reading in every unit, in thousandths of a degree
+ */
+typedef struct temp_all_s {
+    uint16_t raw;       /* Register contents */
+    int32_t mc;         /* Celcius */
+    int32_t mf;         /* Farenheit */
+    int32_t mk;         /* Kelvin */
+    uint32_t ts_ms;     /* When it was read, masked with TEMP_TS_MASK */
+} temp_all_t;
+
 /**
  * @brief Temperature update timer
  */
 #define TEMP_TIMER_NS 260000000
 
+/**
+ * @brief Adaptive sampling limits and bounds (C/s, C, C)
+ */
+#define TEMP_ADAPT_MIN_NS   130000000
+#define TEMP_ADAPT_MAX_NS   4000000000u
+#define TEMP_ADAPT_RATE     0.05
+#define TEMP_ADAPT_STD      0.25
+#define TEMP_ADAPT_NOISE    TEMP_RES
+
+/**
+ * @brief One-shot conversion wait, worst case conversion time from the 
+ * data sheet
+ */
+#define TEMP_ONESHOT_NS 35000000
+
+/**
+ * @brief What the task keeps across a restart
+ *
+ * The supervisor owns one of these and hands it to every temp_task it
+ * starts. A task that finds the bus already open adopts it, along with the
+ * register shadow, sampling period and history, instead of initializing
+ * the sensor again.
+ */
+typedef struct temp_state_s {
+    mraa_i2c_context i2c;           /* NULL until TEMP_INIT */
+    mraa_gpio_context alert_gpio;   /* NULL while ALERT is off */
+    uint16_t ctrl_shadow;           /* Control register, without OS */
+    uint8_t oneshot;                /* One-shot conversions */
+    uint8_t sampling;               /* Check timer is running */
+    adapt_t adapt;
+    hist_t hist;
+    prof_t prof;
+} temp_state_t;
+
 /**
  * @brief Format strings
  */
@@ -106,14 +195,16 @@ static const char *temp_fmt_strings[] = {"Celcius", "Farenheit", "Kelvin"};
 /** 
  * @brief temp task function
  *
- * @param data Data to send to task
+ * @param data temp_state_t to run with and adopt, NULL for one of the
+ * module's own
  *
  * @return Return pointer
  */
 void *temp_task(void *data);
 
 /**
- * @brief Initialize temperature task
+ * @brief Initialize temperature task, nothing to do for a task that adopted
+ * an open bus
  *
  * DATA     none
  * RESPONSE none
@@ -187,6 +278,52 @@ uint8_t temp_writeptr(msg_t *rx);
  */
 uint8_t temp_gettemp(msg_t *rx);
 
+/**
+ * @brief Get the last reading in every unit at once
+ * 
+ * DATA     none
+ * RESPONSE (14) temp_all_t, see temp_all_pack
+ * 
+ * @param rx Pointer to message
+ *
+ * @return Return TEMP_SUCCESS or error code
+ */
+uint8_t temp_gettemp_all(msg_t *rx);
+
+/**
+ * @brief Fill in the Farenheit and Kelvin fields from Celcius
+ *
+ * @param t Reading with mc set
+ */
+void temp_units(temp_all_t *t);
+
+/**
+ * @brief Pack a reading into message data
+ *
+ * Layout is (2) raw, (3) mC, (3) mF, (3) mK, (3) timestamp, all little endian.
+ *
+ * @param t Reading to pack
+ * @param data At least MSG_DATASIZE bytes
+ */
+void temp_all_pack(const temp_all_t *t, uint8_t *data);
+
+/**
+ * @brief Unpack a reading from message data
+ *
+ * @param data Data written by temp_all_pack
+ * @param t Reading to fill in
+ */
+void temp_all_unpack(const uint8_t *data, temp_all_t *t);
+
+/**
+ * @brief Convert an array of register readings to thousandths of a degree C
+ *
+ * @param raw Register contents
+ * @param mc Output
+ * @param n Number of readings
+ */
+void temp_conv_bulk(const uint16_t *raw, int32_t *mc, size_t n);
+
 /**
  * @brief Configures the sensor conversion rate to the specified amount
  * 
@@ -222,10 +359,116 @@ uint8_t temp_shutdown(msg_t *rx);
 uint8_t temp_wakeup(msg_t *rx);
 
 /**
- * @brief Checks if the temperature task is still alive 
+ * @brief Programs the thresholds and ALERT mode and hooks the ALERT edge
+ *
+ * Each ALERT edge reads the temperature and sends MAIN_TEMPALERT to main 
+ * straight away, instead of waiting for the next logic timer.
+ *
+ * DATA     (1) TEMP_ALERT_OFF, TEMP_ALERT_COMP or TEMP_ALERT_INT
+ * RESPONSE none
+ * 
+ * @param rx Pointer to message
+ * @return Return TEMP_SUCCESS or error code
+ */
+uint8_t temp_setalert(msg_t *rx);
+
+/**
+ * @brief Switches between continuous and one-shot sampling
+ *
+ * In one-shot mode the sensor stays in shutdown. Each timer tick sets OS to 
+ * start a single conversion and a second timer reads the result once the 
+ * conversion time has passed. Bus statistics are reset on every switch.
+ *
+ * DATA     (1) 1 for one-shot, 0 for continuous
+ * RESPONSE none
+ * 
+ * @param rx Pointer to message
+ * @return Return TEMP_SUCCESS or error code
+ */
+uint8_t temp_setoneshot(msg_t *rx);
+
+/**
+ * @brief Reports bus usage and sample latency since the last mode switch
+ *
+ * Latency runs from the timer tick that starts a sample to the moment the
+ * new temperature is stored.
  *
  * DATA     none
+ * RESPONSE (4) I2C transactions
+ *          (4) readings
+ *          (4) mean sample latency in us
+ *          (1) 1 if in one-shot mode
+ * 
+ * @param rx Pointer to message
+ * @return Return TEMP_SUCCESS or error code
+ */
+uint8_t temp_getbusstats(msg_t *rx);
+
+/**
+ * @brief Sets the limits for the adaptive sampling period
+ *
+ * Equal limits give a fixed period.
+ *
+ * DATA     (2) minimum period in ms
+ *          (2) maximum period in ms
+ * RESPONSE none
+ * 
+ * @param rx Pointer to message
+ * @return Return TEMP_SUCCESS or error code
+ */
+uint8_t temp_setadapt(msg_t *rx);
+
+/**
+ * @brief Reports the adaptive sampling period and its savings
+ *
+ * DATA     none
+ * RESPONSE (4) current period in us
+ *          (4) samples taken
+ *          (4) samples saved against TEMP_TIMER_NS
+ * 
+ * @param rx Pointer to message
+ * @return Return TEMP_SUCCESS or error code
+ */
+uint8_t temp_getadapt(msg_t *rx);
+
+/**
+ * @brief Reports aggregates of recent temperature readings
+ *
+ * DATA     (1) window, HIST_WIN_1S, HIST_WIN_1M or HIST_WIN_1H
+ * RESPONSE (1) window, or'd with HIST_EMPTY if there were no readings
+ *          (3) minimum in milli-degrees C
+ *          (3) maximum in milli-degrees C
+ *          (3) mean in milli-degrees C
+ *          (3) standard deviation in milli-degrees C
+ * 
+ * @param rx Pointer to message
+ * @return Return TEMP_SUCCESS or error code
+ */
+uint8_t temp_getstats(msg_t *rx);
+
+/**
+ * @brief Reports how the temperature command loop spends its time
+ *
+ * DATA     (1) command, or'd with PROF_RSP for a response, or PROF_WAIT
+ *              for time spent waiting in the queue
+ * RESPONSE (1) the id asked for
+ *          (4) messages dispatched
+ *          (4) mean time in ns
+ *          (4) longest time in ns
+ *          (1) bucket of the 99th percentile, see PROF_BOUND_NS
+ * 
+ * @param rx Pointer to message
+ * @return Return TEMP_SUCCESS or error code
+ */
+uint8_t temp_stats(msg_t *rx);
+
+/**
+ * @brief Checks if the temperature task is still alive 
+ *
+ * DATA     (1) unused
+ *          (4) send stamp from prof_stamp
  * RESPONSE (1) alive packet 0xa5
+ *          (4) the send stamp, for timing the round trip
  * 
  * @param rx Pointer to message
  * @return Return TEMP_SUCCESS or error code
@@ -233,7 +476,7 @@ uint8_t temp_wakeup(msg_t *rx);
 uint8_t temp_alive(msg_t *rx);
 
 /**
- * @brief Kills the task gracefully
+ * @brief Kills the task gracefully, logging its dispatch profile first
  *
  * DATA     none
  * RESPONSE none
@@ -249,8 +492,15 @@ uint8_t temp_kill(msg_t *rx);
 uint16_t  __temp_i2c_read(uint8_t address);
 void __temp_i2c_write(uint16_t data, uint8_t address);
 float __temp_conv(uint16_t);
+int32_t __temp_conv_mc(uint16_t data);
+int32_t __temp_store(uint16_t data);
+uint16_t __temp_unconv(float c);
+void __temp_alert(void *arg);
 void __temp_check(union sigval arg);
+void __temp_oneshot_done(union sigval arg);
 uint8_t __temp_timer_init(void);
+uint8_t __temp_oneshot_timer_init(void);
+void __temp_sample_done(uint16_t data);
 void __temp_terminate(void *arg);
 
 #endif /* __TEMP_H__ */
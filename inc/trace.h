@@ -0,0 +1,75 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file trace.h
+ * @brief Static tracepoints on the hot paths
+ *
+ * Built with USDT defined (make USDT=1, needs sys/sdt.h from the systemtap
+ * sdt headers) each TRACE is a USDT probe in provider project1 that perf or
+ * bpftrace can attach to, a nop until something does. Without USDT the
+ * probes and their arguments compile away entirely.
+ *
+ * Every probe starts with the task (MAIN_THREAD_*), then a command, register
+ * or level, then a size:
+ *
+ *     msg__send        queue, cmd, bytes, from     msg_send, logmsg_send
+ *     msg__drop        queue, cmd, bytes, from     send failed
+ *     dispatch__start  task, cmd, bytes, from      task loop took a message
+ *     dispatch__end    task, cmd, bytes, from      its handler returned
+ *     i2c__start       task, register, bytes       transaction starts
+ *     i2c__end         task, register, bytes       transaction done
+ *     timer__fire      task, TRACE_TIMER_*, us     callback ran, us late
+ *     log__write       task, level, bytes          line written to the file
+ *     log__sample      task, level, bytes, us      sample line, us since published
+ *     led__write       task, led, state, us        rule set an LED, us since published
+ *
+ * tools/ has bpftrace scripts that turn these into latency histograms. The
+ * simulator (make sim) builds with SIM instead, which hands every probe to
+ * its sim_<name> function in sim/sim.c to time the paths it reports on.
+ *
+ * @author Ben Heberlein
+ * @date Nov 14 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/**
+ * @brief Timers named by timer__fire
+ */
+#define TRACE_TIMER_HEARTBEAT   0
+#define TRACE_TIMER_CHECK       1
+#define TRACE_TIMER_ONESHOT     2
+
+#ifdef USDT
+
+#include <sys/sdt.h>
+
+#define TRACE3(name, a, b, c)       DTRACE_PROBE3(project1, name, a, b, c)
+#define TRACE4(name, a, b, c, d)    DTRACE_PROBE4(project1, name, a, b, c, d)
+
+#elif defined(SIM)
+
+#include "sim.h"
+
+#define TRACE3(name, a, b, c)       sim_##name(a, b, c, 0)
+#define TRACE4(name, a, b, c, d)    sim_##name(a, b, c, d)
+
+#else
+
+#define TRACE3(name, a, b, c)       do { } while (0)
+#define TRACE4(name, a, b, c, d)    do { } while (0)
+
+#endif /* USDT, SIM */
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,473 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file mraa.c
+ * @brief Simulated I2C bus and GPIO behind the part of the mraa API the
+ * tasks use
+ *
+ * @author Ben Heberlein
+ * @date Nov 17 2017
+ * @version 1.0
+ *
+ */
+
+#include "mraa.h"
+#include "temp.h"
+#include "light.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * @brief An open bus, the APDS-9301 keeps the command byte between calls
+ */
+struct _i2c {
+    unsigned int bus;
+    uint8_t addr;
+    uint8_t cmd;
+    uint8_t wpend;      /* Next byte written is data for cmd */
+};
+
+/**
+ * @brief A GPIO, with a thread of its own while an ISR is hooked
+ */
+struct _gpio {
+    int pin;
+    mraa_gpio_edge_t edge;
+    void (*fn)(void *);
+    void *args;
+    pthread_t isr;
+    uint32_t pending;
+    uint8_t running;
+    uint8_t stop;
+};
+
+/**
+ * @brief Parts on the bus
+ */
+#define MRAA_SIM_TEMP_CTRL  0x60a0
+#define MRAA_SIM_TEMP_HIGH  0x5000
+#define MRAA_SIM_TEMP_LOW   0x4b00
+#define MRAA_SIM_LIGHT_ID   0x50
+#define MRAA_SIM_LIGHT_TIME LIGHT_INT_402
+#define MRAA_SIM_LIGHT_CH1  0.25
+
+/**
+ * @brief Private data, everything under mraa_sim_lock, which is also the bus
+ */
+static pthread_mutex_t mraa_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mraa_sim_edge = PTHREAD_COND_INITIALIZER;
+static float mraa_sim_c;
+static float mraa_sim_lx;
+static uint32_t mraa_sim_us;
+static uint32_t mraa_sim_ppm;
+static unsigned int mraa_sim_seed = 1;
+static mraa_sim_stats_t mraa_sim_st;
+
+static uint16_t mraa_sim_temp_regs[4] = {
+    [TEMP_REG_CTRL] = MRAA_SIM_TEMP_CTRL,
+    [TEMP_REG_HIGH] = MRAA_SIM_TEMP_HIGH,
+    [TEMP_REG_LOW] = MRAA_SIM_TEMP_LOW,
+};
+static uint8_t mraa_sim_temp_ptr;
+static uint8_t mraa_sim_hot;        /* Comparator output */
+static uint8_t mraa_sim_latched;    /* Interrupt mode output */
+static uint8_t mraa_sim_pin;
+
+static uint8_t mraa_sim_light_regs[16] = {
+    [LIGHT_REG_TIME] = MRAA_SIM_LIGHT_TIME,
+    [LIGHT_REG_ID] = MRAA_SIM_LIGHT_ID,
+};
+
+static struct _gpio *mraa_sim_alert;
+
+/**
+ * @brief Private functions
+ */
+static uint8_t __mraa_sim_xfer(void) {
+
+    /* The bus stays held for the whole transaction, slow or not */
+    mraa_sim_st.xfers++;
+    if (mraa_sim_us) {
+        struct timespec ts = {mraa_sim_us / 1000000, (mraa_sim_us % 1000000) * 1000};
+        nanosleep(&ts, NULL);
+    }
+
+    if (mraa_sim_ppm && (uint32_t) rand_r(&mraa_sim_seed) % 1000000 < mraa_sim_ppm) {
+        mraa_sim_st.errors++;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint16_t __mraa_sim_temp_reg(uint8_t reg) {
+
+    /* Reading any register clears an alert in interrupt mode */
+    mraa_sim_latched = 0;
+
+    if (reg == TEMP_REG_TEMP) {
+        int16_t code = (int16_t) lrintf(mraa_sim_c / TEMP_RES);
+        return (uint16_t) code << 4;
+    }
+
+    return mraa_sim_temp_regs[reg & 0x03];
+}
+
+static uint8_t __mraa_sim_light_reg(uint8_t reg) {
+
+    if (reg < LIGHT_REG_DATA0L) {
+        return mraa_sim_light_regs[reg];
+    }
+
+    /* Counts at 402 ms and 1x gain, from the first segment of the lux
+     * formula with channel 1 at a fixed share of channel 0 */
+    static const float full[] = {5047, 37177, 65535, 65535};
+    static const float integ[] = {13.7 / 402.0, 101.0 / 402.0, 1.0, 1.0};
+    float per = 0.0304f - 0.062f * powf(MRAA_SIM_LIGHT_CH1, 1.4f);
+    float ch = mraa_sim_lx > 0 ? mraa_sim_lx / per : 0;
+
+    uint8_t time = mraa_sim_light_regs[LIGHT_REG_TIME];
+    ch *= integ[time & LIGHT_TIMING_INTEG] * (time & LIGHT_TIMING_GAIN ? 16 : 1);
+    if (reg >= LIGHT_REG_DATA1L) {
+        ch *= MRAA_SIM_LIGHT_CH1;
+    }
+    if ((mraa_sim_light_regs[LIGHT_REG_CTRL] & LIGHT_CTRL_POWERON) != LIGHT_CTRL_POWERON) {
+        ch = 0;
+    }
+
+    uint16_t counts = ch > full[time & LIGHT_TIMING_INTEG] ? full[time & LIGHT_TIMING_INTEG] : ch + 0.5f;
+    return reg & 1 ? counts >> 8 : counts & 0xff;
+}
+
+static void *__mraa_sim_isr(void *arg) {
+    struct _gpio *dev = arg;
+
+    pthread_mutex_lock(&mraa_sim_lock);
+    while (1) {
+        while (!dev->stop && dev->pending == 0) {
+            pthread_cond_wait(&mraa_sim_edge, &mraa_sim_lock);
+        }
+        if (dev->stop) {
+            break;
+        }
+        dev->pending--;
+        dev->running = 1;
+        pthread_mutex_unlock(&mraa_sim_lock);
+        dev->fn(dev->args);
+        pthread_mutex_lock(&mraa_sim_lock);
+        dev->running = 0;
+    }
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Public functions
+ */
+mraa_result_t mraa_init(void) {
+    return MRAA_SUCCESS;
+}
+
+mraa_i2c_context mraa_i2c_init_raw(unsigned int bus) {
+    mraa_i2c_context dev = calloc(1, sizeof(*dev));
+
+    if (dev != NULL) {
+        dev->bus = bus;
+    }
+
+    return dev;
+}
+
+mraa_result_t mraa_i2c_address(mraa_i2c_context dev, uint8_t address) {
+
+    if (dev == NULL) {
+        return MRAA_ERROR_INVALID_HANDLE;
+    }
+    dev->addr = address;
+
+    return MRAA_SUCCESS;
+}
+
+int mraa_i2c_read_byte(mraa_i2c_context dev) {
+    int ret = -1;
+
+    if (dev == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mraa_sim_lock);
+    if (!__mraa_sim_xfer()) {
+        if (dev->addr == TEMP_I2C_ADDR) {
+            ret = __mraa_sim_temp_reg(mraa_sim_temp_ptr) >> 8;
+        } else if (dev->addr == LIGHT_I2C_ADDR) {
+            ret = __mraa_sim_light_reg(dev->cmd & LIGHT_CMD_ADDR_MASK);
+        }
+    }
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    return ret;
+}
+
+int mraa_i2c_read_word_data(mraa_i2c_context dev, const uint8_t command) {
+    int ret = -1;
+
+    if (dev == NULL) {
+        return -1;
+    }
+
+    /* SMBus words come low byte first, the TMP106 sends its high byte first */
+    pthread_mutex_lock(&mraa_sim_lock);
+    if (!__mraa_sim_xfer()) {
+        if (dev->addr == TEMP_I2C_ADDR) {
+            mraa_sim_temp_ptr = command & 0x03;
+            uint16_t v = __mraa_sim_temp_reg(mraa_sim_temp_ptr);
+            ret = (v >> 8) | (v & 0xff) << 8;
+        } else if (dev->addr == LIGHT_I2C_ADDR) {
+            uint8_t reg = command & LIGHT_CMD_ADDR_MASK;
+            ret = __mraa_sim_light_reg(reg) | __mraa_sim_light_reg((reg + 1) & LIGHT_CMD_ADDR_MASK) << 8;
+        }
+    }
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    return ret;
+}
+
+mraa_result_t mraa_i2c_write_byte(mraa_i2c_context dev, const uint8_t data) {
+    mraa_result_t ret = MRAA_ERROR_UNSPECIFIED;
+
+    if (dev == NULL) {
+        return MRAA_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&mraa_sim_lock);
+    if (!__mraa_sim_xfer()) {
+        ret = MRAA_SUCCESS;
+        if (dev->addr == TEMP_I2C_ADDR) {
+            mraa_sim_temp_ptr = data & 0x03;
+        } else if (dev->wpend) {
+            /* ID and data registers are read only */
+            uint8_t reg = dev->cmd & LIGHT_CMD_ADDR_MASK;
+            if (reg < LIGHT_REG_ID) {
+                mraa_sim_light_regs[reg] = data;
+            }
+            dev->wpend = 0;
+        } else {
+            dev->cmd = data;
+            dev->wpend = (data & LIGHT_CMD_READ) == LIGHT_CMD_WRITE;
+        }
+    }
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    return ret;
+}
+
+mraa_result_t mraa_i2c_write_word_data(mraa_i2c_context dev, const uint16_t data, const uint8_t command) {
+    mraa_result_t ret = MRAA_ERROR_UNSPECIFIED;
+
+    if (dev == NULL) {
+        return MRAA_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&mraa_sim_lock);
+    if (!__mraa_sim_xfer()) {
+        ret = MRAA_SUCCESS;
+        if (dev->addr == TEMP_I2C_ADDR) {
+            mraa_sim_temp_ptr = command & 0x03;
+            if (mraa_sim_temp_ptr != TEMP_REG_TEMP) {
+                mraa_sim_temp_regs[mraa_sim_temp_ptr] = (data >> 8) | (data & 0xff) << 8;
+            }
+        } else if (dev->addr == LIGHT_I2C_ADDR) {
+            uint8_t reg = command & LIGHT_CMD_ADDR_MASK;
+            if (reg + 1 < LIGHT_REG_ID) {
+                mraa_sim_light_regs[reg] = data & 0xff;
+                mraa_sim_light_regs[reg + 1] = data >> 8;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    return ret;
+}
+
+mraa_result_t mraa_i2c_stop(mraa_i2c_context dev) {
+    free(dev);
+    return MRAA_SUCCESS;
+}
+
+mraa_gpio_context mraa_gpio_init(int pin) {
+    mraa_gpio_context dev = calloc(1, sizeof(*dev));
+
+    if (dev != NULL) {
+        dev->pin = pin;
+    }
+
+    return dev;
+}
+
+mraa_result_t mraa_gpio_dir(mraa_gpio_context dev, mraa_gpio_dir_t dir) {
+    return dev == NULL ? MRAA_ERROR_INVALID_HANDLE : MRAA_SUCCESS;
+}
+
+mraa_result_t mraa_gpio_isr(mraa_gpio_context dev, mraa_gpio_edge_t edge, void (*fptr)(void *), void *args) {
+
+    /* Only the ALERT pin ever moves */
+    if (dev == NULL || dev->pin != TEMP_ALERT_GPIO || fptr == NULL) {
+        return MRAA_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&mraa_sim_lock);
+    if (mraa_sim_alert != NULL) {
+        pthread_mutex_unlock(&mraa_sim_lock);
+        return MRAA_ERROR_UNSPECIFIED;
+    }
+    dev->edge = edge;
+    dev->fn = fptr;
+    dev->args = args;
+    dev->pending = 0;
+    dev->running = 0;
+    dev->stop = 0;
+    if (pthread_create(&dev->isr, NULL, __mraa_sim_isr, dev)) {
+        pthread_mutex_unlock(&mraa_sim_lock);
+        return MRAA_ERROR_UNSPECIFIED;
+    }
+    mraa_sim_alert = dev;
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    return MRAA_SUCCESS;
+}
+
+mraa_result_t mraa_gpio_isr_exit(mraa_gpio_context dev) {
+
+    pthread_mutex_lock(&mraa_sim_lock);
+    if (dev == NULL || mraa_sim_alert != dev) {
+        pthread_mutex_unlock(&mraa_sim_lock);
+        return MRAA_ERROR_INVALID_HANDLE;
+    }
+    mraa_sim_alert = NULL;
+    dev->stop = 1;
+    pthread_cond_broadcast(&mraa_sim_edge);
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    /* A task restarted in the middle of its ISR leaves it to finish alone */
+    if (pthread_equal(pthread_self(), dev->isr)) {
+        pthread_detach(dev->isr);
+    } else {
+        pthread_join(dev->isr, NULL);
+    }
+
+    return MRAA_SUCCESS;
+}
+
+int mraa_gpio_read(mraa_gpio_context dev) {
+
+    if (dev == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mraa_sim_lock);
+    int pin = dev->pin == TEMP_ALERT_GPIO ? mraa_sim_pin : 0;
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    return pin;
+}
+
+mraa_result_t mraa_gpio_close(mraa_gpio_context dev) {
+
+    if (dev == NULL) {
+        return MRAA_ERROR_INVALID_HANDLE;
+    }
+    if (mraa_sim_alert == dev) {
+        mraa_gpio_isr_exit(dev);
+    }
+    free(dev);
+
+    return MRAA_SUCCESS;
+}
+
+void mraa_sim_temp(float c) {
+    pthread_mutex_lock(&mraa_sim_lock);
+    mraa_sim_c = c;
+    pthread_mutex_unlock(&mraa_sim_lock);
+}
+
+void mraa_sim_lux(float lux) {
+    pthread_mutex_lock(&mraa_sim_lock);
+    mraa_sim_lx = lux;
+    pthread_mutex_unlock(&mraa_sim_lock);
+}
+
+void mraa_sim_latency(uint32_t us) {
+    pthread_mutex_lock(&mraa_sim_lock);
+    mraa_sim_us = us;
+    pthread_mutex_unlock(&mraa_sim_lock);
+}
+
+void mraa_sim_errors(float pct) {
+    pthread_mutex_lock(&mraa_sim_lock);
+    mraa_sim_ppm = pct <= 0 ? 0 : pct >= 100 ? 1000000 : pct * 10000;
+    pthread_mutex_unlock(&mraa_sim_lock);
+}
+
+void mraa_sim_step(void) {
+
+    pthread_mutex_lock(&mraa_sim_lock);
+
+    /* Comparator with THIGH and TLOW as its hysteresis, interrupt mode
+     * latches every change of it until a register is read */
+    int16_t code = (int16_t) lrintf(mraa_sim_c / TEMP_RES) << 4;
+    uint8_t hot = mraa_sim_hot;
+    if (code >= (int16_t) mraa_sim_temp_regs[TEMP_REG_HIGH]) {
+        hot = 1;
+    } else if (code < (int16_t) mraa_sim_temp_regs[TEMP_REG_LOW]) {
+        hot = 0;
+    }
+    if (hot != mraa_sim_hot) {
+        mraa_sim_hot = hot;
+        mraa_sim_latched = 1;
+    }
+
+    uint16_t ctrl = mraa_sim_temp_regs[TEMP_REG_CTRL];
+    uint8_t active = ctrl & TEMP_REG_CTRL_TM ? mraa_sim_latched : mraa_sim_hot;
+    uint8_t pin = ctrl & TEMP_REG_CTRL_POL ? active : !active;
+
+    if (pin != mraa_sim_pin) {
+        mraa_sim_pin = pin;
+        struct _gpio *dev = mraa_sim_alert;
+        if (dev != NULL && (dev->edge == MRAA_GPIO_EDGE_BOTH ||
+                            (dev->edge == MRAA_GPIO_EDGE_RISING && pin) ||
+                            (dev->edge == MRAA_GPIO_EDGE_FALLING && !pin))) {
+            dev->pending++;
+            mraa_sim_st.edges++;
+            pthread_cond_broadcast(&mraa_sim_edge);
+        }
+    }
+
+    pthread_mutex_unlock(&mraa_sim_lock);
+}
+
+uint8_t mraa_sim_idle(void) {
+    pthread_mutex_lock(&mraa_sim_lock);
+    struct _gpio *dev = mraa_sim_alert;
+    uint8_t idle = dev == NULL || (dev->pending == 0 && !dev->running);
+    pthread_mutex_unlock(&mraa_sim_lock);
+
+    return idle;
+}
+
+void mraa_sim_stats(mraa_sim_stats_t *st) {
+    pthread_mutex_lock(&mraa_sim_lock);
+    *st = mraa_sim_st;
+    pthread_mutex_unlock(&mraa_sim_lock);
+}
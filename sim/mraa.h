@@ -0,0 +1,142 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file mraa.h
+ * @brief Simulated I2C bus and GPIO behind the part of the mraa API the
+ * tasks use
+ *
+ * The sim build puts sim/ ahead of the system include path, so the tasks
+ * compile unchanged against this header. Behind it sit a TMP106 at
+ * TEMP_I2C_ADDR and an APDS-9301 at LIGHT_I2C_ADDR on one shared bus, and
+ * the TMP106 ALERT pin on TEMP_ALERT_GPIO. The simulator sets what the
+ * sensors see and how the bus misbehaves with the mraa_sim_* calls.
+ *
+ * @author Ben Heberlein
+ * @date Nov 17 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __MRAA_H__
+#define __MRAA_H__
+
+#include <stdint.h>
+
+/**
+ * @brief The subset of mraa types in use
+ */
+typedef enum {
+    MRAA_SUCCESS = 0,
+    MRAA_ERROR_INVALID_HANDLE = 7,
+    MRAA_ERROR_UNSPECIFIED = 99
+} mraa_result_t;
+
+typedef enum {
+    MRAA_GPIO_OUT = 0,
+    MRAA_GPIO_IN = 1
+} mraa_gpio_dir_t;
+
+typedef enum {
+    MRAA_GPIO_EDGE_NONE = 0,
+    MRAA_GPIO_EDGE_BOTH = 1,
+    MRAA_GPIO_EDGE_RISING = 2,
+    MRAA_GPIO_EDGE_FALLING = 3
+} mraa_gpio_edge_t;
+
+typedef struct _i2c *mraa_i2c_context;
+typedef struct _gpio *mraa_gpio_context;
+
+/**
+ * @brief Bus counters
+ */
+typedef struct mraa_sim_stats_s {
+    uint32_t xfers;     /* Transactions started */
+    uint32_t errors;    /* Transactions failed on purpose */
+    uint32_t edges;     /* ALERT edges handed to an ISR */
+} mraa_sim_stats_t;
+
+/**
+ * @brief mraa calls, same signatures as the library
+ */
+mraa_result_t mraa_init(void);
+mraa_i2c_context mraa_i2c_init_raw(unsigned int bus);
+mraa_result_t mraa_i2c_address(mraa_i2c_context dev, uint8_t address);
+int mraa_i2c_read_byte(mraa_i2c_context dev);
+int mraa_i2c_read_word_data(mraa_i2c_context dev, const uint8_t command);
+mraa_result_t mraa_i2c_write_byte(mraa_i2c_context dev, const uint8_t data);
+mraa_result_t mraa_i2c_write_word_data(mraa_i2c_context dev, const uint16_t data, const uint8_t command);
+mraa_result_t mraa_i2c_stop(mraa_i2c_context dev);
+mraa_gpio_context mraa_gpio_init(int pin);
+mraa_result_t mraa_gpio_dir(mraa_gpio_context dev, mraa_gpio_dir_t dir);
+mraa_result_t mraa_gpio_isr(mraa_gpio_context dev, mraa_gpio_edge_t edge, void (*fptr)(void *), void *args);
+mraa_result_t mraa_gpio_isr_exit(mraa_gpio_context dev);
+int mraa_gpio_read(mraa_gpio_context dev);
+mraa_result_t mraa_gpio_close(mraa_gpio_context dev);
+
+/**
+ * @brief Set the temperature the TMP106 measures
+ *
+ * The ALERT pin follows on the next mraa_sim_step.
+ *
+ * @param c Degrees C
+ */
+void mraa_sim_temp(float c);
+
+/**
+ * @brief Set the light the APDS-9301 sees
+ *
+ * Channel counts are scaled by the integration time and gain the task
+ * programmed, and clip at full scale like the part does.
+ *
+ * @param lux Illuminance, split between the channels like daylight
+ */
+void mraa_sim_lux(float lux);
+
+/**
+ * @brief Time every transaction holds the bus
+ *
+ * @param us Microseconds per transaction
+ */
+void mraa_sim_latency(uint32_t us);
+
+/**
+ * @brief Make transactions fail
+ *
+ * A failed read returns -1 and a failed write MRAA_ERROR_UNSPECIFIED, after
+ * holding the bus as long as a good one.
+ *
+ * @param pct Chance of each transaction failing, 0 to 100
+ */
+void mraa_sim_errors(float pct);
+
+/**
+ * @brief Update the ALERT pin and run the ISR on an edge it waits for
+ *
+ * Called from the simulator's clock thread, the way mraa runs ISRs on a
+ * thread of its own.
+ */
+void mraa_sim_step(void);
+
+/**
+ * @brief Check that no ALERT edge is waiting for or running its ISR
+ *
+ * @return 1 if the ISR thread is idle
+ */
+uint8_t mraa_sim_idle(void);
+
+/**
+ * @brief Read the bus counters
+ *
+ * @param st Filled in
+ */
+void mraa_sim_stats(mraa_sim_stats_t *st);
+
+#endif /* __MRAA_H__ */
@@ -0,0 +1,536 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file sim.c
+ * @brief Runs the whole daemon against simulated sensors and reports how
+ * fast samples get through it
+ *
+ * The sim build links all four tasks and the supervisor, with main renamed
+ * to project1_main, against the bus in sim/mraa.c. Queues and the snapshot
+ * get names of their own, and the log, LEDs, control socket and trace go to
+ * a fresh directory under /tmp, so a daemon running on the same machine is
+ * left alone.
+ *
+ * A script sets what the sensors see over time, one keyframe per line:
+ *
+ *     <ms> temp <C>            temperature, ramps to the next temp keyframe
+ *     <ms> lux <lux>           light, ramps to the next lux keyframe
+ *     <ms> latency <us>        time each bus transaction takes from here on
+ *     <ms> errors <percent>    bus transactions failing from here on
+ *     <ms> end                 stop and report
+ *     conf <key> = <value>     added to the daemon config
+ *
+ * The report counts messages per queue and times two paths from the moment
+ * a reading is published on the sample bus, right after its I2C read: to
+ * the sample line the log task writes for it, and to the LED write a rule
+ * makes because of it. Both come from the log__sample and led__write probes.
+ *
+ * With -v the daemon runs on the virtual clock in clk.c and the script is
+ * stepped from one timer to the next instead of in real time. Before each
+ * step the simulator waits for the work the last one started to finish:
+ * every task queue handled what was sent to it, the ALERT ISR is idle and
+ * the bus subscribers drained. A step that hasn't settled after
+ * SIM_SETTLE_MS of real time goes ahead anyway and is counted. Bus latency
+ * then only costs real time, and the latencies reported are real time spent
+ * in the daemon, so a day of sensor data replays in the order it would have
+ * happened in however long the work itself takes. Runs of a script log the
+ * same lines apart from wall timestamps, startup and the real time
+ * latencies, as long as no step went ahead unsettled.
+ *
+ * @author Ben Heberlein
+ * @date Nov 17 2017
+ * @version 1.0
+ *
+ */
+
+#include "sim.h"
+#include "mraa.h"
+#include "main.h"
+#include "msg.h"
+#include "led.h"
+#include "snap.h"
+#include "temp.h"
+#include "light.h"
+#include "clk.h"
+#include "bus.h"
+#include "metrics.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <mqueue.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Script limits and defaults
+ */
+#define SIM_KEYS        256
+#define SIM_CONF_MAX    4096
+#define SIM_TICK_MS     1
+#define SIM_VTICK_MS    100
+#define SIM_SETTLE_MS   1000
+#define SIM_TEMP_C      20.0
+#define SIM_LUX         20.0
+
+/**
+ * @brief Script channels, the first two ramp and the rest step
+ */
+#define SIM_TEMP        0
+#define SIM_LIGHT       1
+#define SIM_LATENCY     2
+#define SIM_ERRORS      3
+#define SIM_CHANNELS    4
+
+/**
+ * @brief Timed paths, and how many latencies each keeps
+ */
+#define SIM_LOG_TEMP    0
+#define SIM_LOG_LIGHT   1
+#define SIM_LED         2
+#define SIM_PATHS       3
+#define SIM_SAMPLES     65536
+
+typedef struct sim_key_s {
+    uint32_t ms;
+    float v;
+} sim_key_t;
+
+typedef struct sim_chan_s {
+    sim_key_t keys[SIM_KEYS];
+    uint32_t n;
+} sim_chan_t;
+
+int project1_main(int argc, char **argv);
+
+/**
+ * @brief Private data
+ */
+static sim_chan_t sim_chans[SIM_CHANNELS];
+static const char *sim_chan_names[SIM_CHANNELS] = {"temp", "lux", "latency", "errors"};
+static const float sim_chan_defaults[SIM_CHANNELS] = {SIM_TEMP_C, SIM_LUX, 0, 0};
+static uint32_t sim_end_ms;
+static char sim_conf[SIM_CONF_MAX];
+static size_t sim_conf_len;
+
+static char sim_dir[] = "/tmp/project1_sim_XXXXXX";
+static uint8_t sim_on;
+static clk_timer_t sim_tick;
+static uint64_t sim_start_ns;
+static uint32_t sim_steps, sim_unsettled;
+
+static uint32_t sim_sent[MSG_QUEUE_NUM];
+static uint32_t sim_drops[MSG_QUEUE_NUM];
+static uint32_t sim_handled[MSG_QUEUE_NUM];
+static uint32_t sim_reads[MAIN_THREAD_TOTAL];
+static uint32_t sim_lines;
+static uint32_t sim_lat[SIM_PATHS][SIM_SAMPLES];
+static uint32_t sim_nlat[SIM_PATHS];
+
+static const char *sim_tasks[MSG_QUEUE_NUM] = {"main", "light", "temp", "log", "ctl"};
+static const char *sim_paths[SIM_PATHS] = {
+    "sample to log, temp", "sample to log, light", "sample to LED",
+};
+
+/**
+ * @brief Private functions
+ */
+static uint64_t __sim_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int __sim_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void __sim_count(uint32_t *c, uint64_t i, uint64_t n) {
+    if (i < n && __atomic_load_n(&sim_on, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&c[i], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void __sim_latency(uint8_t path, uint64_t us) {
+
+    if (!__atomic_load_n(&sim_on, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    /* Past SIM_SAMPLES only the count goes up */
+    uint32_t i = __atomic_fetch_add(&sim_nlat[path], 1, __ATOMIC_RELAXED);
+    if (i < SIM_SAMPLES) {
+        sim_lat[path][i] = us;
+    }
+}
+
+static float __sim_value(uint8_t ch, uint32_t ms) {
+    const sim_chan_t *c = &sim_chans[ch];
+    uint32_t i;
+
+    if (c->n == 0) {
+        return sim_chan_defaults[ch];
+    }
+
+    for (i = 0; i < c->n && c->keys[i].ms <= ms; i++);
+    if (i == 0) {
+        return c->keys[0].v;
+    }
+    if (i == c->n || ch > SIM_LIGHT) {
+        return c->keys[i-1].v;
+    }
+
+    const sim_key_t *a = &c->keys[i-1], *b = &c->keys[i];
+    return a->v + (b->v - a->v) * (ms - a->ms) / (b->ms - a->ms);
+}
+
+static void __sim_apply(uint32_t ms) {
+    mraa_sim_temp(__sim_value(SIM_TEMP, ms));
+    mraa_sim_lux(__sim_value(SIM_LIGHT, ms));
+    mraa_sim_latency(__sim_value(SIM_LATENCY, ms));
+    mraa_sim_errors(__sim_value(SIM_ERRORS, ms));
+    mraa_sim_step();
+}
+
+static void __sim_vtick(union sigval arg) {
+    uint32_t ms = (clk_now_ns() - sim_start_ns) / 1000000;
+
+    __sim_apply(ms);
+    clk_after(&sim_tick, __sim_vtick, SIM_VTICK_MS * 1000000ull);
+}
+
+static uint8_t __sim_settled(void) {
+
+    /* The ISR and the bus subscribers send before they go idle, so the
+     * queues are checked after them to catch what they sent last */
+    if (!mraa_sim_idle() || !bus_quiet()) {
+        return 0;
+    }
+
+    for (int i = 0; i < MAIN_THREAD_TOTAL; i++) {
+        if (metrics_get(METRIC_MSG_SENT, i) != msg_progress_get(i)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static uint8_t __sim_settle(void) {
+    struct timespec ts = {0, 20000};
+
+    uint64_t end = __sim_now_ns() + SIM_SETTLE_MS * 1000000ull;
+    while (!__sim_settled()) {
+        if (__sim_now_ns() > end) {
+            return 0;
+        }
+        nanosleep(&ts, NULL);
+    }
+
+    return 1;
+}
+
+static void __sim_virtual(void) {
+    uint64_t due;
+
+    /* The supervisor handling its first message means startup is over and
+     * every timer it arms is pending */
+    uint64_t end = __sim_now_ns() + SIM_SETTLE_MS * 1000000ull;
+    while (msg_progress_get(MAIN_THREAD_MAIN) == 0 && __sim_now_ns() < end) {
+        usleep(1000);
+    }
+
+    sim_start_ns = clk_now_ns();
+    clk_after(&sim_tick, __sim_vtick, 0);
+    while (1) {
+        if (!__sim_settle()) {
+            sim_unsettled++;
+        }
+        if (clk_next(&due) != CLK_SUCCESS || due - sim_start_ns >= sim_end_ms * 1000000ull) {
+            break;
+        }
+        clk_step();
+        sim_steps++;
+    }
+}
+
+static void __sim_real(void) {
+
+    /* Steps are absolute so a slow one doesn't stretch the script */
+    struct timespec tick;
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    for (uint32_t ms = 0; ms < sim_end_ms; ms += SIM_TICK_MS) {
+        __sim_apply(ms);
+        tick.tv_nsec += SIM_TICK_MS * 1000000;
+        if (tick.tv_nsec >= 1000000000) {
+            tick.tv_sec++;
+            tick.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+    }
+}
+
+static int __sim_script(const char *path) {
+    char line[256], kind[16];
+    uint32_t ms;
+    float v;
+    int n = 0;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("sim: can't open %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        n++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = 0;
+        }
+
+        char *p = line + strspn(line, " \t");
+        if (*p == '\n' || *p == 0) {
+            continue;
+        }
+
+        /* Config lines go through untouched, the daemon checks them */
+        if (!strncmp(p, "conf ", 5)) {
+            p[strcspn(p, "\n")] = 0;
+            int len = snprintf(sim_conf + sim_conf_len, sizeof(sim_conf) - sim_conf_len, "%s\n", p + 5);
+            if (len < 0 || sim_conf_len + len >= sizeof(sim_conf)) {
+                printf("sim: %s line %d: too much config\n", path, n);
+                fclose(f);
+                return -1;
+            }
+            sim_conf_len += len;
+            continue;
+        }
+
+        int args = sscanf(p, "%u %15s %f", &ms, kind, &v);
+        if (args == 2 && !strcmp(kind, "end")) {
+            sim_end_ms = ms;
+            continue;
+        }
+
+        uint8_t ch;
+        for (ch = 0; ch < SIM_CHANNELS && (args != 3 || strcmp(kind, sim_chan_names[ch])); ch++);
+        sim_chan_t *c = &sim_chans[ch];
+        if (ch == SIM_CHANNELS || c->n == SIM_KEYS || (c->n && c->keys[c->n-1].ms > ms)) {
+            printf("sim: %s line %d: expected <ms> temp|lux|latency|errors <value> or <ms> end, "
+                   "in time order\n", path, n);
+            fclose(f);
+            return -1;
+        }
+        c->keys[c->n].ms = ms;
+        c->keys[c->n].v = v;
+        c->n++;
+    }
+    fclose(f);
+
+    if (sim_end_ms == 0) {
+        printf("sim: %s has no end\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int __sim_write(const char *path, const char *text) {
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    fputs(text, f);
+
+    return fclose(f);
+}
+
+static int __sim_files(char *conf, char *log) {
+    static const char *attrs[] = {"brightness", "trigger", "delay_on", "delay_off", "shot"};
+    char path[PATH_MAX], text[SIM_CONF_MAX + 4 * PATH_MAX];
+
+    if (mkdtemp(sim_dir) == NULL) {
+        return -1;
+    }
+
+    /* An LED directory laid out like sysfs, writes just land in the files */
+    snprintf(path, sizeof(path), "%s/leds", sim_dir);
+    mkdir(path, 0755);
+    for (int i = 0; i < LED_TOTAL; i++) {
+        snprintf(path, sizeof(path), "%s/leds/" LED_NAME, sim_dir, i);
+        mkdir(path, 0755);
+        for (size_t j = 0; j < sizeof(attrs) / sizeof(attrs[0]); j++) {
+            snprintf(path, sizeof(path), "%s/leds/" LED_NAME "/%s", sim_dir, i, attrs[j]);
+            if (__sim_write(path, "0\n")) {
+                return -1;
+            }
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", sim_dir, MAIN_RULES_FILE);
+    if (__sim_write(path, MAIN_RULES_DEFAULT)) {
+        return -1;
+    }
+
+    sprintf(log, "%s/%s", sim_dir, MAIN_LOG_DEFAULT);
+    sprintf(conf, "%s/project1.conf", sim_dir);
+    snprintf(text, sizeof(text),
+             "led.dir = %s/leds\n"
+             "main.rules = %s/%s\n"
+             "ctl.path = %s/ctl.sock\n"
+             "trace.path = %s/%s\n"
+             "metrics.port = 0\n"
+             "%s", sim_dir, sim_dir, MAIN_RULES_FILE, sim_dir, sim_dir, MAIN_TRACE_FILE, sim_conf);
+
+    return __sim_write(conf, text);
+}
+
+static void *__sim_daemon(void *arg) {
+    project1_main(3, arg);
+    return NULL;
+}
+
+static void __sim_report(const char *script, double secs, double real) {
+    static uint32_t lat[SIM_SAMPLES];
+    mraa_sim_stats_t st;
+
+    mraa_sim_stats(&st);
+    printf("%s: %.1f s simulated in %.2f s, files in %s\n", script, secs, real, sim_dir);
+    if (sim_steps) {
+        printf("clock: virtual, %u timer steps, %u went ahead unsettled\n", sim_steps, sim_unsettled);
+    }
+    printf("bus: %u transactions, %u failed, %u ALERT edges\n", st.xfers, st.errors, st.edges);
+    printf("reads: temp %u, light %u\n", sim_reads[MAIN_THREAD_TEMP], sim_reads[MAIN_THREAD_LIGHT]);
+    printf("log: %u lines, %.1f/s\n\n", sim_lines, sim_lines / secs);
+
+    printf("%-8s %10s %10s %10s\n", "queue", "sent/s", "handled/s", "dropped");
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        printf("%-8s %10.1f %10.1f %10u\n", sim_tasks[i], sim_sent[i] / secs,
+               sim_handled[i] / secs, sim_drops[i]);
+    }
+
+    printf("\n%-22s %8s %10s %10s %10s %10s\n", "us from publish", "count", "min", "median", "p99", "max");
+    for (int p = 0; p < SIM_PATHS; p++) {
+        uint32_t n = sim_nlat[p] < SIM_SAMPLES ? sim_nlat[p] : SIM_SAMPLES;
+        if (n == 0) {
+            printf("%-22s %8u %10s %10s %10s %10s\n", sim_paths[p], 0, "-", "-", "-", "-");
+            continue;
+        }
+
+        memcpy(lat, sim_lat[p], n * sizeof(lat[0]));
+        qsort(lat, n, sizeof(lat[0]), __sim_cmp);
+        printf("%-22s %8u %10u %10u %10u %10u\n", sim_paths[p], sim_nlat[p], lat[0], lat[n / 2],
+               lat[(n * 99 + 99) / 100 - 1], lat[n - 1]);
+    }
+}
+
+/**
+ * @brief Probe hooks
+ */
+void sim_msg__send(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+    __sim_count(sim_sent, a, MSG_QUEUE_NUM);
+}
+
+void sim_msg__drop(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+    __sim_count(sim_drops, a, MSG_QUEUE_NUM);
+}
+
+void sim_dispatch__start(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+}
+
+void sim_dispatch__end(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+    __sim_count(sim_handled, a, MSG_QUEUE_NUM);
+}
+
+void sim_i2c__start(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+}
+
+void sim_i2c__end(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+
+    /* One read per temperature sample, light ends with channel 1 */
+    if ((a == MAIN_THREAD_TEMP && b == TEMP_REG_TEMP && c == 2) ||
+        (a == MAIN_THREAD_LIGHT && b == LIGHT_REG_DATA1L)) {
+        __sim_count(sim_reads, a, MAIN_THREAD_TOTAL);
+    }
+}
+
+void sim_timer__fire(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+}
+
+void sim_log__write(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+    __sim_count(&sim_lines, 0, 1);
+}
+
+void sim_log__sample(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+    __sim_latency(a == MAIN_THREAD_TEMP ? SIM_LOG_TEMP : SIM_LOG_LIGHT, d);
+}
+
+void sim_led__write(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+    __sim_latency(SIM_LED, d);
+}
+
+int main(int argc, char **argv) {
+    char conf[PATH_MAX], log[PATH_MAX];
+    pthread_t daemon;
+
+    uint8_t virt = argc == 3 && !strcmp(argv[1], "-v");
+    if (argc != 2 + virt) {
+        printf("Usage: %s [-v] <script>, see sim/*.sim\n", argv[0]);
+        return 1;
+    }
+    const char *script = argv[argc - 1];
+    if (__sim_script(script) || __sim_files(conf, log)) {
+        printf("sim: couldn't set up %s\n", sim_dir);
+        return 1;
+    }
+
+    /* Sensors read sensible values from the first transaction, and the
+     * daemon arms its timers on whichever clock is in use */
+    __sim_apply(0);
+    clk_virtual(virt);
+    __atomic_store_n(&sim_on, 1, __ATOMIC_RELAXED);
+
+    char *args[] = {"project1", log, conf, NULL};
+    if (pthread_create(&daemon, NULL, __sim_daemon, args)) {
+        printf("sim: couldn't start the daemon\n");
+        return 1;
+    }
+
+    uint64_t start = __sim_now_ns();
+    if (virt) {
+        __sim_virtual();
+    } else {
+        __sim_real();
+    }
+
+    /* Let late writers finish with the arrays before they are read */
+    __atomic_store_n(&sim_on, 0, __ATOMIC_RELAXED);
+    usleep(10000);
+    double real = (__sim_now_ns() - start) / 1e9;
+    __sim_report(script, virt ? sim_end_ms / 1e3 : real, real);
+
+    /* The daemon goes with the process, its queues and snapshot are removed
+     * now since nothing else will */
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        mq_unlink(msg_names[i]);
+    }
+    snap_close();
+
+    return sim_reads[MAIN_THREAD_TEMP] && sim_reads[MAIN_THREAD_LIGHT] ? 0 : 1;
+}
@@ -0,0 +1,44 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file sim.h
+ * @brief Tracepoint hooks for the simulator
+ *
+ * In the sim build every TRACE in trace.h calls the function here named
+ * after its probe, with the probe arguments in order and 0 for any it does
+ * not have. They run on the thread that hit the probe.
+ *
+ * @author Ben Heberlein
+ * @date Nov 17 2017
+ * @version 1.0
+ *
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+
+/**
+ * @brief One hook per probe, see trace.h for the arguments
+ */
+void sim_msg__send(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_msg__drop(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_dispatch__start(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_dispatch__end(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_i2c__start(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_i2c__end(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_timer__fire(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_log__write(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_log__sample(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+void sim_led__write(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+
+#endif /* __SIM_H__ */
@@ -0,0 +1,119 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file adapt.c
+ * @brief Adaptive sampling period
+ *
+ * Each sensor task keeps one of these to pick its next sampling period from
+ * how much the signal is moving. A derivative or standard deviation above
+ * its bound drops the period straight to the minimum. A flat signal backs the
+ * period off exponentially up to the maximum. Savings are counted against the
+ * fixed period the task used to run at.
+ *
+ * @author Ben Heberlein
+ * @date Nov 2 2017
+ * @version 1.0
+ *
+ */
+
+#include "adapt.h"
+#include <stdint.h>
+#include <math.h>
+
+/**
+ * @brief Public functions
+ */
+uint8_t adapt_init(adapt_t *a, uint32_t min_ns, uint32_t max_ns, uint32_t base_ns,
+                   float rate_bound, float std_bound, float noise) {
+
+    a->base_ns = base_ns;
+    a->period_ns = base_ns;
+    a->rate_bound = rate_bound;
+    a->std_bound = std_bound;
+    a->noise = noise;
+    a->last = 0.0;
+    a->mean = 0.0;
+    a->var = 0.0;
+    a->primed = 0;
+    a->samples = 0;
+    a->elapsed_ns = 0;
+
+    return adapt_limits(a, min_ns, max_ns);
+}
+
+uint8_t adapt_limits(adapt_t *a, uint32_t min_ns, uint32_t max_ns) {
+
+    if (min_ns == 0 || min_ns > max_ns || max_ns > ADAPT_MAX_NS) {
+        return ADAPT_ERR_PARAM;
+    }
+
+    a->min_ns = min_ns;
+    a->max_ns = max_ns;
+    if (a->period_ns < min_ns) {
+        a->period_ns = min_ns;
+    } else if (a->period_ns > max_ns) {
+        a->period_ns = max_ns;
+    }
+
+    return ADAPT_SUCCESS;
+}
+
+uint32_t adapt_update(adapt_t *a, float x) {
+
+    /* The sample just taken covered the period we asked for */
+    a->samples++;
+    a->elapsed_ns += a->period_ns;
+
+    if (!a->primed) {
+        a->primed = 1;
+        a->last = x;
+        a->mean = x;
+        return a->period_ns;
+    }
+
+    /* Derivative over the last period, ignoring quantization noise */
+    float step = fabsf(x - a->last);
+    float rate = 0.0;
+    if (step > a->noise) {
+        rate = step * 1e9 / a->period_ns;
+    }
+    a->last = x;
+
+    /* Exponentially weighted mean and variance */
+    float delta = x - a->mean;
+    a->mean += ADAPT_ALPHA * delta;
+    a->var = (1.0 - ADAPT_ALPHA) * (a->var + ADAPT_ALPHA * delta * delta);
+    float std = sqrtf(a->var);
+
+    if (rate > a->rate_bound || std > a->std_bound) {
+        /* Moving, sample as fast as allowed */
+        a->period_ns = a->min_ns;
+    } else if (rate <= a->rate_bound / 2 && std <= a->std_bound / 2) {
+        /* Flat, back off */
+        float next = a->period_ns * ADAPT_BACKOFF;
+        if (next > a->max_ns) {
+            next = a->max_ns;
+        }
+        a->period_ns = next;
+    }
+
+    return a->period_ns;
+}
+
+uint32_t adapt_saved(const adapt_t *a) {
+
+    uint64_t fixed = a->elapsed_ns / a->base_ns;
+    if (fixed <= a->samples) {
+        return 0;
+    }
+
+    return fixed - a->samples;
+}
@@ -0,0 +1,260 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file bus.c
+ * @brief Publish/subscribe bus for sensor samples
+ *
+ * Sensor tasks publish every new sample once into a shared ring. Each
+ * subscriber keeps its own cursor into the ring and reads samples in place,
+ * so fan-out costs nothing extra per subscriber. Subscribers filter by topic
+ * and can rate limit and deadband each topic. A subscriber that falls more
+ * than BUS_SIZE samples behind skips ahead and counts what it lost. Waiting
+ * subscribers sleep on a futex that publishers only wake when someone waits.
+ *
+ * @author Ben Heberlein
+ * @date Nov 7 2017
+ * @version 1.0
+ *
+ */
+
+#include "bus.h"
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * @brief Ring entry, seq is 2 * position + 1 while being written and
+ * 2 * position + 2 once complete
+ */
+typedef struct bus_entry_s {
+    uint32_t seq;
+    bus_sample_t s;
+} bus_entry_t;
+
+/**
+ * @brief Private variables
+ */
+static bus_entry_t bus_ring[BUS_SIZE];
+static uint32_t bus_claim;      /* Next ring position to hand to a publisher */
+static uint32_t bus_gen;        /* Bumped on every completed publish */
+static uint32_t bus_waiters;    /* Subscribers sleeping on bus_gen */
+static bus_sub_t *bus_subs[BUS_SUBS];
+static pthread_mutex_t bus_subs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Private functions
+ */
+static int __bus_ready(bus_sub_t *sub, bus_sample_t *out) {
+
+    /* Skip anything already overwritten */
+    uint32_t claim = __atomic_load_n(&bus_claim, __ATOMIC_ACQUIRE);
+    if ((int32_t) (claim - sub->next) > BUS_SIZE) {
+        sub->lost += claim - BUS_SIZE - sub->next;
+        sub->next = claim - BUS_SIZE;
+    }
+
+    bus_entry_t *e = &bus_ring[sub->next & BUS_MASK];
+    uint32_t want = 2 * sub->next + 2;
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (seq != want) {
+        if ((int32_t) (seq - want) > 0) {
+            /* Lapped between the claim check and here */
+            sub->lost++;
+            sub->next++;
+            return -1;
+        }
+
+        /* Claimed but not written yet, or nothing new */
+        return 0;
+    }
+
+    out->topic = __atomic_load_n(&e->s.topic, __ATOMIC_RELAXED);
+    out->value = __atomic_load_n(&e->s.value, __ATOMIC_RELAXED);
+    out->raw = __atomic_load_n(&e->s.raw, __ATOMIC_RELAXED);
+    out->ts_ms = __atomic_load_n(&e->s.ts_ms, __ATOMIC_RELAXED);
+    out->ts_us = __atomic_load_n(&e->s.ts_us, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != want) {
+        sub->lost++;
+        sub->next++;
+        return -1;
+    }
+
+    sub->next++;
+    return 1;
+}
+
+static int __bus_pass(bus_sub_t *sub, const bus_sample_t *s) {
+
+    if (s->topic >= BUS_TOPICS || !(sub->topics & BUS_TOPIC_MASK(s->topic))) {
+        return 0;
+    }
+
+    bus_filter_t *f = &sub->filter[s->topic];
+    if (f->primed) {
+        int32_t d = s->value - f->last;
+        if (s->ts_ms - f->last_ms < f->min_ms ||
+            (uint32_t) (d < 0 ? -d : d) < f->deadband) {
+            sub->filtered++;
+            return 0;
+        }
+    }
+
+    f->primed = 1;
+    f->last = s->value;
+    f->last_ms = s->ts_ms;
+    return 1;
+}
+
+/**
+ * @brief Public functions
+ */
+void bus_publish(uint8_t topic, int32_t value, uint32_t raw, uint32_t ts_ms) {
+
+    uint32_t ts_us = bus_now_us();
+    uint32_t pos = __atomic_fetch_add(&bus_claim, 1, __ATOMIC_ACQ_REL);
+    bus_entry_t *e = &bus_ring[pos & BUS_MASK];
+
+    __atomic_store_n(&e->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&e->s.topic, topic, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->s.value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->s.raw, raw, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->s.ts_ms, ts_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->s.ts_us, ts_us, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&e->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+
+    /* Pairs with the waiter count bump in bus_next */
+    __atomic_fetch_add(&bus_gen, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bus_waiters, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &bus_gen, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+void bus_subscribe(bus_sub_t *sub, uint8_t topics) {
+    memset(sub, 0, sizeof(*sub));
+    sub->topics = topics;
+    sub->next = __atomic_load_n(&bus_claim, __ATOMIC_ACQUIRE);
+
+    /* Busy until its first bus_next */
+    sub->idle_gen = __atomic_load_n(&bus_gen, __ATOMIC_SEQ_CST) - 1;
+
+    pthread_mutex_lock(&bus_subs_lock);
+    int slot = -1;
+    for (int i = 0; i < BUS_SUBS; i++) {
+        if (bus_subs[i] == sub) {
+            slot = i;
+            break;
+        }
+        if (bus_subs[i] == NULL && slot < 0) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        bus_subs[slot] = sub;
+    }
+    pthread_mutex_unlock(&bus_subs_lock);
+}
+
+void bus_unsubscribe(bus_sub_t *sub) {
+
+    pthread_mutex_lock(&bus_subs_lock);
+    for (int i = 0; i < BUS_SUBS; i++) {
+        if (bus_subs[i] == sub) {
+            bus_subs[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&bus_subs_lock);
+}
+
+uint8_t bus_filter(bus_sub_t *sub, uint8_t topic, uint32_t min_ms, uint32_t deadband) {
+
+    if (topic >= BUS_TOPICS) {
+        return BUS_ERR_PARAM;
+    }
+
+    sub->filter[topic].min_ms = min_ms;
+    sub->filter[topic].deadband = deadband;
+
+    return BUS_SUCCESS;
+}
+
+uint8_t bus_next(bus_sub_t *sub, bus_sample_t *out, uint32_t timeout_ms) {
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout_ms / 1000;
+    end.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (end.tv_nsec >= 1000000000) {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000;
+    }
+
+    while (1) {
+        uint32_t gen = __atomic_load_n(&bus_gen, __ATOMIC_SEQ_CST);
+
+        /* Drain whatever is ready before sleeping */
+        int r;
+        while ((r = __bus_ready(sub, out)) != 0) {
+            if (r > 0 && __bus_pass(sub, out)) {
+                sub->delivered++;
+                return BUS_SUCCESS;
+            }
+        }
+        __atomic_store_n(&sub->idle_gen, gen, __ATOMIC_SEQ_CST);
+
+        struct timespec now, left;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left.tv_sec = end.tv_sec - now.tv_sec;
+        left.tv_nsec = end.tv_nsec - now.tv_nsec;
+        if (left.tv_nsec < 0) {
+            left.tv_sec--;
+            left.tv_nsec += 1000000000;
+        }
+        if (left.tv_sec < 0) {
+            return BUS_ERR_TIMEOUT;
+        }
+
+        __atomic_fetch_add(&bus_waiters, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &bus_gen, FUTEX_WAIT_PRIVATE, gen, &left, NULL, 0);
+        __atomic_fetch_sub(&bus_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+uint8_t bus_quiet(void) {
+    uint8_t quiet = 1;
+
+    pthread_mutex_lock(&bus_subs_lock);
+    uint32_t gen = __atomic_load_n(&bus_gen, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < BUS_SUBS; i++) {
+        if (bus_subs[i] != NULL && __atomic_load_n(&bus_subs[i]->idle_gen, __ATOMIC_SEQ_CST) != gen) {
+            quiet = 0;
+        }
+    }
+    pthread_mutex_unlock(&bus_subs_lock);
+
+    return quiet;
+}
+
+uint32_t bus_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint32_t) now.tv_sec * 1000000u + now.tv_nsec / 1000;
+}
@@ -0,0 +1,213 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file clk.c
+ * @brief Clock and one-shot timers, real or virtual
+ *
+ * @author Ben Heberlein
+ * @date Nov 18 2017
+ * @version 1.0
+ *
+ */
+
+#include "clk.h"
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * @brief Private data
+ */
+static uint8_t clk_virt;
+static uint64_t clk_vnow_ns;
+static uint64_t clk_vstart_ns;
+static time_t clk_vwall;
+static uint64_t clk_seq;
+static clk_timer_t *clk_pending[CLK_EVENTS];
+static uint32_t clk_npending;
+static pthread_mutex_t clk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Private functions
+ */
+static uint64_t __clk_real_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static uint8_t __clk_real_after(clk_timer_t *t, clk_fn fn, uint64_t ns) {
+    struct itimerspec ts;
+
+    /* One kernel timer per clk_timer_t, rearming doesn't leak another */
+    if (!t->made) {
+        struct sigevent se;
+        memset(&se, 0, sizeof(se));
+        se.sigev_notify = SIGEV_THREAD;
+        se.sigev_value.sival_ptr = t;
+        se.sigev_notify_function = fn;
+        se.sigev_notify_attributes = NULL;
+        if (timer_create(CLOCK_MONOTONIC, &se, &t->id) == -1) {
+            return CLK_ERR_TIMER;
+        }
+        t->fn = fn;
+        t->made = 1;
+    }
+
+    /* A zero it_value would disarm instead */
+    if (ns == 0) {
+        ns = 1;
+    }
+    ts.it_value.tv_sec = ns / 1000000000;
+    ts.it_value.tv_nsec = ns % 1000000000;
+    ts.it_interval.tv_sec = 0;
+    ts.it_interval.tv_nsec = 0;
+    if (timer_settime(t->id, 0, &ts, NULL) == -1) {
+        return CLK_ERR_TIMER;
+    }
+
+    return CLK_SUCCESS;
+}
+
+static int __clk_before(const clk_timer_t *a, const clk_timer_t *b) {
+
+    if (a->due_ns != b->due_ns) {
+        return a->due_ns < b->due_ns;
+    }
+
+    /* Tasks arm their first timers from their own threads, so arming order
+     * isn't the same from run to run but the callbacks are */
+    if (a->fn != b->fn) {
+        return (uintptr_t) a->fn < (uintptr_t) b->fn;
+    }
+
+    return a->seq < b->seq;
+}
+
+static int __clk_first(void) {
+    int first = -1;
+
+    for (uint32_t i = 0; i < clk_npending; i++) {
+        if (first < 0 || __clk_before(clk_pending[i], clk_pending[first])) {
+            first = i;
+        }
+    }
+
+    return first;
+}
+
+/**
+ * @brief Public functions
+ */
+uint64_t clk_now_ns(void) {
+
+    if (__atomic_load_n(&clk_virt, __ATOMIC_ACQUIRE)) {
+        return __atomic_load_n(&clk_vnow_ns, __ATOMIC_ACQUIRE);
+    }
+
+    return __clk_real_ns();
+}
+
+uint64_t clk_now_us(void) {
+    return clk_now_ns() / 1000;
+}
+
+uint32_t clk_now_ms(void) {
+    return clk_now_ns() / 1000000;
+}
+
+time_t clk_wall(void) {
+
+    if (__atomic_load_n(&clk_virt, __ATOMIC_ACQUIRE)) {
+        return clk_vwall + (clk_now_ns() - clk_vstart_ns) / 1000000000;
+    }
+
+    return time(NULL);
+}
+
+uint8_t clk_after(clk_timer_t *t, clk_fn fn, uint64_t ns) {
+
+    if (!__atomic_load_n(&clk_virt, __ATOMIC_ACQUIRE)) {
+        return __clk_real_after(t, fn, ns);
+    }
+
+    pthread_mutex_lock(&clk_lock);
+    if (!t->pending) {
+        if (clk_npending == CLK_EVENTS) {
+            pthread_mutex_unlock(&clk_lock);
+            return CLK_ERR_FULL;
+        }
+        clk_pending[clk_npending++] = t;
+        t->pending = 1;
+    }
+    t->fn = fn;
+    t->due_ns = clk_vnow_ns + ns;
+    t->seq = clk_seq++;
+    pthread_mutex_unlock(&clk_lock);
+
+    return CLK_SUCCESS;
+}
+
+void clk_virtual(uint8_t on) {
+
+    pthread_mutex_lock(&clk_lock);
+    for (uint32_t i = 0; i < clk_npending; i++) {
+        clk_pending[i]->pending = 0;
+    }
+    clk_npending = 0;
+
+    /* Starting on a whole second keeps ms and s readings of the virtual
+     * time the same from run to run */
+    clk_vstart_ns = __clk_real_ns() / 1000000000 * 1000000000;
+    clk_vwall = time(NULL);
+    __atomic_store_n(&clk_vnow_ns, clk_vstart_ns, __ATOMIC_RELEASE);
+    __atomic_store_n(&clk_virt, on ? 1 : 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&clk_lock);
+}
+
+uint8_t clk_next(uint64_t *due_ns) {
+
+    pthread_mutex_lock(&clk_lock);
+    int first = __clk_first();
+    if (first >= 0) {
+        *due_ns = clk_pending[first]->due_ns;
+    }
+    pthread_mutex_unlock(&clk_lock);
+
+    return first >= 0 ? CLK_SUCCESS : CLK_ERR_EMPTY;
+}
+
+uint8_t clk_step(void) {
+
+    pthread_mutex_lock(&clk_lock);
+    int first = __clk_first();
+    if (first < 0) {
+        pthread_mutex_unlock(&clk_lock);
+        return CLK_ERR_EMPTY;
+    }
+
+    clk_timer_t *t = clk_pending[first];
+    clk_pending[first] = clk_pending[--clk_npending];
+    t->pending = 0;
+    __atomic_store_n(&clk_vnow_ns, t->due_ns, __ATOMIC_RELEASE);
+    clk_fn fn = t->fn;
+    pthread_mutex_unlock(&clk_lock);
+
+    /* The callback is free to rearm its own timer */
+    union sigval arg;
+    arg.sival_ptr = t;
+    fn(arg);
+
+    return CLK_SUCCESS;
+}
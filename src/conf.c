@@ -0,0 +1,437 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file conf.c
+ * @brief Runtime configuration file
+ *
+ * Keys are described by a table of offsets into conf_t, so parsing, diffing
+ * and the live/restart split all come from one place. The watch thread
+ * blocks on a single inotify descriptor covering the directory of every
+ * watched file.
+ *
+ * @author Ben Heberlein
+ * @date Nov 10 2017
+ * @version 1.0
+ *
+ */
+
+#include "conf.h"
+#include "main.h"
+#include "msg.h"
+#include "temp.h"
+#include "light.h"
+#include "log.h"
+#include "ctl.h"
+#include "metrics.h"
+#include "span.h"
+#include "led.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+/**
+ * @brief Value types
+ */
+#define CONF_U32    0
+#define CONF_STR    1
+
+/**
+ * @brief Key table
+ */
+typedef struct conf_key_s {
+    const char *name;
+    uint8_t type;
+    uint8_t live;
+    size_t off;
+    uint32_t min;
+    uint32_t max;
+} conf_key_t;
+
+/**
+ * @brief Watched file
+ */
+typedef struct conf_watch_s {
+    int wd;
+    char path[CONF_PATH_MAX];
+    char name[NAME_MAX + 1];
+    conf_fn fn;
+    void *ctx;
+} conf_watch_t;
+
+/**
+ * @brief Private variables
+ */
+static const conf_key_t conf_keys[CONF_KEYS] = {
+    [CONF_HEARTBEAT_MS] = {"main.heartbeat_ms", CONF_U32, 1, offsetof(conf_t, heartbeat_ms), 100, 60000},
+    [CONF_QUEUE_DEPTH]  = {"msg.queue_depth", CONF_U32, 0, offsetof(conf_t, queue_depth), 1, 1024},
+    [CONF_TEMP_MIN_MS]  = {"temp.min_ms", CONF_U32, 1, offsetof(conf_t, temp_min_ms), 1, TEMP_ADAPT_MAX_NS / 1000000},
+    [CONF_TEMP_MAX_MS]  = {"temp.max_ms", CONF_U32, 1, offsetof(conf_t, temp_max_ms), 1, TEMP_ADAPT_MAX_NS / 1000000},
+    [CONF_TEMP_ONESHOT] = {"temp.oneshot", CONF_U32, 1, offsetof(conf_t, temp_oneshot), 0, 1},
+    [CONF_LIGHT_MIN_MS] = {"light.min_ms", CONF_U32, 1, offsetof(conf_t, light_min_ms), 1, LIGHT_ADAPT_MAX_NS / 1000000},
+    [CONF_LIGHT_MAX_MS] = {"light.max_ms", CONF_U32, 1, offsetof(conf_t, light_max_ms), 1, LIGHT_ADAPT_MAX_NS / 1000000},
+    [CONF_LIGHT_AGC]    = {"light.agc", CONF_U32, 1, offsetof(conf_t, light_agc), 0, 1},
+    [CONF_LOG_PATH]     = {"log.path", CONF_STR, 1, offsetof(conf_t, log_path), 1, CONF_PATH_MAX - 1},
+    [CONF_LOG_LEVEL]    = {"log.level", CONF_U32, 1, offsetof(conf_t, log_level), LOG_LEVEL_DEBUG, LOG_LEVEL_ERROR},
+    [CONF_RULES]        = {"main.rules", CONF_STR, 1, offsetof(conf_t, rules), 1, CONF_PATH_MAX - 1},
+    [CONF_CTL_PATH]     = {"ctl.path", CONF_STR, 0, offsetof(conf_t, ctl_path), 1, CONF_PATH_MAX - 1},
+    [CONF_METRICS_PORT] = {"metrics.port", CONF_U32, 0, offsetof(conf_t, metrics_port), 0, 65535},
+    [CONF_TRACE_PATH]   = {"trace.path", CONF_STR, 1, offsetof(conf_t, trace_path), 1, CONF_PATH_MAX - 1},
+    [CONF_TRACE_EVENTS] = {"trace.events", CONF_U32, 1, offsetof(conf_t, trace_events), 1, SPAN_EVENTS_MAX},
+    [CONF_TRACE_START]  = {"trace.start", CONF_U32, 0, offsetof(conf_t, trace_start), 0, 1},
+    [CONF_STALL_MS]     = {"main.stall_ms", CONF_U32, 1, offsetof(conf_t, stall_ms), 100, 600000},
+    [CONF_LED_DIR]      = {"led.dir", CONF_STR, 0, offsetof(conf_t, led_dir), 1, CONF_PATH_MAX - 1},
+};
+
+static conf_watch_t conf_watches[CONF_WATCH_MAX];
+static int conf_nwatch;
+static int conf_fd = -1;
+static pthread_t conf_thread;
+static pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Private functions
+ */
+static uint8_t __conf_line(conf_t *c, char *line, int n, char *err, size_t errlen) {
+
+    char *hash = strchr(line, '#');
+    if (hash != NULL) {
+        *hash = 0;
+    }
+
+    char *key = line;
+    while (isspace((unsigned char) *key)) {
+        key++;
+    }
+    if (*key == 0) {
+        return CONF_SUCCESS;
+    }
+
+    char *eq = strchr(key, '=');
+    if (eq == NULL) {
+        snprintf(err, errlen, "line %d: expected key = value", n);
+        return CONF_ERR_SYNTAX;
+    }
+
+    /* Trim both sides of the = */
+    char *end = eq;
+    while (end > key && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    *end = 0;
+    char *val = eq + 1;
+    while (isspace((unsigned char) *val)) {
+        val++;
+    }
+    end = val + strlen(val);
+    while (end > val && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    *end = 0;
+
+    const conf_key_t *k = NULL;
+    for (int i = 0; i < CONF_KEYS; i++) {
+        if (!strcmp(key, conf_keys[i].name)) {
+            k = &conf_keys[i];
+            break;
+        }
+    }
+    if (k == NULL) {
+        snprintf(err, errlen, "line %d: unknown key %.32s", n, key);
+        return CONF_ERR_SYNTAX;
+    }
+
+    if (k->type == CONF_STR) {
+        size_t len = strlen(val);
+        if (len < k->min || len > k->max) {
+            snprintf(err, errlen, "line %d: %s must be 1 to %u characters", n, k->name, k->max);
+            return CONF_ERR_SYNTAX;
+        }
+        memcpy((char *) c + k->off, val, len + 1);
+    } else {
+        char *num_end;
+        unsigned long v = strtoul(val, &num_end, 0);
+        if (!isdigit((unsigned char) *val) || *num_end != 0 || v < k->min || v > k->max) {
+            snprintf(err, errlen, "line %d: %s must be %u to %u", n, k->name, k->min, k->max);
+            return CONF_ERR_SYNTAX;
+        }
+        *(uint32_t *) ((char *) c + k->off) = v;
+    }
+
+    return CONF_SUCCESS;
+}
+
+static void *__conf_watch(void *arg) {
+
+    /* Big enough for a batch of events with names */
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(conf_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            logmsg_t ltx;
+            LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Config watch failed, changes need a restart: %s",
+                    len < 0 ? strerror(errno) : "end of events");
+            logmsg_send(&ltx, MAIN_THREAD_LOG);
+            break;
+        }
+
+        /* Several events for the same file in one read only call back once.
+         * Hits are copied out under the lock, a callback may change the
+         * watched files */
+        conf_watch_t hit[CONF_WATCH_MAX];
+        int nhit = 0;
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->len == 0) {
+                continue;
+            }
+
+            pthread_mutex_lock(&conf_lock);
+            for (int i = 0; i < conf_nwatch; i++) {
+                if (conf_watches[i].wd != ev->wd || strcmp(conf_watches[i].name, ev->name)) {
+                    continue;
+                }
+                int j = 0;
+                while (j < nhit && strcmp(hit[j].path, conf_watches[i].path)) {
+                    j++;
+                }
+                if (j == nhit && nhit < CONF_WATCH_MAX) {
+                    hit[nhit++] = conf_watches[i];
+                }
+            }
+            pthread_mutex_unlock(&conf_lock);
+        }
+
+        for (int i = 0; i < nhit; i++) {
+            hit[i].fn(hit[i].path, hit[i].ctx);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Public functions
+ */
+void conf_defaults(conf_t *c) {
+
+    memset(c, 0, sizeof(*c));
+    c->heartbeat_ms = MAIN_TIMER_HEARTBEAT_NS / 1000000;
+    c->queue_depth = MSG_MAXMSGS;
+    c->temp_min_ms = TEMP_ADAPT_MIN_NS / 1000000;
+    c->temp_max_ms = TEMP_ADAPT_MAX_NS / 1000000;
+    c->temp_oneshot = MAIN_TEMP_ONESHOT;
+    c->light_min_ms = LIGHT_ADAPT_MIN_NS / 1000000;
+    c->light_max_ms = LIGHT_ADAPT_MAX_NS / 1000000;
+    c->light_agc = MAIN_LIGHT_AGC;
+    strcpy(c->log_path, MAIN_LOG_DEFAULT);
+    c->log_level = LOG_LEVEL_DEBUG;
+    strcpy(c->rules, MAIN_RULES_FILE);
+    strcpy(c->ctl_path, CTL_PATH);
+    c->metrics_port = METRICS_PORT;
+    strcpy(c->trace_path, MAIN_TRACE_FILE);
+    c->trace_events = SPAN_EVENTS;
+    c->stall_ms = MAIN_STALL_MS;
+    strcpy(c->led_dir, LED_DIR);
+}
+
+uint8_t conf_parse(conf_t *c, const char *src, char *err, size_t errlen) {
+    conf_t next;
+    char line[256];
+    uint8_t ret;
+    int n = 1;
+
+    conf_defaults(&next);
+    while (*src) {
+        size_t len = strcspn(src, "\n");
+        if (len >= sizeof(line)) {
+            snprintf(err, errlen, "line %d: too long", n);
+            return CONF_ERR_SYNTAX;
+        }
+        memcpy(line, src, len);
+        line[len] = 0;
+
+        if ((ret = __conf_line(&next, line, n, err, errlen)) != CONF_SUCCESS) {
+            return ret;
+        }
+
+        src += len;
+        if (*src) {
+            src++;
+        }
+        n++;
+    }
+
+    if (next.temp_min_ms > next.temp_max_ms || next.light_min_ms > next.light_max_ms) {
+        snprintf(err, errlen, "min_ms is above max_ms");
+        return CONF_ERR_SYNTAX;
+    }
+
+    /* A stall has to outlast at least one heartbeat */
+    if (next.stall_ms <= next.heartbeat_ms) {
+        snprintf(err, errlen, "main.stall_ms is not above main.heartbeat_ms");
+        return CONF_ERR_SYNTAX;
+    }
+
+    *c = next;
+    return CONF_SUCCESS;
+}
+
+uint8_t conf_load(conf_t *c, const char *path, char *err, size_t errlen) {
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        snprintf(err, errlen, "can't open %s", path);
+        return CONF_ERR_FILE;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *src = malloc(len + 1);
+    if (src == NULL || fread(src, 1, len, f) != (size_t) len) {
+        free(src);
+        fclose(f);
+        snprintf(err, errlen, "can't read %s", path);
+        return CONF_ERR_FILE;
+    }
+    src[len] = 0;
+    fclose(f);
+
+    uint8_t ret = conf_parse(c, src, err, errlen);
+    free(src);
+
+    return ret;
+}
+
+uint32_t conf_diff(const conf_t *a, const conf_t *b) {
+    uint32_t diff = 0;
+
+    for (int i = 0; i < CONF_KEYS; i++) {
+        const char *pa = (const char *) a + conf_keys[i].off;
+        const char *pb = (const char *) b + conf_keys[i].off;
+        if (conf_keys[i].type == CONF_STR ? strcmp(pa, pb) : memcmp(pa, pb, sizeof(uint32_t))) {
+            diff |= CONF_KEY(i);
+        }
+    }
+
+    return diff;
+}
+
+const char *conf_key_name(uint8_t key) {
+    return key < CONF_KEYS ? conf_keys[key].name : "";
+}
+
+uint8_t conf_key_live(uint8_t key) {
+    return key < CONF_KEYS ? conf_keys[key].live : 0;
+}
+
+uint8_t conf_watch(const char *path, conf_fn fn, void *ctx) {
+    char dir[CONF_PATH_MAX], base[CONF_PATH_MAX];
+
+    if (strlen(path) >= CONF_PATH_MAX) {
+        return CONF_ERR_FILE;
+    }
+    strcpy(dir, path);
+    strcpy(base, path);
+
+    pthread_mutex_lock(&conf_lock);
+
+    for (int i = 0; i < conf_nwatch; i++) {
+        if (!strcmp(conf_watches[i].path, path)) {
+            pthread_mutex_unlock(&conf_lock);
+            return CONF_SUCCESS;
+        }
+    }
+    if (conf_nwatch >= CONF_WATCH_MAX) {
+        pthread_mutex_unlock(&conf_lock);
+        return CONF_ERR_INIT;
+    }
+
+    if (conf_fd < 0) {
+        conf_fd = inotify_init1(IN_CLOEXEC);
+        if (conf_fd < 0) {
+            pthread_mutex_unlock(&conf_lock);
+            return CONF_ERR_INIT;
+        }
+        if (pthread_create(&conf_thread, NULL, __conf_watch, NULL)) {
+            close(conf_fd);
+            conf_fd = -1;
+            pthread_mutex_unlock(&conf_lock);
+            return CONF_ERR_INIT;
+        }
+    }
+
+    /* Adding the same directory twice gives back the same descriptor */
+    int wd = inotify_add_watch(conf_fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+        pthread_mutex_unlock(&conf_lock);
+        return CONF_ERR_FILE;
+    }
+
+    conf_watch_t *w = &conf_watches[conf_nwatch];
+    w->wd = wd;
+    strcpy(w->path, path);
+    snprintf(w->name, sizeof(w->name), "%s", basename(base));
+    w->fn = fn;
+    w->ctx = ctx;
+    conf_nwatch++;
+
+    pthread_mutex_unlock(&conf_lock);
+
+    return CONF_SUCCESS;
+}
+
+void conf_forget(const char *path) {
+
+    /* The directory stays watched, other files may share it */
+    pthread_mutex_lock(&conf_lock);
+    for (int i = 0; i < conf_nwatch; i++) {
+        if (!strcmp(conf_watches[i].path, path)) {
+            conf_watches[i] = conf_watches[--conf_nwatch];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conf_lock);
+}
+
+void conf_unwatch(void) {
+
+    /* The thread takes the lock itself, so it can't be joined under it */
+    pthread_mutex_lock(&conf_lock);
+    int fd = conf_fd;
+    pthread_mutex_unlock(&conf_lock);
+    if (fd < 0) {
+        return;
+    }
+
+    pthread_cancel(conf_thread);
+    pthread_join(conf_thread, NULL);
+
+    pthread_mutex_lock(&conf_lock);
+    close(conf_fd);
+    conf_fd = -1;
+    conf_nwatch = 0;
+    pthread_mutex_unlock(&conf_lock);
+}
@@ -0,0 +1,786 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file ctl.c
+ * @brief Control socket
+ *
+ * One thread polls the listening socket, the clients and the control
+ * response queue. Each client has a ring of requests in arrival order; a
+ * request is answered right away, or waits for its task response or its
+ * turn to dump stats, and replies go out from the front of the ring as soon
+ * as they are ready. Task commands are sent without blocking, so a full
+ * queue is reported to the client instead of stalling every other one.
+ *
+ * @author Ben Heberlein
+ * @date Nov 11 2017
+ * @version 1.0
+ *
+ */
+
+#include "ctl.h"
+#include "main.h"
+#include "msg.h"
+#include "temp.h"
+#include "light.h"
+#include "log.h"
+#include "metrics.h"
+#include "prof.h"
+#include "trace.h"
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mqueue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * @brief Request states
+ */
+#define CTL_WAIT    0   /* Waiting on a task response */
+#define CTL_DONE    1   /* Reply ready */
+#define CTL_STATS   2   /* Stats dumped when it reaches the front */
+
+/**
+ * @brief Most commands per task that are timed
+ */
+#define CTL_CMDS    32
+
+/**
+ * @brief Command names
+ */
+typedef struct ctl_cmd_s {
+    uint8_t thread;
+    uint8_t cmd;
+    uint8_t rsp;        /* Task sends a response */
+    const char *name;
+} ctl_cmd_t;
+
+/**
+ * @brief Request in flight
+ */
+typedef struct ctl_req_s {
+    uint32_t seq;
+    uint8_t state;
+    uint8_t bin;
+    uint8_t thread;
+    uint8_t cmd;
+    uint64_t sent_us;
+    char out[64];       /* Text reply, or a binary reply */
+    uint8_t len;
+} ctl_req_t;
+
+/**
+ * @brief Connected client
+ */
+typedef struct ctl_client_s {
+    int fd;
+    char in[CTL_LINE_MAX * 2];
+    size_t inlen;
+    uint8_t eof;        /* Client is done sending, close once answered */
+    ctl_req_t reqs[CTL_PENDING];
+    uint32_t head;
+    uint32_t tail;
+} ctl_client_t;
+
+/**
+ * @brief Response still expected for a request that was given up on
+ */
+typedef struct ctl_orphan_s {
+    uint32_t seq;
+    uint8_t thread;
+    uint8_t cmd;
+    uint64_t since_us;
+} ctl_orphan_t;
+
+/**
+ * @brief Round trip times per task command
+ */
+typedef struct ctl_lat_s {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+} ctl_lat_t;
+
+/**
+ * @brief Private variables
+ */
+static const char *ctl_threads[MSG_QUEUE_NUM] = {"main", "light", "temp", "log", "ctl"};
+static const ctl_cmd_t ctl_cmds[] = {
+    {MAIN_THREAD_MAIN, MAIN_EXIT, 0, "exit"},
+    {MAIN_THREAD_MAIN, MAIN_STATS, 1, "stats"},
+    {MAIN_THREAD_MAIN, MAIN_TRACE, 1, "trace"},
+    {MAIN_THREAD_TEMP, TEMP_INIT, 0, "init"},
+    {MAIN_THREAD_TEMP, TEMP_READREG, 1, "readreg"},
+    {MAIN_THREAD_TEMP, TEMP_WRITEREG, 0, "writereg"},
+    {MAIN_THREAD_TEMP, TEMP_WRITECONFIG, 0, "writeconfig"},
+    {MAIN_THREAD_TEMP, TEMP_GETTEMP, 1, "gettemp"},
+    {MAIN_THREAD_TEMP, TEMP_SETCONV, 0, "setconv"},
+    {MAIN_THREAD_TEMP, TEMP_SHUTDOWN, 0, "shutdown"},
+    {MAIN_THREAD_TEMP, TEMP_WAKEUP, 0, "wakeup"},
+    {MAIN_THREAD_TEMP, TEMP_ALIVE, 1, "alive"},
+    {MAIN_THREAD_TEMP, TEMP_KILL, 0, "kill"},
+    {MAIN_THREAD_TEMP, TEMP_WRITEPTR, 0, "writeptr"},
+    {MAIN_THREAD_TEMP, TEMP_SETALERT, 0, "setalert"},
+    {MAIN_THREAD_TEMP, TEMP_SETONESHOT, 0, "setoneshot"},
+    {MAIN_THREAD_TEMP, TEMP_GETBUSSTATS, 1, "getbusstats"},
+    {MAIN_THREAD_TEMP, TEMP_SETADAPT, 0, "setadapt"},
+    {MAIN_THREAD_TEMP, TEMP_GETADAPT, 1, "getadapt"},
+    {MAIN_THREAD_TEMP, TEMP_GETTEMP_ALL, 1, "gettemp_all"},
+    {MAIN_THREAD_TEMP, TEMP_GETSTATS, 1, "getstats"},
+    {MAIN_THREAD_TEMP, TEMP_STATS, 1, "stats"},
+    {MAIN_THREAD_LIGHT, LIGHT_INIT, 0, "init"},
+    {MAIN_THREAD_LIGHT, LIGHT_READREG, 1, "readreg"},
+    {MAIN_THREAD_LIGHT, LIGHT_WRITEREG, 0, "writereg"},
+    {MAIN_THREAD_LIGHT, LIGHT_WRITEIT, 0, "writeit"},
+    {MAIN_THREAD_LIGHT, LIGHT_GETLUX, 1, "getlux"},
+    {MAIN_THREAD_LIGHT, LIGHT_ENABLEINT, 0, "enableint"},
+    {MAIN_THREAD_LIGHT, LIGHT_DISABLEINT, 0, "disableint"},
+    {MAIN_THREAD_LIGHT, LIGHT_READID, 1, "readid"},
+    {MAIN_THREAD_LIGHT, LIGHT_ISDAY, 1, "isday"},
+    {MAIN_THREAD_LIGHT, LIGHT_ALIVE, 1, "alive"},
+    {MAIN_THREAD_LIGHT, LIGHT_KILL, 0, "kill"},
+    {MAIN_THREAD_LIGHT, LIGHT_SETAGC, 0, "setagc"},
+    {MAIN_THREAD_LIGHT, LIGHT_GETAGC, 1, "getagc"},
+    {MAIN_THREAD_LIGHT, LIGHT_SETADAPT, 0, "setadapt"},
+    {MAIN_THREAD_LIGHT, LIGHT_GETADAPT, 1, "getadapt"},
+    {MAIN_THREAD_LIGHT, LIGHT_GETSTATS, 1, "getstats"},
+    {MAIN_THREAD_LIGHT, LIGHT_STATS, 1, "stats"},
+    {MAIN_THREAD_LOG, LOG_INIT, 0, "init"},
+    {MAIN_THREAD_LOG, LOG_LOG, 0, "log"},
+    {MAIN_THREAD_LOG, LOG_SETPATH, 0, "setpath"},
+    {MAIN_THREAD_LOG, LOG_ALIVE, 1, "alive"},
+    {MAIN_THREAD_LOG, LOG_KILL, 0, "kill"},
+    {MAIN_THREAD_LOG, LOG_SETLEVEL, 0, "setlevel"},
+    {MAIN_THREAD_LOG, LOG_STATS, 1, "stats"},
+};
+#define CTL_NCMDS (sizeof(ctl_cmds) / sizeof(ctl_cmds[0]))
+
+static int ctl_fd = -1;
+static char ctl_path[108];
+static pthread_t ctl_thread;
+static ctl_stats_fn ctl_stats;
+static mqd_t ctl_rxq = (mqd_t) -1;
+static mqd_t ctl_txq[MSG_QUEUE_NUM] = {[0 ... MSG_QUEUE_NUM - 1] = (mqd_t) -1};
+static ctl_client_t ctl_clients[CTL_CLIENTS];
+static ctl_orphan_t ctl_orphans[CTL_PENDING];
+static uint32_t ctl_norphan;
+static uint32_t ctl_seq;
+static ctl_lat_t ctl_lat[MSG_QUEUE_NUM][CTL_CMDS];
+static uint32_t ctl_busy, ctl_late, ctl_stray, ctl_timeouts, ctl_dropped, ctl_requests;
+
+/**
+ * @brief Private functions
+ */
+static uint64_t __ctl_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static const ctl_cmd_t *__ctl_find(uint8_t thread, uint8_t cmd) {
+
+    for (size_t i = 0; i < CTL_NCMDS; i++) {
+        if (ctl_cmds[i].thread == thread && ctl_cmds[i].cmd == cmd) {
+            return &ctl_cmds[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void __ctl_reply(ctl_req_t *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void __ctl_reply(ctl_req_t *r, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(r->out, sizeof(r->out) - 1, fmt, ap);
+    va_end(ap);
+    strcat(r->out, "\n");
+    r->len = strlen(r->out);
+    r->state = CTL_DONE;
+}
+
+static void __ctl_reply_bin(ctl_req_t *r, uint8_t status, const msg_t *rx) {
+
+    r->out[0] = CTL_BIN;
+    r->out[1] = status;
+    if (rx != NULL) {
+        memcpy(r->out + 2, rx, 2 + MSG_DATASIZE);
+    } else {
+        r->out[2] = r->thread;
+        r->out[3] = r->cmd;
+        memset(r->out + 4, 0, MSG_DATASIZE);
+    }
+    r->len = CTL_BIN_RSP_SIZE;
+    r->state = CTL_DONE;
+}
+
+static void __ctl_fail(ctl_req_t *r, uint8_t status, const char *why) {
+
+    if (r->bin) {
+        __ctl_reply_bin(r, status, NULL);
+    } else {
+        __ctl_reply(r, "err %s", why);
+    }
+}
+
+/* Sends a task command, the reply is filled in now unless a response is due */
+static void __ctl_send(ctl_req_t *r, const uint8_t *data, size_t len) {
+    int ret;
+
+    const ctl_cmd_t *c = __ctl_find(r->thread, r->cmd);
+    if (r->thread == MAIN_THREAD_LOG) {
+        logmsg_t tx;
+        memset(&tx, 0, sizeof(tx));
+        tx.from = MAIN_THREAD_CTL;
+        tx.cmd = r->cmd;
+        memcpy(tx.data, data, len < MSG_LOGDATASIZE ? len : MSG_LOGDATASIZE - 1);
+        tx.ts = prof_stamp();
+        ret = mq_send(ctl_txq[r->thread], (char *) &tx, MSG_LOGSIZE, 0);
+    } else {
+        msg_t tx;
+        memset(&tx, 0, sizeof(tx));
+        tx.from = MAIN_THREAD_CTL;
+        tx.cmd = r->cmd;
+        memcpy(tx.data, data, len < MSG_DATASIZE ? len : MSG_DATASIZE);
+        tx.ts = prof_stamp();
+        ret = mq_send(ctl_txq[r->thread], (char *) &tx, MSG_SIZE, 0);
+    }
+
+    if (ret == -1) {
+        TRACE4(msg__drop, r->thread, r->cmd, r->thread == MAIN_THREAD_LOG ? MSG_LOGSIZE : MSG_SIZE, MAIN_THREAD_CTL);
+        metrics_inc(METRIC_MSG_DROPS, r->thread);
+        ctl_busy++;
+        __ctl_fail(r, CTL_BIN_BUSY, errno == EAGAIN ? "queue full" : "send failed");
+        return;
+    }
+    TRACE4(msg__send, r->thread, r->cmd, r->thread == MAIN_THREAD_LOG ? MSG_LOGSIZE : MSG_SIZE, MAIN_THREAD_CTL);
+    metrics_inc(METRIC_MSG_SENT, r->thread);
+
+    if (c != NULL && c->rsp) {
+        r->state = CTL_WAIT;
+        r->sent_us = __ctl_now_us();
+    } else if (r->bin) {
+        __ctl_reply_bin(r, CTL_BIN_OK, NULL);
+    } else {
+        __ctl_reply(r, "ok");
+    }
+}
+
+static char *__ctl_token(char **p) {
+
+    while (**p == ' ' || **p == '\t' || **p == '\r') {
+        (*p)++;
+    }
+    if (**p == 0) {
+        return NULL;
+    }
+
+    char *tok = *p;
+    while (**p != 0 && **p != ' ' && **p != '\t' && **p != '\r') {
+        (*p)++;
+    }
+    if (**p != 0) {
+        *(*p)++ = 0;
+    }
+
+    return tok;
+}
+
+static void __ctl_text(ctl_req_t *r, char *line) {
+    uint8_t data[MSG_LOGDATASIZE];
+    size_t len = 0;
+    char *p = line;
+    char *end;
+
+    char *tok = __ctl_token(&p);
+    if (tok == NULL) {
+        __ctl_reply(r, "err empty");
+        return;
+    }
+    if (!strcmp(tok, "stats")) {
+        r->state = CTL_STATS;
+        return;
+    }
+
+    int thread = -1;
+    for (int i = 0; i < MAIN_THREAD_TOTAL; i++) {
+        if (!strcmp(tok, ctl_threads[i])) {
+            thread = i;
+        }
+    }
+    if (thread < 0) {
+        __ctl_reply(r, "err unknown task %.16s", tok);
+        return;
+    }
+    r->thread = thread;
+
+    /* Command by number or by name */
+    if ((tok = __ctl_token(&p)) == NULL) {
+        __ctl_reply(r, "err missing command");
+        return;
+    }
+    unsigned long cmd = strtoul(tok, &end, 0);
+    if (*end != 0 || !isdigit((unsigned char) *tok)) {
+        size_t i;
+        for (i = 0; i < CTL_NCMDS; i++) {
+            if (ctl_cmds[i].thread == thread && !strcmp(ctl_cmds[i].name, tok)) {
+                break;
+            }
+        }
+        if (i == CTL_NCMDS) {
+            __ctl_reply(r, "err unknown command %.16s", tok);
+            return;
+        }
+        cmd = ctl_cmds[i].cmd;
+    } else if (cmd > MSG_CMD_MASK) {
+        __ctl_reply(r, "err bad command");
+        return;
+    }
+    r->cmd = cmd;
+
+    /* Data bytes, then an optional quoted string with a terminating zero */
+    size_t max = thread == MAIN_THREAD_LOG ? MSG_LOGDATASIZE - 1 : MSG_DATASIZE;
+    while (1) {
+        p += strspn(p, " \t\r");
+        if (*p == '"') {
+            char *q = strrchr(p + 1, '"');
+            size_t n = q != NULL ? (size_t) (q - p - 1) : 0;
+            if (q == NULL || q[1 + strspn(q + 1, " \t\r")] != 0 || len + n + 1 > max) {
+                __ctl_reply(r, "err bad string");
+                return;
+            }
+            memcpy(data + len, p + 1, n);
+            len += n;
+            data[len++] = 0;
+            break;
+        }
+
+        if ((tok = __ctl_token(&p)) == NULL) {
+            break;
+        }
+        unsigned long v = strtoul(tok, &end, 0);
+        if (*end != 0 || !isdigit((unsigned char) *tok) || v > 0xff || len >= max) {
+            __ctl_reply(r, "err bad data %.16s", tok);
+            return;
+        }
+        data[len++] = v;
+    }
+
+    __ctl_send(r, data, len);
+}
+
+static void __ctl_bin(ctl_req_t *r, const uint8_t *frame) {
+
+    r->bin = 1;
+    r->thread = frame[1];
+    r->cmd = frame[2];
+    if (r->thread >= MAIN_THREAD_TOTAL) {
+        __ctl_reply_bin(r, CTL_BIN_BAD, NULL);
+        return;
+    }
+
+    __ctl_send(r, frame + 3, MSG_DATASIZE);
+}
+
+static void __ctl_orphan(ctl_req_t *r, uint64_t now) {
+
+    /* Oldest orphans give way when the table is full */
+    if (ctl_norphan == CTL_PENDING) {
+        memmove(ctl_orphans, ctl_orphans + 1, sizeof(ctl_orphans[0]) * (CTL_PENDING - 1));
+        ctl_norphan--;
+    }
+    ctl_orphan_t *o = &ctl_orphans[ctl_norphan++];
+    o->seq = r->seq;
+    o->thread = r->thread;
+    o->cmd = r->cmd;
+    o->since_us = now;
+}
+
+static void __ctl_drop(ctl_client_t *cl) {
+
+    uint64_t now = __ctl_now_us();
+    for (uint32_t i = cl->head; i != cl->tail; i++) {
+        ctl_req_t *r = &cl->reqs[i % CTL_PENDING];
+        if (r->state == CTL_WAIT) {
+            __ctl_orphan(r, now);
+        }
+    }
+
+    close(cl->fd);
+    cl->fd = -1;
+}
+
+static size_t __ctl_dump(char *buf, size_t len) {
+    size_t n = snprintf(buf, len, "ok");
+
+    for (int i = 0; i < MSG_QUEUE_NUM && n < len; i++) {
+        long depth;
+        uint32_t drops;
+        msg_stats(i, &depth, &drops);
+        n += snprintf(buf + n, len - n, " q.%s=%ld drops.%s=%u", ctl_threads[i], depth, ctl_threads[i], drops);
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, " ctl.requests=%u ctl.busy=%u ctl.timeouts=%u ctl.late=%u ctl.stray=%u ctl.dropped=%u",
+                      ctl_requests, ctl_busy, ctl_timeouts, ctl_late, ctl_stray, ctl_dropped);
+    }
+    if (ctl_stats != NULL && n < len) {
+        n += ctl_stats(buf + n, len - n);
+    }
+
+    /* Round trips as count/mean/max in us */
+    for (size_t i = 0; i < CTL_NCMDS && n < len; i++) {
+        const ctl_cmd_t *c = &ctl_cmds[i];
+        ctl_lat_t *l = &ctl_lat[c->thread][c->cmd % CTL_CMDS];
+        if (c->rsp && l->count) {
+            n += snprintf(buf + n, len - n, " lat.%s.%s=%u/%llu/%u", ctl_threads[c->thread], c->name,
+                          l->count, (unsigned long long) (l->sum_us / l->count), l->max_us);
+        }
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, "\n");
+    }
+
+    return n < len ? n : len - 1;
+}
+
+static int __ctl_write(ctl_client_t *cl, const char *buf, size_t len) {
+
+    while (len > 0) {
+        ssize_t ret = send(cl->fd, buf, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/* Replies leave from the front of the ring once they are ready */
+static void __ctl_flush(ctl_client_t *cl) {
+    char buf[2048];
+
+    while (cl->fd >= 0 && cl->head != cl->tail) {
+        ctl_req_t *r = &cl->reqs[cl->head % CTL_PENDING];
+        int ret;
+
+        if (r->state == CTL_WAIT) {
+            break;
+        } else if (r->state == CTL_STATS) {
+            ret = __ctl_write(cl, buf, __ctl_dump(buf, sizeof(buf)));
+        } else {
+            ret = __ctl_write(cl, r->out, r->len);
+        }
+        cl->head++;
+
+        if (ret < 0) {
+            ctl_dropped++;
+            __ctl_drop(cl);
+        }
+    }
+}
+
+/* Take every whole request there is room for */
+static void __ctl_parse(ctl_client_t *cl) {
+
+    size_t off = 0;
+    while (cl->fd >= 0 && off < cl->inlen && cl->tail - cl->head < CTL_PENDING) {
+        ctl_req_t *r = &cl->reqs[cl->tail % CTL_PENDING];
+        memset(r, 0, sizeof(*r));
+
+        if ((uint8_t) cl->in[off] == CTL_BIN) {
+            if (cl->inlen - off < CTL_BIN_REQ_SIZE) {
+                break;
+            }
+            r->seq = ctl_seq++;
+            __ctl_bin(r, (uint8_t *) cl->in + off);
+            off += CTL_BIN_REQ_SIZE;
+        } else {
+            char *nl = memchr(cl->in + off, '\n', cl->inlen - off);
+            if (nl == NULL) {
+                if (cl->inlen - off >= CTL_LINE_MAX) {
+                    ctl_dropped++;
+                    __ctl_drop(cl);
+                    return;
+                }
+                break;
+            }
+            *nl = 0;
+            r->seq = ctl_seq++;
+            __ctl_text(r, cl->in + off);
+            off = nl + 1 - cl->in;
+        }
+
+        ctl_requests++;
+        cl->tail++;
+    }
+
+    memmove(cl->in, cl->in + off, cl->inlen - off);
+    cl->inlen -= off;
+}
+
+static void __ctl_read(ctl_client_t *cl) {
+
+    if (cl->eof || cl->inlen == sizeof(cl->in)) {
+        return;
+    }
+
+    ssize_t n = recv(cl->fd, cl->in + cl->inlen, sizeof(cl->in) - cl->inlen, 0);
+    if (n == 0) {
+        cl->eof = 1;
+    } else if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            __ctl_drop(cl);
+        }
+        return;
+    }
+    cl->inlen += n;
+
+    __ctl_parse(cl);
+}
+
+static void __ctl_response(const msg_t *rx) {
+
+    uint8_t thread = rx->from & MSG_FROM_MASK;
+    uint64_t now = __ctl_now_us();
+
+    /* The oldest request still expecting this response gets it */
+    ctl_req_t *best = NULL;
+    for (int c = 0; c < CTL_CLIENTS; c++) {
+        ctl_client_t *cl = &ctl_clients[c];
+        for (uint32_t i = cl->head; cl->fd >= 0 && i != cl->tail; i++) {
+            ctl_req_t *r = &cl->reqs[i % CTL_PENDING];
+            if (r->state == CTL_WAIT && r->thread == thread && r->cmd == rx->cmd &&
+                (best == NULL || (int32_t) (r->seq - best->seq) < 0)) {
+                best = r;
+            }
+        }
+    }
+
+    int orphan = -1;
+    for (uint32_t i = 0; i < ctl_norphan; i++) {
+        ctl_orphan_t *o = &ctl_orphans[i];
+        if (o->thread == thread && o->cmd == rx->cmd &&
+            (best == NULL || (int32_t) (o->seq - best->seq) < 0)) {
+            orphan = i;
+            break;
+        }
+    }
+
+    if (orphan >= 0) {
+        memmove(&ctl_orphans[orphan], &ctl_orphans[orphan + 1], sizeof(ctl_orphans[0]) * (ctl_norphan - orphan - 1));
+        ctl_norphan--;
+        ctl_late++;
+        return;
+    }
+    if (best == NULL) {
+        ctl_stray++;
+        return;
+    }
+
+    uint32_t us = now - best->sent_us;
+    ctl_lat_t *l = &ctl_lat[thread % MSG_QUEUE_NUM][rx->cmd % CTL_CMDS];
+    l->count++;
+    l->sum_us += us;
+    if (us > l->max_us) {
+        l->max_us = us;
+    }
+
+    if (best->bin) {
+        __ctl_reply_bin(best, CTL_BIN_OK, rx);
+        return;
+    }
+    char *p = best->out + sprintf(best->out, "ok");
+    for (int i = 0; i < MSG_DATASIZE; i++) {
+        p += sprintf(p, " %02x", rx->data[i]);
+    }
+    strcpy(p, "\n");
+    best->len = p + 1 - best->out;
+    best->state = CTL_DONE;
+}
+
+static int __ctl_expire(uint64_t now) {
+    int next_ms = -1;
+
+    for (int c = 0; c < CTL_CLIENTS; c++) {
+        ctl_client_t *cl = &ctl_clients[c];
+        for (uint32_t i = cl->head; cl->fd >= 0 && i != cl->tail; i++) {
+            ctl_req_t *r = &cl->reqs[i % CTL_PENDING];
+            if (r->state != CTL_WAIT) {
+                continue;
+            }
+            uint64_t age_ms = (now - r->sent_us) / 1000;
+            if (age_ms >= CTL_RSP_MS) {
+                ctl_timeouts++;
+                __ctl_orphan(r, now);
+                __ctl_fail(r, CTL_BIN_TIMEOUT, "timeout");
+            } else if (next_ms < 0 || CTL_RSP_MS - age_ms < (uint64_t) next_ms) {
+                next_ms = CTL_RSP_MS - age_ms;
+            }
+        }
+    }
+
+    while (ctl_norphan > 0 && now - ctl_orphans[0].since_us >= CTL_ORPHAN_MS * 1000ull) {
+        memmove(ctl_orphans, ctl_orphans + 1, sizeof(ctl_orphans[0]) * --ctl_norphan);
+    }
+    if (ctl_norphan > 0 && next_ms < 0) {
+        next_ms = CTL_ORPHAN_MS;
+    }
+
+    return next_ms;
+}
+
+static void *__ctl_run(void *arg) {
+    struct pollfd fds[2 + CTL_CLIENTS];
+    msg_t rx;
+
+    while (1) {
+        int timeout = __ctl_expire(__ctl_now_us());
+        for (int c = 0; c < CTL_CLIENTS; c++) {
+            ctl_client_t *cl = &ctl_clients[c];
+            __ctl_flush(cl);
+            __ctl_parse(cl);
+            __ctl_flush(cl);
+            if (cl->fd >= 0 && cl->eof && cl->inlen == 0 && cl->head == cl->tail) {
+                __ctl_drop(cl);
+            }
+        }
+
+        fds[0].fd = ctl_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = (int) ctl_rxq;
+        fds[1].events = POLLIN;
+        for (int c = 0; c < CTL_CLIENTS; c++) {
+            ctl_client_t *cl = &ctl_clients[c];
+            fds[2 + c].fd = cl->eof ? -1 : cl->fd;
+            fds[2 + c].events = cl->tail - cl->head < CTL_PENDING && cl->inlen < sizeof(cl->in) ? POLLIN : 0;
+        }
+
+        if (poll(fds, 2 + CTL_CLIENTS, timeout) < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(ctl_fd, NULL, NULL);
+            int c;
+            for (c = 0; fd >= 0 && c < CTL_CLIENTS && ctl_clients[c].fd >= 0; c++);
+            if (fd >= 0 && c == CTL_CLIENTS) {
+                close(fd);
+            } else if (fd >= 0) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                memset(&ctl_clients[c], 0, sizeof(ctl_clients[c]));
+                ctl_clients[c].fd = fd;
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while (mq_receive(ctl_rxq, (char *) &rx, MSG_SIZE, NULL) >= 0) {
+                metrics_inc(METRIC_MSG_RECV, MAIN_THREAD_CTL);
+                if (rx.from & MSG_RSP_MASK) {
+                    __ctl_response(&rx);
+                }
+            }
+        }
+
+        for (int c = 0; c < CTL_CLIENTS; c++) {
+            if (fds[2 + c].fd >= 0 && fds[2 + c].revents) {
+                __ctl_read(&ctl_clients[c]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Public functions
+ */
+uint8_t ctl_init(const char *path, ctl_stats_fn fn) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return CTL_ERR_INIT;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(ctl_path, path);
+    ctl_stats = fn;
+
+    for (int c = 0; c < CTL_CLIENTS; c++) {
+        ctl_clients[c].fd = -1;
+    }
+
+    /* Our own descriptors, so sends to a full queue fail instead of wait */
+    ctl_rxq = mq_open(msg_names[MAIN_THREAD_CTL], O_RDONLY | O_NONBLOCK);
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        ctl_txq[i] = mq_open(msg_names[i], O_WRONLY | O_NONBLOCK);
+    }
+    if (ctl_rxq == (mqd_t) -1) {
+        ctl_close();
+        return CTL_ERR_INIT;
+    }
+
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (ctl_fd < 0 || bind(ctl_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(ctl_fd, CTL_CLIENTS) || pthread_create(&ctl_thread, NULL, __ctl_run, NULL)) {
+        ctl_close();
+        return CTL_ERR_INIT;
+    }
+
+    return CTL_SUCCESS;
+}
+
+void ctl_close(void) {
+
+    if (ctl_thread) {
+        pthread_cancel(ctl_thread);
+        pthread_join(ctl_thread, NULL);
+        ctl_thread = 0;
+    }
+
+    for (int c = 0; c < CTL_CLIENTS; c++) {
+        if (ctl_clients[c].fd >= 0) {
+            close(ctl_clients[c].fd);
+            ctl_clients[c].fd = -1;
+        }
+    }
+    if (ctl_fd >= 0) {
+        close(ctl_fd);
+        unlink(ctl_path);
+        ctl_fd = -1;
+    }
+
+    if (ctl_rxq != (mqd_t) -1) {
+        mq_close(ctl_rxq);
+        ctl_rxq = (mqd_t) -1;
+    }
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        if (ctl_txq[i] != (mqd_t) -1) {
+            mq_close(ctl_txq[i]);
+        }
+        ctl_txq[i] = (mqd_t) -1;
+    }
+    ctl_norphan = 0;
+}
@@ -0,0 +1,191 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file hist.c
+ * @brief Sample history with windowed aggregates
+ *
+ * A fixed ring of timestamped integer samples. Each standard window keeps
+ * running sums and monotonic min/max deques that are updated as samples come
+ * in and age out, so a window query does no scanning. A window can never hold
+ * more than HIST_SIZE samples; at faster sample rates the longest windows are
+ * cut short to what the ring still holds.
+ *
+ * @author Ben Heberlein
+ * @date Nov 2 2017
+ * @version 1.0
+ *
+ */
+
+#include "hist.h"
+#include "msg.h"
+#include "clk.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * @brief Window lengths in ms
+ */
+static const uint32_t hist_spans[HIST_WINDOWS] = {1000, 60000, 3600000};
+
+/**
+ * @brief Samples each window holds
+ */
+static const uint32_t hist_caps[HIST_WINDOWS] = {HIST_CAP_1S, HIST_CAP_1M, HIST_SIZE};
+
+/**
+ * @brief Private functions
+ */
+static uint16_t *__hist_min(hist_t *h, hist_win_t *w, uint32_t i) {
+    return &h->q[w->min_off + (i & w->mask)];
+}
+
+static uint16_t *__hist_max(hist_t *h, hist_win_t *w, uint32_t i) {
+    return &h->q[w->max_off + (i & w->mask)];
+}
+
+static void __hist_evict(hist_t *h, hist_win_t *w) {
+    uint16_t s = w->head & HIST_MASK;
+    int32_t v = h->rec[s].val;
+
+    w->sum -= v;
+    w->sumsq -= (int64_t) v * v;
+    w->head++;
+
+    /* The oldest sample can only be at the front of a deque. A window holds
+     * no more than the ring, so its ring indices are unique */
+    if (w->min_head != w->min_tail && *__hist_min(h, w, w->min_head) == s) {
+        w->min_head++;
+    }
+    if (w->max_head != w->max_tail && *__hist_max(h, w, w->max_head) == s) {
+        w->max_head++;
+    }
+}
+
+static void __hist_expire(hist_t *h, hist_win_t *w, uint32_t now_ms) {
+    uint32_t cutoff = now_ms - w->span_ms;
+
+    while (w->head != h->seq && (int32_t) (h->rec[w->head & HIST_MASK].ts - cutoff) < 0) {
+        __hist_evict(h, w);
+    }
+}
+
+/**
+ * @brief Public functions
+ */
+uint8_t hist_init(hist_t *h) {
+
+    memset(h, 0, sizeof(*h));
+    uint32_t off = 0;
+    for (int i = 0; i < HIST_WINDOWS; i++) {
+        h->win[i].span_ms = hist_spans[i];
+        h->win[i].mask = hist_caps[i] - 1;
+        h->win[i].min_off = off;
+        h->win[i].max_off = off + hist_caps[i];
+        off += 2 * hist_caps[i];
+    }
+
+    if (pthread_mutex_init(&h->lock, NULL)) {
+        return HIST_ERR_PARAM;
+    }
+
+    return HIST_SUCCESS;
+}
+
+void hist_push(hist_t *h, uint32_t ts_ms, int32_t v) {
+
+    pthread_mutex_lock(&h->lock);
+
+    uint32_t s = h->seq;
+    uint16_t idx = s & HIST_MASK;
+    for (int i = 0; i < HIST_WINDOWS; i++) {
+        hist_win_t *w = &h->win[i];
+
+        __hist_expire(h, w, ts_ms);
+
+        /* A full window drops its oldest sample first, for the hour window
+         * that is also the ring slot about to be reused */
+        if (s - w->head > w->mask) {
+            __hist_evict(h, w);
+        }
+
+        w->sum += v;
+        w->sumsq += (int64_t) v * v;
+
+        /* Anything not smaller (larger) than the new sample can never be the
+         * min (max) again */
+        while (w->min_tail != w->min_head && h->rec[*__hist_min(h, w, w->min_tail - 1)].val >= v) {
+            w->min_tail--;
+        }
+        *__hist_min(h, w, w->min_tail++) = idx;
+
+        while (w->max_tail != w->max_head && h->rec[*__hist_max(h, w, w->max_tail - 1)].val <= v) {
+            w->max_tail--;
+        }
+        *__hist_max(h, w, w->max_tail++) = idx;
+    }
+
+    h->rec[idx].ts = ts_ms;
+    h->rec[idx].val = v;
+    h->seq = s + 1;
+
+    pthread_mutex_unlock(&h->lock);
+}
+
+uint8_t hist_stats(hist_t *h, uint8_t win, uint32_t now_ms, hist_stats_t *out) {
+
+    if (win >= HIST_WINDOWS) {
+        return HIST_ERR_PARAM;
+    }
+
+    pthread_mutex_lock(&h->lock);
+
+    hist_win_t *w = &h->win[win];
+    __hist_expire(h, w, now_ms);
+
+    out->count = h->seq - w->head;
+    if (out->count == 0) {
+        pthread_mutex_unlock(&h->lock);
+        memset(out, 0, sizeof(*out));
+        return HIST_ERR_EMPTY;
+    }
+
+    out->min = h->rec[*__hist_min(h, w, w->min_head)].val;
+    out->max = h->rec[*__hist_max(h, w, w->max_head)].val;
+
+    double mean = (double) w->sum / out->count;
+    double var = (double) w->sumsq / out->count - mean * mean;
+
+    pthread_mutex_unlock(&h->lock);
+
+    out->mean = lround(mean);
+    out->std = var > 0 ? lround(sqrt(var)) : 0;
+
+    return HIST_SUCCESS;
+}
+
+void hist_stats_pack(uint8_t win, uint8_t ret, const hist_stats_t *st, uint8_t *data) {
+    data[0] = win;
+    if (ret != HIST_SUCCESS) {
+        data[0] |= HIST_EMPTY;
+    }
+    msg_put24(data+1, st->min);
+    msg_put24(data+4, st->max);
+    msg_put24(data+7, st->mean);
+    msg_put24(data+10, st->std);
+    data[13] = 0;
+}
+
+uint32_t hist_now_ms(void) {
+    return clk_now_ms();
+}
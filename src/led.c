@@ -0,0 +1,277 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file led.c
+ * @brief User LED output through sysfs
+ *
+ * The brightness and trigger files of the four user LEDs are opened once and
+ * kept open. The last value written to each is cached so repeated requests
+ * for the same state cost nothing. Blinking is handed to the kernel timer
+ * trigger and single flashes to the oneshot trigger, so patterns need no
+ * wakeups here. The sysfs directory is a parameter so tests can point it at a
+ * stub tree.
+ *
+ * @author Ben Heberlein
+ * @date Nov 8 2017
+ * @version 1.0
+ *
+ */
+
+#include "led.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+
+/**
+ * @brief Per LED state
+ *
+ * The delay files only exist while a timer or oneshot trigger is attached, so
+ * they are opened with the trigger and closed when it goes away.
+ */
+typedef struct led_s {
+    int brightness;
+    int trigger;
+    int delay_on;
+    int delay_off;
+    int shot;
+    uint8_t state;      /* Cached brightness, 0xff when unknown */
+    uint8_t trig;       /* Attached trigger */
+    uint32_t on_ms;     /* Cached delays */
+    uint32_t off_ms;
+} led_t;
+
+/**
+ * @brief Private variables
+ */
+static const char *led_trig_names[] = {"none", "timer", "oneshot"};
+static char led_dir[PATH_MAX];
+static led_t leds[LED_TOTAL] = {
+    [0 ... LED_TOTAL-1] = {-1, -1, -1, -1, -1, 0xff, LED_TRIG_NONE, 0, 0}
+};
+static uint32_t led_writes, led_skipped;
+static pthread_mutex_t led_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Private functions
+ */
+int __led_open(uint8_t led, const char *file) {
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s/" LED_NAME "/%s", led_dir, led, file) >= (int) sizeof(path)) {
+        return -1;
+    }
+
+    return open(path, O_WRONLY | O_CLOEXEC);
+}
+
+uint8_t __led_write(int fd, const char *buf) {
+
+    if (fd < 0) {
+        return LED_ERR_OPEN;
+    }
+
+    /* sysfs attributes are rewritten from the start every time */
+    if (pwrite(fd, buf, strlen(buf), 0) < 0) {
+        return LED_ERR_WRITE;
+    }
+    led_writes++;
+
+    return LED_SUCCESS;
+}
+
+uint8_t __led_trigger(uint8_t led, uint8_t trig) {
+    led_t *l = &leds[led];
+
+    if (l->trig == trig) {
+        led_skipped++;
+        return LED_SUCCESS;
+    }
+
+    if (l->delay_on >= 0) {
+        close(l->delay_on);
+        close(l->delay_off);
+        l->delay_on = l->delay_off = -1;
+    }
+    if (l->shot >= 0) {
+        close(l->shot);
+        l->shot = -1;
+    }
+
+    uint8_t ret = __led_write(l->trigger, led_trig_names[trig]);
+    if (ret != LED_SUCCESS) {
+        return ret;
+    }
+    l->trig = trig;
+
+    /* Changing the trigger leaves brightness to the kernel */
+    l->state = 0xff;
+    l->on_ms = l->off_ms = 0;
+
+    if (trig != LED_TRIG_NONE) {
+        l->delay_on = __led_open(led, "delay_on");
+        l->delay_off = __led_open(led, "delay_off");
+        if (l->delay_on < 0 || l->delay_off < 0) {
+            return LED_ERR_OPEN;
+        }
+    }
+    if (trig == LED_TRIG_ONESHOT) {
+        l->shot = __led_open(led, "shot");
+        if (l->shot < 0) {
+            return LED_ERR_OPEN;
+        }
+    }
+
+    return LED_SUCCESS;
+}
+
+uint8_t __led_delays(uint8_t led, uint32_t on_ms, uint32_t off_ms) {
+    led_t *l = &leds[led];
+    char buf[16];
+    uint8_t ret;
+
+    if (l->on_ms != on_ms) {
+        snprintf(buf, sizeof(buf), "%u", on_ms);
+        if ((ret = __led_write(l->delay_on, buf)) != LED_SUCCESS) {
+            return ret;
+        }
+        l->on_ms = on_ms;
+    } else {
+        led_skipped++;
+    }
+
+    if (l->off_ms != off_ms) {
+        snprintf(buf, sizeof(buf), "%u", off_ms);
+        if ((ret = __led_write(l->delay_off, buf)) != LED_SUCCESS) {
+            return ret;
+        }
+        l->off_ms = off_ms;
+    } else {
+        led_skipped++;
+    }
+
+    return LED_SUCCESS;
+}
+
+/**
+ * @brief Public functions
+ */
+uint8_t led_init(const char *dir) {
+
+    led_close();
+
+    pthread_mutex_lock(&led_lock);
+    snprintf(led_dir, sizeof(led_dir), "%s", dir);
+
+    uint8_t ret = LED_SUCCESS;
+    for (int i = 0; i < LED_TOTAL; i++) {
+        leds[i].brightness = __led_open(i, "brightness");
+        leds[i].trigger = __led_open(i, "trigger");
+        if (leds[i].brightness < 0 || leds[i].trigger < 0) {
+            ret = LED_ERR_OPEN;
+            continue;
+        }
+
+        /* Start from a known state whatever the last run left behind */
+        leds[i].trig = 0xff;
+        __led_trigger(i, LED_TRIG_NONE);
+        __led_write(leds[i].brightness, "0");
+        leds[i].state = LED_OFF;
+    }
+    pthread_mutex_unlock(&led_lock);
+
+    return ret;
+}
+
+void led_close(void) {
+
+    pthread_mutex_lock(&led_lock);
+    for (int i = 0; i < LED_TOTAL; i++) {
+        int *fds[] = {&leds[i].brightness, &leds[i].trigger, &leds[i].delay_on,
+                      &leds[i].delay_off, &leds[i].shot};
+        for (size_t j = 0; j < sizeof(fds) / sizeof(fds[0]); j++) {
+            if (*fds[j] >= 0) {
+                close(*fds[j]);
+                *fds[j] = -1;
+            }
+        }
+        leds[i].state = 0xff;
+        leds[i].trig = LED_TRIG_NONE;
+        leds[i].on_ms = leds[i].off_ms = 0;
+    }
+    pthread_mutex_unlock(&led_lock);
+}
+
+uint8_t led_set(uint8_t led, uint8_t state) {
+
+    if (led >= LED_TOTAL || state > LED_ON) {
+        return LED_ERR_PARAM;
+    }
+
+    pthread_mutex_lock(&led_lock);
+    led_t *l = &leds[led];
+    uint8_t ret = __led_trigger(led, LED_TRIG_NONE);
+    if (ret == LED_SUCCESS) {
+        if (l->state == state) {
+            led_skipped++;
+        } else if ((ret = __led_write(l->brightness, state ? "1" : "0")) == LED_SUCCESS) {
+            l->state = state;
+        }
+    }
+    pthread_mutex_unlock(&led_lock);
+
+    return ret;
+}
+
+uint8_t led_blink(uint8_t led, uint32_t on_ms, uint32_t off_ms) {
+
+    if (led >= LED_TOTAL) {
+        return LED_ERR_PARAM;
+    }
+
+    pthread_mutex_lock(&led_lock);
+    uint8_t ret = __led_trigger(led, LED_TRIG_TIMER);
+    if (ret == LED_SUCCESS) {
+        ret = __led_delays(led, on_ms, off_ms);
+    }
+    pthread_mutex_unlock(&led_lock);
+
+    return ret;
+}
+
+uint8_t led_flash(uint8_t led, uint32_t on_ms, uint32_t off_ms) {
+
+    if (led >= LED_TOTAL) {
+        return LED_ERR_PARAM;
+    }
+
+    pthread_mutex_lock(&led_lock);
+    uint8_t ret = __led_trigger(led, LED_TRIG_ONESHOT);
+    if (ret == LED_SUCCESS) {
+        ret = __led_delays(led, on_ms, off_ms);
+    }
+    if (ret == LED_SUCCESS) {
+        ret = __led_write(leds[led].shot, "1");
+    }
+    pthread_mutex_unlock(&led_lock);
+
+    return ret;
+}
+
+void led_stats(uint32_t *writes, uint32_t *skipped) {
+    pthread_mutex_lock(&led_lock);
+    *writes = led_writes;
+    *skipped = led_skipped;
+    pthread_mutex_unlock(&led_lock);
+}
@@ -28,117 +28,405 @@
 #include "msg.h"
 #include "log.h"
 #include "main.h"
+#include "adapt.h"
+#include "hist.h"
+#include "snap.h"
+#include "bus.h"
+#include "metrics.h"
+#include "prof.h"
+#include "trace.h"
+#include "span.h"
+#include "clk.h"
 #include <stdint.h>
 #include <mraa.h>
-#include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * @brief Integration and gain settings from least to most sensitive
+ */
+typedef struct light_setting_s {
+    uint8_t integ;      /* LIGHT_INT_* */
+    uint8_t gain;       /* 1 for 16x */
+    uint16_t full;      /* Full scale count */
+    uint32_t ns;        /* Integration period */
+    float scale;        /* Lux scale back to 402 ms / 1x */
+} light_setting_t;
+
+#define LIGHT_SETTINGS 6
+#define LIGHT_SETTING_DEFAULT 3
+static const light_setting_t light_settings[LIGHT_SETTINGS] = {
+    {LIGHT_INT_13_7, 0, 5047,  13700000,  402.0/13.7},
+    {LIGHT_INT_101,  0, 37177, 101000000, 402.0/101.0},
+    {LIGHT_INT_13_7, 1, 5047,  13700000,  402.0/13.7/16.0},
+    {LIGHT_INT_402,  0, 65535, 402000000, 1.0},
+    {LIGHT_INT_101,  1, 37177, 101000000, 402.0/101.0/16.0},
+    {LIGHT_INT_402,  1, 65535, 402000000, 1.0/16.0},
+};
+
+/**
+ * @brief div^1.4 for div from 0 to 0.5 in LIGHT_LUT_SIZE steps
+ */
+#define LIGHT_LUT_SIZE 64
+static const float light_pow_lut[LIGHT_LUT_SIZE + 1] = {
+    0.00000000e+00f, 1.12177571e-03f, 2.96038389e-03f, 5.22246817e-03f,
+    7.81250000e-03f, 1.06773637e-02f, 1.37821762e-02f, 1.71018578e-02f,
+    2.06173118e-02f, 2.43133921e-02f, 2.81777326e-02f, 3.21999937e-02f,
+    3.63713801e-02f, 4.06842902e-02f, 4.51320745e-02f, 4.97088619e-02f,
+    5.44094108e-02f, 5.92290163e-02f, 6.41634241e-02f, 6.92087635e-02f,
+    7.43614808e-02f, 7.96183273e-02f, 8.49762931e-02f, 9.04325992e-02f,
+    9.59846526e-02f, 1.01630032e-01f, 1.07366480e-01f, 1.13191888e-01f,
+    1.19104259e-01f, 1.25101715e-01f, 1.31182462e-01f, 1.37344867e-01f,
+    1.43587291e-01f, 1.49908260e-01f, 1.56306311e-01f, 1.62780091e-01f,
+    1.69328302e-01f, 1.75949663e-01f, 1.82643026e-01f, 1.89407200e-01f,
+    1.96241125e-01f, 2.03143746e-01f, 2.10114032e-01f, 2.17151016e-01f,
+    2.24253789e-01f, 2.31421426e-01f, 2.38653064e-01f, 2.45947853e-01f,
+    2.53305018e-01f, 2.60723740e-01f, 2.68203259e-01f, 2.75742859e-01f,
+    2.83341855e-01f, 2.90999502e-01f, 2.98715204e-01f, 3.06488246e-01f,
+    3.14318031e-01f, 3.22203934e-01f, 3.30145389e-01f, 3.38141799e-01f,
+    3.46192598e-01f, 3.54297280e-01f, 3.62455249e-01f, 3.70666057e-01f,
+    3.78929138e-01f
+};
+
+/**
+ * @brief Data sheet segments as lux = a*ch0 - b*ch1 - c*ch0*div^1.4, the last
+ * segment being zero
+ */
+#define LIGHT_SEGMENTS 5
+static const float light_seg_a[LIGHT_SEGMENTS] = {0.0304, 0.0224, 0.0128, 0.00146, 0.0};
+static const float light_seg_b[LIGHT_SEGMENTS] = {0.0,    0.031,  0.0153, 0.00112, 0.0};
+static const float light_seg_c[LIGHT_SEGMENTS] = {0.062,  0.0,    0.0,    0.0,     0.0};
 
 /**
  * @brief Private variables
  */
-static mraa_i2c_context i2c;
-static float current_lux = 0.0;
+static light_state_t light_own = {.agc_idx = LIGHT_SETTING_DEFAULT};
+static light_state_t *light_st = &light_own;
+static uint32_t light_period_ns = LIGHT_TIMER_NS;
+static uint32_t light_next_ns = LIGHT_TIMER_NS;
+static uint64_t settled_ns;
+static uint16_t last_ch0, last_ch1;
+static uint32_t reads, stale_reads, saturated_reads;
+static uint64_t check_due_us;
+static clk_timer_t light_check_tmr;
 
 /**
  * @brief Private functions
  */
 uint8_t __light_timer_init(void) {
 
-    timer_t tmr;
-    struct itimerspec ts;
-    struct sigevent se;
+    /* sampling only stays set while the check chain is armed, so a
+     * restarted task starts a chain that died */
+    check_due_us = clk_now_us() + light_next_ns / 1000;
+    uint8_t ret = MAIN_SUCCESS;
+    if (clk_after(&light_check_tmr, __light_check, light_next_ns) != CLK_SUCCESS) {
+        ret = MAIN_ERR_INIT;
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_ERROR, ltx, "Failed to set light check timer");
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+    light_st->sampling = ret == MAIN_SUCCESS;
 
-    se.sigev_notify = SIGEV_THREAD;
-    se.sigev_value.sival_ptr = &tmr;
-    se.sigev_notify_function = __light_check;
-    se.sigev_notify_attributes = NULL;
+    /* Back to the steady period after the first read of a new setting */
+    light_next_ns = light_period_ns;
 
-    ts.it_value.tv_sec = 0;
-    ts.it_value.tv_nsec = LIGHT_TIMER_NS;
-    ts.it_interval.tv_sec = 0;
-    ts.it_interval.tv_nsec = 0;
+    return ret;
+}
 
-    if (timer_create(CLOCK_REALTIME, &se, &tmr) == -1) {
-        logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_ERROR, ltx, "Failed to start light check");
+void __light_timing_set(uint8_t integ, uint8_t gain) {
 
-        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    uint8_t timing = __light_i2c_read(LIGHT_REG_TIME);
+    timing &= ~(LIGHT_TIMING_INTEG | LIGHT_TIMING_GAIN);
+    timing |= integ & LIGHT_TIMING_INTEG;
+    if (gain) {
+        timing |= LIGHT_TIMING_GAIN;
+    }
+    __light_i2c_write(timing, LIGHT_REG_TIME);
+
+    for (int i = 0; i < LIGHT_SETTINGS; i++) {
+        if (light_settings[i].integ == integ && light_settings[i].gain == (gain ? 1 : 0)) {
+            light_st->agc_idx = i;
+        }
+    }
+
+    /* Hold off until the new setting has integrated once */
+    const light_setting_t *set = &light_settings[light_st->agc_idx];
+    __light_period_align();
+    light_next_ns = set->ns + LIGHT_AGC_MARGIN_NS;
+
+    settled_ns = clk_now_ns() + set->ns;
+}
+
+void __light_period_align(void) {
+
+    /* Read just after an integration ends, on the multiple nearest the 
+     * adaptive period */
+    const light_setting_t *set = &light_settings[light_st->agc_idx];
+    uint32_t k = (light_st->adapt.period_ns + set->ns / 2) / set->ns;
+    if (k == 0) {
+        k = 1;
     }
+    light_period_ns = k * set->ns + LIGHT_AGC_MARGIN_NS;
+}
+
+void __light_agc(uint16_t ch0, uint16_t ch1) {
+
+    const light_setting_t *cur = &light_settings[light_st->agc_idx];
+    uint32_t peak = ch0 > ch1 ? ch0 : ch1;
+    uint8_t idx = light_st->agc_idx;
+
+    if (peak * 100 > (uint32_t) cur->full * LIGHT_AGC_HIGH) {
+        /* Close to saturation, back off */
+        if (idx > 0) {
+            idx--;
+        }
+    } else if (idx + 1 < LIGHT_SETTINGS) {
+        /* Step up if the next setting still leaves headroom */
+        const light_setting_t *next = &light_settings[idx + 1];
+        if (peak * cur->scale / next->scale * 100 < (float) next->full * LIGHT_AGC_LOW) {
+            idx++;
+        }
+    }
+
+    if (idx != light_st->agc_idx) {
+        __light_timing_set(light_settings[idx].integ, light_settings[idx].gain);
 
-    if (timer_settime(tmr, 0, &ts, 0) == -1) {
         logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_ERROR, ltx, "Failed to set light check timer");
+        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_INFO, ltx, "AGC moved to integration %d gain %dx", 
+                light_settings[idx].integ, light_settings[idx].gain ? 16 : 1);
         logmsg_send(&ltx, MAIN_THREAD_LOG);
     }
-
-    return MAIN_SUCCESS;
 }
 
 void __light_check(union sigval arg) {
-    uint8_t temp;
 	uint16_t ch0, ch1;
 
+    uint64_t span_cb = span_begin();
+    uint64_t now_us = clk_now_us();
+    uint64_t late_us = now_us > check_due_us ? now_us - check_due_us : 0;
+    TRACE3(timer__fire, MAIN_THREAD_LIGHT, TRACE_TIMER_CHECK, late_us);
+    metrics_observe(METRIC_TIMER_LATE_US, MAIN_THREAD_LIGHT, late_us);
+
+    /* The channels still hold the old setting until one integration ends */
+    uint64_t now_ns = clk_now_ns();
+    if (now_ns < settled_ns) {
+        light_next_ns = settled_ns - now_ns + LIGHT_AGC_MARGIN_NS;
+        __light_timer_init();
+        span_end(SPAN_TIMER, MAIN_THREAD_LIGHT, TRACE_TIMER_CHECK, span_cb);
+        return;
+    }
 
+	/* Get both channels with one word read each */
+    ch0 = __light_i2c_read_word(LIGHT_REG_DATA0L);
+    ch1 = __light_i2c_read_word(LIGHT_REG_DATA1L);
 
-	/* Get CH0 */
-    temp = __light_i2c_read(LIGHT_REG_DATA0L);
-    ch0 = temp;
-    temp = __light_i2c_read(LIGHT_REG_DATA0H);
-    ch0 |= (temp << 8);
+    reads++;
+    if (ch0 == last_ch0 && ch1 == last_ch1) {
+        stale_reads++;
+    }
+    last_ch0 = ch0;
+    last_ch1 = ch1;
 
-    /* Get CH1 */
-    temp = __light_i2c_read(LIGHT_REG_DATA1L);
-    ch1 = temp;
-    temp = __light_i2c_read(LIGHT_REG_DATA1H);
-    ch1 |= (temp << 8);
+    const light_setting_t *set = &light_settings[light_st->agc_idx];
+    if (ch0 >= set->full || ch1 >= set->full) {
+        saturated_reads++;
+    }
 
-    float old_lux = current_lux;
+    float old_lux = light_st->lux;
 
     /* Calculate lux */
-    current_lux = __light_convert_lux(ch0, ch1);
+    light_st->lux = __light_convert_lux(ch0, ch1) * set->scale;
+
+    /* Readers on other threads only ever see the published snapshot */
+    uint32_t now_ms = hist_now_ms();
+    int32_t centi = light_st->lux * LIGHT_HIST_SCALE + 0.5;
+    snap_publish(SNAP_LIGHT, centi, ch0 | (uint32_t) ch1 << 16, now_ms);
+    bus_publish(BUS_TOPIC_LIGHT, centi, ch0 | (uint32_t) ch1 << 16, now_ms);
+    hist_push(&light_st->hist, now_ms, centi);
 
     /* Log if there was a large change */
     logmsg_t ltx;
-    if ((current_lux != 0.0 && old_lux != 0.0 ) && (current_lux / old_lux > 2 || old_lux / current_lux > 2)) {
-        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_INFO, ltx, "Lux changed from %f to %f!", old_lux, current_lux);
+    if ((light_st->lux != 0.0 && old_lux != 0.0 ) && (light_st->lux / old_lux > 2 || old_lux / light_st->lux > 2)) {
+        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_INFO, ltx, "Lux changed from %f to %f!", old_lux, light_st->lux);
         logmsg_send(&ltx, MAIN_THREAD_LOG);
     }
 
+    /* Pick the next period from how much the light is moving */
+    adapt_update(&light_st->adapt, light_st->lux);
+    __light_period_align();
+    light_next_ns = light_period_ns;
+
+    if (light_st->agc_on) {
+        __light_agc(ch0, ch1);
+    }
+
 	__light_timer_init();
+    span_end(SPAN_TIMER, MAIN_THREAD_LIGHT, TRACE_TIMER_CHECK, span_cb);
 }
 
 float __light_convert_lux(uint16_t ch0, uint16_t ch1) {
-    float ret = 0.0;
-    float div = 0.0;
+    float c0 = ch0;
+    float c1 = ch1;
+
+    /* Taken from APDS-9301 data sheet page 4. The segment is picked by 
+     * counting the boundaries below div, and a zero channel falls through to
+     * the zero segment like div <= 0 always has */
+    float div = c1 / (ch0 ? c0 : 1.0f);
+    int seg = (div > 0.5f) + (div > 0.61f) + (div > 0.8f) + (div > 1.30f);
+    seg += (LIGHT_SEGMENTS - 1 - seg) * (ch0 == 0 || ch1 == 0);
+
+    /* Interpolate div^1.4, only used in the first segment */
+    float pos = (div < 0.5f ? div : 0.5f) * (2 * LIGHT_LUT_SIZE);
+    int idx = (int) pos;
+    idx -= idx == LIGHT_LUT_SIZE;
+    float p = light_pow_lut[idx] + (light_pow_lut[idx+1] - light_pow_lut[idx]) * (pos - idx);
+
+    return light_seg_a[seg] * c0 - light_seg_b[seg] * c1 - light_seg_c[seg] * c0 * p;
+}
+
+void light_convert_lux_batch(const uint16_t *ch0, const uint16_t *ch1, float *lux, size_t n) {
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 steps = _mm_set1_ps(2 * LIGHT_LUT_SIZE);
+    const __m128i last = _mm_set1_epi32(LIGHT_LUT_SIZE - 1);
+    const __m128i zeroi = _mm_setzero_si128();
+    int32_t idx[4];
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 c0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *) (ch0 + i)), zeroi));
+        __m128 c1 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *) (ch1 + i)), zeroi));
+        __m128 dead = _mm_or_ps(_mm_cmpeq_ps(c0, zero), _mm_cmpeq_ps(c1, zero));
+        __m128 safe = _mm_or_ps(_mm_and_ps(_mm_cmpeq_ps(c0, zero), one), c0);
+        __m128 div = _mm_div_ps(c1, safe);
+
+        /* Boundaries nest, so later blends win */
+        __m128 a = _mm_set1_ps(light_seg_a[0]);
+        __m128 b = _mm_set1_ps(light_seg_b[0]);
+        __m128 c = _mm_set1_ps(light_seg_c[0]);
+        static const float bounds[LIGHT_SEGMENTS - 1] = {0.5f, 0.61f, 0.8f, 1.30f};
+        for (int s = 0; s < LIGHT_SEGMENTS - 1; s++) {
+            __m128 m = _mm_cmpgt_ps(div, _mm_set1_ps(bounds[s]));
+            a = _mm_or_ps(_mm_and_ps(m, _mm_set1_ps(light_seg_a[s+1])), _mm_andnot_ps(m, a));
+            b = _mm_or_ps(_mm_and_ps(m, _mm_set1_ps(light_seg_b[s+1])), _mm_andnot_ps(m, b));
+            c = _mm_or_ps(_mm_and_ps(m, _mm_set1_ps(light_seg_c[s+1])), _mm_andnot_ps(m, c));
+        }
 
-    if (ch0 == 0.0) {
-        return 0.0;
+        /* Interpolate div^1.4, the table lookups are the only scalar part */
+        __m128 pos = _mm_mul_ps(_mm_min_ps(div, half), steps);
+        __m128i ipos = _mm_cvttps_epi32(pos);
+        __m128i over = _mm_cmpgt_epi32(ipos, last);
+        ipos = _mm_or_si128(_mm_and_si128(over, last), _mm_andnot_si128(over, ipos));
+        __m128 frac = _mm_sub_ps(pos, _mm_cvtepi32_ps(ipos));
+        _mm_storeu_si128((__m128i *) idx, ipos);
+        __m128 lo = _mm_setr_ps(light_pow_lut[idx[0]], light_pow_lut[idx[1]], 
+                                light_pow_lut[idx[2]], light_pow_lut[idx[3]]);
+        __m128 hi = _mm_setr_ps(light_pow_lut[idx[0]+1], light_pow_lut[idx[1]+1], 
+                                light_pow_lut[idx[2]+1], light_pow_lut[idx[3]+1]);
+        __m128 p = _mm_add_ps(lo, _mm_mul_ps(_mm_sub_ps(hi, lo), frac));
+
+        __m128 r = _mm_sub_ps(_mm_mul_ps(a, c0), _mm_mul_ps(b, c1));
+        r = _mm_sub_ps(r, _mm_mul_ps(_mm_mul_ps(c, c0), p));
+        _mm_storeu_ps(lux + i, _mm_andnot_ps(dead, r));
     }
+#elif defined(__ARM_NEON)
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const uint32x4_t last = vdupq_n_u32(LIGHT_LUT_SIZE - 1);
+    uint32_t idx[4];
+
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t c0 = vcvtq_f32_u32(vmovl_u16(vld1_u16(ch0 + i)));
+        float32x4_t c1 = vcvtq_f32_u32(vmovl_u16(vld1_u16(ch1 + i)));
+        uint32x4_t dead = vorrq_u32(vceqq_f32(c0, zero), vceqq_f32(c1, zero));
+        float32x4_t safe = vbslq_f32(vceqq_f32(c0, zero), one, c0);
+
+        /* No vector divide on ARMv7, refine the reciprocal estimate twice */
+        float32x4_t inv = vrecpeq_f32(safe);
+        inv = vmulq_f32(vrecpsq_f32(safe, inv), inv);
+        inv = vmulq_f32(vrecpsq_f32(safe, inv), inv);
+        float32x4_t div = vmulq_f32(c1, inv);
+
+        /* Boundaries nest, so later selects win */
+        float32x4_t a = vdupq_n_f32(light_seg_a[0]);
+        float32x4_t b = vdupq_n_f32(light_seg_b[0]);
+        float32x4_t c = vdupq_n_f32(light_seg_c[0]);
+        static const float bounds[LIGHT_SEGMENTS - 1] = {0.5f, 0.61f, 0.8f, 1.30f};
+        for (int s = 0; s < LIGHT_SEGMENTS - 1; s++) {
+            uint32x4_t m = vcgtq_f32(div, vdupq_n_f32(bounds[s]));
+            a = vbslq_f32(m, vdupq_n_f32(light_seg_a[s+1]), a);
+            b = vbslq_f32(m, vdupq_n_f32(light_seg_b[s+1]), b);
+            c = vbslq_f32(m, vdupq_n_f32(light_seg_c[s+1]), c);
+        }
 
-    /* Taken from APDS-9301 data sheet page 4 */
-    div = ((float)ch1)/((float)ch0);
-    if (div > 0 && div <= 0.5) {
-        ret = (0.0304 * ch0) - (0.062 * ch0 *pow(div, 1.4));
-    } else if (div > 0.5 && div <= 0.61) {
-        ret = (0.0224 * ch0) - (0.031 * ch1);
-    } else if (div > 0.61 && div <= 0.8) {
-        ret = (0.0128 * ch0) - (.0153 * ch1);
-    } else if (div > 0.8 && div <= 1.30) {
-        ret = (0.00146 * ch0) - (0.00112 * ch1);
-    } else {
-        ret = 0.0;
+        /* Interpolate div^1.4, the table lookups are the only scalar part */
+        float32x4_t pos = vmulq_n_f32(vminq_f32(div, vdupq_n_f32(0.5f)), 2 * LIGHT_LUT_SIZE);
+        uint32x4_t ipos = vminq_u32(vcvtq_u32_f32(pos), last);
+        float32x4_t frac = vsubq_f32(pos, vcvtq_f32_u32(ipos));
+        vst1q_u32(idx, ipos);
+        float lo_s[4], hi_s[4];
+        for (int k = 0; k < 4; k++) {
+            lo_s[k] = light_pow_lut[idx[k]];
+            hi_s[k] = light_pow_lut[idx[k]+1];
+        }
+        float32x4_t lo = vld1q_f32(lo_s);
+        float32x4_t p = vmlaq_f32(lo, vsubq_f32(vld1q_f32(hi_s), lo), frac);
+
+        float32x4_t r = vmlsq_f32(vmulq_f32(a, c0), b, c1);
+        r = vmlsq_f32(r, vmulq_f32(c, c0), p);
+        vst1q_f32(lux + i, vbslq_f32(dead, zero, r));
     }
+#endif
 
-    return ret;
+    /* Whatever is left over, or everything without SIMD */
+    for (; i < n; i++) {
+        lux[i] = __light_convert_lux(ch0[i], ch1[i]);
+    }
 }
 
 uint8_t __light_i2c_read(uint8_t address) {
 
     uint8_t data;
 
-    mraa_i2c_write_byte(i2c, LIGHT_CMD_READ | (address & LIGHT_CMD_ADDR_MASK));
-    data = mraa_i2c_read_byte(i2c);
+    uint64_t start_us = metrics_now_us();
+    uint64_t span_io = span_begin();
+    TRACE3(i2c__start, MAIN_THREAD_LIGHT, address, 1);
+    mraa_i2c_write_byte(light_st->i2c, LIGHT_CMD_READ | (address & LIGHT_CMD_ADDR_MASK));
+    data = mraa_i2c_read_byte(light_st->i2c);
+    TRACE3(i2c__end, MAIN_THREAD_LIGHT, address, 1);
+    span_end(SPAN_I2C, MAIN_THREAD_LIGHT, address, span_io);
+    metrics_observe(METRIC_I2C_US, MAIN_THREAD_LIGHT, metrics_now_us() - start_us);
+
+    logmsg_t ltx;
+    LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_INFO, ltx, "Register %d is %d", address, data);
+    logmsg_send(&ltx, MAIN_THREAD_LOG);
+
+    return data;
+
+}
+
+uint16_t __light_i2c_read_word(uint8_t address) {
+
+    uint16_t data;
+
+    /* SMBus word read returns the low register in the low byte */
+    uint64_t start_us = metrics_now_us();
+    uint64_t span_io = span_begin();
+    TRACE3(i2c__start, MAIN_THREAD_LIGHT, address, 2);
+    data = mraa_i2c_read_word_data(light_st->i2c, LIGHT_CMD_READ | (address & LIGHT_CMD_ADDR_MASK));
+    TRACE3(i2c__end, MAIN_THREAD_LIGHT, address, 2);
+    span_end(SPAN_I2C, MAIN_THREAD_LIGHT, address, span_io);
+    metrics_observe(METRIC_I2C_US, MAIN_THREAD_LIGHT, metrics_now_us() - start_us);
 
     logmsg_t ltx;
     LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_INFO, ltx, "Register %d is %d", address, data);
@@ -149,9 +437,36 @@ uint8_t __light_i2c_read(uint8_t address) {
 }
 
 void __light_i2c_write(uint8_t data, uint8_t address) {
-    mraa_i2c_write_byte(i2c, LIGHT_CMD_WRITE | (address & LIGHT_CMD_ADDR_MASK));
-    mraa_i2c_write_byte(i2c, data);
+    uint64_t start_us = metrics_now_us();
+    uint64_t span_io = span_begin();
+    TRACE3(i2c__start, MAIN_THREAD_LIGHT, address, 1);
+    mraa_i2c_write_byte(light_st->i2c, LIGHT_CMD_WRITE | (address & LIGHT_CMD_ADDR_MASK));
+    mraa_i2c_write_byte(light_st->i2c, data);
+    TRACE3(i2c__end, MAIN_THREAD_LIGHT, address, 1);
+    span_end(SPAN_I2C, MAIN_THREAD_LIGHT, address, span_io);
+    metrics_observe(METRIC_I2C_US, MAIN_THREAD_LIGHT, metrics_now_us() - start_us);
+
+}
+
+void __light_latest(snap_val_t *v) {
+    uint8_t ret = SNAP_ERR_BUSY;
+
+    /* A busy slot is a writer that keeps getting in, give it the CPU */
+    for (int i = 0; i < SNAP_RETRIES && ret == SNAP_ERR_BUSY; i++) {
+        if ((ret = snap_read(SNAP_LIGHT, v)) == SNAP_ERR_BUSY) {
+            sched_yield();
+        }
+    }
+    if (ret != SNAP_SUCCESS) {
+        if (ret != SNAP_ERR_EMPTY) {
+            logmsg_t ltx;
+            LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_WARN, ltx, "Couldn't read the latest light level, error %u", ret);
+            logmsg_send(&ltx, MAIN_THREAD_LOG);
+        }
 
+        /* No reading is 0 lux, night, as before the snapshot */
+        memset(v, 0, sizeof(*v));
+    }
 }
 
 void __light_terminate(void *arg) {
@@ -168,14 +483,32 @@ void *light_task(void *data) {
     /* Register exit handler */
     pthread_cleanup_push(__light_terminate, "light");
 
-	/* Initialize lux check timer */
-	__light_timer_init();
+    if (data != NULL) {
+        light_st = data;
+    }
+
+    /* A restarted task carries on with the check timer it left running */
+    if (!light_st->sampling) {
+        hist_init(&light_st->hist);
+        prof_init(&light_st->prof);
+        light_st->agc_idx = LIGHT_SETTING_DEFAULT;
+
+        /* Initialize lux check timer */
+        adapt_init(&light_st->adapt, LIGHT_ADAPT_MIN_NS, LIGHT_ADAPT_MAX_NS, LIGHT_TIMER_NS,
+                   LIGHT_ADAPT_RATE, LIGHT_ADAPT_STD, LIGHT_ADAPT_NOISE);
+        __light_timer_init();
+    }
 
     /* Command loop */
     mqd_t rxq = mq_open(msg_names[MAIN_THREAD_LIGHT], O_RDONLY);
     msg_t rx;
     while(1) {
-        mq_receive(rxq, (char *) &rx, MSG_SIZE+1, NULL);
+        if (mq_receive(rxq, (char *) &rx, MSG_SIZE+1, NULL) != -1) {
+            metrics_inc(METRIC_MSG_RECV, MAIN_THREAD_LIGHT);
+        }
+        uint64_t start = prof_begin(&light_st->prof, rx.ts);
+        TRACE4(dispatch__start, MAIN_THREAD_LIGHT, rx.cmd, MSG_SIZE, rx.from);
+        uint64_t span_t = span_begin();
         if (rx.from & MSG_RSP_MASK) {
             /* Handle response data */
             uint16_t rx_fc = MSG_RSP(rx.from, rx.cmd);
@@ -214,6 +547,24 @@ void *light_task(void *data) {
                 case LIGHT_READID:
                     light_readid(&rx);
                     break;
+                case LIGHT_SETAGC:
+                    light_setagc(&rx);
+                    break;
+                case LIGHT_GETAGC:
+                    light_getagc(&rx);
+                    break;
+                case LIGHT_SETADAPT:
+                    light_setadapt(&rx);
+                    break;
+                case LIGHT_GETADAPT:
+                    light_getadapt(&rx);
+                    break;
+                case LIGHT_GETSTATS:
+                    light_getstats(&rx);
+                    break;
+                case LIGHT_STATS:
+                    light_stats(&rx);
+                    break;
                 case LIGHT_KILL:
                     light_kill(&rx);
                     break;                   
@@ -221,6 +572,10 @@ void *light_task(void *data) {
                     break;
             }
         }
+        span_end(SPAN_DISPATCH, MAIN_THREAD_LIGHT, rx.from & MSG_RSP_MASK ? SPAN_RSP | rx.cmd : rx.cmd, span_t);
+        TRACE4(dispatch__end, MAIN_THREAD_LIGHT, rx.cmd, MSG_SIZE, rx.from);
+        prof_end(&light_st->prof, rx.from, rx.cmd, start);
+        msg_progress(MAIN_THREAD_LIGHT);
     }
 
     pthread_cleanup_pop(1);
@@ -230,9 +585,26 @@ void *light_task(void *data) {
 
 uint8_t light_init(msg_t *rx) {
 
+    /* After a restart the bus is open and the setting known */
+    if (light_st->i2c != NULL) {
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_INFO, ltx, "Light module kept its bus");
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return LIGHT_SUCCESS;
+    }
+
     mraa_init();
-    i2c = mraa_i2c_init_raw(LIGHT_I2C_BUS);
-    mraa_i2c_address(i2c, LIGHT_I2C_ADDR);
+    light_st->i2c = mraa_i2c_init_raw(LIGHT_I2C_BUS);
+    mraa_i2c_address(light_st->i2c, LIGHT_I2C_ADDR);
+
+    /* Power up and pick up whatever setting the module is in */
+    __light_i2c_write(LIGHT_CTRL_POWERON, LIGHT_REG_CTRL);
+    uint8_t timing = __light_i2c_read(LIGHT_REG_TIME);
+    uint8_t integ = timing & LIGHT_TIMING_INTEG;
+    if (integ > LIGHT_INT_402) {
+        integ = LIGHT_INT_402;
+    }
+    __light_timing_set(integ, timing & LIGHT_TIMING_GAIN);
 
     logmsg_t ltx;
     LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_INFO, ltx, "Initialized light module");
@@ -280,28 +652,129 @@ uint8_t light_writeit(msg_t *rx) {
         return LIGHT_ERR_PARAM;
     }
 
-    /* Get and set integration time */
-    uint8_t integ = __light_i2c_read(LIGHT_REG_TIME);
-    integ &= ~0x03;
-    integ |= data;
-    __light_i2c_write(integ, LIGHT_REG_TIME);
+    /* Set integration time, keeping the gain */
+    __light_timing_set(data, light_settings[light_st->agc_idx].gain);
+
+	return LIGHT_SUCCESS;
+}
+
+uint8_t light_setagc(msg_t *rx) {
+
+    light_st->agc_on = rx->data[0] ? 1 : 0;
+
+    logmsg_t ltx;
+    LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_INFO, ltx, "AGC %s", light_st->agc_on ? "enabled" : "disabled");
+    logmsg_send(&ltx, MAIN_THREAD_LOG);
+
+	return LIGHT_SUCCESS;
+}
+
+uint8_t light_getagc(msg_t *rx) {
+
+    const light_setting_t *set = &light_settings[light_st->agc_idx];
+
+    /* Send Response*/
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_LIGHT;
+    tx.cmd = LIGHT_GETAGC;
+    tx.data[0] = set->integ;
+    tx.data[1] = set->gain ? 16 : 1;
+    memcpy(tx.data+2, &reads, 4);
+    memcpy(tx.data+6, &stale_reads, 4);
+    memcpy(tx.data+10, &saturated_reads, 4);
+    msg_send(&tx, rx->from);
 
 	return LIGHT_SUCCESS;
 }
 
 uint8_t light_getlux(msg_t *rx) {
 
-    /* Send Response from lux variable*/
+    snap_val_t v;
+    __light_latest(&v);
+    float lux = (float) v.value / LIGHT_HIST_SCALE;
+
+    /* Send Response from the latest snapshot */
     msg_t tx;
     tx.from = MSG_RSP_MASK | MAIN_THREAD_LIGHT;
     tx.cmd = LIGHT_GETLUX;
-    memcpy(tx.data, &current_lux, 4);
+    memcpy(tx.data, &lux, 4);
     tx.data[4] = 0;
     msg_send(&tx, rx->from);
 
 	return LIGHT_SUCCESS;
 }
 
+uint8_t light_setadapt(msg_t *rx) {
+
+    uint32_t min_ms = rx->data[0] | rx->data[1] << 8;
+    uint32_t max_ms = rx->data[2] | rx->data[3] << 8;
+
+    /* Both limits are checked before scaling, 16 bits of ms overflow 32 of ns */
+    if (min_ms > ADAPT_MAX_NS / 1000000 || max_ms > ADAPT_MAX_NS / 1000000 ||
+        adapt_limits(&light_st->adapt, min_ms * 1000000, max_ms * 1000000) != ADAPT_SUCCESS) {
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_ERROR, ltx, "Invalid sampling limits %u to %u ms", min_ms, max_ms);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return LIGHT_ERR_PARAM;
+    }
+    __light_period_align();
+
+	return LIGHT_SUCCESS;
+}
+
+uint8_t light_getadapt(msg_t *rx) {
+
+    uint32_t period_us = light_period_ns / 1000;
+    uint32_t samples = light_st->adapt.samples;
+    uint32_t saved = adapt_saved(&light_st->adapt);
+
+    /* Send Response*/
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_LIGHT;
+    tx.cmd = LIGHT_GETADAPT;
+    memcpy(tx.data, &period_us, 4);
+    memcpy(tx.data+4, &samples, 4);
+    memcpy(tx.data+8, &saved, 4);
+    tx.data[12] = 0;
+    msg_send(&tx, rx->from);
+
+	return LIGHT_SUCCESS;
+}
+
+uint8_t light_getstats(msg_t *rx) {
+
+    hist_stats_t st;
+    uint8_t win = rx->data[0];
+    uint8_t ret = hist_stats(&light_st->hist, win, hist_now_ms(), &st);
+    if (ret == HIST_ERR_PARAM) {
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_LIGHT, LOG_LEVEL_ERROR, ltx, "Invalid stats window %d", win);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return LIGHT_ERR_PARAM;
+    }
+
+    /* Send Response*/
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_LIGHT;
+    tx.cmd = LIGHT_GETSTATS;
+    hist_stats_pack(win, ret, &st, tx.data);
+    msg_send(&tx, rx->from);
+
+	return LIGHT_SUCCESS;
+}
+
+uint8_t light_stats(msg_t *rx) {
+
+    /* Send Response*/
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_LIGHT;
+    tx.cmd = LIGHT_STATS;
+    prof_pack(&light_st->prof, rx->data[0], tx.data);
+    msg_send(&tx, rx->from);
+
+	return LIGHT_SUCCESS;
+}
+
 uint8_t light_enableint(msg_t *rx) {
 
     uint8_t intreg = __light_i2c_read(LIGHT_REG_INT);
@@ -339,8 +812,11 @@ uint8_t light_readid(msg_t *rx) {
 
 uint8_t light_isday(msg_t *rx) {
 
+    snap_val_t v;
+    __light_latest(&v);
+
   	uint8_t day = 0;
-	if (current_lux > LIGHT_DAY_THRESH) {
+	if (v.value > LIGHT_DAY_THRESH * LIGHT_HIST_SCALE) {
 		day = 1;
 	}
 
@@ -361,6 +837,7 @@ uint8_t light_alive(msg_t *rx) {
     tx.from = MSG_RSP_MASK | MAIN_THREAD_LIGHT;
     tx.cmd = LIGHT_ALIVE;
     tx.data[0] = 0xa5;
+    memcpy(tx.data+1, rx->data+1, 4);
     msg_send(&tx, rx->from);
 
 	return LIGHT_SUCCESS;
@@ -368,6 +845,7 @@ uint8_t light_alive(msg_t *rx) {
 
 uint8_t light_kill(msg_t *rx) {
 
+    prof_dump(&light_st->prof, MAIN_THREAD_LIGHT, NULL);
 	pthread_exit(0);
 
 	return LIGHT_SUCCESS;
@@ -23,6 +23,12 @@
 
 #include "log.h"
 #include "main.h"
+#include "bus.h"
+#include "metrics.h"
+#include "prof.h"
+#include "trace.h"
+#include "span.h"
+#include "clk.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
@@ -33,30 +39,97 @@
  * @brief Private variables
  */ 
 static FILE *log_file;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t log_sub;
+static uint8_t log_sub_run;
+static uint8_t log_level = LOG_LEVEL_DEBUG;
+static prof_t log_prof;
 
 /**
  * @brief Private functions
  */
 void __log_terminate(void *arg) {
+
+    /* Stop the sample subscriber before the file goes away */
+    if (__atomic_exchange_n(&log_sub_run, 0, __ATOMIC_SEQ_CST)) {
+        pthread_join(log_sub, NULL);
+    }
+
+    __log_write(MAIN_THREAD_LOG, LOG_LEVEL_WARN, "Closing log thread gracefully");
+
+    pthread_mutex_lock(&log_lock);
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+void __log_write(uint8_t from, uint8_t lvl, const char *text) {
+
+    if (lvl < __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    /* Get time */
+    time_t t = clk_wall();
+    struct tm ti;
+    char p[32];
+    localtime_r(&t, &ti);
+    asctime_r(&ti, p);
+    p[strlen(p) - 1] = 0;
+
+    /* The subscriber writes too, and a cancel must not leave the lock held */
+    int cs;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&log_lock);
     if (log_file != NULL) {
-        /* Get time */
-        time_t t;
-        struct tm *ti;
-        time(&t);
-        ti = localtime(&t);
-
-        /* Log */
-        char *p = asctime(ti);
-        p[strlen(p) - 1] = 0;
+        uint64_t span_wr = span_begin();
         fprintf(log_file, "%s\t", p);
-        fprintf(log_file, "%s\t", log_task_strings[MAIN_THREAD_LOG]);
-        fprintf(log_file, "%s\t", log_level_strings[LOG_LEVEL_WARN]);
-        fprintf(log_file, "'%s'\n", "Closing log thread gracefully");
+        fprintf(log_file, "%s\t", log_task_strings[from]);
+        fprintf(log_file, "%s\t", log_level_strings[lvl]);
+        fprintf(log_file, "'%s'\n", text);
         fflush(log_file);
+        TRACE3(log__write, from, lvl, strlen(text));
+        span_end(SPAN_LOG, from, lvl, span_wr);
+        metrics_inc(METRIC_LOG_LINES, lvl);
+    }
+    pthread_mutex_unlock(&log_lock);
+    pthread_setcancelstate(cs, NULL);
+}
 
-        fclose(log_file);
-        log_file = NULL;
+void __log_prof_line(uint8_t from, const char *line) {
+    __log_write(from, LOG_LEVEL_INFO, line);
+}
+
+void *__log_sub(void *arg) {
+
+    bus_sub_t sub;
+    bus_subscribe(&sub, BUS_TOPIC_MASK(BUS_TOPIC_TEMP) | BUS_TOPIC_MASK(BUS_TOPIC_LIGHT));
+    bus_filter(&sub, BUS_TOPIC_TEMP, LOG_SUB_MIN_MS, LOG_SUB_TEMP_DEADBAND);
+    bus_filter(&sub, BUS_TOPIC_LIGHT, LOG_SUB_MIN_MS, LOG_SUB_LIGHT_DEADBAND);
+
+    bus_sample_t s;
+    char text[64];
+    while (__atomic_load_n(&log_sub_run, __ATOMIC_SEQ_CST)) {
+        if (bus_next(&sub, &s, LOG_SUB_WAIT_MS) != BUS_SUCCESS) {
+            continue;
+        }
+
+        uint8_t from;
+        if (s.topic == BUS_TOPIC_TEMP) {
+            from = MAIN_THREAD_TEMP;
+            snprintf(text, sizeof(text), "Sample %.3f C", s.value / 1000.0);
+        } else {
+            from = MAIN_THREAD_LIGHT;
+            snprintf(text, sizeof(text), "Sample %.2f lux", s.value / 100.0);
+        }
+        __log_write(from, LOG_LEVEL_INFO, text);
+        TRACE4(log__sample, from, LOG_LEVEL_INFO, strlen(text), bus_now_us() - s.ts_us);
     }
+    bus_unsubscribe(&sub);
+
+    return NULL;
 }
 
 /**
@@ -67,11 +140,24 @@ void *log_task(void *data) {
     /* Register exit handler */
     pthread_cleanup_push(__log_terminate, "log");
 
+    prof_init(&log_prof);
+
+    /* Log samples straight off the bus */
+    __atomic_store_n(&log_sub_run, 1, __ATOMIC_SEQ_CST);
+    if (pthread_create(&log_sub, NULL, __log_sub, NULL)) {
+        __atomic_store_n(&log_sub_run, 0, __ATOMIC_SEQ_CST);
+    }
+
     /* Command loop */
     mqd_t rxq = mq_open(msg_names[MAIN_THREAD_LOG], O_RDONLY);
     logmsg_t rx;
     while(1) {
-        mq_receive(rxq, (char *) &rx, MSG_LOGSIZE+1, NULL);
+        if (mq_receive(rxq, (char *) &rx, MSG_LOGSIZE+1, NULL) != -1) {
+            metrics_inc(METRIC_MSG_RECV, MAIN_THREAD_LOG);
+        }
+        uint64_t start = prof_begin(&log_prof, rx.ts);
+        TRACE4(dispatch__start, MAIN_THREAD_LOG, rx.cmd, MSG_LOGSIZE, rx.from);
+        uint64_t span_t = span_begin();
         if (rx.from & MSG_RSP_MASK) {
             /* Handle response data */
             uint16_t rx_fc = MSG_RSP(rx.from, rx.cmd);
@@ -98,10 +184,20 @@ void *log_task(void *data) {
                 case LOG_KILL:
                     log_kill(&rx);
                     break;
+                case LOG_SETLEVEL:
+                    log_setlevel(&rx);
+                    break;
+                case LOG_STATS:
+                    log_stats(&rx);
+                    break;
                 default:
                     break;
             }
         }
+        span_end(SPAN_DISPATCH, MAIN_THREAD_LOG, rx.from & MSG_RSP_MASK ? SPAN_RSP | rx.cmd : rx.cmd, span_t);
+        TRACE4(dispatch__end, MAIN_THREAD_LOG, rx.cmd, MSG_LOGSIZE, rx.from);
+        prof_end(&log_prof, rx.from, rx.cmd, start);
+        msg_progress(MAIN_THREAD_LOG);
     }
 
     pthread_cleanup_pop(1);
@@ -111,6 +207,7 @@ void *log_task(void *data) {
 
 uint8_t log_init(logmsg_t *rx) {
 
+    pthread_mutex_lock(&log_lock);
     if (log_file != NULL) {
         fclose(log_file);
         log_file = NULL;
@@ -121,13 +218,14 @@ uint8_t log_init(logmsg_t *rx) {
     } else {
         log_file = fopen((char *)(rx->data+1), "a+");
     }
+    pthread_mutex_unlock(&log_lock);
     if (log_file == NULL) {
         return LOG_ERR_FILE;
     }
 
-    logmsg_t ltx;
-    LOG_FMT(MAIN_THREAD_LOG, LOG_LEVEL_INFO, ltx, "Initialized logger");
-    logmsg_send(&ltx, MAIN_THREAD_LOG);
+    /* Not through our own queue, it can already be full and nothing else
+     * would ever empty it */
+    __log_write(MAIN_THREAD_LOG, LOG_LEVEL_INFO, "Initialized logger");
 
 	return LOG_SUCCESS;
 }
@@ -138,30 +236,41 @@ uint8_t log_log(logmsg_t *rx) {
         return LOG_ERR_UNINIT;   
     }
 
-    /* Get time */
-    time_t t;
-    struct tm *ti;
-    time(&t);
-    ti = localtime(&t);
-
-    /* Log */
-    char *p = asctime(ti);
-    p[strlen(p) - 1] = 0;
-    fprintf(log_file, "%s\t", p);
-    fprintf(log_file, "%s\t", log_task_strings[rx->from]);
-    fprintf(log_file, "%s\t", log_level_strings[rx->data[0]]);
-    fprintf(log_file, "'%s'\n", &rx->data[1]);
-    fflush(log_file);
+    __log_write(rx->from, rx->data[0], (char *) &rx->data[1]);
 
 	return LOG_SUCCESS;
 }
 
 uint8_t log_setpath(logmsg_t *rx) {
 
+    pthread_mutex_lock(&log_lock);
     if (log_file != NULL) {
         fclose(log_file);
     }
     log_file = fopen((char *)rx->data, "w+");
+    pthread_mutex_unlock(&log_lock);
+
+	return LOG_SUCCESS;
+}
+
+uint8_t log_setlevel(logmsg_t *rx) {
+
+    if (rx->data[0] > LOG_LEVEL_ERROR) {
+        return LOG_ERR_UNKNOWN;
+    }
+    __atomic_store_n(&log_level, rx->data[0], __ATOMIC_RELAXED);
+
+	return LOG_SUCCESS;
+}
+
+uint8_t log_stats(logmsg_t *rx) {
+
+    /* Send response */
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_LOG;
+    tx.cmd = LOG_STATS;
+    prof_pack(&log_prof, rx->data[0], tx.data);
+    msg_send(&tx, rx->from);
 
 	return LOG_SUCCESS;
 }
@@ -173,6 +282,7 @@ uint8_t log_alive(logmsg_t *rx) {
     tx.from = MSG_RSP_MASK | MAIN_THREAD_LOG;
     tx.cmd = LOG_ALIVE;
     tx.data[0] = 0xa5;
+    memcpy(tx.data+1, rx->data+1, 4);
     msg_send(&tx, rx->from);
 
 	return LOG_SUCCESS;
@@ -180,6 +290,8 @@ uint8_t log_alive(logmsg_t *rx) {
 
 uint8_t log_kill(logmsg_t *rx) {
 
+    /* Written here, our own queue may be full */
+    prof_dump(&log_prof, MAIN_THREAD_LOG, __log_prof_line);
     pthread_exit(0);
 
 	return LOG_ERR_STUB;
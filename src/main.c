@@ -26,6 +26,18 @@
 #include "light.h"
 #include "temp.h"
 #include "log.h"
+#include "hist.h"
+#include "snap.h"
+#include "bus.h"
+#include "led.h"
+#include "rule.h"
+#include "conf.h"
+#include "ctl.h"
+#include "metrics.h"
+#include "prof.h"
+#include "trace.h"
+#include "span.h"
+#include "clk.h"
 #include <stdint.h>
 #include <pthread.h>
 #include <mraa.h>
@@ -38,261 +50,563 @@
 /**
  * Private variables
  */
-static const char *MAIN_USAGE = "One optional argument for log file name.\n";
-static char *log_name;
-static float local_temp;
-static float local_lux;
+static const char *MAIN_USAGE = "Optional arguments are the log file name and the config file name.\n";
+static const char *main_log_arg;
+static const char *main_conf_path = MAIN_CONF_FILE;
+static conf_t main_conf;
+static pthread_mutex_t main_conf_lock = PTHREAD_MUTEX_INITIALIZER;
+static rule_set_t *main_rules;
+static rule_set_t *main_rules_next;
+static hist_t main_hist[RULE_SRCS];
+static int32_t main_vars[RULE_VARS];
+static uint32_t main_valid;
+static uint8_t main_restart_failed;
+static const char *main_names[MAIN_THREAD_TOTAL] = {"main", "light", "temp", "log"};
+static uint32_t main_evals, main_changes, main_change_max_us;
+static uint64_t main_eval_us, main_change_us;
 static pthread_t main_tasks[MAIN_THREAD_TOTAL];
-static uint8_t main_alive[MAIN_THREAD_TOTAL];
-static char *led_names[] = {"/sys/devices/platform/leds/leds/beaglebone:green:usr0/brightness",
-                            "/sys/devices/platform/leds/leds/beaglebone:green:usr1/brightness",
-                            "/sys/devices/platform/leds/leds/beaglebone:green:usr2/brightness",
-                            "/sys/devices/platform/leds/leds/beaglebone:green:usr3/brightness"};
+static temp_state_t main_temp_st;
+static light_state_t main_light_st;
+static pthread_t main_sub;
+static uint32_t main_seen[MAIN_THREAD_TOTAL];
+static uint64_t main_seen_us[MAIN_THREAD_TOTAL];
+static uint32_t main_beats;
+static uint8_t main_beat_busy;
+static uint64_t main_beat_due_us;
+static clk_timer_t main_beat_tmr;
+static prof_t main_prof;
 
 /**
  * @brief private functions
  */
-uint8_t __main_led_set(uint8_t led, uint8_t state) {
-    if (led > 3) {
-        logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Bad value in call to LED set");
-        logmsg_send(&ltx, MAIN_THREAD_LOG);
+uint8_t __main_heartbeat_init(void) {
 
-        return MAIN_ERR_PARAM;
-    }
+    pthread_mutex_lock(&main_conf_lock);
+    uint32_t ms = main_conf.heartbeat_ms;
+    pthread_mutex_unlock(&main_conf_lock);
 
-    FILE *f = fopen(led_names[led], "w");
-    if (state) {
-        fputc('1', f);
-    } else {
-        fputc('0', f);
+    main_beat_due_us = clk_now_us() + ms * 1000ull;
+    if (clk_after(&main_beat_tmr, __main_heartbeat, ms * 1000000ull) != CLK_SUCCESS) {
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Failed to set heartbeat timer");
+        logmsg_trysend(&ltx, MAIN_THREAD_LOG);
     }
-    fclose(f);
 
-    return MAIN_SUCCESS;
-} 
+    /* Send out alive packets, they give every task something to handle and
+     * come back with their send stamp so the round trip is timed */
+    uint32_t stamp = prof_stamp();
+    msg_t tx;            
+    tx.from = MAIN_THREAD_MAIN;
+    tx.cmd = LIGHT_ALIVE;
+    tx.data[0] = 0;
+    memcpy(tx.data+1, &stamp, 4);
+    msg_trysend(&tx, MAIN_THREAD_LIGHT);
 
-uint8_t __main_logic_init(void) {
+    tx.from = MAIN_THREAD_MAIN;
+    tx.cmd = TEMP_ALIVE;
+    tx.data[0] = 0;
+    memcpy(tx.data+1, &stamp, 4);
+    msg_trysend(&tx, MAIN_THREAD_TEMP);
 
-    timer_t tmr;
-    struct itimerspec ts;
-    struct sigevent se;
+    logmsg_t ltx;
+    ltx.from = MAIN_THREAD_MAIN;
+    ltx.cmd = LOG_ALIVE;
+    ltx.data[0] = 0;
+    memcpy(ltx.data+1, &stamp, 4);
+    logmsg_trysend(&ltx, MAIN_THREAD_LOG);
 
-    se.sigev_notify = SIGEV_THREAD;
-    se.sigev_value.sival_ptr = &tmr;
-    se.sigev_notify_function = __main_logic;
-    se.sigev_notify_attributes = NULL;
+    return MAIN_SUCCESS;
+}
 
-    ts.it_value.tv_sec = 0;
-    ts.it_value.tv_nsec = MAIN_TIMER_LOGIC_NS;
-    ts.it_interval.tv_sec = 0;
-    ts.it_interval.tv_nsec = 0;
+void __main_conf_send(const conf_t *c, uint32_t keys) {
+    msg_t tx;
 
-    if (timer_create(CLOCK_REALTIME, &se, &tmr) == -1) {
-        logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Failed to start logic timer");
-        
-        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    /* Settings that belong to a task go to it as commands, so each task
+     * applies them between its own messages */
+    if (keys & (CONF_KEY(CONF_TEMP_MIN_MS) | CONF_KEY(CONF_TEMP_MAX_MS))) {
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = TEMP_SETADAPT;
+        tx.data[0] = c->temp_min_ms & 0xff;
+        tx.data[1] = c->temp_min_ms >> 8;
+        tx.data[2] = c->temp_max_ms & 0xff;
+        tx.data[3] = c->temp_max_ms >> 8;
+        msg_send(&tx, MAIN_THREAD_TEMP);
+    }
+    if (keys & CONF_KEY(CONF_TEMP_ONESHOT)) {
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = TEMP_SETONESHOT;
+        tx.data[0] = c->temp_oneshot;
+        msg_send(&tx, MAIN_THREAD_TEMP);
+    }
+    if (keys & (CONF_KEY(CONF_LIGHT_MIN_MS) | CONF_KEY(CONF_LIGHT_MAX_MS))) {
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = LIGHT_SETADAPT;
+        tx.data[0] = c->light_min_ms & 0xff;
+        tx.data[1] = c->light_min_ms >> 8;
+        tx.data[2] = c->light_max_ms & 0xff;
+        tx.data[3] = c->light_max_ms >> 8;
+        msg_send(&tx, MAIN_THREAD_LIGHT);
+    }
+    if (keys & CONF_KEY(CONF_LIGHT_AGC)) {
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = LIGHT_SETAGC;
+        tx.data[0] = c->light_agc;
+        msg_send(&tx, MAIN_THREAD_LIGHT);
     }
 
-    if (timer_settime(tmr, 0, &ts, 0) == -1) {
-        logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Failed to set logic timer");
+    logmsg_t ltx;
+    if (keys & CONF_KEY(CONF_LOG_PATH)) {
+        ltx.from = MAIN_THREAD_MAIN;
+        ltx.cmd = LOG_INIT;
+        ltx.data[0] = 0;
+        strcpy((char *) (ltx.data+1), c->log_path);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+    if (keys & CONF_KEY(CONF_LOG_LEVEL)) {
+        ltx.from = MAIN_THREAD_MAIN;
+        ltx.cmd = LOG_SETLEVEL;
+        ltx.data[0] = c->log_level;
         logmsg_send(&ltx, MAIN_THREAD_LOG);
     }
+}
 
-    return MAIN_SUCCESS;
+void __main_conf_apply(const conf_t *next) {
+    logmsg_t ltx;
+    conf_t c = *next;
+
+    if (main_log_arg != NULL) {
+        snprintf(c.log_path, sizeof(c.log_path), "%s", main_log_arg);
+    }
+
+    /* Keys that only count at startup keep their running value so the next
+     * reload still reports them */
+    char old_rules[CONF_PATH_MAX];
+    pthread_mutex_lock(&main_conf_lock);
+    uint32_t diff = conf_diff(&main_conf, &c);
+    strcpy(old_rules, main_conf.rules);
+    c.queue_depth = main_conf.queue_depth;
+    strcpy(c.ctl_path, main_conf.ctl_path);
+    c.metrics_port = main_conf.metrics_port;
+    c.trace_start = main_conf.trace_start;
+    strcpy(c.led_dir, main_conf.led_dir);
+    main_conf = c;
+    pthread_mutex_unlock(&main_conf_lock);
+
+    for (int i = 0; i < CONF_KEYS; i++) {
+        if (diff & CONF_KEY(i)) {
+            LOG_FMT(MAIN_THREAD_MAIN, conf_key_live(i) ? LOG_LEVEL_INFO : LOG_LEVEL_WARN, ltx,
+                    conf_key_live(i) ? "Config %s changed" : "Config %s only changes on restart", conf_key_name(i));
+            logmsg_send(&ltx, MAIN_THREAD_LOG);
+        }
+    }
+
+    __main_conf_send(&c, diff);
+    if (diff & CONF_KEY(CONF_RULES)) {
+        /* The old rule file gives up its watch so changing files again and
+         * again does not run out of them */
+        if (strcmp(old_rules, main_conf_path)) {
+            conf_forget(old_rules);
+        }
+        if (conf_watch(c.rules, __main_reload, NULL) != CONF_SUCCESS) {
+            LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_WARN, ltx, "Couldn't watch %s, changes need a restart", c.rules);
+            logmsg_send(&ltx, MAIN_THREAD_LOG);
+        }
+        __main_rules_load(c.rules);
+    }
 }
 
-uint8_t __main_heartbeat_init(void) {
+void __main_reload(const char *path, void *ctx) {
+    logmsg_t ltx;
+    char err[128];
 
-    timer_t tmr;
-    struct itimerspec ts;
-    struct sigevent se;
+    if (!strcmp(path, main_conf_path)) {
+        conf_t next;
+        if (conf_load(&next, path, err, sizeof(err)) != CONF_SUCCESS) {
+            LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Bad %.100s, keeping the running config: %.100s", path, err);
+            logmsg_send(&ltx, MAIN_THREAD_LOG);
+            return;
+        }
+        __main_conf_apply(&next);
+        return;
+    }
 
-    se.sigev_notify = SIGEV_THREAD;
-    se.sigev_value.sival_ptr = &tmr;
-    se.sigev_notify_function = __main_heartbeat;
-    se.sigev_notify_attributes = NULL;
+    /* A rule file that was just replaced can still have an event queued */
+    pthread_mutex_lock(&main_conf_lock);
+    uint8_t current = !strcmp(path, main_conf.rules);
+    pthread_mutex_unlock(&main_conf_lock);
+    if (current) {
+        __main_rules_load(path);
+    }
+}
 
-    ts.it_value.tv_sec = 0;
-    ts.it_value.tv_nsec = MAIN_TIMER_HEARTBEAT_NS;
-    ts.it_interval.tv_sec = 0;
-    ts.it_interval.tv_nsec = 0;
+void __main_rules_load(const char *path) {
+    logmsg_t ltx;
+    char err[128];
 
-    if (timer_create(CLOCK_REALTIME, &se, &tmr) == -1) {
-        logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Failed to start heartbeat timer");
-        
+    rule_set_t *rs = malloc(sizeof(*rs));
+    if (rs == NULL) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "No memory for rules");
         logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return;
     }
 
-    if (timer_settime(tmr, 0, &ts, 0) == -1) {
-        logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Failed to set heartbeat timer");
+    uint8_t ret = rule_load(rs, path, err, sizeof(err));
+    if (ret == RULE_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "%u rules loaded from %s", rs->nrules, path);
+    } else if (ret == RULE_ERR_FILE) {
+        rule_compile(rs, MAIN_RULES_DEFAULT, NULL, 0);
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "No %s, using the default rules", path);
+    } else if (__atomic_load_n(&main_rules, __ATOMIC_ACQUIRE) != NULL) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Bad %.100s, keeping the running rules: %.100s", path, err);
         logmsg_send(&ltx, MAIN_THREAD_LOG);
+        free(rs);
+        return;
+    } else {
+        rule_compile(rs, MAIN_RULES_DEFAULT, NULL, 0);
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Bad %.100s, using the default rules: %.100s", path, err);
     }
+    logmsg_send(&ltx, MAIN_THREAD_LOG);
 
-    /* Send out alive packets */                  
-    msg_t tx;            
-    tx.from = MAIN_THREAD_MAIN;
-    tx.cmd = LIGHT_ALIVE;
-    tx.data[0] = 0;
-    msg_send(&tx, MAIN_THREAD_LIGHT);
+    /* The subscriber picks the new set up between samples, a set it never
+     * got to is dropped here */
+    free(__atomic_exchange_n(&main_rules_next, rs, __ATOMIC_ACQ_REL));
+}
 
-    tx.from = MAIN_THREAD_MAIN;
-    tx.cmd = TEMP_ALIVE;
-    tx.data[0] = 0;
-    msg_send(&tx, MAIN_THREAD_TEMP);
+size_t __main_ctl_stats(char *buf, size_t len) {
+    size_t n = 0;
 
-    logmsg_t ltx;
-    ltx.from = MAIN_THREAD_MAIN;
-    ltx.cmd = LOG_ALIVE;
-    ltx.data[0] = 0;
-    logmsg_send(&ltx, MAIN_THREAD_LOG);
+    for (int i = 1; i < MAIN_THREAD_TOTAL && n < len; i++) {
+        n += snprintf(buf + n, len - n, " restarts.%s=%llu", main_names[i],
+                      (unsigned long long) metrics_get(METRIC_RESTARTS, i));
+    }
+    for (int i = 1; i < MAIN_THREAD_TOTAL && n < len; i++) {
+        n += snprintf(buf + n, len - n, " progress.%s=%u", main_names[i], msg_progress_get(i));
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, " rules.samples=%u rules.changes=%u", main_evals, main_changes);
+    }
 
-    return MAIN_SUCCESS;
+    return n < len ? n : len;
 }
 
-void __main_logic(union sigval arg) {
+uint8_t __main_trace_dump(void) {
     logmsg_t ltx;
-    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Logic timer");
-    logmsg_send(&ltx, MAIN_THREAD_LOG);
-
-    /* See if we need to set LEDs (LED3 is handled in heartbeat for errors) */
-    if (local_temp > MAIN_TOOHOT) {
-        __main_led_set(MAIN_LED0, MAIN_LED_ON);
-        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "It is too hot in here!");
-        logmsg_send(&ltx, MAIN_THREAD_LOG);
-    } else if (local_temp < MAIN_TOOCOLD) {
-         LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "It is too cold in here!");
-         logmsg_send(&ltx, MAIN_THREAD_LOG);
-       __main_led_set(MAIN_LED1, MAIN_LED_ON);
+    uint32_t kept, dropped;
+
+    pthread_mutex_lock(&main_conf_lock);
+    char path[CONF_PATH_MAX];
+    strcpy(path, main_conf.trace_path);
+    pthread_mutex_unlock(&main_conf_lock);
+
+    span_stop();
+    span_stats(&kept, &dropped);
+    uint8_t ret = span_dump(path);
+    if (ret == SPAN_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Wrote %u spans to %s, %u dropped", kept, path, dropped);
     } else {
-        __main_led_set(MAIN_LED0, MAIN_LED_OFF);
-        __main_led_set(MAIN_LED1, MAIN_LED_OFF);
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Couldn't write spans to %s", path);
     }
+    logmsg_send(&ltx, MAIN_THREAD_LOG);
 
-    if (local_lux > MAIN_TOOBRIGHT) {
-        __main_led_set(MAIN_LED2, MAIN_LED_ON);
-        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "It is too bright in here!");
-        logmsg_send(&ltx, MAIN_THREAD_LOG);
-    } else {
-        __main_led_set(MAIN_LED2, MAIN_LED_OFF);
+    return ret;
+}
+
+void __main_metrics_collect(void) {
+    long depth;
+    uint32_t drops;
+
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
+        msg_stats(i, &depth, &drops);
+        metrics_set(METRIC_QUEUE_DEPTH, i, depth);
     }
+}
 
-    /* Get temperature in three different formats */
+void __main_rule_act(const rule_set_t *rs, const rule_t *r, const rule_action_t *a, uint8_t active, void *ctx) {
+    logmsg_t ltx;
     msg_t tx;
-    tx.from = MAIN_THREAD_MAIN;
-    tx.cmd = TEMP_GETTEMP;
-    tx.data[0] = TEMP_FMT_CEL;
-    tx.data[1] = 0;
-    msg_send(&tx, MAIN_THREAD_TEMP); 
 
-    tx.from = MAIN_THREAD_MAIN;
-    tx.cmd = TEMP_GETTEMP;
-    tx.data[0] = TEMP_FMT_FAR;
-    tx.data[1] = 0;
-    msg_send(&tx, MAIN_THREAD_TEMP); 
+    /* LEDs follow the rule, logs and commands fire when it becomes active */
+    switch (a->type) {
+        case RULE_ACT_LED:
+            if (led_set(a->arg, active ? LED_ON : LED_OFF) == LED_SUCCESS) {
+                TRACE4(led__write, MAIN_THREAD_MAIN, a->arg, active, bus_now_us() - *(uint32_t *) ctx);
+            }
+            break;
+        case RULE_ACT_LOG:
+            if (active) {
+                LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "%.*s", MSG_LOGDATASIZE - 2, rule_text(rs, a->text));
+            } else {
+                LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "No longer %s", rule_text(rs, r->name));
+            }
+            logmsg_send(&ltx, MAIN_THREAD_LOG);
+            break;
+        case RULE_ACT_CMD:
+            if (active) {
+                tx.from = MAIN_THREAD_MAIN;
+                tx.cmd = a->cmd;
+                tx.data[0] = a->data;
+                msg_send(&tx, a->arg);
+            }
+            break;
+        default:
+            break;
+    }
+}
 
-    tx.from = MAIN_THREAD_MAIN;
-    tx.cmd = TEMP_GETTEMP;
-    tx.data[0] = TEMP_FMT_KEL;
-    tx.data[1] = 0;
-    msg_send(&tx, MAIN_THREAD_TEMP); 
+void __main_led_eval(uint8_t topic, uint32_t ts_us) {
+    hist_stats_t st;
 
-    /* Get lux */
-    tx.from = MAIN_THREAD_MAIN;
-    tx.cmd = LIGHT_GETLUX;
-    tx.data[0] = 0;
-    msg_send(&tx, MAIN_THREAD_LIGHT);
+    /* Only the windows some rule reads are worth querying */
+    uint32_t now_ms = hist_now_ms();
+    for (int w = 0; w < RULE_WINS; w++) {
+        uint32_t mask = 0;
+        for (int a = 0; a < RULE_AGGS; a++) {
+            mask |= 1u << RULE_VAR_AGG(topic, a, w);
+        }
+        if (!(main_rules->used & mask)) {
+            continue;
+        }
+
+        if (hist_stats(&main_hist[topic], w, now_ms, &st) != HIST_SUCCESS) {
+            main_valid &= ~mask;
+            continue;
+        }
+        main_vars[RULE_VAR_AGG(topic, RULE_AGG_MIN, w)] = st.min;
+        main_vars[RULE_VAR_AGG(topic, RULE_AGG_MAX, w)] = st.max;
+        main_vars[RULE_VAR_AGG(topic, RULE_AGG_MEAN, w)] = st.mean;
+        main_vars[RULE_VAR_AGG(topic, RULE_AGG_STD, w)] = st.std;
+        main_valid |= mask;
+    }
+
+    /* LED3 is handled in heartbeat for errors */
+    uint32_t changed = rule_eval(main_rules, main_vars, main_valid, __main_rule_act, &ts_us);
+
+    /* Time from the sample being published to the decision and LED write */
+    uint32_t us = bus_now_us() - ts_us;
+    main_evals++;
+    main_eval_us += us;
+    if (changed) {
+        main_changes++;
+        main_change_us += us;
+        if (us > main_change_max_us) {
+            main_change_max_us = us;
+        }
+    }
+}
+
+void *__main_sub(void *arg) {
+
+    bus_sub_t sub;
+    bus_subscribe(&sub, BUS_TOPIC_MASK(BUS_TOPIC_TEMP) | BUS_TOPIC_MASK(BUS_TOPIC_LIGHT));
+
+    /* Run the rules on every sample as it arrives, the hysteresis keeps the
+     * LEDs from chattering instead of a deadband. Bus topics line up with the
+     * rule sources, temperature in milli-degrees and lux in hundredths */
+    bus_sample_t s;
+    while (1) {
+        /* Swap in reloaded rules, LEDs the old rules held on go off and the
+         * new rules turn them back on from the next sample */
+        rule_set_t *next = __atomic_exchange_n(&main_rules_next, NULL, __ATOMIC_ACQ_REL);
+        if (next != NULL) {
+            rule_set_t *old = main_rules;
+            for (int i = 0; old != NULL && i < old->nrules; i++) {
+                for (int j = 0; old->rules[i].active && j < old->rules[i].nact; j++) {
+                    const rule_action_t *a = &old->acts[old->rules[i].act + j];
+                    if (a->type == RULE_ACT_LED) {
+                        led_set(a->arg, LED_OFF);
+                    }
+                }
+            }
+            __atomic_store_n(&main_rules, next, __ATOMIC_RELEASE);
+            free(old);
+        }
 
-    /* Restart timer */
-    __main_logic_init();
+        if (bus_next(&sub, &s, MAIN_SUB_WAIT_MS) != BUS_SUCCESS) {
+            continue;
+        }
+
+        main_vars[s.topic] = s.value;
+        main_valid |= 1u << s.topic;
+        hist_push(&main_hist[s.topic], s.ts_ms, s.value);
+        if (main_rules != NULL) {
+            uint64_t span_t = span_begin();
+            __main_led_eval(s.topic, s.ts_us);
+            span_end(SPAN_RULES, MAIN_THREAD_MAIN, s.topic, span_t);
+        }
+    }
 
+    return NULL;
 }
 
 void __main_heartbeat(union sigval arg) {    
 
-    logmsg_t ltx;
-    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Heartbeat check");
-    logmsg_send(&ltx, MAIN_THREAD_LOG);
+    /* Single flight, a beat that fires while the last one is still checking
+     * is dropped, the running one arms the next */
+    if (__atomic_exchange_n(&main_beat_busy, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
 
-    /* Send aliveness requests */
-    for (int i = 1; i < MAIN_THREAD_TOTAL; i++) {
-        /* Check if we have recieved a confirmation from the last time */
-        if (main_alive[i] != 0xa5) {
-            logmsg_t ltx;
-            LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "%s missed a heartbeat check, restarting thread", log_task_strings[i]);
-            logmsg_send(&ltx, MAIN_THREAD_LOG);
-            __main_led_set(MAIN_LED3, MAIN_LED_ON);
+    uint64_t span_cb = span_begin();
+    uint64_t now_us = clk_now_us();
+    uint64_t late_us = now_us > main_beat_due_us ? now_us - main_beat_due_us : 0;
+    TRACE3(timer__fire, MAIN_THREAD_MAIN, TRACE_TIMER_HEARTBEAT, late_us);
+    metrics_observe(METRIC_TIMER_LATE_US, MAIN_THREAD_MAIN, late_us);
+
+    pthread_mutex_lock(&main_conf_lock);
+    uint64_t stall_us = main_conf.stall_ms * 1000ull;
+    pthread_mutex_unlock(&main_conf_lock);
 
-            /* Kill thread and restart */
+    for (int i = 1; i < MAIN_THREAD_TOTAL; i++) {
+        /* A task that is handling messages is alive however slow its
+         * replies are, only one that has stopped for stall_ms is restarted */
+        uint32_t done = msg_progress_get(i);
+        if (done != main_seen[i]) {
+            main_seen[i] = done;
+            main_seen_us[i] = now_us;
+        } else if (now_us - main_seen_us[i] >= stall_us) {
+            uint64_t idle_ms = (now_us - main_seen_us[i]) / 1000;
+            main_seen_us[i] = now_us;
+
+            /* Kill thread and restart, before anything goes to its queue,
+             * since a stalled task leaves its queue full */
             pthread_cancel(main_tasks[i]);
+            metrics_inc(METRIC_RESTARTS, i);
+            logmsg_t ltx;
+            LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "%s handled nothing for %llu ms, restarting thread",
+                    log_task_strings[i], (unsigned long long) idle_ms);
+            logmsg_trysend(&ltx, MAIN_THREAD_LOG);
             if (i == MAIN_THREAD_TEMP) {
-                if (pthread_create(&main_tasks[MAIN_THREAD_TEMP], NULL, temp_task, NULL)) {
+                if (pthread_create(&main_tasks[MAIN_THREAD_TEMP], NULL, temp_task, &main_temp_st)) {
             	   	logmsg_t ltx;
 			        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Couldn't restart thread");
-            		logmsg_send(&ltx, MAIN_THREAD_LOG);
+            		logmsg_trysend(&ltx, MAIN_THREAD_LOG);
+                    main_restart_failed = 1;
  
                 } else {
-    	            /* Initialize temperature module */
+    	            /* Only opens the bus if the first init never ran, the
+                     * settings are still in the adopted state */
                 	msg_t tx;
                 	tx.from = MAIN_THREAD_MAIN;
                 	tx.cmd = TEMP_INIT;
                 	tx.data[0] = 0;
-                    msg_send(&tx, MAIN_THREAD_TEMP);
+                    msg_trysend(&tx, MAIN_THREAD_TEMP);
                 }
             } else if (i == MAIN_THREAD_LIGHT) {
-                if (pthread_create(&main_tasks[MAIN_THREAD_LIGHT], NULL, light_task, NULL)) {
+                if (pthread_create(&main_tasks[MAIN_THREAD_LIGHT], NULL, light_task, &main_light_st)) {
                     logmsg_t ltx;
                     LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Couldn't restart thread");
-                    logmsg_send(&ltx, MAIN_THREAD_LOG);
-    
+                    logmsg_trysend(&ltx, MAIN_THREAD_LOG);
+                    main_restart_failed = 1;
                 } else {
-                    /* Initialize light module */
+                    /* As for temperature, a no-op once the bus is open */
                     msg_t tx;
                     tx.from = MAIN_THREAD_MAIN;
                     tx.cmd = LIGHT_INIT;
                     tx.data[0] = 0;
-                    msg_send(&tx, MAIN_THREAD_LIGHT);
+                    msg_trysend(&tx, MAIN_THREAD_LIGHT);
                 }
             } else if (i == MAIN_THREAD_LOG) {
                 if (pthread_create(&main_tasks[MAIN_THREAD_LOG], NULL, log_task, NULL)) {
                     logmsg_t ltx;
                     LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Couldn't restart thread");
-                    logmsg_send(&ltx, MAIN_THREAD_LOG);    
+                    logmsg_trysend(&ltx, MAIN_THREAD_LOG);    
+                    main_restart_failed = 1;
                 } else {
                     /* Initialize log */
                     logmsg_t ltx;
                     ltx.from = MAIN_THREAD_MAIN;
                     ltx.cmd = LOG_INIT;
                     ltx.data[0] = 0;
-                    strcpy((char *) (ltx.data+1), log_name);
-                    logmsg_send(&ltx, MAIN_THREAD_LOG);      
+                    pthread_mutex_lock(&main_conf_lock);
+                    strcpy((char *) (ltx.data+1), main_conf.log_path);
+                    pthread_mutex_unlock(&main_conf_lock);
+                    logmsg_trysend(&ltx, MAIN_THREAD_LOG);      
 
                     LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Log reinitialized");
-                    logmsg_send(&ltx, MAIN_THREAD_LOG);
+                    logmsg_trysend(&ltx, MAIN_THREAD_LOG);
 
                 }     
             }
+
+            /* The kernel blinks LED3 for good once a restart fails, otherwise
+             * it flashes once per restart */
+            if (main_restart_failed) {
+                led_blink(MAIN_LED3, MAIN_LED_ERR_MS, MAIN_LED_ERR_MS);
+            } else {
+                led_flash(MAIN_LED3, MAIN_LED_FLASH_MS, MAIN_LED_FLASH_MS);
+            }
             
-        } else {
-            main_alive[i] = 0;
         }
     }
 
+    /* Only now that no task is stalled does anything go to the queues,
+     * and nothing waits for room */
+    logmsg_t ltx;
+    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Heartbeat check");
+    logmsg_trysend(&ltx, MAIN_THREAD_LOG);
+
+    /* Ask for the temperature bus report every so often */
+    if (++main_beats % MAIN_BUSSTATS_BEATS == 0) {
+        msg_t tx;
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = TEMP_GETBUSSTATS;
+        tx.data[0] = 0;
+        msg_trysend(&tx, MAIN_THREAD_TEMP);
+
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = LIGHT_GETAGC;
+        tx.data[0] = 0;
+        msg_trysend(&tx, MAIN_THREAD_LIGHT);
+
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = TEMP_GETADAPT;
+        tx.data[0] = 0;
+        msg_trysend(&tx, MAIN_THREAD_TEMP);
+
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = LIGHT_GETADAPT;
+        tx.data[0] = 0;
+        msg_trysend(&tx, MAIN_THREAD_LIGHT);
+
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = TEMP_GETSTATS;
+        tx.data[0] = HIST_WIN_1M;
+        msg_trysend(&tx, MAIN_THREAD_TEMP);
+
+        tx.from = MAIN_THREAD_MAIN;
+        tx.cmd = LIGHT_GETSTATS;
+        tx.data[0] = HIST_WIN_1M;
+        msg_trysend(&tx, MAIN_THREAD_LIGHT);
+
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Rules: %u samples, %llu us mean to decide; %u changes, %llu us mean, %u us max from read", 
+                main_evals, main_evals ? main_eval_us / main_evals : 0ull,
+                main_changes, main_changes ? main_change_us / main_changes : 0ull, main_change_max_us);
+        logmsg_trysend(&ltx, MAIN_THREAD_LOG);
+
+        uint32_t writes, skipped;
+        led_stats(&writes, &skipped);
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "LEDs: %u sysfs writes, %u skipped", writes, skipped);
+        logmsg_trysend(&ltx, MAIN_THREAD_LOG);
+    }
+
     /* Restart timer and send alive packets*/
+    __atomic_store_n(&main_beat_busy, 0, __ATOMIC_RELEASE);
     __main_heartbeat_init();
+    span_end(SPAN_TIMER, MAIN_THREAD_MAIN, TRACE_TIMER_HEARTBEAT, span_cb);
 }
 
 uint8_t __main_pthread_init(void) {
 
+    /* Stalls are counted from startup */
+    for (int i = 0; i < MAIN_THREAD_TOTAL; i++) {
+        main_seen_us[i] = clk_now_us();
+    }
+
     /* Open all threads */
-    if (pthread_create(&main_tasks[MAIN_THREAD_TEMP], NULL, temp_task, NULL)) {
+    if (pthread_create(&main_tasks[MAIN_THREAD_TEMP], NULL, temp_task, &main_temp_st)) {
        return MAIN_ERR_INIT; 
     }
-    if (pthread_create(&main_tasks[MAIN_THREAD_LIGHT], NULL, light_task, NULL)) {
+    if (pthread_create(&main_tasks[MAIN_THREAD_LIGHT], NULL, light_task, &main_light_st)) {
        return MAIN_ERR_INIT; 
     }
     if (pthread_create(&main_tasks[MAIN_THREAD_LOG], NULL, log_task, NULL)) {
@@ -308,6 +622,13 @@ uint8_t main_exit(msg_t *rx) {
     LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Main has recieved signal to exit. Goodbye");
     logmsg_send(&ltx, MAIN_THREAD_LOG);
 
+    prof_dump(&main_prof, MAIN_THREAD_MAIN, NULL);
+    if (span_recording()) {
+        __main_trace_dump();
+    }
+    ctl_close();
+    metrics_close();
+    snap_close();
     for (int i = 1; i < MAIN_THREAD_TOTAL; i++) {
         pthread_cancel(main_tasks[i]);
     }
@@ -317,29 +638,150 @@ uint8_t main_exit(msg_t *rx) {
     return MAIN_SUCCESS;
 }
 
+uint8_t main_tempalert(msg_t *rx) {
+
+    int32_t mc;
+    memcpy(&mc, rx->data, 4);
+
+    logmsg_t ltx;
+    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Temperature alert at %f, pin %s", mc / 1000.0, rx->data[4] ? "high" : "low");
+    logmsg_send(&ltx, MAIN_THREAD_LOG);
+
+    return MAIN_SUCCESS;
+}
+
+uint8_t main_stats(msg_t *rx) {
+
+    /* Send response */
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_MAIN;
+    tx.cmd = MAIN_STATS;
+    prof_pack(&main_prof, rx->data[0], tx.data);
+    msg_send(&tx, rx->from);
+
+    return MAIN_SUCCESS;
+}
+
+uint8_t main_trace(msg_t *rx) {
+    uint8_t ret;
+
+    if (rx->data[0]) {
+        pthread_mutex_lock(&main_conf_lock);
+        uint32_t events = main_conf.trace_events;
+        pthread_mutex_unlock(&main_conf_lock);
+        ret = span_start(events);
+
+        logmsg_t ltx;
+        if (ret == SPAN_SUCCESS) {
+            LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Recording up to %u spans", events);
+        } else {
+            LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Couldn't record %u spans", events);
+        }
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    } else {
+        ret = __main_trace_dump();
+    }
+
+    /* Send response */
+    uint32_t kept, dropped;
+    span_stats(&kept, &dropped);
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_MAIN;
+    tx.cmd = MAIN_TRACE;
+    tx.data[0] = span_recording();
+    memcpy(tx.data+1, &kept, 4);
+    memcpy(tx.data+5, &dropped, 4);
+    tx.data[9] = ret;
+    msg_send(&tx, rx->from);
+
+    return ret == SPAN_SUCCESS ? MAIN_SUCCESS : MAIN_ERR_PARAM;
+}
+
 int main(int argc, char **argv) {
     
     if (argc > 3) {
         printf("%s", MAIN_USAGE);
     }            
+
+    /* A log file on the command line wins over log.path */
+    if (argc >= 2) {
+        main_log_arg = argv[1];
+    }
+    if (argc >= 3) {
+        main_conf_path = argv[2];
+    }
+
+    /* Queue depth has to be known before the queues exist */
+    char conf_err[128];
+    conf_t conf;
+    uint8_t conf_ret = conf_load(&conf, main_conf_path, conf_err, sizeof(conf_err));
+    if (conf_ret != CONF_SUCCESS) {
+        conf_defaults(&conf);
+    }
+    if (main_log_arg != NULL) {
+        snprintf(conf.log_path, sizeof(conf.log_path), "%s", main_log_arg);
+    }
+    main_conf = conf;
    
-    msg_init();
+    msg_init(main_conf.queue_depth);
+    uint8_t snap_ret = snap_init();
+
+    /* Record from the start so task and timer setup show in the trace */
+    uint8_t span_ret = main_conf.trace_start ? span_start(main_conf.trace_events) : SPAN_SUCCESS;
+
+    /* Initialize LEDs before anything can drive them */
+    uint8_t led_ret = led_init(main_conf.led_dir);
+    for (int i = 0; i < RULE_SRCS; i++) {
+        hist_init(&main_hist[i]);
+    }
     __main_pthread_init();
+    pthread_create(&main_sub, NULL, __main_sub, NULL);
 
     /* Initialize logger */ 
-    if (argc == 2) {
-        log_name = argv[1];
-    } else {
-        log_name = "project1.log";
-    }
-    
     logmsg_t ltx;
     ltx.from = MAIN_THREAD_MAIN;
     ltx.cmd = LOG_INIT;
     ltx.data[0] = 1;
-    strcpy((char *) (ltx.data+1), log_name);
+    strcpy((char *) (ltx.data+1), main_conf.log_path);
     logmsg_send(&ltx, MAIN_THREAD_LOG);
 
+    if (conf_ret == CONF_ERR_FILE) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "No %s, using the default config", main_conf_path);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    } else if (conf_ret != CONF_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_ERROR, ltx, "Bad %.100s, using the default config: %.100s", main_conf_path, conf_err);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+    if (snap_ret != SNAP_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_WARN, ltx, "Couldn't create %s, sensor snapshots are private", SNAP_NAME);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+    if (led_ret != LED_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_WARN, ltx, "Couldn't open all LEDs under %s", main_conf.led_dir);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+    if (span_ret != SPAN_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_WARN, ltx, "Couldn't record %u spans from startup", main_conf.trace_events);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+    __main_rules_load(main_conf.rules);
+
+    /* Edits to either file are applied as they are saved */
+    if (conf_watch(main_conf_path, __main_reload, NULL) != CONF_SUCCESS ||
+        conf_watch(main_conf.rules, __main_reload, NULL) != CONF_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_WARN, ltx, "Couldn't watch %s, changes need a restart", main_conf_path);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+
+    if (ctl_init(main_conf.ctl_path, __main_ctl_stats) != CTL_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_WARN, ltx, "Couldn't open control socket %s", main_conf.ctl_path);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+    if (main_conf.metrics_port != 0 && metrics_init(main_conf.metrics_port, __main_metrics_collect) != METRICS_SUCCESS) {
+        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_WARN, ltx, "Couldn't serve metrics on port %u", main_conf.metrics_port);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+
 	/* Initialize temperature module */
 	msg_t tx;
 	tx.from = MAIN_THREAD_MAIN;
@@ -347,48 +789,110 @@ int main(int argc, char **argv) {
 	tx.data[0] = 0;
     msg_send(&tx, MAIN_THREAD_TEMP);
 
+    /* Let the ALERT pin report hot/cold edges */
+    tx.from = MAIN_THREAD_MAIN;
+    tx.cmd = TEMP_SETALERT;
+    tx.data[0] = MAIN_TEMP_ALERT;
+    msg_send(&tx, MAIN_THREAD_TEMP);
+
 	/* Initialize light module */
 	tx.from = MAIN_THREAD_MAIN;
 	tx.cmd = LIGHT_INIT;
 	tx.data[0] = 0;
     msg_send(&tx, MAIN_THREAD_LIGHT);
 
+    /* Task settings from the config, the log path already went out */
+    __main_conf_send(&main_conf, ~CONF_KEY(CONF_LOG_PATH));
+
     /* Initialize heartbeat timer */
     __main_heartbeat_init();
 
-    /* Initialize logic timer */
-    __main_logic_init();
-
-    /* Initialize LEDs */
-    __main_led_set(MAIN_LED3, MAIN_LED_OFF);
-    __main_led_set(MAIN_LED2, MAIN_LED_OFF);
-    __main_led_set(MAIN_LED1, MAIN_LED_OFF);
-    __main_led_set(MAIN_LED0, MAIN_LED_OFF);        
-
     /* Command loop */
     mqd_t rxq = mq_open(msg_names[MAIN_THREAD_MAIN], O_RDONLY);
 	msg_t rx;
     while(1) {
         
-        mq_receive(rxq, (char *) &rx, MSG_SIZE+10, NULL);
+        if (mq_receive(rxq, (char *) &rx, MSG_SIZE+10, NULL) != -1) {
+            metrics_inc(METRIC_MSG_RECV, MAIN_THREAD_MAIN);
+        }
+        uint64_t start = prof_begin(&main_prof, rx.ts);
+        TRACE4(dispatch__start, MAIN_THREAD_MAIN, rx.cmd, MSG_SIZE, rx.from);
+        uint64_t span_t = span_begin();
         if (rx.from & MSG_RSP_MASK) {
             /* Handle response data */
 			uint16_t rx_fc = MSG_RSP(rx.from, rx.cmd);
 			switch(rx_fc) {
-                case MSG_RSP(MAIN_THREAD_LIGHT, LIGHT_GETLUX):
-                    memcpy(&local_lux, rx.data, 4);                                       
-                    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Recieved light value %f lux", local_lux);
+                case MSG_RSP(MAIN_THREAD_LIGHT, LIGHT_GETLUX): {
+                    float lux;
+                    memcpy(&lux, rx.data, 4);                                       
+                    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Recieved light value %f lux", lux);
+                    logmsg_send(&ltx, MAIN_THREAD_LOG);
+                    break;
+                }
+                case MSG_RSP(MAIN_THREAD_TEMP, TEMP_GETTEMP_ALL): {
+                    temp_all_t t;
+                    temp_all_unpack(rx.data, &t);
+
+                    uint32_t age = (hist_now_ms() - t.ts_ms) & TEMP_TS_MASK;
+                    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Recieved temperature %.3f C %.3f F %.3f K, raw 0x%04x, %u ms old", 
+                            t.mc / 1000.0, t.mf / 1000.0, t.mk / 1000.0, t.raw, age);
                     logmsg_send(&ltx, MAIN_THREAD_LOG);
                     break;
-                case MSG_RSP(MAIN_THREAD_TEMP, TEMP_GETTEMP):
-                    if (rx.data[4] == TEMP_FMT_CEL) {
-                        memcpy(&local_temp, rx.data, 4); 
-                    }                    
+                }
+                case MSG_RSP(MAIN_THREAD_TEMP, TEMP_GETTEMP): {
                     float temp;
                     memcpy(&temp, rx.data, 4);                    
                     LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Recieved temperature value %f %s", temp, temp_fmt_strings[rx.data[4]]);
                     logmsg_send(&ltx, MAIN_THREAD_LOG);
                     break;
+                }
+                case MSG_RSP(MAIN_THREAD_TEMP, TEMP_GETBUSSTATS): {
+                    uint32_t xfers, count, mean_us;
+                    memcpy(&xfers, rx.data, 4);
+                    memcpy(&count, rx.data+4, 4);
+                    memcpy(&mean_us, rx.data+8, 4);
+                    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Temp %s: %u transactions over %u readings (%.2f per reading), %u us sample latency", 
+                            rx.data[12] ? "one-shot" : "continuous", xfers, count, count ? (float) xfers / count : 0.0, mean_us);
+                    logmsg_send(&ltx, MAIN_THREAD_LOG);
+                    break;
+                }
+                case MSG_RSP(MAIN_THREAD_LIGHT, LIGHT_GETAGC): {
+                    uint32_t reads, stale, saturated;
+                    memcpy(&reads, rx.data+2, 4);
+                    memcpy(&stale, rx.data+6, 4);
+                    memcpy(&saturated, rx.data+10, 4);
+                    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Light integration %d gain %dx: %u reads, %u stale, %u saturated", 
+                            rx.data[0], rx.data[1], reads, stale, saturated);
+                    logmsg_send(&ltx, MAIN_THREAD_LOG);
+                    break;
+                }
+                case MSG_RSP(MAIN_THREAD_TEMP, TEMP_GETADAPT):
+                case MSG_RSP(MAIN_THREAD_LIGHT, LIGHT_GETADAPT): {
+                    uint32_t period_us, samples, saved;
+                    memcpy(&period_us, rx.data, 4);
+                    memcpy(&samples, rx.data+4, 4);
+                    memcpy(&saved, rx.data+8, 4);
+                    LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "%s sampling every %u us, %u samples taken, %u saved", 
+                            log_task_strings[rx.from & MSG_FROM_MASK], period_us, samples, saved);
+                    logmsg_send(&ltx, MAIN_THREAD_LOG);
+                    break;
+                }
+                case MSG_RSP(MAIN_THREAD_TEMP, TEMP_GETSTATS):
+                case MSG_RSP(MAIN_THREAD_LIGHT, LIGHT_GETSTATS): {
+                    /* Temperature comes in milli-degrees, lux in hundredths */
+                    float scale = (rx.from & MSG_FROM_MASK) == MAIN_THREAD_TEMP ? 1000.0 : LIGHT_HIST_SCALE;
+                    if (rx.data[0] & HIST_EMPTY) {
+                        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "%s has no readings in window %d", 
+                                log_task_strings[rx.from & MSG_FROM_MASK], rx.data[0] & ~HIST_EMPTY);
+                    } else {
+                        LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "%s window %d: min %.2f max %.2f mean %.2f std %.2f", 
+                                log_task_strings[rx.from & MSG_FROM_MASK], rx.data[0],
+                                msg_get24(rx.data+1) / scale, msg_get24(rx.data+4) / scale,
+                                msg_get24(rx.data+7) / scale, msg_get24(rx.data+10) / scale);
+                    }
+                    logmsg_send(&ltx, MAIN_THREAD_LOG);
+                    break;
+                }
                 case MSG_RSP(MAIN_THREAD_TEMP, TEMP_READREG):
                     LOG_FMT(MAIN_THREAD_MAIN, LOG_LEVEL_INFO, ltx, "Register value is %d", rx.data[1] << 8 | rx.data[0]);
                     logmsg_send(&ltx, MAIN_THREAD_LOG);
@@ -398,14 +902,14 @@ int main(int argc, char **argv) {
                     logmsg_send(&ltx, MAIN_THREAD_LOG);
                     break;
                 case MSG_RSP(MAIN_THREAD_TEMP, TEMP_ALIVE):
-                    main_alive[MAIN_THREAD_TEMP] = rx.data[0];    
-                    break;
                 case MSG_RSP(MAIN_THREAD_LIGHT, LIGHT_ALIVE):
-                    main_alive[MAIN_THREAD_LIGHT] = rx.data[0];    
-                    break;
-                case MSG_RSP(MAIN_THREAD_LOG, LOG_ALIVE):
-                    main_alive[MAIN_THREAD_LOG] = rx.data[0];    
+                case MSG_RSP(MAIN_THREAD_LOG, LOG_ALIVE): {
+                    /* Stamps wrap, the difference doesn't */
+                    uint32_t sent;
+                    memcpy(&sent, rx.data+1, 4);
+                    metrics_observe(METRIC_HEARTBEAT_RTT_US, rx.from & MSG_FROM_MASK, prof_stamp() - sent);
                     break;
+                }
                 default:
 					break;
 			}
@@ -415,11 +919,23 @@ int main(int argc, char **argv) {
                 case MAIN_EXIT:
                     main_exit(&rx);
                     break;
+                case MAIN_TEMPALERT:
+                    main_tempalert(&rx);
+                    break;
+                case MAIN_STATS:
+                    main_stats(&rx);
+                    break;
+                case MAIN_TRACE:
+                    main_trace(&rx);
+                    break;
                 default:
                     break;
             }
         }
-        
+        span_end(SPAN_DISPATCH, MAIN_THREAD_MAIN, rx.from & MSG_RSP_MASK ? SPAN_RSP | rx.cmd : rx.cmd, span_t);
+        TRACE4(dispatch__end, MAIN_THREAD_MAIN, rx.cmd, MSG_SIZE, rx.from);
+        prof_end(&main_prof, rx.from, rx.cmd, start);
+        msg_progress(MAIN_THREAD_MAIN);
     }
 
     pthread_join(main_tasks[MAIN_THREAD_TEMP], NULL);
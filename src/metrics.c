@@ -0,0 +1,390 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file metrics.c
+ * @brief In-process metrics served over loopback HTTP
+ *
+ * Shards are handed out round robin, so the short lived timer threads just
+ * cycle through them. Two threads can end up on the same shard, which is why
+ * updates are still atomic adds; they are relaxed and the line is almost
+ * never contended, so they cost about as much as a plain add.
+ *
+ * @author Ben Heberlein
+ * @date Nov 12 2017
+ * @version 1.0
+ *
+ */
+
+#include "metrics.h"
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+ * @brief Metric types
+ */
+#define METRICS_COUNTER     0
+#define METRICS_GAUGE       1
+#define METRICS_HISTOGRAM   2
+
+/**
+ * @brief Slots of a series, a counter only uses the first. Histogram buckets
+ * are kept apart and summed up to the cumulative form when rendered.
+ */
+#define METRICS_INF         METRICS_BUCKETS
+#define METRICS_SUM         (METRICS_BUCKETS + 1)
+#define METRICS_SLOTS       (METRICS_BUCKETS + 2)
+
+/**
+ * @brief Registry entry, series with a NULL label are never written
+ */
+typedef struct metrics_desc_s {
+    const char *name;
+    const char *help;
+    uint8_t type;
+    const char *label;
+    const char *labels[METRICS_LABELS];
+    const uint32_t *bounds;
+} metrics_desc_t;
+
+/**
+ * @brief One copy of every counter and histogram
+ */
+typedef struct metrics_shard_s {
+    uint64_t v[METRICS_NUM][METRICS_LABELS][METRICS_SLOTS];
+} __attribute__((aligned(64))) metrics_shard_t;
+
+/**
+ * @brief Histogram bounds in microseconds
+ */
+static const uint32_t metrics_i2c_us[METRICS_BUCKETS] =
+    {50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000};
+static const uint32_t metrics_late_us[METRICS_BUCKETS] =
+    {10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000};
+static const uint32_t metrics_rtt_us[METRICS_BUCKETS] =
+    {100, 500, 1000, 5000, 10000, 50000, 100000, 250000, 500000, 1000000};
+
+/**
+ * @brief Private variables
+ */
+static const metrics_desc_t metrics_desc[METRICS_NUM] = {
+    [METRIC_MSG_SENT] = {"project1_msg_sent_total", "Messages sent to each queue", METRICS_COUNTER,
+                         "queue", {"main", "light", "temp", "log", "ctl"}, NULL},
+    [METRIC_MSG_RECV] = {"project1_msg_received_total", "Messages taken off each queue", METRICS_COUNTER,
+                         "queue", {"main", "light", "temp", "log", "ctl"}, NULL},
+    [METRIC_MSG_DROPS] = {"project1_msg_dropped_total", "Sends to each queue that failed", METRICS_COUNTER,
+                          "queue", {"main", "light", "temp", "log", "ctl"}, NULL},
+    [METRIC_QUEUE_DEPTH] = {"project1_queue_depth", "Messages waiting in each queue", METRICS_GAUGE,
+                            "queue", {"main", "light", "temp", "log", "ctl"}, NULL},
+    [METRIC_I2C_US] = {"project1_i2c_seconds", "Time spent in each I2C transaction", METRICS_HISTOGRAM,
+                       "task", {NULL, "light", "temp"}, metrics_i2c_us},
+    [METRIC_LOG_LINES] = {"project1_log_lines_total", "Lines written to the log file", METRICS_COUNTER,
+                          "level", {"debug", "info", "warn", "error"}, NULL},
+    [METRIC_TIMER_LATE_US] = {"project1_timer_late_seconds", "How long after its deadline each timer ran", METRICS_HISTOGRAM,
+                              "task", {"main", "light", "temp"}, metrics_late_us},
+    [METRIC_HEARTBEAT_RTT_US] = {"project1_heartbeat_rtt_seconds", "Time from a heartbeat check to each task's answer", METRICS_HISTOGRAM,
+                                 "task", {NULL, "light", "temp", "log"}, metrics_rtt_us},
+    [METRIC_RESTARTS] = {"project1_restarts_total", "Tasks restarted after a missed heartbeat", METRICS_COUNTER,
+                         "task", {NULL, "light", "temp", "log"}, NULL},
+};
+static metrics_shard_t metrics_shards[METRICS_SHARDS];
+static int64_t metrics_gauges[METRICS_NUM][METRICS_LABELS];
+static uint32_t metrics_next;
+static __thread metrics_shard_t *metrics_mine;
+static metrics_collect_fn metrics_collect;
+static pthread_t metrics_thread;
+static int metrics_fd = -1;
+static int metrics_client = -1;
+static uint16_t metrics_bound;
+static char metrics_text[METRICS_TEXT_MAX];
+
+/**
+ * @brief Private functions
+ */
+static metrics_shard_t *__metrics_shard(void) {
+
+    if (metrics_mine == NULL) {
+        uint32_t s = __atomic_fetch_add(&metrics_next, 1, __ATOMIC_RELAXED);
+        metrics_mine = &metrics_shards[s % METRICS_SHARDS];
+    }
+
+    return metrics_mine;
+}
+
+static uint64_t __metrics_sum(uint8_t m, uint8_t l, uint8_t slot) {
+    uint64_t v = 0;
+
+    for (int s = 0; s < METRICS_SHARDS; s++) {
+        v += __atomic_load_n(&metrics_shards[s].v[m][l][slot], __ATOMIC_RELAXED);
+    }
+
+    return v;
+}
+
+static size_t __metrics_printf(char *buf, size_t len, size_t n, const char *fmt, ...) {
+    va_list ap;
+
+    if (n >= len) {
+        return len;
+    }
+    va_start(ap, fmt);
+    int w = vsnprintf(buf + n, len - n, fmt, ap);
+    va_end(ap);
+
+    return w < 0 || n + w >= len ? len : n + w;
+}
+
+static void __metrics_reply(int fd, const char *status, const char *body, size_t len) {
+    char head[160];
+
+    int n = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, len);
+    if (write(fd, head, n) != n) {
+        return;
+    }
+    while (len > 0) {
+        ssize_t w = write(fd, body, len);
+        if (w <= 0) {
+            return;
+        }
+        body += w;
+        len -= w;
+    }
+}
+
+static void __metrics_serve(int fd) {
+    char req[METRICS_REQ_MAX];
+    size_t n = 0;
+
+    /* Only the request line matters, but read the headers so the client
+     * doesn't see a reset */
+    req[0] = 0;
+    while (n < sizeof(req) - 1 && strstr(req, "\r\n\r\n") == NULL && strstr(req, "\n\n") == NULL) {
+        ssize_t r = read(fd, req + n, sizeof(req) - 1 - n);
+        if (r <= 0) {
+            break;
+        }
+        n += r;
+        req[n] = 0;
+    }
+
+    if (strncmp(req, "GET ", 4) != 0) {
+        __metrics_reply(fd, "405 Method Not Allowed", "", 0);
+    } else if (strncmp(req + 4, "/metrics", 8) != 0 || strchr(" ?", req[12]) == NULL) {
+        __metrics_reply(fd, "404 Not Found", "", 0);
+    } else {
+        if (metrics_collect != NULL) {
+            metrics_collect();
+        }
+        size_t len = metrics_render(metrics_text, sizeof(metrics_text));
+        __metrics_reply(fd, "200 OK", metrics_text, len);
+    }
+}
+
+static void *__metrics_run(void *arg) {
+    struct timeval tv = {METRICS_IO_MS / 1000, (METRICS_IO_MS % 1000) * 1000};
+
+    while (1) {
+        int fd = accept(metrics_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        /* A client that stalls can't hold up the next scrape for long */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        __atomic_store_n(&metrics_client, fd, __ATOMIC_RELEASE);
+        __metrics_serve(fd);
+        __atomic_store_n(&metrics_client, -1, __ATOMIC_RELEASE);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Public functions
+ */
+void metrics_add(uint8_t m, uint8_t l, uint64_t v) {
+
+    if (m >= METRICS_NUM || l >= METRICS_LABELS) {
+        return;
+    }
+
+    __atomic_fetch_add(&__metrics_shard()->v[m][l][0], v, __ATOMIC_RELAXED);
+}
+
+void metrics_inc(uint8_t m, uint8_t l) {
+    metrics_add(m, l, 1);
+}
+
+void metrics_set(uint8_t m, uint8_t l, int64_t v) {
+
+    if (m >= METRICS_NUM || l >= METRICS_LABELS) {
+        return;
+    }
+
+    __atomic_store_n(&metrics_gauges[m][l], v, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(uint8_t m, uint8_t l, uint64_t v) {
+
+    if (m >= METRICS_NUM || l >= METRICS_LABELS || metrics_desc[m].bounds == NULL) {
+        return;
+    }
+
+    int b = 0;
+    while (b < METRICS_BUCKETS && v > metrics_desc[m].bounds[b]) {
+        b++;
+    }
+
+    uint64_t *slots = __metrics_shard()->v[m][l];
+    __atomic_fetch_add(&slots[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slots[METRICS_SUM], v, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_get(uint8_t m, uint8_t l) {
+
+    if (m >= METRICS_NUM || l >= METRICS_LABELS) {
+        return 0;
+    }
+
+    if (metrics_desc[m].type == METRICS_GAUGE) {
+        return __atomic_load_n(&metrics_gauges[m][l], __ATOMIC_RELAXED);
+    }
+    if (metrics_desc[m].type == METRICS_COUNTER) {
+        return __metrics_sum(m, l, 0);
+    }
+
+    uint64_t count = 0;
+    for (int b = 0; b <= METRICS_INF; b++) {
+        count += __metrics_sum(m, l, b);
+    }
+    return count;
+}
+
+uint64_t metrics_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000u + now.tv_nsec / 1000;
+}
+
+size_t metrics_render(char *buf, size_t len) {
+    size_t n = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    buf[0] = 0;
+
+    for (int m = 0; m < METRICS_NUM; m++) {
+        const metrics_desc_t *d = &metrics_desc[m];
+        static const char *types[] = {"counter", "gauge", "histogram"};
+
+        n = __metrics_printf(buf, len, n, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name, types[d->type]);
+
+        for (int l = 0; l < METRICS_LABELS; l++) {
+            if (d->labels[l] == NULL) {
+                continue;
+            }
+
+            if (d->type == METRICS_GAUGE) {
+                n = __metrics_printf(buf, len, n, "%s{%s=\"%s\"} %lld\n", d->name, d->label, d->labels[l],
+                                     (long long) __atomic_load_n(&metrics_gauges[m][l], __ATOMIC_RELAXED));
+                continue;
+            }
+            if (d->type == METRICS_COUNTER) {
+                n = __metrics_printf(buf, len, n, "%s{%s=\"%s\"} %llu\n", d->name, d->label, d->labels[l],
+                                     (unsigned long long) __metrics_sum(m, l, 0));
+                continue;
+            }
+
+            /* Buckets are cumulative and in seconds on the way out */
+            uint64_t count = 0;
+            for (int b = 0; b <= METRICS_INF; b++) {
+                count += __metrics_sum(m, l, b);
+                if (b < METRICS_BUCKETS) {
+                    n = __metrics_printf(buf, len, n, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", d->name, d->label,
+                                         d->labels[l], d->bounds[b] / 1e6, (unsigned long long) count);
+                } else {
+                    n = __metrics_printf(buf, len, n, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", d->name, d->label,
+                                         d->labels[l], (unsigned long long) count);
+                }
+            }
+            n = __metrics_printf(buf, len, n, "%s_sum{%s=\"%s\"} %.6f\n%s_count{%s=\"%s\"} %llu\n",
+                                 d->name, d->label, d->labels[l], __metrics_sum(m, l, METRICS_SUM) / 1e6,
+                                 d->name, d->label, d->labels[l], (unsigned long long) count);
+        }
+    }
+
+    return n < len ? n : len - 1;
+}
+
+uint8_t metrics_init(uint16_t port, metrics_collect_fn fn) {
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    int on = 1;
+
+    if (metrics_fd >= 0) {
+        return METRICS_ERR_PARAM;
+    }
+    metrics_collect = fn;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_fd < 0 || setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+        bind(metrics_fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(metrics_fd, 4) ||
+        getsockname(metrics_fd, (struct sockaddr *) &addr, &alen) ||
+        pthread_create(&metrics_thread, NULL, __metrics_run, NULL)) {
+        metrics_close();
+        return METRICS_ERR_INIT;
+    }
+    metrics_bound = ntohs(addr.sin_port);
+
+    return METRICS_SUCCESS;
+}
+
+uint16_t metrics_port(void) {
+    return metrics_bound;
+}
+
+void metrics_close(void) {
+
+    if (metrics_thread) {
+        pthread_cancel(metrics_thread);
+        pthread_join(metrics_thread, NULL);
+        metrics_thread = 0;
+    }
+
+    /* Cancelled in the middle of a scrape */
+    if (metrics_client >= 0) {
+        close(metrics_client);
+        metrics_client = -1;
+    }
+    if (metrics_fd >= 0) {
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+    metrics_bound = 0;
+}
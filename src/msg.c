@@ -23,38 +23,130 @@
 
 #include "msg.h"
 #include "main.h"
+#include "metrics.h"
+#include "prof.h"
+#include "trace.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <mqueue.h>
+#include <time.h>
+
+/**
+ * @brief Messages each task has finished handling
+ */
+static uint32_t msg_done[MSG_QUEUE_NUM];
+
+/**
+ * @brief A send deadline that has already passed, so a full queue fails
+ * at once instead of blocking
+ */
+static const struct timespec msg_past = {0, 0};
 
 uint8_t logmsg_send(logmsg_t *tx, uint8_t to) {
     
-    mq_send(msg_queues[to], (char *) tx, MSG_LOGSIZE, 0);
+    tx->ts = prof_stamp();
+    if (mq_send(msg_queues[to], (char *) tx, MSG_LOGSIZE, 0) == -1) {
+        TRACE4(msg__drop, to, tx->cmd, MSG_LOGSIZE, tx->from);
+        metrics_inc(METRIC_MSG_DROPS, to);
+    } else {
+        TRACE4(msg__send, to, tx->cmd, MSG_LOGSIZE, tx->from);
+        metrics_inc(METRIC_MSG_SENT, to);
+    }
     
     return MSG_SUCCESS;
 }
 
 uint8_t msg_send(msg_t *tx, uint8_t to) {
 
-    mq_send(msg_queues[to], (char *) tx, MSG_SIZE, 0); 
+    tx->ts = prof_stamp();
+    if (mq_send(msg_queues[to], (char *) tx, MSG_SIZE, 0) == -1) {
+        TRACE4(msg__drop, to, tx->cmd, MSG_SIZE, tx->from);
+        metrics_inc(METRIC_MSG_DROPS, to);
+    } else {
+        TRACE4(msg__send, to, tx->cmd, MSG_SIZE, tx->from);
+        metrics_inc(METRIC_MSG_SENT, to);
+    }
+
+    return MSG_SUCCESS;
+}
+
+uint8_t logmsg_trysend(logmsg_t *tx, uint8_t to) {
+
+    tx->ts = prof_stamp();
+    if (mq_timedsend(msg_queues[to], (char *) tx, MSG_LOGSIZE, 0, &msg_past) == -1) {
+        TRACE4(msg__drop, to, tx->cmd, MSG_LOGSIZE, tx->from);
+        metrics_inc(METRIC_MSG_DROPS, to);
+        return MSG_ERR_FULL;
+    }
+    TRACE4(msg__send, to, tx->cmd, MSG_LOGSIZE, tx->from);
+    metrics_inc(METRIC_MSG_SENT, to);
+
+    return MSG_SUCCESS;
+}
+
+uint8_t msg_trysend(msg_t *tx, uint8_t to) {
+
+    tx->ts = prof_stamp();
+    if (mq_timedsend(msg_queues[to], (char *) tx, MSG_SIZE, 0, &msg_past) == -1) {
+        TRACE4(msg__drop, to, tx->cmd, MSG_SIZE, tx->from);
+        metrics_inc(METRIC_MSG_DROPS, to);
+        return MSG_ERR_FULL;
+    }
+    TRACE4(msg__send, to, tx->cmd, MSG_SIZE, tx->from);
+    metrics_inc(METRIC_MSG_SENT, to);
+
+    return MSG_SUCCESS;
+}
+
+uint8_t msg_stats(uint8_t q, long *depth, uint32_t *drops) {
+    struct mq_attr attr;
+
+    if (q >= MSG_QUEUE_NUM) {
+        return MSG_ERR_UNKNOWN;
+    }
+
+    *depth = mq_getattr(msg_queues[q], &attr) == 0 ? attr.mq_curmsgs : -1;
+    *drops = metrics_get(METRIC_MSG_DROPS, q);
 
     return MSG_SUCCESS;
 }
 
-uint8_t msg_init(void) {
+void msg_progress(uint8_t q) {
+    __atomic_fetch_add(&msg_done[q], 1, __ATOMIC_RELAXED);
+}
+
+uint32_t msg_progress_get(uint8_t q) {
+    return q < MSG_QUEUE_NUM ? __atomic_load_n(&msg_done[q], __ATOMIC_RELAXED) : 0;
+}
+
+void msg_put24(uint8_t *p, int32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+}
+
+int32_t msg_get24(const uint8_t *p) {
+    int32_t v = p[0] | p[1] << 8 | p[2] << 16;
+
+    /* Sign extend from bit 23 */
+    return (v ^ 0x800000) - 0x800000;
+}
+
+uint8_t msg_init(uint32_t depth) {
 
     /* Set attributes */
-    for (int i = 0; i < MAIN_THREAD_TOTAL; i++) {
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {
         msg_attrs[i].mq_flags = 0;
-        msg_attrs[i].mq_maxmsg = MSG_MAXMSGS;
+        msg_attrs[i].mq_maxmsg = depth;
         msg_attrs[i].mq_msgsize = MSG_SIZE;
         msg_attrs[i].mq_curmsgs = 0;
     }
     msg_attrs[MAIN_THREAD_LOG].mq_msgsize = MSG_LOGSIZE;
 
     /* Open queues */
-    for (int i = 0; i < MAIN_THREAD_TOTAL; i++) {       
+    for (int i = 0; i < MSG_QUEUE_NUM; i++) {       
+            mq_unlink(msg_names[i]);
             msg_queues[i] = mq_open(msg_names[i], O_WRONLY | O_CREAT, MSG_QUEUE_PERM, &msg_attrs[i]);
             if (msg_queues[i] == -1) {
                 perror("msg init");
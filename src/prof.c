@@ -0,0 +1,173 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file prof.c
+ * @brief Dispatch profiling for the task command loops
+ *
+ * @author Ben Heberlein
+ * @date Nov 13 2017
+ * @version 1.0
+ *
+ */
+
+#include "prof.h"
+#include "msg.h"
+#include "log.h"
+#include "main.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Private functions
+ */
+static uint64_t __prof_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+static void __prof_add(prof_ent_t *e, uint64_t ns) {
+    uint8_t b = 0;
+
+    if (ns >= PROF_BOUND_NS(0)) {
+        b = 64 - __builtin_clzll(ns >> 10);
+        if (b >= PROF_BUCKETS) {
+            b = PROF_BUCKETS - 1;
+        }
+    }
+
+    e->count++;
+    e->total_ns += ns;
+    if (ns > e->max_ns) {
+        e->max_ns = ns > UINT32_MAX ? UINT32_MAX : ns;
+    }
+    e->hist[b]++;
+}
+
+static void __prof_line(const prof_ent_t *e, const char *what, int id, uint8_t from, prof_out_fn fn) {
+    char line[128];
+    int n;
+
+    if (id < 0) {
+        n = snprintf(line, sizeof(line), "%s: %u messages", what, e->count);
+    } else {
+        n = snprintf(line, sizeof(line), "%s %d: %u calls", what, id, e->count);
+    }
+
+    uint8_t b = prof_pct(e, 99);
+    snprintf(line + n, sizeof(line) - n, ", %.1f us mean, %.1f us max, 99%% %s %llu us",
+             e->total_ns / 1000.0 / e->count, e->max_ns / 1000.0,
+             b == PROF_BUCKETS - 1 ? "over" : "under",
+             (unsigned long long) PROF_BOUND_NS(b == PROF_BUCKETS - 1 ? b - 1 : b) / 1000);
+
+    if (fn != NULL) {
+        fn(from, line);
+    } else {
+        logmsg_t ltx;
+        LOG_FMT(from, LOG_LEVEL_INFO, ltx, "%s", line);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+    }
+}
+
+/**
+ * @brief Public functions
+ */
+void prof_init(prof_t *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+uint32_t prof_stamp(void) {
+    return __prof_now_ns() / 1000;
+}
+
+uint64_t prof_begin(prof_t *p, uint32_t stamp) {
+    uint64_t now = __prof_now_ns();
+
+    /* Stamps wrap every 71 minutes, a difference doesn't */
+    __prof_add(&p->wait, (uint64_t) (uint32_t) (now / 1000 - stamp) * 1000);
+
+    return now;
+}
+
+void prof_end(prof_t *p, uint8_t from, uint8_t cmd, uint64_t start) {
+    uint64_t ns = __prof_now_ns() - start;
+
+    if (cmd >= PROF_CMDS) {
+        cmd = PROF_CMDS - 1;
+    }
+    __prof_add(from & MSG_RSP_MASK ? &p->rsp[cmd] : &p->cmd[cmd], ns);
+}
+
+const prof_ent_t *prof_get(const prof_t *p, uint8_t id) {
+
+    if (id == PROF_WAIT) {
+        return &p->wait;
+    }
+    if ((id & ~PROF_RSP) >= PROF_CMDS) {
+        return NULL;
+    }
+
+    return id & PROF_RSP ? &p->rsp[id & ~PROF_RSP] : &p->cmd[id];
+}
+
+uint8_t prof_pct(const prof_ent_t *e, uint8_t pct) {
+    uint64_t want = ((uint64_t) e->count * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    for (uint8_t b = 0; b < PROF_BUCKETS; b++) {
+        seen += e->hist[b];
+        if (seen >= want && seen > 0) {
+            return b;
+        }
+    }
+
+    return 0;
+}
+
+void prof_pack(const prof_t *p, uint8_t id, uint8_t *data) {
+    const prof_ent_t *e = prof_get(p, id);
+    uint32_t count = 0, mean = 0, max = 0;
+    uint8_t b = 0;
+
+    if (e != NULL && e->count > 0) {
+        uint64_t m = e->total_ns / e->count;
+        count = e->count;
+        mean = m > UINT32_MAX ? UINT32_MAX : m;
+        max = e->max_ns;
+        b = prof_pct(e, 99);
+    }
+
+    data[0] = id;
+    memcpy(data+1, &count, 4);
+    memcpy(data+5, &mean, 4);
+    memcpy(data+9, &max, 4);
+    data[13] = b;
+}
+
+void prof_dump(const prof_t *p, uint8_t from, prof_out_fn fn) {
+
+    for (int i = 0; i < PROF_CMDS; i++) {
+        if (p->cmd[i].count) {
+            __prof_line(&p->cmd[i], "Dispatch command", i, from, fn);
+        }
+    }
+    for (int i = 0; i < PROF_CMDS; i++) {
+        if (p->rsp[i].count) {
+            __prof_line(&p->rsp[i], "Dispatch response", i, from, fn);
+        }
+    }
+    if (p->wait.count) {
+        __prof_line(&p->wait, "Queue wait", -1, from, fn);
+    }
+}
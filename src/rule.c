@@ -0,0 +1,565 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file rule.c
+ * @brief Threshold rules compiled to bytecode
+ *
+ * Recursive descent compiler from the rule language to postfix bytecode, and
+ * the evaluator for it. See rule.h for the language.
+ *
+ * @author Ben Heberlein
+ * @date Nov 9 2017
+ * @version 1.0
+ *
+ */
+
+#include "rule.h"
+#include "main.h"
+#include "led.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+/**
+ * @brief Opcodes
+ */
+#define RULE_OP_GT  0
+#define RULE_OP_LT  1
+#define RULE_OP_GE  2
+#define RULE_OP_LE  3
+#define RULE_OP_EQ  4
+#define RULE_OP_NE  5
+#define RULE_OP_AND 6
+#define RULE_OP_OR  7
+#define RULE_OP_NOT 8
+
+/**
+ * @brief Compiler state for one line
+ */
+typedef struct rule_parse_s {
+    rule_set_t *rs;
+    const char *p;      /* Next character */
+    int line;
+    int depth;          /* Stack depth the code so far leaves */
+    uint32_t vars;      /* Variables read by the rule */
+    char *err;
+    size_t errlen;
+} rule_parse_t;
+
+/**
+ * @brief Private variables
+ */
+static const char *rule_srcs[RULE_SRCS] = {"temp", "lux"};
+static const char *rule_aggs[RULE_AGGS] = {"min", "max", "mean", "std"};
+static const char *rule_wins[RULE_WINS] = {"1s", "1m", "1h"};
+static const double rule_scale[RULE_SRCS] = {1000.0, 100.0};
+
+/**
+ * @brief Private functions
+ */
+static uint8_t __rule_fail(rule_parse_t *ps, const char *what) {
+    snprintf(ps->err, ps->errlen, "line %d: %s near '%.16s'", ps->line, what, ps->p);
+    return RULE_ERR_SYNTAX;
+}
+
+static void __rule_space(rule_parse_t *ps) {
+    while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\r') {
+        ps->p++;
+    }
+    if (*ps->p == '#') {
+        while (*ps->p && *ps->p != '\n') {
+            ps->p++;
+        }
+    }
+}
+
+/* Consume a fixed token, words have to end at a non word character */
+static int __rule_accept(rule_parse_t *ps, const char *tok) {
+    size_t n = strlen(tok);
+
+    __rule_space(ps);
+    if (strncmp(ps->p, tok, n)) {
+        return 0;
+    }
+    if (isalpha((unsigned char) tok[0]) && (isalnum((unsigned char) ps->p[n]) || ps->p[n] == '_')) {
+        return 0;
+    }
+
+    ps->p += n;
+    return 1;
+}
+
+static size_t __rule_word(rule_parse_t *ps, char *buf, size_t len) {
+    size_t n = 0;
+
+    __rule_space(ps);
+    while (isalnum((unsigned char) ps->p[n]) || ps->p[n] == '_' || ps->p[n] == '.') {
+        n++;
+    }
+    if (n == 0 || n >= len) {
+        return 0;
+    }
+
+    memcpy(buf, ps->p, n);
+    buf[n] = 0;
+    ps->p += n;
+    return n;
+}
+
+static int __rule_number(rule_parse_t *ps, double *v) {
+    char *end;
+
+    /* strtod would skip newlines and take inf or nan */
+    __rule_space(ps);
+    if (!isdigit((unsigned char) *ps->p) && *ps->p != '-' && *ps->p != '+' && *ps->p != '.') {
+        return 0;
+    }
+    *v = strtod(ps->p, &end);
+    if (end == ps->p) {
+        return 0;
+    }
+
+    ps->p = end;
+    return 1;
+}
+
+static int __rule_text(rule_set_t *rs, const char *s, size_t n, uint16_t *off) {
+
+    if (rs->ntext + n + 1 > RULE_TEXT_MAX) {
+        return 0;
+    }
+
+    *off = rs->ntext;
+    memcpy(rs->text + rs->ntext, s, n);
+    rs->text[rs->ntext + n] = 0;
+    rs->ntext += n + 1;
+    return 1;
+}
+
+static uint8_t __rule_emit(rule_parse_t *ps, uint8_t op, uint8_t var, int32_t k, int32_t h) {
+    rule_set_t *rs = ps->rs;
+
+    if (rs->ncode >= RULE_CODE_MAX) {
+        snprintf(ps->err, ps->errlen, "line %d: too much code", ps->line);
+        return RULE_ERR_FULL;
+    }
+
+    /* Comparisons push a result, and/or pop two and push one */
+    if (op <= RULE_OP_NE) {
+        if (++ps->depth > RULE_STACK) {
+            return __rule_fail(ps, "condition nested too deep");
+        }
+    } else if (op != RULE_OP_NOT) {
+        ps->depth--;
+    }
+
+    rule_insn_t *in = &rs->code[rs->ncode++];
+    in->op = op;
+    in->var = var;
+    in->on = 0;
+    in->k = k;
+    in->h = h;
+
+    return RULE_SUCCESS;
+}
+
+static int __rule_var(const char *name) {
+
+    for (int s = 0; s < RULE_SRCS; s++) {
+        size_t n = strlen(rule_srcs[s]);
+        if (strncmp(name, rule_srcs[s], n)) {
+            continue;
+        }
+        if (name[n] == 0) {
+            return s;
+        }
+        if (name[n] != '.') {
+            return -1;
+        }
+
+        for (int a = 0; a < RULE_AGGS; a++) {
+            size_t m = strlen(rule_aggs[a]);
+            if (strncmp(name + n + 1, rule_aggs[a], m) || name[n + 1 + m] != '.') {
+                continue;
+            }
+            for (int w = 0; w < RULE_WINS; w++) {
+                if (!strcmp(name + n + 2 + m, rule_wins[w])) {
+                    return RULE_VAR_AGG(s, a, w);
+                }
+            }
+        }
+        return -1;
+    }
+
+    return -1;
+}
+
+static uint8_t __rule_expr(rule_parse_t *ps);
+
+static uint8_t __rule_cmp(rule_parse_t *ps) {
+    char name[32];
+    uint8_t op;
+    double k, h = 0.0;
+
+    if (!__rule_word(ps, name, sizeof(name))) {
+        return __rule_fail(ps, "expected a value");
+    }
+    int var = __rule_var(name);
+    if (var < 0) {
+        return __rule_fail(ps, "unknown value");
+    }
+
+    if (__rule_accept(ps, ">=")) {
+        op = RULE_OP_GE;
+    } else if (__rule_accept(ps, "<=")) {
+        op = RULE_OP_LE;
+    } else if (__rule_accept(ps, "==")) {
+        op = RULE_OP_EQ;
+    } else if (__rule_accept(ps, "!=")) {
+        op = RULE_OP_NE;
+    } else if (__rule_accept(ps, ">")) {
+        op = RULE_OP_GT;
+    } else if (__rule_accept(ps, "<")) {
+        op = RULE_OP_LT;
+    } else {
+        return __rule_fail(ps, "expected a comparison");
+    }
+
+    if (!__rule_number(ps, &k)) {
+        return __rule_fail(ps, "expected a number");
+    }
+    if (__rule_accept(ps, "hyst")) {
+        if (op == RULE_OP_EQ || op == RULE_OP_NE) {
+            return __rule_fail(ps, "hysteresis needs <, <=, > or >=");
+        }
+        if (!__rule_number(ps, &h) || h < 0) {
+            return __rule_fail(ps, "expected a hysteresis");
+        }
+    }
+
+    /* Numbers go to the fixed point units of the value's source */
+    int src = var < RULE_SRCS ? var : (var - RULE_SRCS) / (RULE_AGGS * RULE_WINS);
+    double scale = rule_scale[src];
+    if (fabs(k * scale) > INT32_MAX || h * scale > INT32_MAX) {
+        return __rule_fail(ps, "number out of range");
+    }
+
+    ps->vars |= 1u << var;
+    return __rule_emit(ps, op, var, lround(k * scale), lround(h * scale));
+}
+
+static uint8_t __rule_factor(rule_parse_t *ps) {
+    uint8_t ret;
+
+    if (__rule_accept(ps, "not")) {
+        if ((ret = __rule_factor(ps)) != RULE_SUCCESS) {
+            return ret;
+        }
+        return __rule_emit(ps, RULE_OP_NOT, 0, 0, 0);
+    }
+
+    if (__rule_accept(ps, "(")) {
+        if ((ret = __rule_expr(ps)) != RULE_SUCCESS) {
+            return ret;
+        }
+        if (!__rule_accept(ps, ")")) {
+            return __rule_fail(ps, "expected )");
+        }
+        return RULE_SUCCESS;
+    }
+
+    return __rule_cmp(ps);
+}
+
+static uint8_t __rule_term(rule_parse_t *ps) {
+    uint8_t ret;
+
+    if ((ret = __rule_factor(ps)) != RULE_SUCCESS) {
+        return ret;
+    }
+    while (__rule_accept(ps, "and")) {
+        if ((ret = __rule_factor(ps)) != RULE_SUCCESS ||
+            (ret = __rule_emit(ps, RULE_OP_AND, 0, 0, 0)) != RULE_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return RULE_SUCCESS;
+}
+
+static uint8_t __rule_expr(rule_parse_t *ps) {
+    uint8_t ret;
+
+    if ((ret = __rule_term(ps)) != RULE_SUCCESS) {
+        return ret;
+    }
+    while (__rule_accept(ps, "or")) {
+        if ((ret = __rule_term(ps)) != RULE_SUCCESS ||
+            (ret = __rule_emit(ps, RULE_OP_OR, 0, 0, 0)) != RULE_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return RULE_SUCCESS;
+}
+
+static uint8_t __rule_action(rule_parse_t *ps) {
+    rule_set_t *rs = ps->rs;
+    double v;
+
+    if (rs->nact >= RULE_ACT_MAX) {
+        snprintf(ps->err, ps->errlen, "line %d: too many actions", ps->line);
+        return RULE_ERR_FULL;
+    }
+    rule_action_t *a = &rs->acts[rs->nact];
+    memset(a, 0, sizeof(*a));
+
+    if (__rule_accept(ps, "led")) {
+        if (!__rule_number(ps, &v) || v < 0 || v >= LED_TOTAL || v != (int) v) {
+            return __rule_fail(ps, "expected an LED number");
+        }
+        a->type = RULE_ACT_LED;
+        a->arg = v;
+
+    } else if (__rule_accept(ps, "log")) {
+        __rule_space(ps);
+        const char *end = *ps->p == '"' ? strchr(ps->p + 1, '"') : NULL;
+        const char *nl = strchr(ps->p, '\n');
+        if (end == NULL || (nl != NULL && nl < end)) {
+            return __rule_fail(ps, "expected a quoted message");
+        }
+        if (end - ps->p - 1 > MSG_LOGDATASIZE - 2) {
+            return __rule_fail(ps, "message too long");
+        }
+        if (!__rule_text(rs, ps->p + 1, end - ps->p - 1, &a->text)) {
+            snprintf(ps->err, ps->errlen, "line %d: too much text", ps->line);
+            return RULE_ERR_FULL;
+        }
+        ps->p = end + 1;
+        a->type = RULE_ACT_LOG;
+
+    } else if (__rule_accept(ps, "cmd")) {
+        if (__rule_accept(ps, "temp")) {
+            a->arg = MAIN_THREAD_TEMP;
+        } else if (__rule_accept(ps, "light")) {
+            a->arg = MAIN_THREAD_LIGHT;
+        } else {
+            return __rule_fail(ps, "expected temp or light");
+        }
+        if (!__rule_number(ps, &v) || v < 0 || v > 0x7f || v != (int) v) {
+            return __rule_fail(ps, "expected a command number");
+        }
+        a->cmd = v;
+
+        /* Optional data byte */
+        const char *save = ps->p;
+        if (__rule_number(ps, &v)) {
+            if (v < 0 || v > 0xff || v != (int) v) {
+                return __rule_fail(ps, "expected a data byte");
+            }
+            a->data = v;
+        } else {
+            ps->p = save;
+        }
+        a->type = RULE_ACT_CMD;
+
+    } else {
+        return __rule_fail(ps, "expected led, log or cmd");
+    }
+
+    rs->nact++;
+    return RULE_SUCCESS;
+}
+
+static uint8_t __rule_line(rule_parse_t *ps) {
+    rule_set_t *rs = ps->rs;
+    uint8_t ret;
+
+    __rule_space(ps);
+    if (*ps->p == '\n' || *ps->p == 0) {
+        return RULE_SUCCESS;
+    }
+
+    if (rs->nrules >= RULE_MAX) {
+        snprintf(ps->err, ps->errlen, "line %d: too many rules", ps->line);
+        return RULE_ERR_FULL;
+    }
+    rule_t *r = &rs->rules[rs->nrules];
+
+    /* Optional name */
+    char name[32];
+    const char *save = ps->p;
+    size_t n = __rule_word(ps, name, sizeof(name));
+    if (n == 0 || !__rule_accept(ps, ":")) {
+        ps->p = save;
+        n = snprintf(name, sizeof(name), "rule %d", rs->nrules + 1);
+    }
+    if (!__rule_text(rs, name, n, &r->name)) {
+        snprintf(ps->err, ps->errlen, "line %d: too much text", ps->line);
+        return RULE_ERR_FULL;
+    }
+
+    r->code = rs->ncode;
+    ps->depth = 0;
+    ps->vars = 0;
+    if ((ret = __rule_expr(ps)) != RULE_SUCCESS) {
+        return ret;
+    }
+    r->ncode = rs->ncode - r->code;
+    r->vars = ps->vars;
+
+    if (!__rule_accept(ps, "->")) {
+        return __rule_fail(ps, "expected ->");
+    }
+    r->act = rs->nact;
+    do {
+        if ((ret = __rule_action(ps)) != RULE_SUCCESS) {
+            return ret;
+        }
+    } while (__rule_accept(ps, ","));
+    r->nact = rs->nact - r->act;
+    r->active = 0;
+
+    __rule_space(ps);
+    if (*ps->p != '\n' && *ps->p != 0) {
+        return __rule_fail(ps, "unexpected text");
+    }
+
+    rs->used |= r->vars;
+    rs->nrules++;
+    return RULE_SUCCESS;
+}
+
+/**
+ * @brief Public functions
+ */
+uint8_t rule_compile(rule_set_t *rs, const char *src, char *err, size_t errlen) {
+
+    rs->nrules = rs->ncode = rs->nact = rs->ntext = 0;
+    rs->used = 0;
+
+    rule_parse_t ps = {rs, src, 1, 0, 0, err, errlen};
+    while (1) {
+        uint8_t ret = __rule_line(&ps);
+        if (ret != RULE_SUCCESS) {
+            rs->nrules = rs->ncode = rs->nact = rs->ntext = 0;
+            rs->used = 0;
+            return ret;
+        }
+
+        if (*ps.p == 0) {
+            break;
+        }
+        ps.p++;
+        ps.line++;
+    }
+
+    return RULE_SUCCESS;
+}
+
+uint8_t rule_load(rule_set_t *rs, const char *path, char *err, size_t errlen) {
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        snprintf(err, errlen, "can't open %s", path);
+        return RULE_ERR_FILE;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *src = malloc(len + 1);
+    if (src == NULL || fread(src, 1, len, f) != (size_t) len) {
+        free(src);
+        fclose(f);
+        snprintf(err, errlen, "can't read %s", path);
+        return RULE_ERR_FILE;
+    }
+    src[len] = 0;
+    fclose(f);
+
+    uint8_t ret = rule_compile(rs, src, err, errlen);
+    free(src);
+
+    return ret;
+}
+
+uint32_t rule_eval(rule_set_t *rs, const int32_t *vars, uint32_t valid, rule_act_fn act, void *ctx) {
+    uint8_t st[RULE_STACK];
+    uint32_t changed = 0;
+
+    for (int i = 0; i < rs->nrules; i++) {
+        rule_t *r = &rs->rules[i];
+        if (r->vars & ~valid) {
+            continue;
+        }
+
+        /* Hysteresis pulls each limit back while its own comparison holds,
+         * so a rule under not gets the same dead band */
+        int sp = 0;
+        rule_insn_t *in = &rs->code[r->code];
+        const rule_insn_t *end = in + r->ncode;
+        for (; in < end; in++) {
+            int32_t v = vars[in->var];
+            switch (in->op) {
+                case RULE_OP_GT:
+                    st[sp++] = in->on = v > in->k - in->on * in->h;
+                    break;
+                case RULE_OP_GE:
+                    st[sp++] = in->on = v >= in->k - in->on * in->h;
+                    break;
+                case RULE_OP_LT:
+                    st[sp++] = in->on = v < in->k + in->on * in->h;
+                    break;
+                case RULE_OP_LE:
+                    st[sp++] = in->on = v <= in->k + in->on * in->h;
+                    break;
+                case RULE_OP_EQ:
+                    st[sp++] = v == in->k;
+                    break;
+                case RULE_OP_NE:
+                    st[sp++] = v != in->k;
+                    break;
+                case RULE_OP_AND:
+                    sp--;
+                    st[sp - 1] &= st[sp];
+                    break;
+                case RULE_OP_OR:
+                    sp--;
+                    st[sp - 1] |= st[sp];
+                    break;
+                case RULE_OP_NOT:
+                    st[sp - 1] = !st[sp - 1];
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if (st[0] != r->active) {
+            r->active = st[0];
+            changed++;
+            for (int j = 0; j < r->nact; j++) {
+                act(rs, r, &rs->acts[r->act + j], r->active, ctx);
+            }
+        }
+    }
+
+    return changed;
+}
+
+const char *rule_text(const rule_set_t *rs, uint16_t off) {
+    return rs->text + off;
+}
@@ -0,0 +1,160 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file snap.c
+ * @brief Latest sensor readings published through seqlocks
+ *
+ * Each sensor task publishes its newest reading into a slot of a shared
+ * memory segment. A slot's sequence counter is odd while a write is in
+ * progress, so readers copy the slot and retry if the counter moved. Readers
+ * never block the sensor tasks and any process can map the segment read only
+ * to watch the sensors. If the segment cannot be created the slots live in
+ * process memory and only this process sees them.
+ *
+ * @author Ben Heberlein
+ * @date Nov 6 2017
+ * @version 1.0
+ *
+ */
+
+#include "snap.h"
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Private variables
+ */
+static snap_shm_t snap_local;
+static snap_shm_t *snap = &snap_local;
+static uint8_t snap_created;
+
+/**
+ * @brief Public functions
+ */
+uint8_t snap_init(void) {
+
+    int fd = shm_open(SNAP_NAME, O_CREAT | O_RDWR, 0644);
+    if (fd == -1) {
+        return SNAP_ERR_SHM;
+    }
+
+    if (ftruncate(fd, sizeof(snap_shm_t)) == -1) {
+        close(fd);
+        return SNAP_ERR_SHM;
+    }
+
+    void *p = mmap(NULL, sizeof(snap_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return SNAP_ERR_SHM;
+    }
+
+    /* Readers check the magic before trusting the layout */
+    snap_shm_t *s = p;
+    __atomic_store_n(&s->magic, 0, __ATOMIC_RELAXED);
+    memset(s->slot, 0, sizeof(s->slot));
+    s->size = sizeof(snap_shm_t);
+    __atomic_store_n(&s->magic, SNAP_MAGIC, __ATOMIC_RELEASE);
+
+    snap = s;
+    snap_created = 1;
+
+    return SNAP_SUCCESS;
+}
+
+void snap_close(void) {
+
+    /* Only the name goes, the mapping lasts until exit so a task that is
+     * still publishing is not left writing to unmapped memory */
+    if (snap_created) {
+        shm_unlink(SNAP_NAME);
+        snap_created = 0;
+    }
+}
+
+uint8_t snap_attach(void) {
+
+    int fd = shm_open(SNAP_NAME, O_RDONLY, 0);
+    if (fd == -1) {
+        return SNAP_ERR_SHM;
+    }
+
+    void *p = mmap(NULL, sizeof(snap_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return SNAP_ERR_SHM;
+    }
+
+    snap_shm_t *s = p;
+    if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != SNAP_MAGIC || s->size != sizeof(snap_shm_t)) {
+        munmap(p, sizeof(snap_shm_t));
+        return SNAP_ERR_SHM;
+    }
+
+    snap = s;
+
+    return SNAP_SUCCESS;
+}
+
+void snap_publish(uint8_t id, int32_t value, uint32_t raw, uint32_t ts_ms) {
+
+    if (id >= SNAP_TOTAL) {
+        return;
+    }
+    snap_slot_t *sl = &snap->slot[id];
+
+    /* Take the slot by making the counter odd, the alert and sample threads
+     * can both publish temperature */
+    uint32_t seq = __atomic_load_n(&sl->lock, __ATOMIC_RELAXED);
+    while ((seq & 1) || !__atomic_compare_exchange_n(&sl->lock, &seq, seq + 1, 1,
+                                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        seq = __atomic_load_n(&sl->lock, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&sl->val.value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&sl->val.raw, raw, __ATOMIC_RELAXED);
+    __atomic_store_n(&sl->val.ts_ms, ts_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&sl->val.seq, seq / 2 + 1, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&sl->lock, seq + 2, __ATOMIC_RELEASE);
+}
+
+uint8_t snap_read(uint8_t id, snap_val_t *out) {
+
+    if (id >= SNAP_TOTAL) {
+        return SNAP_ERR_PARAM;
+    }
+    snap_slot_t *sl = &snap->slot[id];
+
+    for (int i = 0; i < SNAP_TRIES; i++) {
+        uint32_t before = __atomic_load_n(&sl->lock, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+
+        out->value = __atomic_load_n(&sl->val.value, __ATOMIC_RELAXED);
+        out->raw = __atomic_load_n(&sl->val.raw, __ATOMIC_RELAXED);
+        out->ts_ms = __atomic_load_n(&sl->val.ts_ms, __ATOMIC_RELAXED);
+        out->seq = __atomic_load_n(&sl->val.seq, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sl->lock, __ATOMIC_RELAXED) == before) {
+            return before ? SNAP_SUCCESS : SNAP_ERR_EMPTY;
+        }
+    }
+
+    return SNAP_ERR_BUSY;
+}
@@ -0,0 +1,270 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file span.c
+ * @brief Span recorder with Chrome trace-event export
+ *
+ * @author Ben Heberlein
+ * @date Nov 15 2017
+ * @version 1.0
+ *
+ */
+
+#include "span.h"
+#include "main.h"
+#include "trace.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+/**
+ * @brief One recorded span, ready is set last so a dump skips spans that are
+ * still being written
+ */
+typedef struct span_ev_s {
+    uint64_t ts_ns;
+    uint32_t dur_ns;
+    uint32_t tid;
+    uint16_t arg;
+    uint8_t kind;
+    uint8_t task;
+    uint8_t ready;
+} span_ev_t;
+
+/**
+ * @brief Private data
+ */
+static uint8_t span_on;
+static span_ev_t *span_evs;
+static uint32_t span_alloc;
+static uint32_t span_cap;
+static uint32_t span_head;
+static uint32_t span_writers;
+static __thread uint32_t span_tid;
+
+static const char *span_kinds[SPAN_KINDS] = {
+    "dispatch", "timer", "i2c", "log", "rules",
+};
+
+static const char *span_tasks[MAIN_THREAD_TOTAL] = {
+    "main", "light", "temp", "log",
+};
+
+static const char *span_timers[] = {
+    "heartbeat", "check", "oneshot",
+};
+
+/**
+ * @brief Private functions
+ */
+static uint64_t __span_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+static const char *__span_task(uint8_t task) {
+    return task < MAIN_THREAD_TOTAL ? span_tasks[task] : "ctl";
+}
+
+static void __span_name(const span_ev_t *e, char *name, size_t len) {
+
+    switch (e->kind) {
+        case SPAN_DISPATCH:
+            snprintf(name, len, "%s %u", e->arg & SPAN_RSP ? "rsp" : "cmd", e->arg & 0xff);
+            break;
+        case SPAN_TIMER:
+            snprintf(name, len, "%s", e->arg <= TRACE_TIMER_ONESHOT ? span_timers[e->arg] : "timer");
+            break;
+        case SPAN_I2C:
+            snprintf(name, len, "i2c 0x%02x", e->arg);
+            break;
+        default:
+            snprintf(name, len, "%s", span_kinds[e->kind]);
+            break;
+    }
+}
+
+/**
+ * @brief Public functions
+ */
+uint64_t span_begin(void) {
+
+    if (!__atomic_load_n(&span_on, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    return __span_now_ns();
+}
+
+void span_end(uint8_t kind, uint8_t task, uint16_t arg, uint64_t t) {
+
+    if (t == 0 || kind >= SPAN_KINDS) {
+        return;
+    }
+
+    /* Counted before span_on is checked, span_start waits for the count to
+     * drain before it frees or clears the buffer */
+    __atomic_fetch_add(&span_writers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&span_on, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_sub(&span_writers, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    /* Slots are handed out once, a full buffer only counts what it drops */
+    uint32_t i = __atomic_fetch_add(&span_head, 1, __ATOMIC_RELAXED);
+    if (i >= span_cap) {
+        __atomic_fetch_sub(&span_writers, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (span_tid == 0) {
+        span_tid = syscall(SYS_gettid);
+    }
+
+    span_ev_t *e = &span_evs[i];
+    uint64_t dur = __span_now_ns() - t;
+    e->ts_ns = t;
+    e->dur_ns = dur > UINT32_MAX ? UINT32_MAX : dur;
+    e->tid = span_tid;
+    e->arg = arg;
+    e->kind = kind;
+    e->task = task;
+    __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&span_writers, 1, __ATOMIC_RELEASE);
+}
+
+uint8_t span_start(uint32_t events) {
+
+    if (events == 0) {
+        events = SPAN_EVENTS;
+    }
+    if (events > SPAN_EVENTS_MAX) {
+        return SPAN_ERR_PARAM;
+    }
+
+    span_stop();
+
+    /* Writers that saw the old recording still running finish in the old
+     * buffer, later ones see span_on cleared */
+    while (__atomic_load_n(&span_writers, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+
+    /* The buffer only grows, a shorter burst uses the front of it */
+    if (events > span_alloc) {
+        span_ev_t *evs = calloc(events, sizeof(span_ev_t));
+        if (evs == NULL) {
+            return SPAN_ERR_MEM;
+        }
+        free(span_evs);
+        span_evs = evs;
+        span_alloc = events;
+    } else {
+        memset(span_evs, 0, span_alloc * sizeof(span_ev_t));
+    }
+
+    span_cap = events;
+    __atomic_store_n(&span_head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&span_on, 1, __ATOMIC_RELEASE);
+
+    return SPAN_SUCCESS;
+}
+
+void span_stop(void) {
+    __atomic_store_n(&span_on, 0, __ATOMIC_SEQ_CST);
+}
+
+uint8_t span_recording(void) {
+    return __atomic_load_n(&span_on, __ATOMIC_RELAXED);
+}
+
+void span_stats(uint32_t *kept, uint32_t *dropped) {
+    uint32_t head = __atomic_load_n(&span_head, __ATOMIC_RELAXED);
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < span_cap; i++) {
+        n += __atomic_load_n(&span_evs[i].ready, __ATOMIC_ACQUIRE);
+    }
+
+    *kept = n;
+    *dropped = head > span_cap ? head - span_cap : 0;
+}
+
+uint8_t span_dump(const char *path) {
+    struct { uint32_t tid; uint8_t task; uint8_t loop; } tids[64];
+    uint8_t ntids = 0;
+    char name[32];
+    uint32_t kept, dropped;
+    int pid = getpid();
+
+    if (path == NULL) {
+        return SPAN_ERR_PARAM;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return SPAN_ERR_FILE;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+               "\"args\":{\"name\":\"project1\"}}", pid, pid);
+
+    for (uint32_t i = 0; i < span_cap; i++) {
+        const span_ev_t *e = &span_evs[i];
+        if (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        /* Threads that dispatch or run rules are long lived, the rest are
+         * timer callbacks, each on a thread of its own */
+        uint8_t t;
+        for (t = 0; t < ntids && tids[t].tid != e->tid; t++);
+        if (t == ntids && ntids < sizeof(tids) / sizeof(tids[0])) {
+            tids[t].tid = e->tid;
+            tids[t].task = e->task;
+            tids[t].loop = 0;
+            ntids++;
+        }
+        if (t < ntids && (e->kind == SPAN_DISPATCH || e->kind == SPAN_RULES)) {
+            tids[t].loop = 1;
+        }
+
+        __span_name(e, name, sizeof(name));
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"pid\":%d,\"tid\":%u,\"args\":{\"task\":\"%s\",\"arg\":%u}}",
+                name, span_kinds[e->kind], e->ts_ns / 1000.0, e->dur_ns / 1000.0,
+                pid, e->tid, __span_task(e->task), e->arg);
+    }
+
+    for (uint8_t t = 0; t < ntids; t++) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                   "\"args\":{\"name\":\"%s%s\"}}", pid, tids[t].tid, __span_task(tids[t].task),
+                   tids[t].loop ? "" : " timer");
+    }
+
+    span_stats(&kept, &dropped);
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"kept\":%u,\"dropped\":%u}}\n",
+            kept, dropped);
+
+    if (fclose(f) != 0) {
+        return SPAN_ERR_FILE;
+    }
+
+    return SPAN_SUCCESS;
+}
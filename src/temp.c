@@ -27,25 +27,49 @@
 #include "msg.h"
 #include "log.h"
 #include "main.h"
+#include "adapt.h"
+#include "hist.h"
+#include "snap.h"
+#include "bus.h"
+#include "metrics.h"
+#include "prof.h"
+#include "trace.h"
+#include "span.h"
+#include "clk.h"
 #include <mraa.h>
 #include <stdint.h>
 #include <byteswap.h>
 #include <mqueue.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <sched.h>
 
 /**
  * @brief Private variables
  */
-static mraa_i2c_context i2c;
-static float temperature_c = 123.456;
+static temp_state_t temp_own;
+static temp_state_t *temp_st = &temp_own;
+static uint64_t sample_start_ns;
+static uint32_t bus_xfers;
+static uint32_t readings;
+static uint64_t latency_ns;
+static uint64_t check_due_us, oneshot_due_us;
+static clk_timer_t temp_check_tmr, temp_oneshot_tmr;
 
 /**
  * @brief Private functions
  */ 
 uint16_t  __temp_i2c_read(uint8_t address) {
 
-    uint16_t data = __bswap_16((mraa_i2c_read_word_data(i2c, address)));
+    uint64_t start_us = metrics_now_us();
+    uint64_t span_io = span_begin();
+    TRACE3(i2c__start, MAIN_THREAD_TEMP, address, 2);
+    uint16_t data = __bswap_16((mraa_i2c_read_word_data(temp_st->i2c, address)));
+    TRACE3(i2c__end, MAIN_THREAD_TEMP, address, 2);
+    span_end(SPAN_I2C, MAIN_THREAD_TEMP, address, span_io);
+    metrics_observe(METRIC_I2C_US, MAIN_THREAD_TEMP, metrics_now_us() - start_us);
+    bus_xfers++;
 
     logmsg_t ltx;
     LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_INFO, ltx, "Register %d is %d", address, data);
@@ -55,7 +79,19 @@ uint16_t  __temp_i2c_read(uint8_t address) {
 }
 
 void __temp_i2c_write(uint16_t data, uint8_t address) {
-     mraa_i2c_write_word_data(i2c, __bswap_16(data), address);
+     uint64_t start_us = metrics_now_us();
+     uint64_t span_io = span_begin();
+     TRACE3(i2c__start, MAIN_THREAD_TEMP, address, 2);
+     mraa_i2c_write_word_data(temp_st->i2c, __bswap_16(data), address);
+     TRACE3(i2c__end, MAIN_THREAD_TEMP, address, 2);
+     span_end(SPAN_I2C, MAIN_THREAD_TEMP, address, span_io);
+     metrics_observe(METRIC_I2C_US, MAIN_THREAD_TEMP, metrics_now_us() - start_us);
+     bus_xfers++;
+
+     /* OS is a trigger, not a setting */
+     if (address == TEMP_REG_CTRL) {
+         temp_st->ctrl_shadow = data & ~TEMP_REG_CTRL_OS;
+     }
 }
 
 float __temp_conv(uint16_t data) {
@@ -74,45 +110,150 @@ float __temp_conv(uint16_t data) {
 
 }
 
-uint8_t __temp_timer_init(void) {
+uint16_t __temp_unconv(float c) {
+    /* Back to a left justified 12 bit two's complement code */
+    int16_t code = (int16_t) (c / TEMP_RES);
+    return ((uint16_t) code << 4) & 0xfff0;
+}
+
+int32_t __temp_conv_mc(uint16_t data) {
+    /* 12 bit signed count of 1/16 C, rounded half away from zero */
+    int32_t code = (int16_t) data >> 4;
+    return (code * 125 + (code < 0 ? -1 : 1)) / 2;
+}
+
+int32_t __temp_store(uint16_t data) {
+    uint32_t now_ms = hist_now_ms();
+    int32_t mc = __temp_conv_mc(data);
 
-    timer_t tmr;
-    struct itimerspec ts;
-    struct sigevent se;
+    /* Readers on other threads only ever see the published snapshot */
+    snap_publish(SNAP_TEMP, mc, data, now_ms);
+    bus_publish(BUS_TOPIC_TEMP, mc, data, now_ms);
+    hist_push(&temp_st->hist, now_ms, mc);
 
-    se.sigev_notify = SIGEV_THREAD;
-    se.sigev_value.sival_ptr = &tmr;
-    se.sigev_notify_function = __temp_check;
-    se.sigev_notify_attributes = NULL;
+    return mc;
+}
+
+void __temp_alert(void *arg) {
+
+    /* Reading any register also clears the alert in interrupt mode */
+    int32_t mc = __temp_store(__temp_i2c_read(TEMP_REG_TEMP));
+
+    /* Hand the fresh reading to the LED logic */
+    msg_t tx;
+    tx.from = MAIN_THREAD_TEMP;
+    tx.cmd = MAIN_TEMPALERT;
+    memcpy(tx.data, &mc, 4);
+    tx.data[4] = mraa_gpio_read(temp_st->alert_gpio) == 1;
+    tx.data[5] = 0;
+    msg_send(&tx, MAIN_THREAD_MAIN);
+}
 
-    ts.it_value.tv_sec = 0;
-    ts.it_value.tv_nsec = TEMP_TIMER_NS;
-    ts.it_interval.tv_sec = 0;
-    ts.it_interval.tv_nsec = 0;
+uint8_t __temp_timer_init(void) {
 
-    if (timer_create(CLOCK_REALTIME, &se, &tmr) == -1) {
+    /* sampling only stays set while the check chain is armed, so a
+     * restarted task starts a chain that died */
+    check_due_us = clk_now_us() + temp_st->adapt.period_ns / 1000;
+    if (clk_after(&temp_check_tmr, __temp_check, temp_st->adapt.period_ns) != CLK_SUCCESS) {
+        temp_st->sampling = 0;
         logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_ERROR, ltx, "Failed to start temp check timer");
+        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_ERROR, ltx, "Failed to set temp check timer");
         logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return MAIN_ERR_INIT;
     }
+    temp_st->sampling = 1;
+
+    return MAIN_SUCCESS;
+}
 
-    if (timer_settime(tmr, 0, &ts, 0) == -1) {
+uint8_t __temp_oneshot_timer_init(void) {
+
+    oneshot_due_us = clk_now_us() + TEMP_ONESHOT_NS / 1000;
+    if (clk_after(&temp_oneshot_tmr, __temp_oneshot_done, TEMP_ONESHOT_NS) != CLK_SUCCESS) {
+        temp_st->sampling = 0;
         logmsg_t ltx;
-        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_ERROR, ltx, "Failed to set temp check timer");
+        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_ERROR, ltx, "Failed to set one-shot timer");
         logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return MAIN_ERR_INIT;
     }
 
     return MAIN_SUCCESS;
 }
 
-void __temp_check(union sigval arg) {
+void __temp_sample_done(uint16_t data) {
+    int32_t mc = __temp_store(data);
 
-    /* Get temperature */
-    temperature_c = __temp_conv(__temp_i2c_read(TEMP_REG_TEMP));
+    readings++;
+    latency_ns += clk_now_ns() - sample_start_ns;
+
+    /* Pick the next period from how much the temperature is moving */
+    adapt_update(&temp_st->adapt, mc / 1000.0f);
+}
+
+void __temp_oneshot_done(union sigval arg) {
+
+    uint64_t span_cb = span_begin();
+    uint64_t now_us = clk_now_us();
+    uint64_t late_us = now_us > oneshot_due_us ? now_us - oneshot_due_us : 0;
+    TRACE3(timer__fire, MAIN_THREAD_TEMP, TRACE_TIMER_ONESHOT, late_us);
+    metrics_observe(METRIC_TIMER_LATE_US, MAIN_THREAD_TEMP, late_us);
+
+    /* Conversion time has passed, the register holds the new result */
+    __temp_sample_done(__temp_i2c_read(TEMP_REG_TEMP));
     __temp_timer_init();
+    span_end(SPAN_TIMER, MAIN_THREAD_TEMP, TRACE_TIMER_ONESHOT, span_cb);
+}
+
+void __temp_check(union sigval arg) {
+
+    uint64_t span_cb = span_begin();
+    sample_start_ns = clk_now_ns();
+
+    uint64_t now_us = clk_now_us();
+    uint64_t late_us = now_us > check_due_us ? now_us - check_due_us : 0;
+    TRACE3(timer__fire, MAIN_THREAD_TEMP, TRACE_TIMER_CHECK, late_us);
+    metrics_observe(METRIC_TIMER_LATE_US, MAIN_THREAD_TEMP, late_us);
+
+    if (temp_st->oneshot) {
+        /* Start a single conversion and pick it up when it is done */
+        uint64_t start_us = metrics_now_us();
+        uint64_t span_io = span_begin();
+        TRACE3(i2c__start, MAIN_THREAD_TEMP, TEMP_REG_CTRL, 2);
+        mraa_i2c_write_word_data(temp_st->i2c, __bswap_16(temp_st->ctrl_shadow | TEMP_REG_CTRL_OS), TEMP_REG_CTRL);
+        TRACE3(i2c__end, MAIN_THREAD_TEMP, TEMP_REG_CTRL, 2);
+        span_end(SPAN_I2C, MAIN_THREAD_TEMP, TEMP_REG_CTRL, span_io);
+        metrics_observe(METRIC_I2C_US, MAIN_THREAD_TEMP, metrics_now_us() - start_us);
+        bus_xfers++;
+        __temp_oneshot_timer_init();
+    } else {
+        /* Get temperature */
+        __temp_sample_done(__temp_i2c_read(TEMP_REG_TEMP));
+        __temp_timer_init();
+    }
+    span_end(SPAN_TIMER, MAIN_THREAD_TEMP, TRACE_TIMER_CHECK, span_cb);
 
 }
 
+void __temp_latest(snap_val_t *v) {
+    uint8_t ret = SNAP_ERR_BUSY;
+
+    /* A busy slot is a writer that keeps getting in, give it the CPU */
+    for (int i = 0; i < SNAP_RETRIES && ret == SNAP_ERR_BUSY; i++) {
+        if ((ret = snap_read(SNAP_TEMP, v)) == SNAP_ERR_BUSY) {
+            sched_yield();
+        }
+    }
+    if (ret != SNAP_SUCCESS) {
+        if (ret != SNAP_ERR_EMPTY) {
+            logmsg_t ltx;
+            LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_WARN, ltx, "Couldn't read the latest temperature, error %u", ret);
+            logmsg_send(&ltx, MAIN_THREAD_LOG);
+        }
+        memset(v, 0, sizeof(*v));
+        v->value = TEMP_NONE_MC;
+    }
+}
+
 void __temp_terminate(void *arg) {
     logmsg_t ltx;
     LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_WARN, ltx, "Killing temperature module gracefully");
@@ -127,14 +268,32 @@ void *temp_task(void *data) {
     /* Register exit handler */
     pthread_cleanup_push(__temp_terminate, "temp");
 
-    /* Initialize temp check timer */
-    __temp_timer_init();
+    if (data != NULL) {
+        temp_st = data;
+    }
+
+    /* A restarted task finds the check timer still running off the state it
+     * left behind and carries on with it */
+    if (!temp_st->sampling) {
+        hist_init(&temp_st->hist);
+        prof_init(&temp_st->prof);
+
+        /* Initialize temp check timer */
+        adapt_init(&temp_st->adapt, TEMP_ADAPT_MIN_NS, TEMP_ADAPT_MAX_NS, TEMP_TIMER_NS,
+                   TEMP_ADAPT_RATE, TEMP_ADAPT_STD, TEMP_ADAPT_NOISE);
+        __temp_timer_init();
+    }
 
     /* Command loop */
     mqd_t rxq = mq_open(msg_names[MAIN_THREAD_TEMP], O_RDONLY);
     msg_t rx;
     while(1) {
-        mq_receive(rxq, (char *) &rx, MSG_SIZE+1, NULL);
+        if (mq_receive(rxq, (char *) &rx, MSG_SIZE+1, NULL) != -1) {
+            metrics_inc(METRIC_MSG_RECV, MAIN_THREAD_TEMP);
+        }
+        uint64_t start = prof_begin(&temp_st->prof, rx.ts);
+        TRACE4(dispatch__start, MAIN_THREAD_TEMP, rx.cmd, MSG_SIZE, rx.from);
+        uint64_t span_t = span_begin();
         if (rx.from & MSG_RSP_MASK) {
             /* Handle response data */
             uint16_t rx_fc = MSG_RSP(rx.from, rx.cmd);
@@ -161,6 +320,9 @@ void *temp_task(void *data) {
                 case TEMP_GETTEMP:
                     temp_gettemp(&rx);
                     break;
+                case TEMP_GETTEMP_ALL:
+                    temp_gettemp_all(&rx);
+                    break;
                 case TEMP_WRITECONFIG:
                     temp_writeconfig(&rx);
                     break;
@@ -176,6 +338,27 @@ void *temp_task(void *data) {
                 case TEMP_WRITEPTR:
                     temp_writeptr(&rx);
                     break;
+                case TEMP_SETALERT:
+                    temp_setalert(&rx);
+                    break;
+                case TEMP_SETONESHOT:
+                    temp_setoneshot(&rx);
+                    break;
+                case TEMP_GETBUSSTATS:
+                    temp_getbusstats(&rx);
+                    break;
+                case TEMP_SETADAPT:
+                    temp_setadapt(&rx);
+                    break;
+                case TEMP_GETADAPT:
+                    temp_getadapt(&rx);
+                    break;
+                case TEMP_GETSTATS:
+                    temp_getstats(&rx);
+                    break;
+                case TEMP_STATS:
+                    temp_stats(&rx);
+                    break;
                 case TEMP_KILL:
                     temp_kill(&rx);
                     break;
@@ -183,6 +366,10 @@ void *temp_task(void *data) {
                     break;
             }
         }
+        span_end(SPAN_DISPATCH, MAIN_THREAD_TEMP, rx.from & MSG_RSP_MASK ? SPAN_RSP | rx.cmd : rx.cmd, span_t);
+        TRACE4(dispatch__end, MAIN_THREAD_TEMP, rx.cmd, MSG_SIZE, rx.from);
+        prof_end(&temp_st->prof, rx.from, rx.cmd, start);
+        msg_progress(MAIN_THREAD_TEMP);
     }
 
     pthread_cleanup_pop(1);
@@ -192,11 +379,19 @@ void *temp_task(void *data) {
 
 uint8_t temp_init(msg_t *rx) {
 
+    /* After a restart the bus and shadow are still good */
+    logmsg_t ltx;
+    if (temp_st->i2c != NULL) {
+        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_INFO, ltx, "Temperature module kept its bus");
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return TEMP_SUCCESS;
+    }
+
     mraa_init();
-    i2c = mraa_i2c_init_raw(TEMP_I2C_BUS);
-    mraa_i2c_address(i2c, TEMP_I2C_ADDR);
+    temp_st->i2c = mraa_i2c_init_raw(TEMP_I2C_BUS);
+    mraa_i2c_address(temp_st->i2c, TEMP_I2C_ADDR);
+    temp_st->ctrl_shadow = __temp_i2c_read(TEMP_REG_CTRL) & ~TEMP_REG_CTRL_OS;
 
-    logmsg_t ltx;
     LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_INFO, ltx, "Initialized temperature module");
     logmsg_send(&ltx, MAIN_THREAD_LOG);
 
@@ -244,20 +439,34 @@ uint8_t temp_writeptr(msg_t *rx) {
     uint8_t data = rx->data[0];
     
     /* Write just the pointer register */
-    mraa_i2c_write_byte(i2c, data);
+    uint64_t start_us = metrics_now_us();
+    uint64_t span_io = span_begin();
+    TRACE3(i2c__start, MAIN_THREAD_TEMP, data, 0);
+    mraa_i2c_write_byte(temp_st->i2c, data);
+    TRACE3(i2c__end, MAIN_THREAD_TEMP, data, 0);
+    span_end(SPAN_I2C, MAIN_THREAD_TEMP, data, span_io);
+    metrics_observe(METRIC_I2C_US, MAIN_THREAD_TEMP, metrics_now_us() - start_us);
+    bus_xfers++;
 
     return TEMP_SUCCESS;
 }
 
 uint8_t temp_gettemp(msg_t *rx) {
 
-    float ret = temperature_c;
+    snap_val_t v;
+    __temp_latest(&v);
+
+    temp_all_t t;
+    t.mc = v.value;
+    temp_units(&t);
+
+    float ret;
     if (rx->data[0] == TEMP_FMT_KEL) {
-        ret = temperature_c + 273.15;
+        ret = t.mk / 1000.0f;
     } else if (rx->data[0] == TEMP_FMT_FAR) {
-        ret = temperature_c * 1.8 + 32;
+        ret = t.mf / 1000.0f;
     } else {
-        ret = temperature_c;
+        ret = t.mc / 1000.0f;
     }
 
     /* Send response */
@@ -272,12 +481,64 @@ uint8_t temp_gettemp(msg_t *rx) {
     return TEMP_SUCCESS;
 }
 
+uint8_t temp_gettemp_all(msg_t *rx) {
+
+    snap_val_t v;
+    __temp_latest(&v);
+
+    temp_all_t t;
+    t.raw = v.raw;
+    t.mc = v.value;
+    t.ts_ms = v.ts_ms & TEMP_TS_MASK;
+    temp_units(&t);
+
+    /* Send response */
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_TEMP;
+    tx.cmd = TEMP_GETTEMP_ALL;
+    temp_all_pack(&t, tx.data);
+    msg_send(&tx, rx->from);
+
+    return TEMP_SUCCESS;
+}
+
+void temp_units(temp_all_t *t) {
+    int32_t f9 = t->mc * 9;
+
+    /* Rounded half away from zero like the Celcius conversion */
+    t->mf = (f9 + (f9 < 0 ? -2 : 2)) / 5 + 32000;
+    t->mk = t->mc + 273150;
+}
+
+void temp_all_pack(const temp_all_t *t, uint8_t *data) {
+    data[0] = t->raw & 0xff;
+    data[1] = t->raw >> 8;
+    msg_put24(data+2, t->mc);
+    msg_put24(data+5, t->mf);
+    msg_put24(data+8, t->mk);
+    msg_put24(data+11, t->ts_ms & TEMP_TS_MASK);
+}
+
+void temp_all_unpack(const uint8_t *data, temp_all_t *t) {
+    t->raw = data[0] | data[1] << 8;
+    t->mc = msg_get24(data+2);
+    t->mf = msg_get24(data+5);
+    t->mk = msg_get24(data+8);
+    t->ts_ms = msg_get24(data+11) & TEMP_TS_MASK;
+}
+
+void temp_conv_bulk(const uint16_t *raw, int32_t *mc, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        mc[i] = __temp_conv_mc(raw[i]);
+    }
+}
+
 uint8_t temp_setconv(msg_t *rx) {
     uint16_t data = __temp_i2c_read(TEMP_REG_CTRL);
     data &= ~(TEMP_REG_CTRL_CR1 | TEMP_REG_CTRL_CR2);
-    data |= rx->data[0] << 7;
+    data |= rx->data[0] << 6;
 
-    __temp_i2c_write(TEMP_REG_CTRL, data);
+    __temp_i2c_write(data, TEMP_REG_CTRL);
 
     return TEMP_SUCCESS;
 }
@@ -286,7 +547,7 @@ uint8_t temp_shutdown(msg_t *rx) {
     uint16_t data = __temp_i2c_read(TEMP_REG_CTRL);
     data |= TEMP_REG_CTRL_SD;
 
-    __temp_i2c_write(TEMP_REG_CTRL, data);
+    __temp_i2c_write(data, TEMP_REG_CTRL);
 
     return TEMP_SUCCESS;
 }
@@ -295,7 +556,180 @@ uint8_t temp_wakeup(msg_t *rx) {
     uint16_t data = __temp_i2c_read(TEMP_REG_CTRL);
     data &= ~TEMP_REG_CTRL_SD;
 
-    __temp_i2c_write(TEMP_REG_CTRL, data);
+    __temp_i2c_write(data, TEMP_REG_CTRL);
+
+    return TEMP_SUCCESS;
+}
+
+uint8_t temp_setalert(msg_t *rx) {
+
+    uint8_t mode = rx->data[0];
+    if (mode > TEMP_ALERT_INT) {
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_ERROR, ltx, "Invalid alert mode");
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return TEMP_ERR_PARAM;
+    }
+
+    /* Drop any previous edge handler */
+    if (temp_st->alert_gpio != NULL) {
+        mraa_gpio_isr_exit(temp_st->alert_gpio);
+        mraa_gpio_close(temp_st->alert_gpio);
+        temp_st->alert_gpio = NULL;
+    }
+
+    uint16_t data = __temp_i2c_read(TEMP_REG_CTRL);
+    data &= ~(TEMP_REG_CTRL_TM | TEMP_REG_CTRL_POL | TEMP_REG_CTRL_F1 | TEMP_REG_CTRL_F0);
+    if (mode == TEMP_ALERT_OFF) {
+        __temp_i2c_write(data, TEMP_REG_CTRL);
+        return TEMP_SUCCESS;
+    }
+
+    /* Active high, single fault so the edge follows the conversion */
+    data |= TEMP_REG_CTRL_POL;
+    if (mode == TEMP_ALERT_INT) {
+        data |= TEMP_REG_CTRL_TM;
+        __temp_i2c_write(__temp_unconv(MAIN_TOOCOLD), TEMP_REG_LOW);
+    } else {
+        __temp_i2c_write(__temp_unconv(MAIN_TOOHOT - TEMP_ALERT_HYST), TEMP_REG_LOW);
+    }
+    __temp_i2c_write(__temp_unconv(MAIN_TOOHOT), TEMP_REG_HIGH);
+    __temp_i2c_write(data, TEMP_REG_CTRL);
+
+    temp_st->alert_gpio = mraa_gpio_init(TEMP_ALERT_GPIO);
+    if (temp_st->alert_gpio == NULL || 
+        mraa_gpio_dir(temp_st->alert_gpio, MRAA_GPIO_IN) != MRAA_SUCCESS ||
+        mraa_gpio_isr(temp_st->alert_gpio, 
+                      mode == TEMP_ALERT_INT ? MRAA_GPIO_EDGE_RISING : MRAA_GPIO_EDGE_BOTH, 
+                      __temp_alert, NULL) != MRAA_SUCCESS) {
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_ERROR, ltx, "Failed to hook ALERT pin, staying on timer reads");
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        if (temp_st->alert_gpio != NULL) {
+            mraa_gpio_close(temp_st->alert_gpio);
+            temp_st->alert_gpio = NULL;
+        }
+        return TEMP_ERR_GPIO;
+    }
+
+    logmsg_t ltx;
+    LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_INFO, ltx, "ALERT pin enabled in %s mode", 
+            mode == TEMP_ALERT_INT ? "interrupt" : "comparator");
+    logmsg_send(&ltx, MAIN_THREAD_LOG);
+
+    return TEMP_SUCCESS;
+}
+
+uint8_t temp_setoneshot(msg_t *rx) {
+
+    temp_st->oneshot = rx->data[0] ? 1 : 0;
+    if (temp_st->oneshot) {
+        __temp_i2c_write(temp_st->ctrl_shadow | TEMP_REG_CTRL_SD, TEMP_REG_CTRL);
+    } else {
+        __temp_i2c_write(temp_st->ctrl_shadow & ~TEMP_REG_CTRL_SD, TEMP_REG_CTRL);
+    }
+
+    /* Start the measurement over for the new mode */
+    bus_xfers = 0;
+    readings = 0;
+    latency_ns = 0;
+
+    logmsg_t ltx;
+    LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_INFO, ltx, "Sampling in %s mode", temp_st->oneshot ? "one-shot" : "continuous");
+    logmsg_send(&ltx, MAIN_THREAD_LOG);
+
+    return TEMP_SUCCESS;
+}
+
+uint8_t temp_getbusstats(msg_t *rx) {
+
+    uint32_t xfers = bus_xfers;
+    uint32_t count = readings;
+    uint32_t mean_us = 0;
+    if (count > 0) {
+        mean_us = latency_ns / count / 1000;
+    }
+
+    /* Send response */
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_TEMP;
+    tx.cmd = TEMP_GETBUSSTATS;
+    memcpy(tx.data, &xfers, 4);
+    memcpy(tx.data+4, &count, 4);
+    memcpy(tx.data+8, &mean_us, 4);
+    tx.data[12] = temp_st->oneshot;
+    tx.data[13] = 0;
+    msg_send(&tx, rx->from);
+
+    return TEMP_SUCCESS;
+}
+
+uint8_t temp_setadapt(msg_t *rx) {
+
+    uint32_t min_ms = rx->data[0] | rx->data[1] << 8;
+    uint32_t max_ms = rx->data[2] | rx->data[3] << 8;
+
+    /* Both limits are checked before scaling, 16 bits of ms overflow 32 of ns */
+    if (min_ms > ADAPT_MAX_NS / 1000000 || max_ms > ADAPT_MAX_NS / 1000000 ||
+        adapt_limits(&temp_st->adapt, min_ms * 1000000, max_ms * 1000000) != ADAPT_SUCCESS) {
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_ERROR, ltx, "Invalid sampling limits %u to %u ms", min_ms, max_ms);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return TEMP_ERR_PARAM;
+    }
+
+    return TEMP_SUCCESS;
+}
+
+uint8_t temp_getadapt(msg_t *rx) {
+
+    uint32_t period_us = temp_st->adapt.period_ns / 1000;
+    uint32_t samples = temp_st->adapt.samples;
+    uint32_t saved = adapt_saved(&temp_st->adapt);
+
+    /* Send response */
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_TEMP;
+    tx.cmd = TEMP_GETADAPT;
+    memcpy(tx.data, &period_us, 4);
+    memcpy(tx.data+4, &samples, 4);
+    memcpy(tx.data+8, &saved, 4);
+    tx.data[12] = 0;
+    msg_send(&tx, rx->from);
+
+    return TEMP_SUCCESS;
+}
+
+uint8_t temp_getstats(msg_t *rx) {
+
+    hist_stats_t st;
+    uint8_t win = rx->data[0];
+    uint8_t ret = hist_stats(&temp_st->hist, win, hist_now_ms(), &st);
+    if (ret == HIST_ERR_PARAM) {
+        logmsg_t ltx;
+        LOG_FMT(MAIN_THREAD_TEMP, LOG_LEVEL_ERROR, ltx, "Invalid stats window %d", win);
+        logmsg_send(&ltx, MAIN_THREAD_LOG);
+        return TEMP_ERR_PARAM;
+    }
+
+    /* Send response */
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_TEMP;
+    tx.cmd = TEMP_GETSTATS;
+    hist_stats_pack(win, ret, &st, tx.data);
+    msg_send(&tx, rx->from);
+
+    return TEMP_SUCCESS;
+}
+
+uint8_t temp_stats(msg_t *rx) {
+
+    /* Send response */
+    msg_t tx;
+    tx.from = MSG_RSP_MASK | MAIN_THREAD_TEMP;
+    tx.cmd = TEMP_STATS;
+    prof_pack(&temp_st->prof, rx->data[0], tx.data);
+    msg_send(&tx, rx->from);
 
     return TEMP_SUCCESS;
 }
@@ -307,6 +741,7 @@ uint8_t temp_alive(msg_t *rx) {
     tx.from = MSG_RSP_MASK | MAIN_THREAD_TEMP;
     tx.cmd = TEMP_ALIVE;
     tx.data[0] = 0xa5;
+    memcpy(tx.data+1, rx->data+1, 4);
     msg_send(&tx, rx->from);
 
     return TEMP_SUCCESS;
@@ -314,6 +749,7 @@ uint8_t temp_alive(msg_t *rx) {
 
 uint8_t temp_kill(msg_t *rx) {
 
+    prof_dump(&temp_st->prof, MAIN_THREAD_TEMP, NULL);
     pthread_exit(0);
 
     return TEMP_SUCCESS;
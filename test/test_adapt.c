@@ -0,0 +1,76 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_adapt.c
+ * @brief Test suite for the adaptive sampling period in adapt.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 5 2017
+ * @version 1.0
+ *
+ */
+
+#include "adapt.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <limits.h>
+
+void test_adapt(void) {
+
+    adapt_t a;
+    uint32_t period;
+
+    /* Bad limits */
+    assert_true(adapt_init(&a, 0, 1000, 100, 1.0, 1.0, 0.0) == ADAPT_ERR_PARAM);
+    assert_true(adapt_init(&a, 2000, 1000, 100, 1.0, 1.0, 0.0) == ADAPT_ERR_PARAM);
+
+    /* Starts at the base period */
+    assert_true(adapt_init(&a, 100000000, 3200000000u, 200000000, 1.0, 1.0, 0.1) == ADAPT_SUCCESS);
+    assert_true(a.period_ns == 200000000);
+
+    /* A flat signal backs off to the maximum and stays there */
+    for (int i = 0; i < 20; i++) {
+        period = adapt_update(&a, 20.0);
+    }
+    assert_true(period == 3200000000u);
+
+    /* Noise below the threshold does not count as movement */
+    period = adapt_update(&a, 20.05);
+    assert_true(period == 3200000000u);
+
+    /* Flat sampling saves samples against the base period */
+    assert_true(adapt_saved(&a) > 0);
+
+    /* A fast change drops straight to the minimum */
+    period = adapt_update(&a, 40.0);
+    assert_true(period == 100000000);
+
+    /* Still moving keeps the minimum */
+    period = adapt_update(&a, 45.0);
+    assert_true(period == 100000000);
+
+    /* Once the variance settles it grows back by the backoff factor */
+    for (int i = 0; i < 100 && a.period_ns == 100000000; i++) {
+        adapt_update(&a, 45.0);
+    }
+    period = a.period_ns;
+    assert_true(period == (uint32_t) (100000000 * ADAPT_BACKOFF));
+    assert_true(adapt_update(&a, 45.0) == (uint32_t) (period * ADAPT_BACKOFF));
+
+    /* Narrowing the limits clamps the period */
+    assert_true(adapt_limits(&a, 100000000, 150000000) == ADAPT_SUCCESS);
+    assert_true(a.period_ns <= 150000000);
+
+    return;
+}
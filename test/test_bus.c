@@ -0,0 +1,112 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_bus.c
+ * @brief Test suite for the sample bus in bus.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 7 2017
+ * @version 1.0
+ *
+ */
+
+#include "bus.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static void *test_bus_publisher(void *arg) {
+    usleep(20000);
+    bus_publish(BUS_TOPIC_LIGHT, 4242, 0, 0);
+
+    return NULL;
+}
+
+void test_bus(void) {
+
+    bus_sub_t all, temp;
+    bus_sample_t s;
+
+    bus_subscribe(&all, BUS_TOPIC_MASK(BUS_TOPIC_TEMP) | BUS_TOPIC_MASK(BUS_TOPIC_LIGHT));
+    bus_subscribe(&temp, BUS_TOPIC_MASK(BUS_TOPIC_TEMP));
+    assert_true(bus_filter(&temp, BUS_TOPICS, 0, 0) == BUS_ERR_PARAM);
+
+    /* Nothing yet */
+    assert_true(bus_next(&all, &s, 0) == BUS_ERR_TIMEOUT);
+
+    /* Every subscriber sees the same sample, filtered by topic */
+    bus_publish(BUS_TOPIC_TEMP, 25000, 0x1900, 100);
+    bus_publish(BUS_TOPIC_LIGHT, 1234, 0x00100020, 110);
+
+    assert_true(bus_next(&all, &s, 0) == BUS_SUCCESS);
+    assert_true(s.topic == BUS_TOPIC_TEMP && s.value == 25000 && s.raw == 0x1900 && s.ts_ms == 100);
+    assert_true(bus_next(&all, &s, 0) == BUS_SUCCESS);
+    assert_true(s.topic == BUS_TOPIC_LIGHT && s.value == 1234 && s.raw == 0x00100020);
+    assert_true(bus_next(&all, &s, 0) == BUS_ERR_TIMEOUT);
+
+    assert_true(bus_next(&temp, &s, 0) == BUS_SUCCESS);
+    assert_true(s.value == 25000);
+    assert_true(bus_next(&temp, &s, 0) == BUS_ERR_TIMEOUT);
+
+    /* Deadband drops small changes, measured from the last delivered value */
+    assert_true(bus_filter(&temp, BUS_TOPIC_TEMP, 0, 100) == BUS_SUCCESS);
+    bus_publish(BUS_TOPIC_TEMP, 25050, 0, 200);
+    bus_publish(BUS_TOPIC_TEMP, 25099, 0, 300);
+    bus_publish(BUS_TOPIC_TEMP, 24900, 0, 400);
+    assert_true(bus_next(&temp, &s, 0) == BUS_SUCCESS);
+    assert_true(s.value == 24900);
+    assert_true(temp.filtered == 2);
+
+    /* Rate limit */
+    assert_true(bus_filter(&temp, BUS_TOPIC_TEMP, 1000, 0) == BUS_SUCCESS);
+    bus_publish(BUS_TOPIC_TEMP, 30000, 0, 900);
+    bus_publish(BUS_TOPIC_TEMP, 31000, 0, 1400);
+    assert_true(bus_next(&temp, &s, 0) == BUS_SUCCESS);
+    assert_true(s.value == 31000);
+
+    /* A subscriber that falls too far behind loses the oldest samples */
+    bus_subscribe(&all, BUS_TOPIC_MASK(BUS_TOPIC_LIGHT));
+    for (int i = 0; i < BUS_SIZE + 10; i++) {
+        bus_publish(BUS_TOPIC_LIGHT, i, 0, i);
+    }
+    assert_true(bus_next(&all, &s, 0) == BUS_SUCCESS);
+    assert_true(s.value == 10);
+    assert_true(all.lost == 10);
+    while (bus_next(&all, &s, 0) == BUS_SUCCESS);
+    assert_true(s.value == BUS_SIZE + 9);
+    assert_true(all.delivered == BUS_SIZE);
+
+    /* A waiting subscriber is woken by the publish */
+    pthread_t p;
+    assert_true(pthread_create(&p, NULL, test_bus_publisher, NULL) == 0);
+    assert_true(bus_next(&all, &s, 2000) == BUS_SUCCESS);
+    assert_true(s.value == 4242);
+    pthread_join(p, NULL);
+
+    /* And times out when nothing comes */
+    assert_true(bus_next(&all, &s, 10) == BUS_ERR_TIMEOUT);
+
+    /* Quiet once every subscriber came back and found nothing */
+    assert_true(bus_quiet() == 0);
+    while (bus_next(&temp, &s, 0) == BUS_SUCCESS);
+    assert_true(bus_quiet() == 1);
+    bus_publish(BUS_TOPIC_TEMP, 1, 0, 0);
+    assert_true(bus_quiet() == 0);
+    bus_unsubscribe(&all);
+    bus_unsubscribe(&temp);
+    assert_true(bus_quiet() == 1);
+
+    return;
+}
@@ -0,0 +1,119 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_clk.c
+ * @brief Test suite for the clock and timers in clk.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 18 2017
+ * @version 1.0
+ *
+ */
+
+#include "clk.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+static clk_timer_t test_clk_a, test_clk_b, test_clk_c;
+static char test_clk_order[16];
+static uint32_t test_clk_len;
+static uint64_t test_clk_at[16];
+static volatile uint32_t test_clk_fired;
+
+static void test_clk_fn(union sigval arg) {
+    clk_timer_t *t = arg.sival_ptr;
+    char name = t == &test_clk_a ? 'a' : t == &test_clk_b ? 'b' : 'c';
+
+    test_clk_at[test_clk_len] = clk_now_ns();
+    test_clk_order[test_clk_len++] = name;
+
+    /* a keeps itself going every 10 ms, like the check timers */
+    if (t == &test_clk_a && test_clk_len < 6) {
+        clk_after(&test_clk_a, test_clk_fn, 10000000);
+    }
+}
+
+static void test_clk_real_fn(union sigval arg) {
+    __atomic_add_fetch(&test_clk_fired, 1, __ATOMIC_RELEASE);
+}
+
+void test_clk(void) {
+    uint64_t due;
+    static clk_timer_t real;
+
+    /* The real clock moves on its own and fires without being stepped */
+    uint64_t t0 = clk_now_ns();
+    assert_int_equal(clk_after(&real, test_clk_real_fn, 1000000), CLK_SUCCESS);
+    assert_int_equal(clk_next(&due), CLK_ERR_EMPTY);
+    struct timespec ts = {0, 1000000};
+    for (int i = 0; i < 1000 && !__atomic_load_n(&test_clk_fired, __ATOMIC_ACQUIRE); i++) {
+        nanosleep(&ts, NULL);
+    }
+    assert_int_equal(test_clk_fired, 1);
+    assert_true(clk_now_ns() - t0 >= 1000000);
+
+    /* Rearming reuses the same kernel timer */
+    assert_int_equal(clk_after(&real, test_clk_real_fn, 1000000), CLK_SUCCESS);
+    for (int i = 0; i < 1000 && __atomic_load_n(&test_clk_fired, __ATOMIC_ACQUIRE) < 2; i++) {
+        nanosleep(&ts, NULL);
+    }
+    assert_int_equal(test_clk_fired, 2);
+
+    /* The virtual clock stands still until it is stepped */
+    clk_virtual(1);
+    uint64_t v0 = clk_now_ns();
+    time_t w0 = clk_wall();
+    nanosleep(&ts, NULL);
+    assert_true(clk_now_ns() == v0);
+    assert_int_equal(clk_step(), CLK_ERR_EMPTY);
+
+    /* Timers run in due order, ties with one callback in the order they
+     * were armed */
+    assert_int_equal(clk_after(&test_clk_a, test_clk_fn, 10000000), CLK_SUCCESS);
+    assert_int_equal(clk_after(&test_clk_b, test_clk_fn, 25000000), CLK_SUCCESS);
+    assert_int_equal(clk_after(&test_clk_c, test_clk_fn, 30000000), CLK_SUCCESS);
+    assert_int_equal(clk_next(&due), CLK_SUCCESS);
+    assert_true(due == v0 + 10000000);
+
+    /* Moving a pending timer doesn't queue it twice */
+    assert_int_equal(clk_after(&test_clk_b, test_clk_fn, 20000000), CLK_SUCCESS);
+    while (clk_step() == CLK_SUCCESS);
+    test_clk_order[test_clk_len] = 0;
+    assert_string_equal(test_clk_order, "abacaa");
+    assert_true(test_clk_at[0] == v0 + 10000000);
+    assert_true(test_clk_at[1] == v0 + 20000000);
+    assert_true(test_clk_at[3] == v0 + 30000000);
+    assert_true(test_clk_at[5] == v0 + 40000000);
+    assert_true(clk_now_ns() == v0 + 40000000);
+    assert_int_equal(clk_now_ms(), (uint32_t) ((v0 + 40000000) / 1000000));
+
+    /* An hour goes by in one step, and the wall clock with it */
+    assert_int_equal(clk_after(&test_clk_c, test_clk_fn, 3600000000000ull), CLK_SUCCESS);
+    assert_int_equal(clk_step(), CLK_SUCCESS);
+    assert_true(clk_wall() - w0 >= 3600);
+
+    /* There is room for CLK_EVENTS pending timers */
+    static clk_timer_t many[CLK_EVENTS + 1];
+    for (int i = 0; i < CLK_EVENTS; i++) {
+        assert_int_equal(clk_after(&many[i], test_clk_fn, i), CLK_SUCCESS);
+    }
+    assert_int_equal(clk_after(&many[CLK_EVENTS], test_clk_fn, 0), CLK_ERR_FULL);
+
+    /* Back to real time drops what was pending */
+    clk_virtual(0);
+    assert_int_equal(clk_next(&due), CLK_ERR_EMPTY);
+    assert_true(clk_now_ns() >= v0);
+}
@@ -0,0 +1,146 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_conf.c
+ * @brief Test suite for the configuration parser and file watch in conf.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 10 2017
+ * @version 1.0
+ *
+ */
+
+#include "conf.h"
+#include "main.h"
+#include "msg.h"
+#include "led.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static char test_conf_dir[] = "/tmp/test_conf_XXXXXX";
+static uint32_t test_conf_calls;
+
+static void test_conf_changed(const char *path, void *ctx) {
+    __atomic_fetch_add(&test_conf_calls, 1, __ATOMIC_SEQ_CST);
+}
+
+static int test_conf_wait(uint32_t calls) {
+
+    for (int i = 0; i < 200; i++) {
+        if (__atomic_load_n(&test_conf_calls, __ATOMIC_SEQ_CST) >= calls) {
+            return 1;
+        }
+        struct timespec ts = {0, 5000000};
+        nanosleep(&ts, NULL);
+    }
+
+    return 0;
+}
+
+static void test_conf_write(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    assert_true(f != NULL);
+    fputs(text, f);
+    fclose(f);
+}
+
+void test_conf(void) {
+    conf_t def, c;
+    char err[128];
+
+    /* Empty text is the defaults */
+    conf_defaults(&def);
+    assert_int_equal(def.queue_depth, MSG_MAXMSGS);
+    assert_int_equal(def.heartbeat_ms, MAIN_TIMER_HEARTBEAT_NS / 1000000);
+    assert_int_equal(def.stall_ms, MAIN_STALL_MS);
+    assert_string_equal(def.rules, MAIN_RULES_FILE);
+    assert_string_equal(def.led_dir, LED_DIR);
+    assert_int_equal(conf_parse(&c, "", err, sizeof(err)), CONF_SUCCESS);
+    assert_int_equal(conf_diff(&c, &def), 0);
+
+    assert_int_equal(conf_parse(&c,
+        "# tuning\n"
+        "main.heartbeat_ms = 1500\n"
+        "  temp.min_ms=200   # faster\n"
+        "msg.queue_depth = 10\n"
+        "log.path = /tmp/x.log\n", err, sizeof(err)), CONF_SUCCESS);
+    assert_int_equal(c.heartbeat_ms, 1500);
+    assert_int_equal(c.temp_min_ms, 200);
+    assert_string_equal(c.log_path, "/tmp/x.log");
+    assert_int_equal(conf_diff(&def, &c), CONF_KEY(CONF_HEARTBEAT_MS) | CONF_KEY(CONF_TEMP_MIN_MS) |
+                     CONF_KEY(CONF_QUEUE_DEPTH) | CONF_KEY(CONF_LOG_PATH));
+    assert_false(conf_key_live(CONF_QUEUE_DEPTH));
+    assert_true(conf_key_live(CONF_HEARTBEAT_MS));
+    assert_string_equal(conf_key_name(CONF_LOG_LEVEL), "log.level");
+
+    /* Any bad line rejects the whole text and leaves the settings alone */
+    conf_t before = c;
+    assert_int_equal(conf_parse(&c, "main.heartbeat_ms = 900\nfoo = 1\n", err, sizeof(err)), CONF_ERR_SYNTAX);
+    assert_true(strncmp(err, "line 2", 6) == 0);
+    assert_int_equal(conf_parse(&c, "main.heartbeat_ms = 99\n", err, sizeof(err)), CONF_ERR_SYNTAX);
+    assert_int_equal(conf_parse(&c, "temp.oneshot = yes\n", err, sizeof(err)), CONF_ERR_SYNTAX);
+    assert_int_equal(conf_parse(&c, "light.agc\n", err, sizeof(err)), CONF_ERR_SYNTAX);
+    assert_int_equal(conf_parse(&c, "light.min_ms = 500\nlight.max_ms = 400\n", err, sizeof(err)), CONF_ERR_SYNTAX);
+    assert_int_equal(conf_parse(&c, "main.heartbeat_ms = 3000\n", err, sizeof(err)), CONF_ERR_SYNTAX);
+    assert_int_equal(conf_diff(&before, &c), 0);
+
+    /* Writes and replacements of a watched file are seen, others are not */
+    char path[64], other[64], tmp[64];
+    assert_true(mkdtemp(test_conf_dir) != NULL);
+    snprintf(path, sizeof(path), "%s/a.conf", test_conf_dir);
+    snprintf(other, sizeof(other), "%s/b.conf", test_conf_dir);
+    snprintf(tmp, sizeof(tmp), "%s/a.conf.tmp", test_conf_dir);
+    assert_int_equal(conf_watch(path, test_conf_changed, NULL), CONF_SUCCESS);
+    assert_int_equal(conf_watch(path, test_conf_changed, NULL), CONF_SUCCESS);
+
+    test_conf_write(path, "log.level = 2\n");
+    assert_true(test_conf_wait(1));
+    assert_int_equal(conf_load(&c, path, err, sizeof(err)), CONF_SUCCESS);
+    assert_int_equal(c.log_level, 2);
+
+    test_conf_write(other, "log.level = 3\n");
+    test_conf_write(tmp, "log.level = 1\n");
+    assert_int_equal(rename(tmp, path), 0);
+    assert_true(test_conf_wait(2));
+    assert_int_equal(conf_load(&c, path, err, sizeof(err)), CONF_SUCCESS);
+    assert_int_equal(c.log_level, 1);
+    usleep(20000);
+    assert_int_equal(test_conf_calls, 2);
+
+    /* A forgotten file frees its slot and is no longer called back */
+    char name[64];
+    for (int i = 0; i < 2 * CONF_WATCH_MAX; i++) {
+        snprintf(name, sizeof(name), "%s/r%d.rules", test_conf_dir, i);
+        assert_int_equal(conf_watch(name, test_conf_changed, NULL), CONF_SUCCESS);
+        conf_forget(name);
+    }
+    assert_int_equal(conf_watch(other, test_conf_changed, NULL), CONF_SUCCESS);
+    conf_forget(path);
+    test_conf_write(path, "log.level = 2\n");
+    test_conf_write(other, "log.level = 2\n");
+    assert_true(test_conf_wait(3));
+    usleep(20000);
+    assert_int_equal(test_conf_calls, 3);
+
+    conf_unwatch();
+    assert_int_equal(conf_load(&c, tmp, err, sizeof(err)), CONF_ERR_FILE);
+
+    unlink(path);
+    unlink(other);
+    rmdir(test_conf_dir);
+}
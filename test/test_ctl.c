@@ -0,0 +1,172 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_ctl.c
+ * @brief Test suite for the control socket in ctl.c, standing in for the
+ * temperature and light tasks on their queues
+ *
+ * @author Ben Heberlein
+ * @date Nov 11 2017
+ * @version 1.0
+ *
+ */
+
+#include "ctl.h"
+#include "msg.h"
+#include "main.h"
+#include "temp.h"
+#include "light.h"
+#include "log.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define TEST_CTL_PATH "/tmp/test_ctl.sock"
+
+static int test_ctl_connect(void) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, TEST_CTL_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(fd >= 0);
+    assert_int_equal(connect(fd, (struct sockaddr *) &addr, sizeof(addr)), 0);
+
+    return fd;
+}
+
+/* Reads until lines newlines have come in, then bin more bytes */
+static size_t test_ctl_recv(int fd, char *buf, size_t len, int lines, size_t bin) {
+    size_t n = 0;
+    int seen = 0;
+    size_t after = 0;
+
+    while (seen < lines || after < bin) {
+        ssize_t ret = recv(fd, buf + n, 1, 0);
+        assert_true(ret == 1);
+        if (seen < lines) {
+            seen += buf[n] == '\n';
+        } else {
+            after++;
+        }
+        n++;
+        assert_true(n < len);
+    }
+    buf[n] = 0;
+
+    return n;
+}
+
+static void test_ctl_task(mqd_t q, uint8_t cmd, uint8_t from, uint8_t byte) {
+    msg_t rx, tx;
+
+    assert_true(mq_receive(q, (char *) &rx, MSG_SIZE, NULL) == MSG_SIZE);
+    assert_int_equal(rx.from, MAIN_THREAD_CTL);
+    assert_int_equal(rx.cmd, cmd);
+
+    if (byte) {
+        memset(&tx, 0, sizeof(tx));
+        tx.from = MSG_RSP_MASK | from;
+        tx.cmd = cmd;
+        tx.data[0] = byte;
+        tx.data[1] = rx.data[0];
+        msg_send(&tx, MAIN_THREAD_CTL);
+    }
+}
+
+void test_ctl(void) {
+    char buf[4096];
+
+    assert_int_equal(msg_init(MSG_MAXMSGS), MSG_SUCCESS);
+    assert_int_equal(ctl_init(TEST_CTL_PATH, NULL), CTL_SUCCESS);
+    mqd_t tq = mq_open(msg_names[MAIN_THREAD_TEMP], O_RDONLY);
+    mqd_t lq = mq_open(msg_names[MAIN_THREAD_LIGHT], O_RDONLY);
+    assert_true(tq != (mqd_t) -1 && lq != (mqd_t) -1);
+
+    /* Pipelined text and binary requests come back in order */
+    int fd = test_ctl_connect();
+    const char *text = "temp gettemp 2\nstats\ntemp 9\nfoo 1\nlight readreg 0x300\nlog log 1 \"hi there\"\n";
+    uint8_t frame[CTL_BIN_REQ_SIZE] = {CTL_BIN, MAIN_THREAD_TEMP, TEMP_ALIVE};
+    assert_int_equal(send(fd, text, strlen(text), 0), (ssize_t) strlen(text));
+    assert_int_equal(send(fd, frame, sizeof(frame), 0), (ssize_t) sizeof(frame));
+
+    test_ctl_task(tq, TEMP_GETTEMP, MAIN_THREAD_TEMP, 0x42);
+    test_ctl_task(tq, TEMP_KILL, MAIN_THREAD_TEMP, 0);
+    test_ctl_task(tq, TEMP_ALIVE, MAIN_THREAD_TEMP, 0xa5);
+
+    size_t n = test_ctl_recv(fd, buf, sizeof(buf), 6, CTL_BIN_RSP_SIZE);
+    char *line = buf;
+    assert_true(strncmp(line, "ok 42 02 ", 9) == 0);
+    line = strchr(line, '\n') + 1;
+    assert_true(strncmp(line, "ok q.main=", 10) == 0);
+    /* The kill behind the stats may already be queued for the task */
+    char *q = strstr(line, "q.temp=");
+    assert_true(q != NULL && (q[7] == '0' || q[7] == '1') && q[8] == ' ');
+    assert_true(strstr(line, "lat.temp.gettemp=1/") != NULL);
+    line = strchr(line, '\n') + 1;
+    assert_true(strncmp(line, "ok\n", 3) == 0);
+    line = strchr(line, '\n') + 1;
+    assert_true(strncmp(line, "err unknown task", 16) == 0);
+    line = strchr(line, '\n') + 1;
+    assert_true(strncmp(line, "err bad data", 12) == 0);
+    line = strchr(line, '\n') + 1;
+    assert_true(strncmp(line, "ok\n", 3) == 0);
+    line = strchr(line, '\n') + 1;
+    assert_int_equal(buf + n - line, CTL_BIN_RSP_SIZE);
+    assert_int_equal(line[0], CTL_BIN);
+    assert_int_equal(line[1], CTL_BIN_OK);
+    assert_int_equal((uint8_t) line[2], MSG_RSP_MASK | MAIN_THREAD_TEMP);
+    assert_int_equal(line[3], TEMP_ALIVE);
+    assert_int_equal((uint8_t) line[4], 0xa5);
+
+    /* The log command went out with its text */
+    logmsg_t lrx;
+    mqd_t gq = mq_open(msg_names[MAIN_THREAD_LOG], O_RDONLY);
+    assert_true(mq_receive(gq, (char *) &lrx, MSG_LOGSIZE, NULL) == MSG_LOGSIZE);
+    assert_int_equal(lrx.cmd, LOG_LOG);
+    assert_int_equal(lrx.data[0], 1);
+    assert_string_equal((char *) lrx.data + 1, "hi there");
+    mq_close(gq);
+
+    /* A response that misses its request is not taken for the next one */
+    send(fd, "light getlux\n", 13, 0);
+    test_ctl_task(lq, LIGHT_GETLUX, MAIN_THREAD_LIGHT, 0);
+    test_ctl_recv(fd, buf, sizeof(buf), 1, 0);
+    assert_string_equal(buf, "err timeout\n");
+
+    send(fd, "light getlux 7\n", 15, 0);
+    test_ctl_task(lq, LIGHT_GETLUX, MAIN_THREAD_LIGHT, 0);
+    msg_t tx = {.from = MSG_RSP_MASK | MAIN_THREAD_LIGHT, .cmd = LIGHT_GETLUX, .data = {1}};
+    msg_send(&tx, MAIN_THREAD_CTL);
+    tx.data[0] = 2;
+    msg_send(&tx, MAIN_THREAD_CTL);
+    test_ctl_recv(fd, buf, sizeof(buf), 1, 0);
+    assert_true(strncmp(buf, "ok 02 ", 6) == 0);
+
+    send(fd, "stats\n", 6, 0);
+    test_ctl_recv(fd, buf, sizeof(buf), 1, 0);
+    assert_true(strstr(buf, "ctl.timeouts=1 ctl.late=1") != NULL);
+
+    close(fd);
+    ctl_close();
+    mq_close(tq);
+    mq_close(lq);
+    assert_int_equal(access(TEST_CTL_PATH, F_OK), -1);
+}
@@ -0,0 +1,122 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_hist.c
+ * @brief Test suite for the windowed sample history in hist.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 6 2017
+ * @version 1.0
+ *
+ */
+
+#include "hist.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <limits.h>
+
+/* Too big for the stack */
+static hist_t h;
+
+void test_hist(void) {
+
+    hist_stats_t st;
+
+    assert_true(hist_init(&h) == HIST_SUCCESS);
+
+    /* Nothing in any window yet */
+    assert_true(hist_stats(&h, HIST_WIN_1S, 0, &st) == HIST_ERR_EMPTY);
+    assert_true(hist_stats(&h, HIST_WINDOWS, 0, &st) == HIST_ERR_PARAM);
+
+    /* 10 samples 100 ms apart: 1000, -2000, 3000, ... */
+    for (int i = 0; i < 10; i++) {
+        hist_push(&h, 100 * i, (i % 2 ? -1 : 1) * 1000 * (i + 1));
+    }
+
+    /* Only the last 1 s is in the short window at t = 1500 */
+    assert_true(hist_stats(&h, HIST_WIN_1S, 1500, &st) == HIST_SUCCESS);
+    assert_true(st.count == 5);
+    assert_true(st.min == -10000);
+    assert_true(st.max == 9000);
+    assert_true(st.mean == -1600);
+
+    /* Everything in the minute window */
+    assert_true(hist_stats(&h, HIST_WIN_1M, 1500, &st) == HIST_SUCCESS);
+    assert_true(st.count == 10);
+    assert_true(st.min == -10000);
+    assert_true(st.max == 9000);
+    assert_true(st.mean == -500);
+
+    /* Constant samples have no spread */
+    assert_true(hist_init(&h) == HIST_SUCCESS);
+    for (int i = 0; i < 100; i++) {
+        hist_push(&h, i, 25000);
+    }
+    assert_true(hist_stats(&h, HIST_WIN_1S, 100, &st) == HIST_SUCCESS);
+    assert_true(st.std == 0);
+    assert_true(st.mean == 25000);
+
+    /* Two values half and half give their half distance */
+    for (int i = 0; i < 100; i++) {
+        hist_push(&h, 100, 27000);
+    }
+    assert_true(hist_stats(&h, HIST_WIN_1S, 100, &st) == HIST_SUCCESS);
+    assert_true(st.count == 200);
+    assert_true(st.mean == 26000);
+    assert_true(st.std == 1000);
+
+    /* The window ages out completely */
+    assert_true(hist_stats(&h, HIST_WIN_1S, 5000, &st) == HIST_ERR_EMPTY);
+    assert_true(hist_stats(&h, HIST_WIN_1M, 5000, &st) == HIST_SUCCESS);
+    assert_true(st.count == 200);
+
+    /* Wrapping the ring keeps the newest HIST_SIZE samples, with an old
+     * extreme falling out as its slot is reused */
+    assert_true(hist_init(&h) == HIST_SUCCESS);
+    hist_push(&h, 0, 1000000);
+    for (int i = 1; i < HIST_SIZE + 10; i++) {
+        hist_push(&h, i / 10, i);
+    }
+    assert_true(hist_stats(&h, HIST_WIN_1H, 2000, &st) == HIST_SUCCESS);
+    assert_true(st.count == HIST_SIZE);
+    assert_true(st.max == HIST_SIZE + 9);
+    assert_true(st.min == 10);
+
+    /* A short window keeps only its newest HIST_CAP_1S samples */
+    assert_true(hist_init(&h) == HIST_SUCCESS);
+    hist_push(&h, 0, -1000000);
+    for (int i = 1; i < HIST_CAP_1S + 10; i++) {
+        hist_push(&h, 0, i);
+    }
+    assert_true(hist_stats(&h, HIST_WIN_1S, 0, &st) == HIST_SUCCESS);
+    assert_true(st.count == HIST_CAP_1S);
+    assert_true(st.min == 10);
+    assert_true(st.max == HIST_CAP_1S + 9);
+    assert_true(hist_stats(&h, HIST_WIN_1M, 0, &st) == HIST_SUCCESS);
+    assert_true(st.count == HIST_CAP_1S + 10);
+    assert_true(st.min == -1000000);
+
+    /* Timestamps wrapping at 32 bits */
+    assert_true(hist_init(&h) == HIST_SUCCESS);
+    hist_push(&h, UINT_MAX - 200, 1);
+    hist_push(&h, UINT_MAX, 2);
+    hist_push(&h, 300, 3);
+    assert_true(hist_stats(&h, HIST_WIN_1S, 500, &st) == HIST_SUCCESS);
+    assert_true(st.count == 3);
+    assert_true(hist_stats(&h, HIST_WIN_1S, 1000, &st) == HIST_SUCCESS);
+    assert_true(st.count == 1);
+    assert_true(st.min == 3);
+
+    return;
+}
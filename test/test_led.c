@@ -0,0 +1,141 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_led.c
+ * @brief Test suite for the LED module in led.c against a stub sysfs tree
+ *
+ * @author Ben Heberlein
+ * @date Nov 8 2017
+ * @version 1.0
+ *
+ */
+
+#include "led.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char *test_led_files[] = {"brightness", "trigger", "delay_on", "delay_off", "shot"};
+
+static char test_led_dir[] = "/tmp/test_led_XXXXXX";
+
+/* Stub files are never truncated, so compare only what the last write covers */
+static int test_led_is(uint8_t led, const char *file, const char *want) {
+    char path[256];
+    char buf[32] = {0};
+
+    snprintf(path, sizeof(path), "%s/" LED_NAME "/%s", test_led_dir, led, file);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+
+    return strncmp(buf, want, strlen(want)) == 0;
+}
+
+static void test_led_stub(void) {
+    char path[256];
+
+    assert_true(mkdtemp(test_led_dir) != NULL);
+    for (int i = 0; i < LED_TOTAL; i++) {
+        snprintf(path, sizeof(path), "%s/" LED_NAME, test_led_dir, i);
+        assert_true(mkdir(path, 0755) == 0);
+        for (size_t j = 0; j < sizeof(test_led_files) / sizeof(test_led_files[0]); j++) {
+            snprintf(path, sizeof(path), "%s/" LED_NAME "/%s", test_led_dir, i, test_led_files[j]);
+            FILE *f = fopen(path, "w");
+            assert_true(f != NULL);
+            fclose(f);
+        }
+    }
+}
+
+static void test_led_unstub(void) {
+    char path[256];
+
+    for (int i = 0; i < LED_TOTAL; i++) {
+        for (size_t j = 0; j < sizeof(test_led_files) / sizeof(test_led_files[0]); j++) {
+            snprintf(path, sizeof(path), "%s/" LED_NAME "/%s", test_led_dir, i, test_led_files[j]);
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/" LED_NAME, test_led_dir, i);
+        rmdir(path);
+    }
+    rmdir(test_led_dir);
+}
+
+void test_led(void) {
+
+    uint32_t writes, skipped, w;
+
+    /* A missing tree fails to open but later calls are harmless */
+    assert_true(led_init("/nonexistent") == LED_ERR_OPEN);
+    assert_true(led_set(0, LED_ON) == LED_ERR_OPEN);
+
+    test_led_stub();
+    assert_true(led_init(test_led_dir) == LED_SUCCESS);
+    assert_true(test_led_is(2, "trigger", "none"));
+    assert_true(test_led_is(2, "brightness", "0"));
+
+    assert_true(led_set(LED_TOTAL, LED_ON) == LED_ERR_PARAM);
+    assert_true(led_set(0, 2) == LED_ERR_PARAM);
+
+    /* Only changes are written */
+    led_stats(&writes, &skipped);
+    assert_true(led_set(1, LED_ON) == LED_SUCCESS);
+    assert_true(test_led_is(1, "brightness", "1"));
+    led_stats(&w, &skipped);
+    assert_true(w == writes + 1);
+    assert_true(led_set(1, LED_ON) == LED_SUCCESS);
+    led_stats(&w, &skipped);
+    assert_true(w == writes + 1);
+    assert_true(led_set(1, LED_OFF) == LED_SUCCESS);
+    assert_true(test_led_is(1, "brightness", "0"));
+
+    /* Blinking goes to the timer trigger */
+    assert_true(led_blink(3, 100, 400) == LED_SUCCESS);
+    assert_true(test_led_is(3, "trigger", "timer"));
+    assert_true(test_led_is(3, "delay_on", "100"));
+    assert_true(test_led_is(3, "delay_off", "400"));
+
+    /* Same pattern again writes nothing */
+    led_stats(&writes, &skipped);
+    assert_true(led_blink(3, 100, 400) == LED_SUCCESS);
+    led_stats(&w, &skipped);
+    assert_true(w == writes);
+
+    /* Setting the LED detaches the trigger first */
+    assert_true(led_set(3, LED_ON) == LED_SUCCESS);
+    assert_true(test_led_is(3, "trigger", "none"));
+    assert_true(test_led_is(3, "brightness", "1"));
+
+    /* A flash fires the oneshot trigger every time */
+    assert_true(led_flash(0, 250, 250) == LED_SUCCESS);
+    assert_true(test_led_is(0, "trigger", "oneshot"));
+    assert_true(test_led_is(0, "delay_on", "250"));
+    assert_true(test_led_is(0, "shot", "1"));
+    led_stats(&writes, &skipped);
+    assert_true(led_flash(0, 250, 250) == LED_SUCCESS);
+    led_stats(&w, &skipped);
+    assert_true(w == writes + 1);
+
+    led_close();
+    test_led_unstub();
+
+    return;
+}
@@ -26,6 +26,28 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <stdio.h>
+#include <math.h>
+
+/**
+ * @brief The original double precision conversion, for comparison
+ */
+static float test_light_ref(uint16_t ch0, uint16_t ch1) {
+    if (ch0 == 0) {
+        return 0.0;
+    }
+
+    double div = ((float)ch1)/((float)ch0);
+    if (div > 0 && div <= 0.5) {
+        return (0.0304 * ch0) - (0.062 * ch0 *pow(div, 1.4));
+    } else if (div > 0.5 && div <= 0.61) {
+        return (0.0224 * ch0) - (0.031 * ch1);
+    } else if (div > 0.61 && div <= 0.8) {
+        return (0.0128 * ch0) - (.0153 * ch1);
+    } else if (div > 0.8 && div <= 1.30) {
+        return (0.00146 * ch0) - (0.00112 * ch1);
+    }
+    return 0.0;
+}
 
 void test_light_conv(void) {
 
@@ -94,3 +116,35 @@ void test_light_conv(void) {
     assert_true(ret == 0.0); 
 
 }
+
+void test_light_conv_batch(void) {
+
+    uint16_t ch0[37], ch1[37];
+    float lux[37];
+
+    /* Sweep ratios over every segment, with zeros and full scale mixed in */
+    for (int i = 0; i < 37; i++) {
+        ch0[i] = (i * 1777) % 65536;
+        ch1[i] = (ch0[i] * (i % 15)) / 10;
+    }
+    ch0[5] = 0;
+    ch1[6] = 0;
+    ch0[7] = 65535;
+    ch1[7] = 65535;
+
+    /* Batch matches the single sample path, including the scalar tail */
+    light_convert_lux_batch(ch0, ch1, lux, 37);
+    for (int i = 0; i < 37; i++) {
+        float one = __light_convert_lux(ch0[i], ch1[i]);
+        assert_true(fabsf(lux[i] - one) <= 1e-4 * fabsf(one) + 1e-6);
+    }
+
+    /* Close to the original pow() conversion away from segment boundaries */
+    for (uint32_t c0 = 1; c0 < 65536; c0 += 997) {
+        for (uint32_t c1 = 0; c1 <= c0 + c0 / 2 && c1 < 65536; c1 += c0 / 7 + 1) {
+            float ref = test_light_ref(c0, c1);
+            float ret = __light_convert_lux(c0, c1);
+            assert_true(fabsf(ret - ref) <= 0.001 * fabsf(ref) + 0.01);
+        }
+    }
+}
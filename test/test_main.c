@@ -29,19 +29,35 @@
 #include <limits.h>
 
 void test_temp_conv(void);
+void test_temp_fixed(void);
 void test_temp_rw(void);
 void test_light_conv(void);
+void test_light_conv_batch(void);
 void test_light_rw(void);
+void test_adapt(void);
+void test_hist(void);
+void test_snap(void);
+void test_bus(void);
+void test_led(void);
+void test_rule(void);
+void test_conf(void);
+void test_ctl(void);
+void test_metrics(void);
+void test_prof(void);
+void test_span(void);
+void test_clk(void);
 
 int main(void) {
 
     /* Tests run as separate groups because of cmocka issue */
     const struct CMUnitTest t_temp_conv[] = {
         cmocka_unit_test(test_temp_conv),
+        cmocka_unit_test(test_temp_fixed),
     };
 
     const struct CMUnitTest t_light_conv[] = {
         cmocka_unit_test(test_light_conv),
+        cmocka_unit_test(test_light_conv_batch),
     };
 
     const struct CMUnitTest t_temp_rw[] = {
@@ -52,10 +68,70 @@ int main(void) {
         cmocka_unit_test(test_light_rw),
     };
 
+    const struct CMUnitTest t_adapt[] = {
+        cmocka_unit_test(test_adapt),
+    };
+
+    const struct CMUnitTest t_hist[] = {
+        cmocka_unit_test(test_hist),
+    };
+
+    const struct CMUnitTest t_snap[] = {
+        cmocka_unit_test(test_snap),
+    };
+
+    const struct CMUnitTest t_bus[] = {
+        cmocka_unit_test(test_bus),
+    };
+
+    const struct CMUnitTest t_led[] = {
+        cmocka_unit_test(test_led),
+    };
+
+    const struct CMUnitTest t_rule[] = {
+        cmocka_unit_test(test_rule),
+    };
+
+    const struct CMUnitTest t_conf[] = {
+        cmocka_unit_test(test_conf),
+    };
+
+    const struct CMUnitTest t_ctl[] = {
+        cmocka_unit_test(test_ctl),
+    };
+
+    const struct CMUnitTest t_metrics[] = {
+        cmocka_unit_test(test_metrics),
+    };
+
+    const struct CMUnitTest t_prof[] = {
+        cmocka_unit_test(test_prof),
+    };
+
+    const struct CMUnitTest t_span[] = {
+        cmocka_unit_test(test_span),
+    };
+
+    const struct CMUnitTest t_clk[] = {
+        cmocka_unit_test(test_clk),
+    };
+
     cmocka_run_group_tests(t_light_conv, NULL, NULL);
     cmocka_run_group_tests(t_temp_conv, NULL, NULL);
     cmocka_run_group_tests(t_temp_rw, NULL, NULL);
     cmocka_run_group_tests(t_light_rw, NULL, NULL);
+    cmocka_run_group_tests(t_adapt, NULL, NULL);
+    cmocka_run_group_tests(t_hist, NULL, NULL);
+    cmocka_run_group_tests(t_snap, NULL, NULL);
+    cmocka_run_group_tests(t_bus, NULL, NULL);
+    cmocka_run_group_tests(t_led, NULL, NULL);
+    cmocka_run_group_tests(t_rule, NULL, NULL);
+    cmocka_run_group_tests(t_conf, NULL, NULL);
+    cmocka_run_group_tests(t_ctl, NULL, NULL);
+    cmocka_run_group_tests(t_metrics, NULL, NULL);
+    cmocka_run_group_tests(t_prof, NULL, NULL);
+    cmocka_run_group_tests(t_span, NULL, NULL);
+    cmocka_run_group_tests(t_clk, NULL, NULL);
 
     return 0;
 }
@@ -0,0 +1,151 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_metrics.c
+ * @brief Test suite for the metrics registry and its HTTP endpoint
+ *
+ * @author Ben Heberlein
+ * @date Nov 12 2017
+ * @version 1.0
+ *
+ */
+
+#include "metrics.h"
+#include "main.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TEST_METRICS_THREADS    4
+#define TEST_METRICS_INCS       100000
+
+static char test_metrics_text[METRICS_TEXT_MAX];
+
+static void *test_metrics_worker(void *arg) {
+
+    for (int i = 0; i < TEST_METRICS_INCS; i++) {
+        metrics_inc(METRIC_RESTARTS, MAIN_THREAD_LIGHT);
+    }
+
+    return NULL;
+}
+
+static void test_metrics_collect(void) {
+    metrics_set(METRIC_QUEUE_DEPTH, MAIN_THREAD_CTL, 7);
+}
+
+/* Sends a request and reads the reply until the server closes */
+static size_t test_metrics_get(const char *req, char *buf, size_t len) {
+    struct sockaddr_in addr;
+    size_t n = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(metrics_port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(fd >= 0);
+    assert_int_equal(connect(fd, (struct sockaddr *) &addr, sizeof(addr)), 0);
+    assert_int_equal(write(fd, req, strlen(req)), strlen(req));
+
+    ssize_t r;
+    while ((r = read(fd, buf + n, len - 1 - n)) > 0) {
+        n += r;
+    }
+    buf[n] = 0;
+    close(fd);
+
+    return n;
+}
+
+void test_metrics(void) {
+    pthread_t threads[TEST_METRICS_THREADS];
+    char *text = test_metrics_text;
+
+    /* No increments lost between threads */
+    uint64_t before = metrics_get(METRIC_RESTARTS, MAIN_THREAD_LIGHT);
+    for (int i = 0; i < TEST_METRICS_THREADS; i++) {
+        assert_int_equal(pthread_create(&threads[i], NULL, test_metrics_worker, NULL), 0);
+    }
+    for (int i = 0; i < TEST_METRICS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert_true(metrics_get(METRIC_RESTARTS, MAIN_THREAD_LIGHT) == before + TEST_METRICS_THREADS * TEST_METRICS_INCS);
+
+    /* A bound is the top of its own bucket */
+    metrics_observe(METRIC_HEARTBEAT_RTT_US, MAIN_THREAD_LOG, 50);
+    metrics_observe(METRIC_HEARTBEAT_RTT_US, MAIN_THREAD_LOG, 100);
+    metrics_observe(METRIC_HEARTBEAT_RTT_US, MAIN_THREAD_LOG, 2000000);
+    assert_true(metrics_get(METRIC_HEARTBEAT_RTT_US, MAIN_THREAD_LOG) == 3);
+
+    metrics_set(METRIC_QUEUE_DEPTH, MAIN_THREAD_LOG, -1);
+
+    /* Out of range metrics and labels are ignored */
+    metrics_inc(METRICS_NUM, 0);
+    metrics_inc(METRIC_MSG_SENT, METRICS_LABELS);
+    metrics_observe(METRIC_MSG_SENT, 0, 1);
+
+    size_t n = metrics_render(text, METRICS_TEXT_MAX);
+    assert_true(n > 0 && n < METRICS_TEXT_MAX);
+    assert_int_equal(strlen(text), n);
+    assert_non_null(strstr(text, "# TYPE project1_heartbeat_rtt_seconds histogram\n"));
+    assert_non_null(strstr(text, "project1_heartbeat_rtt_seconds_bucket{task=\"log\",le=\"0.0001\"} 2\n"));
+    assert_non_null(strstr(text, "project1_heartbeat_rtt_seconds_bucket{task=\"log\",le=\"1\"} 2\n"));
+    assert_non_null(strstr(text, "project1_heartbeat_rtt_seconds_bucket{task=\"log\",le=\"+Inf\"} 3\n"));
+    assert_non_null(strstr(text, "project1_heartbeat_rtt_seconds_sum{task=\"log\"} 2.000150\n"));
+    assert_non_null(strstr(text, "project1_heartbeat_rtt_seconds_count{task=\"log\"} 3\n"));
+    assert_non_null(strstr(text, "project1_queue_depth{queue=\"log\"} -1\n"));
+    assert_non_null(strstr(text, "# TYPE project1_restarts_total counter\n"));
+
+    /* Series without a label aren't written */
+    assert_null(strstr(text, "project1_restarts_total{task=\"main\"}"));
+    assert_null(strstr(text, "project1_i2c_seconds_count{task=\"main\"}"));
+
+    /* A short buffer is cut off, not overrun */
+    char small[64];
+    memset(small, 'x', sizeof(small));
+    assert_int_equal(metrics_render(small, 32), 31);
+    assert_int_equal(strlen(small), 31);
+    assert_int_equal(small[33], 'x');
+
+    /* Served on loopback, collecting first */
+    assert_int_equal(metrics_init(0, test_metrics_collect), METRICS_SUCCESS);
+    assert_true(metrics_port() != 0);
+    assert_int_equal(metrics_init(0, NULL), METRICS_ERR_PARAM);
+
+    test_metrics_get("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n", text, METRICS_TEXT_MAX);
+    assert_true(strncmp(text, "HTTP/1.0 200 OK\r\n", 17) == 0);
+    assert_non_null(strstr(text, "Content-Type: text/plain; version=0.0.4\r\n"));
+    assert_non_null(strstr(text, "project1_queue_depth{queue=\"ctl\"} 7\n"));
+
+    char *body = strstr(text, "\r\n\r\n");
+    assert_non_null(body);
+    unsigned long clen = 0;
+    assert_int_equal(sscanf(strstr(text, "Content-Length: "), "Content-Length: %lu", &clen), 1);
+    assert_int_equal(strlen(body + 4), clen);
+
+    test_metrics_get("GET /other HTTP/1.0\r\n\r\n", text, METRICS_TEXT_MAX);
+    assert_true(strncmp(text, "HTTP/1.0 404 Not Found\r\n", 24) == 0);
+    test_metrics_get("POST /metrics HTTP/1.0\r\n\r\n", text, METRICS_TEXT_MAX);
+    assert_true(strncmp(text, "HTTP/1.0 405 Method Not Allowed\r\n", 33) == 0);
+
+    metrics_close();
+    assert_int_equal(metrics_port(), 0);
+}
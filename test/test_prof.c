@@ -0,0 +1,102 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_prof.c
+ * @brief Test suite for dispatch profiling in prof.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 13 2017
+ * @version 1.0
+ *
+ */
+
+#include "prof.h"
+#include "msg.h"
+#include "main.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <string.h>
+
+static char test_prof_lines[8][128];
+static int test_prof_nlines;
+
+static void test_prof_out(uint8_t from, const char *line) {
+    assert_int_equal(from, MAIN_THREAD_TEMP);
+    assert_true(test_prof_nlines < 8);
+    snprintf(test_prof_lines[test_prof_nlines++], 128, "%s", line);
+}
+
+void test_prof(void) {
+    prof_t p;
+    uint8_t data[MSG_DATASIZE];
+    uint32_t count, mean, max;
+
+    prof_init(&p);
+
+    /* Sent 5 ms ago, handled in 3 ms */
+    uint64_t start = prof_begin(&p, prof_stamp() - 5000);
+    prof_end(&p, MAIN_THREAD_MAIN, 4, start - 3000000);
+    start = prof_begin(&p, prof_stamp());
+    prof_end(&p, MAIN_THREAD_MAIN, 4, start);
+
+    const prof_ent_t *e = prof_get(&p, 4);
+    assert_int_equal(e->count, 2);
+    assert_true(e->max_ns >= 3000000 && e->max_ns < 3100000);
+    assert_int_equal(e->hist[12], 1);
+    assert_int_equal(prof_pct(e, 50), 0);
+    assert_int_equal(prof_pct(e, 99), 12);
+    assert_true(PROF_BOUND_NS(11) < 3000000 && PROF_BOUND_NS(12) > 3000000);
+
+    e = prof_get(&p, PROF_WAIT);
+    assert_int_equal(e->count, 2);
+    assert_true(e->max_ns >= 5000000);
+
+    /* Responses and commands are kept apart, big command numbers share */
+    start = prof_begin(&p, prof_stamp());
+    prof_end(&p, MSG_RSP_MASK | MAIN_THREAD_TEMP, 4, start);
+    start = prof_begin(&p, prof_stamp());
+    prof_end(&p, MAIN_THREAD_MAIN, 200, start);
+    assert_int_equal(prof_get(&p, PROF_RSP | 4)->count, 1);
+    assert_int_equal(prof_get(&p, PROF_CMDS - 1)->count, 1);
+    assert_null(prof_get(&p, PROF_CMDS));
+
+    prof_pack(&p, 4, data);
+    memcpy(&count, data+1, 4);
+    memcpy(&mean, data+5, 4);
+    memcpy(&max, data+9, 4);
+    assert_int_equal(data[0], 4);
+    assert_int_equal(count, 2);
+    assert_true(mean >= 1500000 && mean < max);
+    assert_true(max >= 3000000);
+    assert_int_equal(data[13], 12);
+
+    prof_pack(&p, 7, data);
+    memcpy(&count, data+1, 4);
+    assert_int_equal(data[0], 7);
+    assert_int_equal(count, 0);
+
+    /* One line per command that ran, then queue wait */
+    prof_dump(&p, MAIN_THREAD_TEMP, test_prof_out);
+    assert_int_equal(test_prof_nlines, 4);
+    assert_true(strncmp(test_prof_lines[0], "Dispatch command 4: 2 calls,", 28) == 0);
+    assert_non_null(strstr(test_prof_lines[0], "99% under 4194 us"));
+    assert_true(strncmp(test_prof_lines[1], "Dispatch command 31: 1 calls,", 29) == 0);
+    assert_true(strncmp(test_prof_lines[2], "Dispatch response 4: 1 calls,", 29) == 0);
+    assert_true(strncmp(test_prof_lines[3], "Queue wait: 4 messages,", 23) == 0);
+
+    /* The stamp travels with the message */
+    msg_t tx;
+    assert_true(sizeof(tx) == MSG_SIZE);
+    assert_true(sizeof(logmsg_t) <= MSG_LOGSIZE);
+}
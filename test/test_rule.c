@@ -0,0 +1,156 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_rule.c
+ * @brief Test suite for the rule compiler and evaluator in rule.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 9 2017
+ * @version 1.0
+ *
+ */
+
+#include "rule.h"
+#include "main.h"
+#include "temp.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdio.h>
+
+static rule_set_t test_rules;
+static int32_t test_vars[RULE_VARS];
+static uint8_t test_leds[4];
+static uint32_t test_logs, test_cmds;
+static rule_action_t test_last;
+
+static void test_rule_act(const rule_set_t *rs, const rule_t *r, const rule_action_t *a, uint8_t active, void *ctx) {
+    test_last = *a;
+    if (a->type == RULE_ACT_LED) {
+        test_leds[a->arg] = active;
+    } else if (a->type == RULE_ACT_LOG && active) {
+        test_logs++;
+    } else if (a->type == RULE_ACT_CMD && active) {
+        test_cmds++;
+    }
+}
+
+static uint32_t test_rule_run(int32_t mc, int32_t clux, uint32_t valid) {
+    test_vars[RULE_VAR_TEMP] = mc;
+    test_vars[RULE_VAR_LUX] = clux;
+    return rule_eval(&test_rules, test_vars, valid, test_rule_act, NULL);
+}
+
+void test_rule(void) {
+    char err[128];
+    uint32_t all = (1u << RULE_VARS) - 1;
+
+    /* Syntax errors name the line */
+    assert_int_equal(rule_compile(&test_rules, "temp > 30 -> led 0\ntemp >> 1 -> led 1\n", err, sizeof(err)), RULE_ERR_SYNTAX);
+    assert_true(strncmp(err, "line 2", 6) == 0);
+    assert_int_equal(test_rules.nrules, 0);
+    assert_int_equal(rule_compile(&test_rules, "pressure > 1 -> led 0", err, sizeof(err)), RULE_ERR_SYNTAX);
+    assert_int_equal(rule_compile(&test_rules, "temp > 1 -> led 4", err, sizeof(err)), RULE_ERR_SYNTAX);
+    assert_int_equal(rule_compile(&test_rules, "temp > 1 -> log \"open", err, sizeof(err)), RULE_ERR_SYNTAX);
+    assert_int_equal(rule_compile(&test_rules, "temp.mean.2m > 1 -> led 0", err, sizeof(err)), RULE_ERR_SYNTAX);
+    assert_int_equal(rule_compile(&test_rules, "temp > 1 -> cmd temp 3\n4 -> led 0", err, sizeof(err)), RULE_ERR_SYNTAX);
+
+    /* Log text must fit in one log message */
+    char src[MSG_LOGDATASIZE + 32];
+    snprintf(src, sizeof(src), "temp > 1 -> log \"%0*d\"", MSG_LOGDATASIZE - 1, 0);
+    assert_int_equal(rule_compile(&test_rules, src, err, sizeof(err)), RULE_ERR_SYNTAX);
+    assert_true(strncmp(err, "line 1: message too long", 24) == 0);
+    snprintf(src, sizeof(src), "temp > 1 -> log \"%0*d\"", MSG_LOGDATASIZE - 2, 0);
+    assert_int_equal(rule_compile(&test_rules, src, err, sizeof(err)), RULE_SUCCESS);
+
+    /* Default rules, hysteresis holds a rule on until its limit is crossed back */
+    assert_int_equal(rule_compile(&test_rules, MAIN_RULES_DEFAULT, err, sizeof(err)), RULE_SUCCESS);
+    assert_int_equal(test_rules.nrules, 3);
+    assert_string_equal(rule_text(&test_rules, test_rules.rules[0].name), "hot");
+    assert_int_equal(test_rules.used, (1u << RULE_VAR_TEMP) | (1u << RULE_VAR_LUX));
+
+    assert_int_equal(test_rule_run(20000, 1000, all), 0);
+    assert_int_equal(test_rule_run(30001, 1000, all), 1);
+    assert_int_equal(test_leds[0], 1);
+    assert_int_equal(test_logs, 1);
+    assert_int_equal(test_rule_run(29600, 1000, all), 0);
+    assert_int_equal(test_leds[0], 1);
+    assert_int_equal(test_rule_run(29499, 1000, all), 1);
+    assert_int_equal(test_leds[0], 0);
+    assert_int_equal(test_logs, 1);
+    assert_int_equal(test_rule_run(9999, 5001, all), 2);
+    assert_int_equal(test_leds[1], 1);
+    assert_int_equal(test_leds[2], 1);
+    assert_int_equal(test_rule_run(10400, 4600, all), 0);
+    assert_int_equal(test_rule_run(10501, 4499, all), 2);
+    assert_int_equal(test_leds[1], 0);
+    assert_int_equal(test_leds[2], 0);
+
+    /* Hysteresis follows each comparison, so not keeps the dead band */
+    assert_int_equal(rule_compile(&test_rules, "not temp > 30 hyst 0.5 -> led 0", err, sizeof(err)), RULE_SUCCESS);
+    assert_int_equal(test_rule_run(20000, 0, all), 1);
+    assert_int_equal(test_leds[0], 1);
+    assert_int_equal(test_rule_run(30001, 0, all), 1);
+    assert_int_equal(test_leds[0], 0);
+    assert_int_equal(test_rule_run(29800, 0, all), 0);
+    assert_int_equal(test_rule_run(29800, 0, all), 0);
+    assert_int_equal(test_leds[0], 0);
+    assert_int_equal(test_rule_run(29499, 0, all), 1);
+    assert_int_equal(test_leds[0], 1);
+    assert_int_equal(test_rule_run(29800, 0, all), 0);
+    assert_int_equal(test_leds[0], 1);
+
+    /* Each comparison holds its own band, another one turning on doesn't
+     * move it */
+    assert_int_equal(rule_compile(&test_rules, "temp > 30 hyst 1 or lux > 10 -> led 0", err, sizeof(err)), RULE_SUCCESS);
+    assert_int_equal(test_rule_run(29500, 11000, all), 1);
+    assert_int_equal(test_leds[0], 1);
+    assert_int_equal(test_rule_run(29500, 0, all), 1);
+    assert_int_equal(test_leds[0], 0);
+
+    /* Equality has nothing to hold back */
+    assert_int_equal(rule_compile(&test_rules, "temp == 30 hyst 1 -> led 0", err, sizeof(err)), RULE_ERR_SYNTAX);
+    assert_int_equal(rule_compile(&test_rules, "lux != 30 hyst 1 -> led 0", err, sizeof(err)), RULE_ERR_SYNTAX);
+    assert_int_equal(rule_compile(&test_rules, "lux != 30 -> led 0", err, sizeof(err)), RULE_SUCCESS);
+
+    /* Precedence, not, aggregates and commands */
+    assert_int_equal(rule_compile(&test_rules,
+        "# comment\n"
+        "\n"
+        "a: temp > 20 or lux > 10 and not temp.max.1m > 25 -> cmd light 3 1, led 3\n",
+        err, sizeof(err)), RULE_SUCCESS);
+    assert_int_equal(test_rules.nrules, 1);
+    assert_int_equal(test_rules.used, (1u << RULE_VAR_TEMP) | (1u << RULE_VAR_LUX) |
+                     (1u << RULE_VAR_AGG(0, RULE_AGG_MAX, 1)));
+
+    /* Rules reading a value that isn't there yet keep their state */
+    test_vars[RULE_VAR_AGG(0, RULE_AGG_MAX, 1)] = 26000;
+    assert_int_equal(test_rule_run(21000, 0, 3), 0);
+    assert_int_equal(test_rule_run(21000, 0, all), 1);
+    assert_int_equal(test_cmds, 1);
+    assert_int_equal(test_leds[3], 1);
+    assert_int_equal(test_last.type, RULE_ACT_LED);
+    assert_int_equal(test_rule_run(19000, 2000, all), 1);
+    assert_int_equal(test_leds[3], 0);
+    test_vars[RULE_VAR_AGG(0, RULE_AGG_MAX, 1)] = 24000;
+    assert_int_equal(test_rule_run(19000, 2000, all), 1);
+    assert_int_equal(test_cmds, 2);
+
+    /* Command actions */
+    assert_int_equal(rule_compile(&test_rules, "(temp <= 0) -> cmd temp 5", err, sizeof(err)), RULE_SUCCESS);
+    assert_int_equal(test_rule_run(0, 0, all), 1);
+    assert_int_equal(test_last.type, RULE_ACT_CMD);
+    assert_int_equal(test_last.arg, MAIN_THREAD_TEMP);
+    assert_int_equal(test_last.cmd, 5);
+    assert_int_equal(test_last.data, 0);
+}
@@ -0,0 +1,83 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_snap.c
+ * @brief Test suite for the seqlock snapshots in snap.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 6 2017
+ * @version 1.0
+ *
+ */
+
+#include "snap.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define TEST_SNAP_WRITES 200000
+
+static void *test_snap_writer(void *arg) {
+    for (int32_t i = 1; i <= TEST_SNAP_WRITES; i++) {
+        snap_publish(SNAP_LIGHT, i, ~i, i);
+    }
+
+    return NULL;
+}
+
+void test_snap(void) {
+
+    snap_val_t v;
+
+    /* Nothing published yet, the private slots are used without snap_init */
+    assert_true(snap_read(SNAP_TEMP, &v) == SNAP_ERR_EMPTY);
+    assert_true(snap_read(SNAP_TOTAL, &v) == SNAP_ERR_PARAM);
+
+    snap_publish(SNAP_TEMP, -1250, 0xfec0, 1000);
+    assert_true(snap_read(SNAP_TEMP, &v) == SNAP_SUCCESS);
+    assert_true(v.value == -1250);
+    assert_true(v.raw == 0xfec0);
+    assert_true(v.ts_ms == 1000);
+    assert_true(v.seq == 1);
+
+    snap_publish(SNAP_TEMP, 25000, 0x1900, 1100);
+    assert_true(snap_read(SNAP_TEMP, &v) == SNAP_SUCCESS);
+    assert_true(v.value == 25000);
+    assert_true(v.seq == 2);
+
+    /* Slots are independent */
+    assert_true(snap_read(SNAP_LIGHT, &v) == SNAP_ERR_EMPTY);
+
+    /* A reader racing a writer never sees a torn reading */
+    pthread_t writer;
+    assert_true(pthread_create(&writer, NULL, test_snap_writer, NULL) == 0);
+
+    uint32_t last = 0;
+    do {
+        uint8_t ret = snap_read(SNAP_LIGHT, &v);
+        if (ret == SNAP_SUCCESS) {
+            assert_true(v.raw == ~(uint32_t) v.value);
+            assert_true(v.ts_ms == (uint32_t) v.value);
+            assert_true(v.seq == (uint32_t) v.value);
+            assert_true(v.seq >= last);
+            last = v.seq;
+        } else {
+            assert_true(ret == SNAP_ERR_EMPTY || ret == SNAP_ERR_BUSY);
+        }
+    } while (last < TEST_SNAP_WRITES);
+
+    pthread_join(writer, NULL);
+
+    return;
+}
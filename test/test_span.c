@@ -0,0 +1,137 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_span.c
+ * @brief Test suite for the span recorder in span.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 15 2017
+ * @version 1.0
+ *
+ */
+
+#include "span.h"
+#include "main.h"
+#include "trace.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static char test_span_path[] = "/tmp/test_span_XXXXXX";
+
+static void *test_span_timer(void *arg) {
+    uint64_t t = span_begin();
+    uint64_t io = span_begin();
+    span_end(SPAN_I2C, MAIN_THREAD_TEMP, 5, io);
+    span_end(SPAN_TIMER, MAIN_THREAD_TEMP, TRACE_TIMER_CHECK, t);
+
+    return NULL;
+}
+
+static uint8_t test_span_hammer_on;
+
+static void *test_span_hammer(void *arg) {
+
+    while (__atomic_load_n(&test_span_hammer_on, __ATOMIC_RELAXED)) {
+        span_end(SPAN_LOG, MAIN_THREAD_LOG, 0, span_begin());
+    }
+
+    return NULL;
+}
+
+void test_span(void) {
+    uint32_t kept, dropped;
+    char buf[4096];
+    pthread_t th;
+
+    /* Nothing is taken while stopped */
+    assert_int_equal(span_recording(), 0);
+    assert_int_equal(span_begin(), 0);
+    assert_int_equal(span_start(SPAN_EVENTS_MAX + 1), SPAN_ERR_PARAM);
+
+    /* A full buffer keeps the first spans and counts the rest */
+    assert_int_equal(span_start(4), SPAN_SUCCESS);
+    assert_int_equal(span_recording(), 1);
+    uint64_t t = span_begin();
+    assert_true(t != 0);
+    span_end(SPAN_DISPATCH, MAIN_THREAD_MAIN, MAIN_STATS, t);
+    span_end(SPAN_DISPATCH, MAIN_THREAD_LIGHT, SPAN_RSP | 3, span_begin());
+    pthread_create(&th, NULL, test_span_timer, NULL);
+    pthread_join(th, NULL);
+    span_end(SPAN_LOG, MAIN_THREAD_LOG, 1, span_begin());
+    span_end(SPAN_KINDS, MAIN_THREAD_LOG, 1, span_begin());
+    span_stats(&kept, &dropped);
+    assert_int_equal(kept, 4);
+    assert_int_equal(dropped, 1);
+
+    /* Spans that end after a stop are left out */
+    t = span_begin();
+    span_stop();
+    span_end(SPAN_RULES, MAIN_THREAD_MAIN, 0, t);
+    span_stats(&kept, &dropped);
+    assert_int_equal(kept, 4);
+
+    int fd = mkstemp(test_span_path);
+    assert_true(fd >= 0);
+    close(fd);
+    assert_int_equal(span_dump(test_span_path), SPAN_SUCCESS);
+    assert_int_equal(span_dump(NULL), SPAN_ERR_PARAM);
+
+    FILE *f = fopen(test_span_path, "r");
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = 0;
+    fclose(f);
+    unlink(test_span_path);
+
+    assert_true(strncmp(buf, "{\"traceEvents\":[", 16) == 0);
+    assert_non_null(strstr(buf, "\"name\":\"cmd 2\",\"cat\":\"dispatch\",\"ph\":\"X\""));
+    assert_non_null(strstr(buf, "\"name\":\"rsp 3\""));
+    assert_non_null(strstr(buf, "\"name\":\"i2c 0x05\""));
+    assert_non_null(strstr(buf, "\"name\":\"check\",\"cat\":\"timer\""));
+    assert_null(strstr(buf, "\"cat\":\"log\""));
+    assert_non_null(strstr(buf, "\"args\":{\"name\":\"main\"}"));
+    assert_non_null(strstr(buf, "\"args\":{\"name\":\"temp timer\"}"));
+    assert_non_null(strstr(buf, "\"otherData\":{\"kept\":4,\"dropped\":1}}"));
+
+    /* A new recording starts empty */
+    assert_int_equal(span_start(2), SPAN_SUCCESS);
+    span_stats(&kept, &dropped);
+    assert_int_equal(kept, 0);
+    assert_int_equal(dropped, 0);
+
+    /* Restarts with writers running, growing buffers free the old ones */
+    pthread_t hammer[4];
+    __atomic_store_n(&test_span_hammer_on, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&hammer[i], NULL, test_span_hammer, NULL);
+    }
+    for (uint32_t i = 0; i < 200; i++) {
+        assert_int_equal(span_start(16 + i * 16), SPAN_SUCCESS);
+        usleep(50);
+    }
+    __atomic_store_n(&test_span_hammer_on, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(hammer[i], NULL);
+    }
+    span_stats(&kept, &dropped);
+    assert_true(kept <= 16 + 199 * 16);
+
+    assert_int_equal(span_start(2), SPAN_SUCCESS);
+    span_stats(&kept, &dropped);
+    assert_int_equal(kept, 0);
+    span_stop();
+}
@@ -75,6 +75,12 @@ void test_temp_conv(void) {
     data = 0xC900;
     ret = __temp_conv(data);
     assert_true(ret == -55);
+
+    /* Threshold registers use the same format */
+    assert_true(__temp_unconv(25.0) == 0x1900);
+    assert_true(__temp_unconv(-25.0) == 0xE700);
+    assert_true(__temp_unconv(-0.25) == 0xFFC0);
+    assert_true(__temp_conv(__temp_unconv(30.0)) == 30.0);
   
     return; 
 }
@@ -0,0 +1,83 @@
+/******************************************************************************
+* Copyright (C) 2017 by Ben Heberlein
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. This file
+* was created for the University of Colorado Boulder course Advanced Practical
+* Embedded Software Development. Ben Heberlein and the University of Colorado 
+* are not liable for any misuse of this material.
+*
+*******************************************************************************/
+/**
+ * @file test_temp_fixed.c
+ * @brief Test suite for the fixed point temperature path in temp.c
+ *
+ * @author Ben Heberlein
+ * @date Nov 5 2017
+ * @version 1.0
+ *
+ */
+
+#include "temp.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <limits.h>
+
+void test_temp_fixed(void) {
+
+    /* From Table 2 in TMP102 data sheet, half counts round away from zero */
+    assert_int_equal(__temp_conv_mc(0x7FF0), 127938);
+    assert_int_equal(__temp_conv_mc(0x6400), 100000);
+    assert_int_equal(__temp_conv_mc(0x1900), 25000);
+    assert_int_equal(__temp_conv_mc(0x0040), 250);
+    assert_int_equal(__temp_conv_mc(0x0010), 63);
+    assert_int_equal(__temp_conv_mc(0x0000), 0);
+    assert_int_equal(__temp_conv_mc(0xFFF0), -63);
+    assert_int_equal(__temp_conv_mc(0xFFC0), -250);
+    assert_int_equal(__temp_conv_mc(0xE700), -25000);
+    assert_int_equal(__temp_conv_mc(0xC900), -55000);
+
+    /* Other units */
+    temp_all_t t;
+    t.mc = 25000;
+    temp_units(&t);
+    assert_int_equal(t.mf, 77000);
+    assert_int_equal(t.mk, 298150);
+
+    t.mc = -40000;
+    temp_units(&t);
+    assert_int_equal(t.mf, -40000);
+    assert_int_equal(t.mk, 233150);
+
+    t.mc = 63;
+    temp_units(&t);
+    assert_int_equal(t.mf, 32113);
+
+    /* Message packing keeps signs and masks the timestamp */
+    uint8_t data[MSG_DATASIZE];
+    temp_all_t u;
+    t.raw = 0xC900;
+    t.mc = -55000;
+    temp_units(&t);
+    t.ts_ms = 0x12345678;
+    temp_all_pack(&t, data);
+    temp_all_unpack(data, &u);
+    assert_int_equal(u.raw, 0xC900);
+    assert_int_equal(u.mc, -55000);
+    assert_int_equal(u.mf, t.mf);
+    assert_int_equal(u.mk, 218150);
+    assert_int_equal(u.ts_ms, 0x345678);
+
+    /* Bulk matches one at a time */
+    uint16_t raw[] = {0x7FF0, 0x1900, 0x0010, 0x0000, 0xFFC0, 0xC900};
+    int32_t mc[6];
+    temp_conv_bulk(raw, mc, 6);
+    for (int i = 0; i < 6; i++) {
+        assert_int_equal(mc[i], __temp_conv_mc(raw[i]));
+    }
+
+    return;
+}